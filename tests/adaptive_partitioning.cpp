@@ -0,0 +1,75 @@
+#define BOOST_TEST_MODULE AdaptivePartitioning
+#include <boost/test/unit_test.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/element_index.hpp>
+#include <vexcl/function.hpp>
+#include <vexcl/adaptive_partitioning.hpp>
+#include "context_setup.hpp"
+
+BOOST_AUTO_TEST_CASE(rebalance_vector)
+{
+    const size_t n = 1 << 20;
+
+    std::vector<vex::command_queue> q(ctx.queue());
+    if (q.size() == 1) q.push_back(vex::backend::duplicate_queue(q[0]));
+
+    std::vector<double> x = random_vector<double>(n);
+    vex::vector<double> X(q, x);
+
+    vex::adaptive_partitioning balance(q, 0.1, 1.0);
+
+    // Pretend the first device takes twice as long as the rest.
+    std::vector<double> t(q.size(), 1.0);
+    t[0] = 2.0;
+
+    std::vector<size_t> part0 = X.partition();
+    balance.record(part0, t);
+
+    BOOST_CHECK(balance.imbalanced());
+
+    balance.repartition(X);
+
+    std::vector<size_t> part1 = X.partition();
+    BOOST_CHECK(part1[1] - part1[0] < part0[1] - part0[0]);
+
+    check_sample(X, x, [](size_t, double a, double b) { BOOST_CHECK_EQUAL(a, b); });
+
+    // The new partitioning should be balanced wrt the pretended speeds.
+    for(size_t d = 0; d < q.size(); ++d)
+        t[d] = static_cast<double>(part1[d + 1] - part1[d]) /
+            ((part0[d + 1] - part0[d]) / t[d]);
+
+    balance.record(part1, t);
+    BOOST_CHECK(!balance.imbalanced());
+}
+
+BOOST_AUTO_TEST_CASE(measure_workload)
+{
+    const size_t n = 1 << 20;
+
+    std::vector<vex::command_queue> q(ctx.queue());
+    if (q.size() == 1) q.push_back(vex::backend::duplicate_queue(q[0]));
+
+    vex::vector<double> X(q, n);
+    vex::adaptive_partitioning balance(q, 0.1, 1.0);
+
+    // The first device gets four times as much work per element as the
+    // rest, and should get a smaller share of the vector.
+    balance.measure(X.partition(), [&](unsigned d) {
+            vex::vector<double> x(q[d], X(d));
+            for(int i = 0; i < (d ? 1 : 4); ++i)
+                x = sin(x + vex::element_index());
+            });
+
+    for(size_t d = 0; d < q.size(); ++d)
+        BOOST_CHECK(balance.weights()[d] > 0);
+
+    BOOST_CHECK(balance.imbalanced());
+
+    std::vector<size_t> p = balance.partition(n);
+    BOOST_CHECK_EQUAL(p.size(), q.size() + 1);
+    BOOST_CHECK_EQUAL(p.back(), n);
+    BOOST_CHECK(p[1] - p[0] < X.part_size(0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
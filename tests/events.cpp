@@ -102,5 +102,27 @@ BOOST_AUTO_TEST_CASE(enqueue_multiexpression)
     BOOST_CHECK_EQUAL(count(y(1) != 8), 0);
 }
 
+BOOST_AUTO_TEST_CASE(async_copy)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q1(1, ctx.queue(0));
+    std::vector<vex::command_queue> q2(1, vex::backend::duplicate_queue(ctx.queue(0)));
+
+    std::vector<int> xh(n, 42), yh(n);
+
+    vex::vector<int> xd(q1, n);
+    vex::vector<int> yd(q2, n);
+
+    vex::backend::wait_list uploaded = vex::copy_async(xh, xd);
+
+    vex::backend::enqueue_barrier(q2[0], uploaded);
+    enqueue(q2, yd) = 2 * xd;
+
+    vex::backend::wait_for_events(vex::copy_async(yd.begin(), yd.end(), yh.begin()));
+
+    BOOST_CHECK_EQUAL(std::count(yh.begin(), yh.end(), 84), n);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
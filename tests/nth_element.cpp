@@ -0,0 +1,158 @@
+#define BOOST_TEST_MODULE NthElement
+#include <algorithm>
+#include <cmath>
+#include <boost/test/unit_test.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/nth_element.hpp>
+#include "context_setup.hpp"
+
+template <typename K, class Comp>
+void check_nth_element(const std::vector<K> &src, const std::vector<K> &dst,
+        size_t nth, Comp comp)
+{
+    for(size_t i = 0; i < nth; ++i)
+        BOOST_REQUIRE( !comp(dst[nth], dst[i]) );
+    for(size_t i = nth + 1; i < dst.size(); ++i)
+        BOOST_REQUIRE( !comp(dst[i], dst[nth]) );
+
+    std::vector<K> a(src), b(dst);
+    std::sort(a.begin(), a.end());
+    std::sort(b.begin(), b.end());
+    BOOST_CHECK( a == b );
+}
+
+BOOST_AUTO_TEST_CASE(nth_element_keys)
+{
+    const size_t n = 1000 * 1000;
+
+    std::vector<float> k = random_vector<float>(n);
+    vex::vector<float> keys(ctx, k);
+
+    // Wraps the buffer of the first partition: the result has to be written
+    // to the buffers of the vector.
+    vex::vector<float> head(ctx.queue(0), keys(0));
+
+    const size_t nth = n / 2;
+
+    float median = vex::nth_element(keys, nth);
+
+    std::vector<float> r(n);
+    vex::copy(keys, r);
+
+    check_sample(head, [&](size_t pos, float val) {
+            BOOST_CHECK_EQUAL(val, r[pos]);
+            });
+
+    std::vector<float> s(k);
+    std::nth_element(s.begin(), s.begin() + nth, s.end());
+
+    BOOST_CHECK_EQUAL(median, s[nth]);
+    BOOST_CHECK_EQUAL(r[nth], s[nth]);
+
+    check_nth_element(k, r, nth, std::less<float>());
+}
+
+BOOST_AUTO_TEST_CASE(nth_element_keys_vals)
+{
+    const size_t n = 1000 * 1000;
+
+    std::vector<vex::command_queue> q = ctx.queue();
+    while(q.size() < 3) q.push_back(vex::backend::duplicate_queue(ctx.queue(0)));
+
+    // Plenty of equal keys, both signs.
+    std::vector<int> k = random_vector<int>(n);
+    for(auto x = k.begin(); x != k.end(); ++x) *x = *x % 64 - 32;
+
+    std::vector<int> v(n);
+    for(size_t i = 0; i < n; ++i) v[i] = static_cast<int>(i);
+
+    vex::vector<int> keys(q, k);
+    vex::vector<int> vals(q, v);
+
+    for(size_t nth : {size_t(0), n / 3, n - 1}) {
+        vex::copy(k, keys);
+        vex::copy(v, vals);
+
+        int x = vex::nth_element(keys, vals, nth, vex::greater<int>());
+
+        std::vector<int> rk(n), rv(n);
+        vex::copy(keys, rk);
+        vex::copy(vals, rv);
+
+        std::vector<int> s(k);
+        std::nth_element(s.begin(), s.begin() + nth, s.end(), std::greater<int>());
+
+        BOOST_CHECK_EQUAL(x, s[nth]);
+
+        check_nth_element(k, rk, nth, std::greater<int>());
+
+        // The values follow the keys, and the partition is stable.
+        for(size_t i = 0; i < n; ++i) {
+            BOOST_REQUIRE_EQUAL(rk[i], k[rv[i]]);
+
+            if (i > 0 && rk[i] == rk[i-1] && rk[i] == x)
+                BOOST_REQUIRE(rv[i] > rv[i-1]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(top_k_keys)
+{
+    const size_t n = 1000 * 1000;
+    const size_t k = 100;
+
+    std::vector<double> x = random_vector<double>(n);
+    for(auto v = x.begin(); v != x.end(); ++v) *v = 100 * (*v - 0.5);
+
+    vex::vector<double> keys(ctx, x);
+    vex::vector<double> head(ctx.queue(0), keys(0));
+
+    vex::top_k(keys, k);
+
+    std::vector<double> s(x);
+    std::sort(s.begin(), s.end(), std::greater<double>());
+
+    for(size_t i = 0; i < k; ++i) {
+        BOOST_CHECK_EQUAL(keys[i], s[i]);
+        BOOST_CHECK_EQUAL(head[i], s[i]);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(top_k_keys_vals)
+{
+    const size_t n = 1000 * 1000;
+
+    std::vector<vex::command_queue> q = ctx.queue();
+    while(q.size() < 3) q.push_back(vex::backend::duplicate_queue(ctx.queue(0)));
+
+    std::vector<float> x = random_vector<float>(n);
+    std::vector<int>   v(n);
+    for(size_t i = 0; i < n; ++i) v[i] = static_cast<int>(i);
+
+    std::vector<float> s(x);
+    std::sort(s.begin(), s.end());
+
+    vex::vector<float> keys(q, x);
+    vex::vector<int>   vals(q, v);
+
+    // Smallest elements, both within the first partition and spanning the
+    // devices.
+    for(size_t k : {size_t(1000), n / 2}) {
+        vex::copy(x, keys);
+        vex::copy(v, vals);
+
+        vex::top_k(keys, vals, k, vex::less<float>());
+
+        std::vector<float> rk(n);
+        std::vector<int>   rv(n);
+        vex::copy(keys, rk);
+        vex::copy(vals, rv);
+
+        for(size_t i = 0; i < k; ++i) {
+            BOOST_REQUIRE_EQUAL(rk[i], s[i]);
+            BOOST_REQUIRE_EQUAL(rk[i], x[rv[i]]);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -128,4 +128,50 @@ BOOST_AUTO_TEST_CASE(rbk_tuple)
         });
 }
 
+BOOST_AUTO_TEST_CASE(rbk_multidevice)
+{
+    const int n = 1000 * 1000;
+
+    std::vector<vex::command_queue> q = ctx.queue();
+    while(q.size() < 3) q.push_back(vex::backend::duplicate_queue(ctx.queue(0)));
+
+    std::vector<double> y = random_vector<double>(n);
+
+    // Short segments, and segments that span whole partitions.
+    for(int nseg : {n / 10, 2}) {
+        std::vector<int> x = random_vector<int>(n);
+        for(auto v = x.begin(); v != x.end(); ++v) *v %= nseg;
+        std::sort(x.begin(), x.end());
+
+        vex::vector<int>    ikeys(q, x);
+        vex::vector<double> ivals(q, y);
+
+        vex::vector<int>    okeys;
+        vex::vector<double> ovals;
+
+        int num_keys = vex::reduce_by_key(ikeys, ivals, okeys, ovals);
+
+        std::vector<int>    rk(1, x[0]);
+        std::vector<double> rs(1, y[0]);
+
+        for(int i = 1; i < n; ++i) {
+            if (x[i] == x[i-1]) {
+                rs.back() += y[i];
+            } else {
+                rk.push_back(x[i]);
+                rs.push_back(y[i]);
+            }
+        }
+
+        BOOST_REQUIRE_EQUAL(rk.size(),    num_keys);
+        BOOST_REQUIRE_EQUAL(okeys.size(), num_keys);
+        BOOST_REQUIRE_EQUAL(ovals.size(), num_keys);
+
+        for(int i = 0; i < num_keys; ++i) {
+            BOOST_CHECK_EQUAL(okeys[i], rk[i]);
+            BOOST_CHECK_CLOSE(static_cast<double>(ovals[i]), rs[i], 1e-8);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
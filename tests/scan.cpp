@@ -40,4 +40,74 @@ BOOST_AUTO_TEST_CASE(exclusive)
             });
 }
 
+template <typename T>
+struct maximum {
+    VEX_FUNCTION(T, device, (T, x)(T, y), return x > y ? x : y;);
+
+    maximum() {}
+
+    T operator()(T x, T y) const { return x > y ? x : y; }
+};
+
+BOOST_AUTO_TEST_CASE(partition_carries)
+{
+    std::vector<vex::command_queue> q = ctx.queue();
+    while(q.size() < 3) q.push_back(vex::backend::duplicate_queue(ctx.queue(0)));
+
+    for(size_t n : {size_t(1), size_t(2), size_t(5), size_t(1001)}) {
+        std::vector<int> x = random_vector<int>(n);
+        for(auto v = x.begin(); v != x.end(); ++v) *v %= 1000;
+
+        vex::vector<int> X(q, x);
+        vex::vector<int> Y(q, n);
+
+        vex::exclusive_scan(X, Y, 42);
+
+        std::vector<int> s(n);
+        s[0] = 42;
+        for(size_t i = 1; i < n; ++i) s[i] = s[i-1] + x[i-1];
+
+        std::vector<int> y(n);
+        vex::copy(Y, y);
+        BOOST_REQUIRE(y == s);
+
+        vex::inclusive_scan(X, X, 0, maximum<int>());
+
+        std::partial_sum(x.begin(), x.end(), s.begin(), maximum<int>());
+
+        vex::copy(X, y);
+        BOOST_REQUIRE(y == s);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(tile_boundaries)
+{
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    for(size_t n : {size_t(1023), size_t(2049), size_t(4097), size_t(100001)}) {
+        std::vector<int> x = random_vector<int>(n);
+        for(auto v = x.begin(); v != x.end(); ++v) *v %= 1000;
+
+        vex::vector<int> X(q, x);
+        vex::vector<int> Y(q, n);
+
+        vex::exclusive_scan(X, Y, 42);
+
+        std::vector<int> s(n);
+        s[0] = 42;
+        for(size_t i = 1; i < n; ++i) s[i] = s[i-1] + x[i-1];
+
+        std::vector<int> y(n);
+        vex::copy(Y, y);
+        BOOST_REQUIRE(y == s);
+
+        vex::inclusive_scan(X, X, 0, maximum<int>());
+
+        std::partial_sum(x.begin(), x.end(), s.begin(), maximum<int>());
+
+        vex::copy(X, y);
+        BOOST_REQUIRE(y == s);
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
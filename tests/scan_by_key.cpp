@@ -123,4 +123,47 @@ BOOST_AUTO_TEST_CASE(sbk_tuple)
             });
 }
 
+BOOST_AUTO_TEST_CASE(sbk_multidevice)
+{
+    // NVIDIA OpenCL compiler crashes on scan_by_key kernels.
+    if (nvidia_cl(ctx)) return;
+
+    const int n = 100 * 1000;
+
+    std::vector<vex::command_queue> q = ctx.queue();
+    while(q.size() < 3) q.push_back(vex::backend::duplicate_queue(ctx.queue(0)));
+
+    std::vector<int> y = random_vector<int>(n);
+    for(auto v = y.begin(); v != y.end(); ++v) *v %= 100;
+
+    // Short segments, and segments that span whole partitions.
+    for(int nseg : {n / 10, 2}) {
+        std::vector<int> x = random_vector<int>(n);
+        for(auto v = x.begin(); v != x.end(); ++v) *v %= nseg;
+        std::sort(x.begin(), x.end());
+
+        vex::vector<int> ikeys(q, x);
+        vex::vector<int> ivals(q, y);
+        vex::vector<int> ovals(q, n);
+
+        std::vector<int> r(n);
+
+        vex::inclusive_scan_by_key(ikeys, ivals, ovals);
+        vex::copy(ovals, r);
+
+        for(int i = 0, s = 0; i < n; ++i) {
+            s = (i && x[i] == x[i-1]) ? s + y[i] : y[i];
+            BOOST_REQUIRE_EQUAL(r[i], s);
+        }
+
+        vex::exclusive_scan_by_key(ikeys, ivals, ovals, 42);
+        vex::copy(ovals, r);
+
+        for(int i = 0, s = 42; i < n; ++i) {
+            s = (i && x[i] == x[i-1]) ? s + y[i-1] : 42;
+            BOOST_REQUIRE_EQUAL(r[i], s);
+        }
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,129 @@
+#define BOOST_TEST_MODULE SegmentedSort
+#include <algorithm>
+#include <boost/test/unit_test.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/segmented_sort.hpp>
+#include "context_setup.hpp"
+
+// Segment sizes of all kinds: empty, sorted in registers, by the block sort,
+// and by the regular sort. There are several large segments, so that the
+// regular sort handles a batch of them.
+std::vector<int> make_offsets() {
+    std::vector<int> size;
+
+    for(int i = 0; i < 20000; ++i) size.push_back(rand() % 20);
+    for(int i = 0; i < 200;   ++i) size.push_back(17 + rand() % 5000);
+
+    size.push_back(100000);
+    size.push_back(80000);
+    size.push_back(70000);
+    size.push_back(0);
+
+    std::random_shuffle(size.begin(), size.end());
+
+    std::vector<int> offsets(1, 0);
+    for(auto s = size.begin(); s != size.end(); ++s)
+        offsets.push_back(offsets.back() + *s);
+
+    return offsets;
+}
+
+template <typename T>
+struct even_first {
+    VEX_DUAL_FUNCTOR(bool, (T, a)(T, b),
+        char bit1 = 1 & a;
+        char bit2 = 1 & b;
+        if (bit1 == bit2) return a < b;
+        return bit1 < bit2;
+    )
+};
+
+BOOST_AUTO_TEST_CASE(segmented_sort_keys)
+{
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int> o = make_offsets();
+    const size_t n = o.back();
+
+    std::vector<float> k = random_vector<float>(n);
+
+    vex::vector<int>   offsets(q, o);
+    vex::vector<float> keys(q, k);
+
+    vex::segmented_sort(keys, offsets);
+
+    std::vector<float> r(n);
+    vex::copy(keys, r);
+
+    for(size_t s = 0; s + 1 < o.size(); ++s)
+        std::sort(k.begin() + o[s], k.begin() + o[s + 1]);
+
+    BOOST_CHECK(r == k);
+}
+
+BOOST_AUTO_TEST_CASE(segmented_sort_keys_vals)
+{
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int> o = make_offsets();
+    const size_t n = o.back();
+
+    // Plenty of equal keys to check that the sort is stable.
+    std::vector<int> k = random_vector<int>(n);
+    for(auto x = k.begin(); x != k.end(); ++x) *x %= 16;
+
+    std::vector<int> v(n);
+    for(size_t i = 0; i < n; ++i) v[i] = static_cast<int>(i);
+
+    vex::vector<int> offsets(q, o);
+    vex::vector<int> keys(q, k);
+    vex::vector<int> vals(q, v);
+
+    vex::segmented_sort(keys, vals, offsets, vex::greater<int>());
+
+    std::vector<int> rk(n), rv(n);
+    vex::copy(keys, rk);
+    vex::copy(vals, rv);
+
+    for(size_t s = 0; s + 1 < o.size(); ++s) {
+        std::vector< std::pair<int,int> > kv;
+        for(int i = o[s]; i < o[s + 1]; ++i)
+            kv.push_back(std::make_pair(k[i], v[i]));
+
+        std::stable_sort(kv.begin(), kv.end(),
+                [](const std::pair<int,int> &a, const std::pair<int,int> &b) {
+                    return a.first > b.first;
+                });
+
+        for(int i = o[s], j = 0; i < o[s + 1]; ++i, ++j) {
+            BOOST_REQUIRE_EQUAL(rk[i], kv[j].first);
+            BOOST_REQUIRE_EQUAL(rv[i], kv[j].second);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(segmented_sort_custom_comparator)
+{
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int> o = make_offsets();
+    const size_t n = o.back();
+
+    std::vector<int> k = random_vector<int>(n);
+    for(auto x = k.begin(); x != k.end(); ++x) *x %= 1000;
+
+    vex::vector<int> offsets(q, o);
+    vex::vector<int> keys(q, k);
+
+    vex::segmented_sort(keys, offsets, even_first<int>());
+
+    std::vector<int> r(n);
+    vex::copy(keys, r);
+
+    for(size_t s = 0; s + 1 < o.size(); ++s)
+        std::sort(k.begin() + o[s], k.begin() + o[s + 1], even_first<int>());
+
+    BOOST_CHECK(r == k);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -1,5 +1,6 @@
 #define BOOST_TEST_MODULE Sort
 #include <algorithm>
+#include <cmath>
 #include <boost/iterator/counting_iterator.hpp>
 #include <boost/test/unit_test.hpp>
 #include <vexcl/vector.hpp>
@@ -170,4 +171,118 @@ BOOST_AUTO_TEST_CASE(sort_keys_vals_tuple)
             });
 }
 
+BOOST_AUTO_TEST_CASE(radix_sort_keys)
+{
+    const size_t n = 1000 * 1000;
+
+    // Negative and positive keys in both directions.
+    std::vector<double> d = random_vector<double>(n);
+    for(auto v = d.begin(); v != d.end(); ++v) *v = 100 * (*v - 0.5);
+
+    vex::vector<double> dkeys(ctx, d);
+
+    vex::sort(dkeys, vex::greater<double>());
+    vex::copy(dkeys, d);
+
+    BOOST_CHECK( std::is_sorted(d.begin(), d.end(), std::greater<double>()) );
+
+    std::vector<cl_long> l = random_vector<cl_long>(n);
+    for(auto v = l.begin(); v != l.end(); ++v) *v = (*v - 50) * 1000000000000LL;
+
+    vex::vector<cl_long> lkeys(ctx, l);
+
+    vex::sort(lkeys);
+    vex::copy(lkeys, l);
+
+    BOOST_CHECK( std::is_sorted(l.begin(), l.end()) );
+}
+
+BOOST_AUTO_TEST_CASE(radix_sort_keys_vals)
+{
+    const size_t n = 1000 * 1000;
+
+    std::vector<float> k = random_vector<float>(n);
+    std::vector<int>   v = random_vector<int  >(n);
+    std::vector<int>   p(n);
+
+    // Plenty of equal keys to check the stability.
+    for(auto x = k.begin(); x != k.end(); ++x) *x = std::floor(16 * (*x - 0.5f));
+
+    vex::vector<float> keys(ctx, k);
+    vex::vector<int>   vals(ctx, v);
+
+    for(size_t i = 0; i < p.size(); ++i) p[i] = static_cast<int>(i);
+    std::stable_sort(p.begin(), p.end(), [&](int i, int j) { return k[i] > k[j]; });
+
+    vex::sort_by_key(keys, vals, vex::greater<float>());
+
+    check_sample(keys, [&](size_t pos, float val) {
+            BOOST_CHECK_EQUAL(val, k[p[pos]]);
+            });
+
+    check_sample(vals, [&](size_t pos, int val) {
+            BOOST_CHECK_EQUAL(val, v[p[pos]]);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(sort_multidevice)
+{
+    const size_t n = 1000 * 1000;
+
+    std::vector<vex::command_queue> q = ctx.queue();
+    while(q.size() < 3) q.push_back(vex::backend::duplicate_queue(ctx.queue(0)));
+
+    std::vector<int  > k = random_vector<int  >(n);
+    std::vector<float> v = random_vector<float>(n);
+    std::vector<int>   p(n);
+
+    vex::vector<int> keys(q, k);
+
+    // Wraps the buffer of the first partition: the sort has to write the
+    // result to the buffers of the vector.
+    vex::vector<int> head(q[0], keys(0));
+
+    vex::sort(keys);
+
+    std::vector<int> s(k);
+    std::sort(s.begin(), s.end());
+
+    check_sample(keys, [&](size_t pos, int val) {
+            BOOST_CHECK_EQUAL(val, s[pos]);
+            });
+
+    check_sample(head, [&](size_t pos, int val) {
+            BOOST_CHECK_EQUAL(val, s[pos]);
+            });
+
+    struct odd_first_t {
+        typedef bool result_type;
+        odd_first_t() {}
+
+        VEX_DUAL_FUNCTOR(result_type, (int, a)(int, b),
+            return (1 & a) > (1 & b);
+            )
+    } odd_first;
+
+    for(size_t i = 0; i < p.size(); ++i) p[i] = static_cast<int>(i);
+    std::stable_sort(p.begin(), p.end(), [&](int i, int j) { return odd_first(k[i], k[j]); });
+
+    vex::copy(k, keys);
+    vex::vector<float> vals(q, v);
+
+    vex::sort_by_key(keys, vals, odd_first);
+
+    check_sample(keys, [&](size_t pos, int val) {
+            BOOST_CHECK_EQUAL(val, k[p[pos]]);
+            });
+
+    check_sample(vals, [&](size_t pos, float val) {
+            BOOST_CHECK_EQUAL(val, v[p[pos]]);
+            });
+
+    check_sample(head, [&](size_t pos, int val) {
+            BOOST_CHECK_EQUAL(val, k[p[pos]]);
+            });
+}
+
 BOOST_AUTO_TEST_SUITE_END()
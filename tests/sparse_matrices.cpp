@@ -1,10 +1,25 @@
 #define BOOST_TEST_MODULE SparseMatrices
 #include <boost/test/unit_test.hpp>
+#include <map>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
 #include <vexcl/vector.hpp>
+#include <vexcl/multivector.hpp>
+#include <vexcl/reductor.hpp>
 #include <vexcl/sparse/csr.hpp>
 #include <vexcl/sparse/ell.hpp>
+#include <vexcl/sparse/sell.hpp>
+#include <vexcl/sparse/bsr.hpp>
+#include <vexcl/sparse/symmetric.hpp>
+#include <vexcl/sparse/reorder.hpp>
 #include <vexcl/sparse/matrix.hpp>
 #include <vexcl/sparse/distributed.hpp>
+#include <vexcl/sparse/spgemm.hpp>
+#include <vexcl/sparse/coo.hpp>
+#include <vexcl/sparse/triangular.hpp>
+#include <vexcl/sparse/semiring.hpp>
+#include "temp_cache_dir.hpp"
 
 typedef std::array<std::array<double, 2>, 2> matrix_value;
 typedef std::array<double, 2> vector_value;
@@ -121,6 +136,226 @@ BOOST_AUTO_TEST_CASE(ell)
             });
 }
 
+BOOST_AUTO_TEST_CASE(sell)
+{
+    const size_t n = 1021;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    const size_t C[]     = {0, 4, 1};
+    const size_t sigma[] = {0, 64, 1};
+
+    for(int k = 0; k < 3; ++k) {
+        vex::sparse::sell<double> A(q, n, n, row, col, val, true, C[k], sigma[k]);
+
+        Y = A * X;
+
+        check_sample(Y, [&](size_t idx, double a) {
+                double sum = 0;
+                for(int j = row[idx]; j < row[idx + 1]; j++)
+                    sum += val[j] * x[col[j]];
+
+                BOOST_CHECK_CLOSE(a, sum, 1e-8);
+                });
+    }
+}
+
+template <unsigned B>
+void test_bsr(const std::vector<vex::command_queue> &q, size_t n) {
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::sparse::bsr<double, B> A(q, n, n, row, col, val);
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    BOOST_CHECK(A.blocks() <= col.size());
+
+    Y = X - A * X;
+
+    check_sample(Y, [&](size_t idx, double a) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(a, x[idx] - sum, 1e-8);
+            });
+
+    Y = A * (2 * X) + A * X;
+
+    check_sample(Y, [&](size_t idx, double a) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(a, 3 * sum, 1e-8);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(bsr)
+{
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    test_bsr<3>(q, 1023);
+    test_bsr<5>(q, 1025);
+}
+
+BOOST_AUTO_TEST_CASE(symmetric)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    // Tridiagonal matrix with a few random long-range couplings.
+    std::vector< std::map<int, double> > a(n);
+    for(size_t i = 0; i < n; ++i) {
+        a[i][i] = 4;
+        if (i > 0) a[i][i-1] = a[i-1][i] = -1;
+
+        int j = rand() % n;
+        if (rand() % 4 == 0 && j != static_cast<int>(i))
+            a[i][j] = a[j][i] = 0.5;
+    }
+
+    std::vector<int>    row(1, 0);
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    for(size_t i = 0; i < n; ++i) {
+        for(auto v = a[i].begin(); v != a[i].end(); ++v) {
+            col.push_back(v->first);
+            val.push_back(v->second);
+        }
+        row.push_back(col.size());
+    }
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    const vex::sparse::symmetric_split split[] = {
+        vex::sparse::symmetric_split::automatic,
+        vex::sparse::symmetric_split::chunks,
+        vex::sparse::symmetric_split::colored
+    };
+
+    for(auto s : split) {
+        vex::sparse::symmetric<double> A(q, n, n, row, col, val, true, s);
+
+        BOOST_CHECK_EQUAL(A.nonzeros(), (col.size() + n) / 2);
+
+        Y = X - A * X + A * (2 * X);
+
+        check_sample(Y, [&](size_t idx, double v) {
+                double sum = 0;
+                for(int j = row[idx]; j < row[idx + 1]; j++)
+                    sum += val[j] * x[col[j]];
+
+                BOOST_CHECK_CLOSE(v, x[idx] + sum, 1e-8);
+                });
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rcm_reordering)
+{
+    const size_t m = 32;
+    const size_t n = m * m;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    // 2D Poisson matrix with randomly shuffled unknowns.
+    std::vector<size_t> shuffle(n);
+    std::iota(shuffle.begin(), shuffle.end(), 0);
+    std::random_shuffle(shuffle.begin(), shuffle.end());
+
+    std::vector< std::map<int, double> > a(n);
+    for(size_t j = 0, k = 0; j < m; ++j) {
+        for(size_t i = 0; i < m; ++i, ++k) {
+            size_t r = shuffle[k];
+            a[r][r] = 4;
+            if (i > 0)     a[r][shuffle[k - 1]] = -1;
+            if (i + 1 < m) a[r][shuffle[k + 1]] = -1;
+            if (j > 0)     a[r][shuffle[k - m]] = -1;
+            if (j + 1 < m) a[r][shuffle[k + m]] = -1;
+        }
+    }
+
+    std::vector<int>    row(1, 0);
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    for(size_t i = 0; i < n; ++i) {
+        for(auto v = a[i].begin(); v != a[i].end(); ++v) {
+            col.push_back(v->first);
+            val.push_back(v->second);
+        }
+        row.push_back(col.size());
+    }
+
+    vex::sparse::reordering R(q, n, row, col);
+
+    // Rectangular matrices are rejected.
+    {
+        std::vector<int> wide_col(col);
+        wide_col[0] = static_cast<int>(n);
+
+        BOOST_CHECK_THROW(vex::sparse::rcm(n, row, wide_col), std::exception);
+        BOOST_CHECK_THROW(vex::sparse::rcm(n - 1, row, col), std::exception);
+    }
+
+    std::vector<int>    rrow;
+    std::vector<int>    rcol;
+    std::vector<double> rval;
+
+    R.matrix(row, col, val, rrow, rcol, rval);
+
+    BOOST_CHECK_EQUAL(rcol.size(), col.size());
+
+    int bandwidth = 0;
+    for(size_t i = 0; i < n; ++i)
+        for(int j = rrow[i]; j < rrow[i + 1]; ++j)
+            bandwidth = std::max(bandwidth, std::abs(rcol[j] - static_cast<int>(i)));
+
+    BOOST_CHECK(bandwidth <= 2 * static_cast<int>(m));
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::sparse::csr<double> A(q, n, n, rrow, rcol, rval);
+    vex::vector<double> X(q, x);
+    vex::vector<double> Xr(q, n);
+    vex::vector<double> Yr(q, n);
+    vex::vector<double> Y(q, n);
+
+    R.forward(X, Xr);
+    Yr = A * Xr;
+    R.inverse(Yr, Y);
+
+    check_sample(Y, [&](size_t idx, double v) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(v, sum, 1e-8);
+            });
+}
+
 BOOST_AUTO_TEST_CASE(matrix)
 {
     const size_t n = 1024;
@@ -135,21 +370,808 @@ BOOST_AUTO_TEST_CASE(matrix)
 
     std::vector<double> x = random_vector<double>(n);
 
-    vex::sparse::matrix<double> A(q, n, n, row, col, val);
+    vex::sparse::matrix<double> A(q, n, n, row, col, val);
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    Y = A * X;
+
+    check_sample(Y, [&](size_t idx, double a) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(a, sum, 1e-8);
+            });
+}
+
+// Matrix with the row widths cycling through 3..9, so that matrices of
+// different sizes share the average width and the variability.
+void periodic_matrix(size_t n,
+        std::vector<int> &row, std::vector<int> &col, std::vector<double> &val)
+{
+    row.assign(1, 0);
+    col.clear();
+    val.clear();
+
+    for(size_t i = 0; i < n; ++i) {
+        for(size_t k = 0, w = 3 + i % 7; k < w; ++k) {
+            col.push_back(rand() % n);
+            val.push_back(static_cast<double>(rand()) / RAND_MAX);
+        }
+        row.push_back(col.size());
+    }
+}
+
+template <class Matrix>
+void check_tuned_product(const std::vector<vex::command_queue> &q, const Matrix &A,
+        const std::vector<int> &row, const std::vector<int> &col, const std::vector<double> &val)
+{
+    const size_t n = row.size() - 1;
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    Y = A * X;
+
+    check_sample(Y, [&](size_t idx, double a) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(a, sum, 1e-8);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(tuned_format)
+{
+    // Keep the decisions out of the cache of the user.
+    temp_cache_dir cache("VEXCL_SPARSE_FORMATS_PATH");
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    periodic_matrix(1001, row, col, val);
+
+    vex::sparse::matrix<double> A(q, 1001, 1001, row, col, val, vex::sparse::format::tuned);
+
+    BOOST_CHECK(A.storage_format() != vex::sparse::format::tuned);
+    BOOST_CHECK(A.storage_format() != vex::sparse::format::automatic);
+
+    check_tuned_product(q, A, row, col, val);
+
+    // Replace the cached decision with another format, so that a cache hit
+    // may be told from a new measurement.
+    std::vector<boost::filesystem::path> files(
+            boost::filesystem::directory_iterator(cache.dir()),
+            boost::filesystem::directory_iterator());
+
+    BOOST_REQUIRE_EQUAL(files.size(), 1);
+
+    std::string signature;
+    {
+        std::ifstream f(files[0].string().c_str());
+        int fmt;
+        f >> fmt;
+        std::getline(f >> std::ws, signature);
+    }
+
+    const vex::sparse::format cached = A.storage_format() == vex::sparse::format::ell ?
+        vex::sparse::format::sell : vex::sparse::format::ell;
+
+    {
+        std::ofstream f(files[0].string().c_str());
+        f << static_cast<int>(cached) << "\n" << signature << std::endl;
+    }
+
+    // A matrix of a slightly different size with the same structure
+    // statistics gets the cached format.
+    periodic_matrix(1008, row, col, val);
+
+    vex::sparse::matrix<double> B(q, 1008, 1008, row, col, val, vex::sparse::format::tuned);
+
+    BOOST_CHECK(B.storage_format() == cached);
+
+    check_tuned_product(q, B, row, col, val);
+}
+
+BOOST_AUTO_TEST_CASE(csr_balanced)
+{
+    const size_t n = 4096;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    // A few dense rows on top of a random sparse matrix.
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 8, row, col, val);
+
+    std::vector<int>    ptr(1, 0), c;
+    std::vector<double> v;
+
+    for(size_t i = 0; i < n; ++i) {
+        if (i < 4) {
+            for(size_t j = 0; j < n; j += 2) c.push_back(static_cast<int>(j));
+        } else {
+            c.insert(c.end(), col.begin() + row[i], col.begin() + row[i+1]);
+        }
+        ptr.push_back(static_cast<int>(c.size()));
+    }
+    v = random_vector<double>(c.size());
+
+    std::vector<double> x = random_vector<double>(n);
+    std::vector<double> y = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, y);
+    vex::vector<double> Z(q, n);
+
+    auto spmv = [&](size_t i, const std::vector<double> &x) {
+        double sum = 0;
+        for(int j = ptr[i]; j < ptr[i + 1]; j++)
+            sum += v[j] * x[c[j]];
+        return sum;
+    };
+
+    vex::sparse::csr<double>    A(q, n, n, ptr, c, v);
+    vex::sparse::matrix<double> B(q, n, n, ptr, c, v);
+
+    if (vex::is_cpu(q[0])) BOOST_CHECK(A.balanced());
+
+    Z = A * X;
+
+    check_sample(Z, [&](size_t idx, double a) {
+            BOOST_CHECK_CLOSE(a, spmv(idx, x), 1e-8);
+            });
+
+    Z = 2 * (A * X) - A * Y + Y;
+
+    check_sample(Z, [&](size_t idx, double a) {
+            BOOST_CHECK_CLOSE(a, 2 * spmv(idx, x) - spmv(idx, y) + y[idx], 1e-8);
+            });
+
+    vex::Reductor<double, vex::SUM> sum(q);
+
+    double s = 0;
+    for(size_t i = 0; i < n; ++i) s += spmv(i, x) + 2 * spmv(i, y);
+
+    BOOST_CHECK_CLOSE(sum(A * X + 2 * (A * Y)), s, 1e-6);
+
+    Z = B * (X + Y);
+
+    check_sample(Z, [&](size_t idx, double a) {
+            double sum = 0;
+            for(int j = ptr[idx]; j < ptr[idx + 1]; j++)
+                sum += v[j] * (x[c[j]] + y[c[j]]);
+
+            BOOST_CHECK_CLOSE(a, sum, 1e-8);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(matrix_formats)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    const vex::sparse::format fmt[] = {
+        vex::sparse::format::csr,
+        vex::sparse::format::ell,
+        vex::sparse::format::sell
+    };
+
+    for(int k = 0; k < 3; ++k) {
+        vex::sparse::matrix<double> A(q, n, n, row, col, val, fmt[k]);
+        BOOST_CHECK(A.storage_format() == fmt[k]);
+
+        Y = A * X;
+
+        check_sample(Y, [&](size_t idx, double a) {
+                double sum = 0;
+                for(int j = row[idx]; j < row[idx + 1]; j++)
+                    sum += val[j] * x[col[j]];
+
+                BOOST_CHECK_CLOSE(a, sum, 1e-8);
+                });
+    }
+}
+
+BOOST_AUTO_TEST_CASE(multivector_product)
+{
+    const size_t n = 1024;
+    const size_t m = 3;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+
+    std::vector<double> x = random_vector<double>(n * m);
+
+    vex::multivector<double, m> X(q, x);
+    vex::multivector<double, m> Y(q, n);
+    vex::multivector<double, m> Z(q, n);
+
+    const vex::sparse::format fmt[] = {
+        vex::sparse::format::csr,
+        vex::sparse::format::ell,
+        vex::sparse::format::sell
+    };
+
+    for(int f = 0; f < 3; ++f) {
+        vex::sparse::matrix<double> A(q, n, n, row, col, val, fmt[f]);
+
+        Y = A * X;
+        Z = X - 2 * (A * X);
+
+        for(size_t k = 0; k < m; ++k) {
+            check_sample(Y(k), Z(k), [&](size_t idx, double a, double b) {
+                    double sum = 0;
+                    for(int j = row[idx]; j < row[idx + 1]; j++)
+                        sum += val[j] * x[k * n + col[j]];
+
+                    BOOST_CHECK_CLOSE(a, sum, 1e-8);
+                    BOOST_CHECK_CLOSE(b, x[k * n + idx] - 2 * sum, 1e-8);
+                    });
+        }
+
+        vex::multivector<double, m> W(q, n / 2);
+        BOOST_CHECK_THROW(Y = A * W, std::exception);
+        BOOST_CHECK_THROW(W = A * X, std::exception);
+
+        if (ctx.size() > 1) {
+            vex::multivector<double, m> V(ctx, n);
+            BOOST_CHECK_THROW(V = A * X, std::exception);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(block_vector_product)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+
+    std::vector<cl_double4> x = random_vector<cl_double4>(n);
+
+    vex::vector<cl_double4> X(q, x);
+    vex::vector<cl_double4> Y(q, n);
+
+    const vex::sparse::format fmt[] = {
+        vex::sparse::format::csr,
+        vex::sparse::format::ell,
+        vex::sparse::format::sell
+    };
+
+    for(int f = 0; f < 3; ++f) {
+        vex::sparse::matrix<double> A(q, n, n, row, col, val, fmt[f]);
+
+        Y = A * X;
+
+        check_sample(Y, [&](size_t idx, cl_double4 a) {
+                for(int k = 0; k < 4; ++k) {
+                    double sum = 0;
+                    for(int j = row[idx]; j < row[idx + 1]; j++)
+                        sum += val[j] * x[col[j]].s[k];
+
+                    BOOST_CHECK_CLOSE(a.s[k], sum, 1e-8);
+                }
+                });
+    }
+}
+
+BOOST_AUTO_TEST_CASE(spgemm)
+{
+    const size_t n = 1024;
+    const size_t k = 512;
+    const size_t m = 768;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    arow, acol, brow, bcol;
+    std::vector<double> aval, bval;
+
+    random_matrix(n, k, 16, arow, acol, aval);
+    random_matrix(k, m, 16, brow, bcol, bval);
+
+    vex::sparse::csr<double> A(q, n, k, arow, acol, aval);
+    vex::sparse::csr<double> B(q, k, m, brow, bcol, bval);
+
+    vex::sparse::csr<double> C = vex::sparse::multiply(A, B);
+
+    BOOST_CHECK_EQUAL(C.rows(), n);
+    BOOST_CHECK_EQUAL(C.cols(), m);
+
+    size_t nnz = 0;
+    for(size_t i = 0; i < n; ++i) {
+        std::set<int> cols;
+        for(int j = arow[i]; j < arow[i+1]; ++j)
+            cols.insert(bcol.begin() + brow[acol[j]], bcol.begin() + brow[acol[j]+1]);
+        nnz += cols.size();
+    }
+
+    BOOST_CHECK_EQUAL(C.nonzeros(), nnz);
+
+    std::vector<double> x = random_vector<double>(m);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> T(q, k);
+    vex::vector<double> Y(q, n);
+    vex::vector<double> Z(q, n);
+
+    T = B * X;
+    Y = A * T;
+    Z = C * X;
+
+    check_sample(Y, Z, [&](size_t, double a, double b) {
+            BOOST_CHECK_CLOSE(a, b, 1e-8);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(coo_to_csr)
+{
+    const size_t n = 1024;
+    const size_t m = 768;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, m, 16, row, col, val);
+
+    // Shuffled triplets, each nonzero is split into two duplicate entries.
+    std::vector<size_t> order(2 * col.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::random_shuffle(order.begin(), order.end());
+
+    std::vector<int>    ci(order.size());
+    std::vector<int>    cj(order.size());
+    std::vector<double> cv(order.size());
+
+    for(size_t i = 0; i < n; ++i) {
+        for(int j = row[i]; j < row[i + 1]; ++j) {
+            for(size_t k = 0; k < 2; ++k) {
+                size_t p = order[2 * j + k];
+                ci[p] = i;
+                cj[p] = col[j];
+                cv[p] = 0.5 * val[j];
+            }
+        }
+    }
+
+    vex::vector<int>    I(q, ci);
+    vex::vector<int>    J(q, cj);
+    vex::vector<double> V(q, cv);
+
+    vex::vector<int>    ptr;
+    vex::vector<int>    idx;
+    vex::vector<double> nz;
+
+    vex::sparse::coo_to_csr(n, m, I, J, V, ptr, idx, nz);
+
+    BOOST_CHECK_EQUAL(ptr.size(), n + 1);
+    BOOST_CHECK_EQUAL(nz.size(), col.size());
+
+    vex::sparse::csr<double> A(n, m, ptr, idx, nz);
+    vex::sparse::ell<double> B(n, m, ptr, idx, nz);
+
+    std::vector<double> x = random_vector<double>(m);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+    vex::vector<double> Z(q, n);
+
+    Y = A * X;
+    Z = B * X;
+
+    check_sample(Y, Z, [&](size_t idx, double a, double b) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(a, sum, 1e-8);
+            BOOST_CHECK_CLOSE(b, sum, 1e-8);
+            });
+
+    // Both matrices keep copies of the CSR arrays.
+    std::vector<double> nz2(nz.size());
+    vex::copy(nz, nz2);
+    for(auto v = nz2.begin(); v != nz2.end(); ++v) *v *= 2;
+
+    ptr = 0;
+    idx = 0;
+    nz  = 0;
+
+    A.update_values(nz2);
+    B.update_values(nz2);
+
+    BOOST_CHECK_EQUAL(nz[0], 0);
+
+    Y = A * X;
+    Z = B * X;
+
+    check_sample(Y, Z, [&](size_t idx, double a, double b) {
+            double sum = 0;
+            for(int j = row[idx]; j < row[idx + 1]; j++)
+                sum += val[j] * x[col[j]];
+
+            BOOST_CHECK_CLOSE(a, 2 * sum, 1e-8);
+            BOOST_CHECK_CLOSE(b, 2 * sum, 1e-8);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(triangular_solve)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    // Diagonally dominant matrix with random couplings.
+    std::vector< std::map<int, double> > a(n);
+    for(size_t i = 0; i < n; ++i) {
+        a[i][i] = 8;
+        for(int k = 0; k < 4; ++k)
+            a[i][rand() % n] += 1;
+    }
+
+    std::vector<int>    row(1, 0);
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    for(size_t i = 0; i < n; ++i) {
+        for(auto v = a[i].begin(); v != a[i].end(); ++v) {
+            col.push_back(v->first);
+            val.push_back(v->second);
+        }
+        row.push_back(col.size());
+    }
+
+    std::vector<double> b = random_vector<double>(n);
+
+    vex::sparse::csr<double> A(q, n, n, row, col, val);
+
+    vex::vector<double> B(q, b);
+    vex::vector<double> X(q, n);
+
+    for(int lower = 0; lower < 2; ++lower) {
+        for(int unit = 0; unit < 2; ++unit) {
+            vex::sparse::triangular_solve<double> S(A, lower, unit);
+
+            BOOST_CHECK(S.levels() > 0);
+            BOOST_CHECK(S.levels() < n);
+
+            S.apply(B, X);
+
+            std::vector<double> x(n);
+            vex::copy(X, x);
+
+            for(size_t i = 0; i < n; ++i) {
+                double sum = 0;
+                for(int j = row[i]; j < row[i + 1]; ++j) {
+                    size_t c = col[j];
+                    if (c == i)
+                        sum += (unit ? 1 : val[j]) * x[c];
+                    else if (lower ? c < i : c > i)
+                        sum += val[j] * x[c];
+                }
+                BOOST_CHECK_CLOSE(sum, b[i], 1e-8);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(semiring_product)
+{
+    const size_t n = 1024;
+    const double inf = std::numeric_limits<double>::max();
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+    for(auto v = val.begin(); v != val.end(); ++v) *v = std::abs(*v);
+
+    // Tentative distances with some of the vertices not reached yet.
+    std::vector<double> x = random_vector<double>(n);
+    for(size_t i = 0; i < n; ++i)
+        x[i] = (i % 3) ? std::abs(x[i]) : inf;
+
+    // Frontier of the breadth-first search.
+    std::vector<int> ival(val.size(), 1);
+    std::vector<int> f(n);
+    for(size_t i = 0; i < n; ++i) f[i] = (i % 7 == 0);
+
+    vex::sparse::csr<double> Acsr(q, n, n, row, col, val);
+    vex::sparse::ell<double> Aell(q, n, n, row, col, val);
+    vex::sparse::csr<int>    Bcsr(q, n, n, row, col, ival);
+    vex::sparse::ell<int>    Bell(q, n, n, row, col, ival);
+
     vex::vector<double> X(q, x);
     vex::vector<double> Y(q, n);
+    vex::vector<int>    F(q, f);
+    vex::vector<int>    G(q, n);
 
-    Y = A * X;
+    auto min_plus = [&](size_t idx, double a) {
+        double d = inf;
+        for(int j = row[idx]; j < row[idx + 1]; j++)
+            if (x[col[j]] != inf) d = std::min(d, val[j] + x[col[j]]);
+
+        BOOST_CHECK_CLOSE(a, d, 1e-8);
+    };
+
+    auto max_times = [&](size_t idx, double a) {
+        double p = 0;
+        for(int j = row[idx]; j < row[idx + 1]; j++)
+            if (x[col[j]] != inf) p = std::max(p, val[j] * x[col[j]]);
+
+        BOOST_CHECK_CLOSE(a, p, 1e-8);
+    };
+
+    auto or_and = [&](size_t idx, int a) {
+        int r = 0;
+        for(int j = row[idx]; j < row[idx + 1]; j++)
+            r = r || f[col[j]];
+
+        BOOST_CHECK_EQUAL(a, r);
+    };
+
+    Y = vex::sparse::over<vex::sparse::min_plus>(Acsr) * X;
+    check_sample(Y, min_plus);
+
+    Y = vex::sparse::over<vex::sparse::min_plus>(Aell) * X;
+    check_sample(Y, min_plus);
+
+    Y = vex::sparse::over<vex::sparse::max_times>(Acsr) * ((X != inf) * X);
+    check_sample(Y, max_times);
+
+    Y = vex::sparse::over<vex::sparse::max_times>(Aell) * ((X != inf) * X);
+    check_sample(Y, max_times);
+
+    G = vex::sparse::over<vex::sparse::or_and>(Bcsr) * F;
+    check_sample(G, or_and);
+
+    G = vex::sparse::over<vex::sparse::or_and>(Bell) * F;
+    check_sample(G, or_and);
+
+    // The default semiring matches the usual product.
+    vex::vector<double> Z = Acsr * ((X != inf) * X);
+    Y = vex::sparse::over<vex::sparse::plus_times>(Acsr) * ((X != inf) * X);
+    check_sample(Y, Z, [](size_t, double a, double b) { BOOST_CHECK_CLOSE(a, b, 1e-8); });
+}
+
+BOOST_AUTO_TEST_CASE(transposed_product)
+{
+    const size_t n = 1024;
+    const size_t m = 768;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, m, 16, row, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    std::vector<double> y(m, 0.0);
+    for(size_t i = 0; i < n; ++i)
+        for(int j = row[i]; j < row[i + 1]; j++)
+            y[col[j]] += val[j] * x[i];
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, m);
+
+    vex::sparse::csr<double> A(q, n, m, row, col, val);
+    vex::sparse::matrix<double> B(q, n, m, row, col, val, vex::sparse::format::csr);
+
+    BOOST_CHECK_EQUAL(A.transposed().rows(), m);
+    BOOST_CHECK_EQUAL(A.transposed().cols(), n);
+
+    Y = A.transposed() * X;
+
+    check_sample(Y, [&](size_t idx, double a) {
+            BOOST_CHECK_CLOSE(a, y[idx], 1e-8);
+            });
+
+    Y = 1 - 2 * (B.transposed() * X);
 
     check_sample(Y, [&](size_t idx, double a) {
+            BOOST_CHECK_CLOSE(a, 1 - 2 * y[idx], 1e-8);
+            });
+
+    // The matrix itself is not changed by the transposition.
+    std::vector<double> z = random_vector<double>(m);
+
+    vex::vector<double> Z(q, z);
+    vex::vector<double> W(q, n);
+
+    W = A * Z;
+
+    check_sample(W, [&](size_t idx, double a) {
             double sum = 0;
             for(int j = row[idx]; j < row[idx + 1]; j++)
-                sum += val[j] * x[col[j]];
+                sum += val[j] * z[col[j]];
 
             BOOST_CHECK_CLOSE(a, sum, 1e-8);
             });
 }
 
+BOOST_AUTO_TEST_CASE(transposed_product_formats)
+{
+    const size_t n = 1024;
+    const size_t m = 768;
+
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, m, 16, row, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    std::vector<double> y(m, 0.0);
+    for(size_t i = 0; i < n; ++i)
+        for(int j = row[i]; j < row[i + 1]; j++)
+            y[col[j]] += val[j] * x[i];
+
+    std::vector<double> val2(val.size());
+    std::transform(val.begin(), val.end(), val2.begin(), [](double v) { return 2 * v; });
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, m);
+
+    const vex::sparse::format formats[] = {
+        vex::sparse::format::ell,
+        vex::sparse::format::sell
+    };
+
+    for(auto f : formats) {
+        for(int fast = 0; fast < 2; ++fast) {
+            vex::sparse::matrix<double> A(q, n, m, row, col, val, f, fast != 0);
+
+            Y = A.transposed() * X;
+
+            check_sample(Y, [&](size_t idx, double a) {
+                    BOOST_CHECK_CLOSE(a, y[idx], 1e-8);
+                    });
+
+            A.update_values(val2);
+
+            Y = A.transposed() * X;
+
+            check_sample(Y, [&](size_t idx, double a) {
+                    BOOST_CHECK_CLOSE(a, 2 * y[idx], 1e-8);
+                    });
+        }
+    }
+
+    // A few wide rows: the ELL matrix keeps them in the CSR part.
+    std::vector<int>    hrow(1, 0);
+    std::vector<int>    hcol;
+    std::vector<double> hval;
+
+    for(size_t i = 0; i < n; ++i) {
+        size_t w = (i % 64 == 0) ? 100 : 2;
+        for(size_t j = 0; j < w; ++j) {
+            hcol.push_back(static_cast<int>((i * 7 + j * 13) % m));
+            hval.push_back(1.0 + (i + j) % 5);
+        }
+        hrow.push_back(static_cast<int>(hcol.size()));
+    }
+
+    std::vector<double> hy(m, 0.0);
+    for(size_t i = 0; i < n; ++i)
+        for(int j = hrow[i]; j < hrow[i + 1]; j++)
+            hy[hcol[j]] += hval[j] * x[i];
+
+    for(auto f : formats) {
+        vex::sparse::matrix<double> A(q, n, m, hrow, hcol, hval, f);
+
+        Y = A.transposed() * X;
+
+        check_sample(Y, [&](size_t idx, double a) {
+                BOOST_CHECK_CLOSE(a, hy[idx], 1e-8);
+                });
+    }
+}
+
+template <class Matrix>
+void test_update_values(const std::vector<vex::command_queue> &q, bool fast_setup) {
+    const size_t n = 1024;
+
+    std::vector<int>    row;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, row, col, val);
+
+    Matrix A(q, n, n, row, col, val, fast_setup);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    auto check = [&]() {
+        Y = A * X;
+
+        check_sample(Y, [&](size_t idx, double a) {
+                double sum = 0;
+                for(int j = row[idx]; j < row[idx + 1]; j++)
+                    sum += val[j] * x[col[j]];
+
+                BOOST_CHECK_CLOSE(a, sum, 1e-8);
+                });
+    };
+
+    // Values from the host.
+    val = random_vector<double>(val.size());
+    A.update_values(val);
+    check();
+
+    // Values from the device.
+    val = random_vector<double>(val.size());
+    vex::vector<double> V(q, val);
+    A.update_values(V);
+    check();
+}
+
+BOOST_AUTO_TEST_CASE(update_values)
+{
+    std::vector<vex::command_queue> q(1, ctx.queue(0));
+
+    test_update_values< vex::sparse::csr<double>    >(q, true);
+    test_update_values< vex::sparse::ell<double>    >(q, true);
+    test_update_values< vex::sparse::ell<double>    >(q, false);
+    test_update_values< vex::sparse::sell<double>   >(q, true);
+    test_update_values< vex::sparse::matrix<double> >(q, true);
+
+    // Several queues on the same device(s) exercise the local/remote split.
+    std::vector<vex::command_queue> mq;
+    for(size_t d = 0; d < ctx.size(); ++d) {
+        mq.push_back(ctx.queue(d));
+        mq.push_back(vex::backend::duplicate_queue(ctx.queue(d)));
+    }
+
+    test_update_values< vex::sparse::distributed< vex::sparse::csr<double> > >(mq, true);
+    test_update_values< vex::sparse::distributed< vex::sparse::ell<double> > >(mq, true);
+}
+
 BOOST_AUTO_TEST_CASE(distributed)
 {
     const int n = 1024;
@@ -192,6 +1214,128 @@ BOOST_AUTO_TEST_CASE(distributed)
     }
 }
 
+BOOST_AUTO_TEST_CASE(distributed_queues)
+{
+    const size_t n = 1024;
+
+    // Several queues on the same device(s) exercise the ghost exchange.
+    std::vector<vex::command_queue> q;
+    for(size_t d = 0; d < ctx.size(); ++d) {
+        q.push_back(ctx.queue(d));
+        q.push_back(vex::backend::duplicate_queue(ctx.queue(d)));
+    }
+
+    std::vector<int>    ptr;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, ptr, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+    std::vector<double> y = random_vector<double>(n);
+
+    vex::sparse::distributed<vex::sparse::matrix<double>> A(q, n, n, ptr, col, val);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, y);
+    vex::vector<double> Z(q, n);
+
+    for(int k = 0; k < 2; ++k) {
+        Z = Y - 2 * (A * (X + Y));
+
+        check_sample(Z, [&](size_t idx, double a) {
+                double sum = 0;
+                for(int j = ptr[idx]; j < ptr[idx + 1]; j++)
+                    sum += val[j] * (x[col[j]] + y[col[j]]);
+
+                BOOST_CHECK_CLOSE(a, y[idx] - 2 * sum, 1e-8);
+                });
+    }
+}
+
+BOOST_AUTO_TEST_CASE(distributed_two_products)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q;
+    for(size_t d = 0; d < ctx.size(); ++d) {
+        q.push_back(ctx.queue(d));
+        q.push_back(vex::backend::duplicate_queue(ctx.queue(d)));
+    }
+
+    std::vector<int>    ptr;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, ptr, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+    std::vector<double> z = random_vector<double>(n);
+
+    vex::sparse::distributed<vex::sparse::matrix<double>> A(q, n, n, ptr, col, val);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Z(q, z);
+    vex::vector<double> Y(q, n);
+
+    // Each product of the same matrix needs its own ghost values.
+    Y = A * X + A * Z;
+
+    for(size_t i = 0; i < n; ++i) {
+        double sum = 0;
+        for(int j = ptr[i]; j < ptr[i + 1]; j++)
+            sum += val[j] * (x[col[j]] + z[col[j]]);
+
+        BOOST_CHECK_CLOSE(static_cast<double>(Y[i]), sum, 1e-8);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(distributed_back_to_back)
+{
+    const size_t n = 1024;
+
+    std::vector<vex::command_queue> q;
+    for(size_t d = 0; d < ctx.size(); ++d) {
+        q.push_back(ctx.queue(d));
+        q.push_back(vex::backend::duplicate_queue(ctx.queue(d)));
+    }
+
+    std::vector<int>    ptr;
+    std::vector<int>    col;
+    std::vector<double> val;
+
+    random_matrix(n, n, 16, ptr, col, val);
+
+    std::vector<double> x = random_vector<double>(n);
+    std::vector<double> y(n);
+
+    vex::sparse::distributed<vex::sparse::matrix<double>> A(q, n, n, ptr, col, val);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    // The products reuse the ghost buffers of the previous ones while their
+    // kernels may still be running.
+    for(int k = 0; k < 4; ++k) {
+        Y = 0.1 * (A * X);
+        X = 0.1 * (A * Y);
+    }
+
+    for(int k = 0; k < 8; ++k) {
+        for(size_t i = 0; i < n; ++i) {
+            double sum = 0;
+            for(int j = ptr[i]; j < ptr[i + 1]; j++)
+                sum += val[j] * x[col[j]];
+            y[i] = 0.1 * sum;
+        }
+        x.swap(y);
+    }
+
+    check_sample(X, [&](size_t idx, double a) {
+            BOOST_CHECK_CLOSE(a, x[idx], 1e-8);
+            });
+}
+
 BOOST_AUTO_TEST_CASE(distributed_single)
 {
     std::vector<vex::command_queue> q(1, ctx.queue(0));
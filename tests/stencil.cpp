@@ -56,6 +56,43 @@ BOOST_AUTO_TEST_CASE(stencil_convolution)
     });
 }
 
+BOOST_AUTO_TEST_CASE(stencil_queues)
+{
+    const size_t n = 1024;
+
+    // Several queues per device exercise the halo exchange.
+    std::vector<vex::command_queue> q;
+    for(size_t d = 0; d < ctx.size(); ++d) {
+        q.push_back(ctx.queue(d));
+        q.push_back(vex::backend::duplicate_queue(ctx.queue(d)));
+    }
+
+    std::vector<double> s = random_vector<double>(7);
+
+    vex::stencil<double> S(q, s, 3);
+
+    std::vector<double> x = random_vector<double>(n);
+
+    vex::vector<double> X(q, x);
+    vex::vector<double> Y(q, n);
+
+    index idx(n);
+
+    for(int iter = 0; iter < 2; ++iter) {
+        Y = X * S;
+
+        check_sample(Y, [&](size_t i, double a) {
+            double sum = 0;
+            for(int j = 0; j < 7; j++)
+                sum += s[j] * x[idx(i, j - 3)];
+            BOOST_CHECK_CLOSE(a, sum, 1e-8);
+        });
+
+        X = Y;
+        vex::copy(X, x);
+    }
+}
+
 #if BOOST_VERSION >= 105000
 // Boost upto v1.49 segfaults on this test
 BOOST_AUTO_TEST_CASE(two_stencils)
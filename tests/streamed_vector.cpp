@@ -0,0 +1,61 @@
+#define BOOST_TEST_MODULE StreamedVector
+#include <cstdio>
+#include <boost/test/unit_test.hpp>
+#include <vexcl/streamed_vector.hpp>
+#include <vexcl/element_index.hpp>
+#include "context_setup.hpp"
+
+BOOST_AUTO_TEST_CASE(host_resident)
+{
+    const size_t n = 1024 * 1024 + 17;
+
+    std::vector<double> X = random_vector<double>(n);
+    std::vector<double> Y = random_vector<double>(n);
+    std::vector<double> Z(n);
+
+    vex::streamed_vector<double> x(ctx, X.data(), n, 1000);
+    vex::streamed_vector<double> y(ctx, Y.data(), n, 1000);
+    vex::streamed_vector<double> z(ctx, Z.data(), n, 1000);
+
+    z = 2 * x + y * vex::element_index();
+
+    check_sample(Z, [&](size_t i, double a) {
+            BOOST_CHECK_CLOSE(a, 2 * X[i] + Y[i] * i, 1e-8);
+            });
+
+    z += x;
+
+    check_sample(Z, [&](size_t i, double a) {
+            BOOST_CHECK_CLOSE(a, 3 * X[i] + Y[i] * i, 1e-8);
+            });
+}
+
+BOOST_AUTO_TEST_CASE(file_resident)
+{
+    const size_t n = 100000;
+    const char *fname = "streamed_vector_test.bin";
+
+    std::vector<int> X(n);
+    for(size_t i = 0; i < n; ++i) X[i] = static_cast<int>(i);
+
+    {
+        vex::streamed_vector<int> x(ctx, X.data(), n, 4096);
+        vex::streamed_vector<int> f(ctx, fname, n, 4096);
+
+        f = x * 2;
+        f += 1;
+    }
+
+    std::vector<int> Y(n);
+    vex::streamed_vector<int> f(ctx, fname, n, 3000);
+    vex::streamed_vector<int> y(ctx, Y.data(), n, 3000);
+
+    y = f - vex::element_index();
+
+    for(size_t i = 0; i < n; ++i)
+        BOOST_REQUIRE_EQUAL(Y[i], static_cast<int>(i + 1));
+
+    std::remove(fname);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,53 @@
+#ifndef TESTS_TEMP_CACHE_DIR_HPP
+#define TESTS_TEMP_CACHE_DIR_HPP
+
+#include <string>
+#include <cstdlib>
+#include <boost/filesystem.hpp>
+
+// Points the cache folder given by an environment variable to a fresh
+// temporary folder. The folder is removed and the variable is restored on
+// destruction, so that the tests do not touch the cache of the user.
+class temp_cache_dir {
+    public:
+        temp_cache_dir(const std::string &var) : var(var),
+            path(boost::filesystem::temp_directory_path() /
+                    boost::filesystem::unique_path("vexcl-%%%%-%%%%-%%%%"))
+        {
+            if (const char *v = ::getenv(var.c_str())) {
+                had_old = true;
+                old = v;
+            } else {
+                had_old = false;
+            }
+
+            boost::filesystem::create_directories(path);
+            set_env(path.string().c_str());
+        }
+
+        ~temp_cache_dir() {
+            set_env(had_old ? old.c_str() : 0);
+
+            boost::system::error_code ec;
+            boost::filesystem::remove_all(path, ec);
+        }
+
+        const boost::filesystem::path& dir() const {
+            return path;
+        }
+    private:
+        std::string var, old;
+        bool had_old;
+        boost::filesystem::path path;
+
+        void set_env(const char *val) const {
+#ifdef _WIN32
+            _putenv_s(var.c_str(), val ? val : "");
+#else
+            if (val) setenv(var.c_str(), val, 1);
+            else unsetenv(var.c_str());
+#endif
+        }
+};
+
+#endif
@@ -3,6 +3,7 @@
 #include <vexcl/vector.hpp>
 #include <vexcl/function.hpp>
 #include "context_setup.hpp"
+#include "temp_cache_dir.hpp"
 
 BOOST_AUTO_TEST_CASE(empty)
 {
@@ -193,4 +194,25 @@ BOOST_AUTO_TEST_CASE(some_devices_are_empty)
     BOOST_CHECK(x[0] == 0);
 }
 
+BOOST_AUTO_TEST_CASE(cached_device_weight)
+{
+    temp_cache_dir cache("VEXCL_DEVICE_WEIGHTS_PATH");
+
+    const vex::backend::command_queue &q = ctx.queue(0);
+
+    BOOST_CHECK(!vex::detail::load_device_weight(q));
+
+    vex::detail::save_device_weight(q, 42.0);
+    boost::optional<double> c = vex::detail::load_device_weight(q);
+
+    BOOST_REQUIRE(c);
+    BOOST_CHECK_EQUAL(*c, 42.0);
+
+    BOOST_CHECK(boost::filesystem::exists(vex::detail::device_weight_path(
+                    vex::backend::get_device_signature(q))));
+    BOOST_CHECK_EQUAL(
+            boost::filesystem::path(vex::detail::device_weight_dir()),
+            cache.dir());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
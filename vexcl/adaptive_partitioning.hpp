@@ -0,0 +1,202 @@
+#ifndef VEXCL_ADAPTIVE_PARTITIONING_HPP
+#define VEXCL_ADAPTIVE_PARTITIONING_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/adaptive_partitioning.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Runtime rebalancing of multi-device partitions.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+
+#include <vexcl/backend.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/profiler.hpp>
+#include <vexcl/vector.hpp>
+
+namespace vex {
+
+/// Adaptive partitioning policy.
+/**
+ * Device weights computed by vex::partitioning_scheme come from a single
+ * vector addition benchmark. This class instead measures the per-device time
+ * of the actual workload, and suggests a new partitioning when the devices
+ * finish their parts at substantially different times:
+ *
+ \code
+ vex::adaptive_partitioning balance(ctx);
+
+ for(int iter = 0; iter < niters; ++iter) {
+     balance.measure(x.partition(), [&](unsigned d) {
+         // The part of the workload that belongs to device d.
+         vex::vector<double> xd(ctx.queue(d), x(d)), yd(ctx.queue(d), y(d));
+         yd = sin(xd) * cos(xd);
+         });
+
+     if (balance.imbalanced()) {
+         balance.repartition(x);
+         balance.repartition(y);
+         balance.apply(); // objects created from now on use the new weights
+     }
+ }
+ \endcode
+ *
+ * The device throughput (elements per second) is smoothed across the
+ * measurements with the given relaxation factor.
+ */
+class adaptive_partitioning {
+    public:
+        /// Constructor.
+        /**
+         * \param queue      Command queues to balance.
+         * \param threshold  Relative imbalance that triggers repartitioning.
+         * \param relax      Weight of the most recent measurement.
+         */
+        adaptive_partitioning(const std::vector<backend::command_queue> &queue,
+                double threshold = 0.1, double relax = 0.5)
+            : queue(queue), threshold(threshold), relax(relax),
+              weight(queue.size(), 0.0), time(queue.size(), 0.0)
+        {
+            precondition(!queue.empty(), "Empty queue list");
+            precondition(relax > 0 && relax <= 1, "Relaxation factor should be in (0,1]");
+        }
+
+        /// Records per-device times of a workload split with the given partitioning.
+        void record(const std::vector<size_t> &part, const std::vector<double> &t) {
+            precondition(
+                    part.size() == queue.size() + 1 && t.size() == queue.size(),
+                    "Wrong number of device timings"
+                    );
+
+            for(size_t d = 0; d < queue.size(); ++d) {
+                time[d] = t[d];
+
+                const size_t n = part[d + 1] - part[d];
+                if (!n || t[d] <= 0) continue;
+
+                const double w = n / t[d];
+                weight[d] = weight[d] > 0 ? (1 - relax) * weight[d] + relax * w : w;
+            }
+        }
+
+        /// Runs the workload and measures the time each device spends on it.
+        /**
+         * The workload is called once for every device with the device
+         * index, and should only submit the part of the work that belongs
+         * to that device (for example, by wrapping the partitions of the
+         * vectors with single-device vectors). The devices are run one after
+         * another, and the time of a device is the time from the start of
+         * its part to the moment its queue is finished. This works the same
+         * with the backends that launch kernels asynchronously and with the
+         * synchronous ones (JIT), where the whole part runs inside the call.
+         */
+        template <class Workload>
+        void measure(const std::vector<size_t> &part, Workload &&work) {
+            for(auto q = queue.begin(); q != queue.end(); ++q) q->finish();
+
+            std::vector<double> t(queue.size());
+
+            for(unsigned d = 0; d < queue.size(); ++d) {
+                stopwatch<> watch;
+
+                work(d);
+                queue[d].finish();
+
+                t[d] = watch.toc();
+            }
+
+            record(part, t);
+        }
+
+        /// Relative difference between the slowest device and the average.
+        double imbalance() const {
+            double tmax = *std::max_element(time.begin(), time.end());
+            double tavg = std::accumulate(time.begin(), time.end(), 0.0) / time.size();
+
+            return tavg > 0 ? tmax / tavg - 1 : 0.0;
+        }
+
+        /// Whether the imbalance exceeds the threshold.
+        bool imbalanced() const {
+            return queue.size() > 1 && imbalance() > threshold;
+        }
+
+        /// Current device weights (measured throughput).
+        const std::vector<double>& weights() const {
+            return weight;
+        }
+
+        /// Partitioning of n elements according to the measured weights.
+        /**
+         * Falls back to vex::partition() until every device has been measured.
+         */
+        std::vector<size_t> partition(size_t n) const {
+            if (std::find(weight.begin(), weight.end(), 0.0) != weight.end())
+                return vex::partition(n, queue);
+
+            std::vector<double> cumsum(1, 0.0);
+            for(auto w = weight.begin(); w != weight.end(); ++w)
+                cumsum.push_back(cumsum.back() + *w);
+
+            std::vector<size_t> part(1, 0);
+            for(size_t d = 1; d < queue.size(); ++d)
+                part.push_back(
+                        std::max(part.back(),
+                            std::min(n, alignup(static_cast<size_t>(n * cumsum[d] / cumsum.back()))))
+                        );
+            part.push_back(n);
+
+            return part;
+        }
+
+        /// Migrates the vector data to match the measured weights.
+        template <typename T>
+        void repartition(vector<T> &x) const {
+            x.repartition(partition(x.size()));
+        }
+
+        /// Makes objects created from now on use the measured weights.
+        /**
+         * The measured throughput is rescaled to the units of the weighting
+         * function of vex::partitioning_scheme (see
+         * vex::partitioning_scheme::update()).
+         */
+        void apply() const {
+            if (std::find(weight.begin(), weight.end(), 0.0) == weight.end())
+                partitioning_scheme<>::update(queue, weight);
+        }
+    private:
+        std::vector<backend::command_queue> queue;
+        double threshold, relax;
+        std::vector<double> weight, time;
+};
+
+} // namespace vex
+
+#endif
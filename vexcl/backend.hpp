@@ -86,6 +86,29 @@ namespace vex {
 
 #endif
 
+namespace vex {
+namespace backend {
+
+/// Checks if kernels may directly access buffers allocated for any of the queues.
+/**
+ * This is the case when all queues share the same context and either the
+ * devices are CPUs (and hence share the host memory), or the queues belong to
+ * the same device. The JIT backend always satisfies this.
+ */
+inline bool shared_memory_access(const std::vector<command_queue> &q) {
+    for(size_t d = 1; d < q.size(); ++d) {
+        if (get_context_id(q[d]) != get_context_id(q[0])) return false;
+
+        if (!(is_cpu(q[d]) && is_cpu(q[0])) && get_device_id(q[d]) != get_device_id(q[0]))
+            return false;
+    }
+
+    return true;
+}
+
+} // namespace backend
+} // namespace vex
+
 namespace vex {
     using backend::device;
     using backend::command_queue;
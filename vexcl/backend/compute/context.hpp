@@ -80,6 +80,15 @@ inline device_id get_device_id(const command_queue &q) {
     return q.get_device().get();
 }
 
+/// Returns string identifying the backend, the device, and the driver version.
+inline std::string get_device_signature(const command_queue &q) {
+    device d = q.get_device();
+
+    return "Compute; " + d.platform().name()
+        + "; " + d.name()
+        + "; " + d.driver_version();
+}
+
 /// Returns raw context id for the given queue.
 inline context_id get_context_id(const command_queue &q) {
     return q.get_context().get();
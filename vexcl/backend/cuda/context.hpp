@@ -34,6 +34,7 @@ THE SOFTWARE.
 #include <vector>
 #include <tuple>
 #include <iostream>
+#include <sstream>
 #include <memory>
 
 #include <cuda.h>
@@ -292,6 +293,16 @@ inline device_id get_device_id(const command_queue &q) {
     return q.device().raw();
 }
 
+/// Returns string identifying the backend, the device, and the driver version.
+inline std::string get_device_signature(const command_queue &q) {
+    int version;
+    cuda_check( cuDriverGetVersion(&version) );
+
+    std::ostringstream s;
+    s << "CUDA; " << q.device().name() << "; " << version;
+    return s.str();
+}
+
 /// Launch grid size.
 struct ndrange {
     size_t x, y, z;
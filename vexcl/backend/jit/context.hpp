@@ -32,9 +32,12 @@ THE SOFTWARE.
  */
 
 #include <string>
+#include <sstream>
+#include <fstream>
 #include <stdexcept>
 
 #include <boost/dll/shared_library.hpp>
+#include <boost/thread/thread.hpp>
 
 namespace vex {
 namespace backend {
@@ -82,6 +85,34 @@ inline device_id get_device_id(const command_queue&) {
     return 0;
 }
 
+/// Model name of the host CPU (empty when it is unknown).
+inline std::string cpu_model() {
+    std::string model;
+#if defined(__linux__)
+    std::ifstream f("/proc/cpuinfo");
+    for(std::string line; std::getline(f, line); ) {
+        if (line.compare(0, 10, "model name") == 0) {
+            std::string::size_type p = line.find(':');
+            if (p != std::string::npos)
+                p = line.find_first_not_of(" \t", p + 1);
+            if (p != std::string::npos)
+                model = line.substr(p);
+            break;
+        }
+    }
+#endif
+    return model;
+}
+
+inline std::string get_device_signature(const command_queue&) {
+    static const std::string model = cpu_model();
+
+    std::ostringstream s;
+    s << "JIT; " << device().name() << "; " << model << "; "
+      << boost::thread::hardware_concurrency();
+    return s.str();
+}
+
 typedef unsigned context_id;
 
 inline context_id get_context_id(const command_queue&) {
@@ -69,6 +69,16 @@ inline device_id get_device_id(const command_queue &q) {
     return q.getInfo<CL_QUEUE_DEVICE>()();
 }
 
+/// Returns string identifying the backend, the device, and the driver version.
+inline std::string get_device_signature(const command_queue &q) {
+    cl::Device d = q.getInfo<CL_QUEUE_DEVICE>();
+    cl::Platform p(d.getInfo<CL_DEVICE_PLATFORM>());
+
+    return "OpenCL; " + p.getInfo<CL_PLATFORM_NAME>()
+        + "; " + d.getInfo<CL_DEVICE_NAME>()
+        + "; " + d.getInfo<CL_DRIVER_VERSION>();
+}
+
 typedef cl_context       context_id;
 /// Returns raw context id for the given queue.
 inline context_id get_context_id(const command_queue &q) {
@@ -0,0 +1,197 @@
+#ifndef VEXCL_DETAIL_COPY_RANGE_HPP
+#define VEXCL_DETAIL_COPY_RANGE_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/detail/copy_range.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Copies of buffer ranges between compute devices.
+ */
+
+#include <vector>
+#include <algorithm>
+
+#include <vexcl/backend.hpp>
+#include <vexcl/cache.hpp>
+#include <vexcl/types.hpp>
+#include <vexcl/detail/fusion.hpp>
+
+namespace vex {
+namespace detail {
+
+/// Checks if a kernel on the second queue may read buffers of the first one.
+inline bool same_device(const backend::command_queue &a, const backend::command_queue &b) {
+    return backend::get_context_id(a) == backend::get_context_id(b)
+        && backend::get_device_id(a)  == backend::get_device_id(b);
+}
+
+template <typename T>
+backend::kernel& copy_range_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        src.begin_kernel("copy_range");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t >("n");
+        src.template parameter< global_ptr<const T> >("src");
+        src.template parameter< size_t >("src_pos");
+        src.template parameter< global_ptr<T> >("dst");
+        src.template parameter< size_t >("dst_pos");
+        src.end_kernel_parameters();
+
+        src.grid_stride_loop().open("{");
+        src.new_line() << "dst[dst_pos + idx] = src[src_pos + idx];";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "copy_range"));
+    }
+
+    return kernel->second;
+}
+
+/// Copies ranges of device buffers, possibly between compute devices.
+/**
+ * A copy within a device is done by a kernel on the destination queue, so the
+ * source has to be ready by the time the kernel runs on that queue. A copy
+ * between devices goes through two bounded host buffers: writing one chunk to
+ * the destination device overlaps with reading the next one, and the host
+ * only waits for a pending write when it has to reuse its buffer. The
+ * destination buffers may not be used on other queues until finish() is
+ * called or the copier is destroyed.
+ */
+class range_copier {
+    public:
+        range_copier() : next(0) {}
+
+        ~range_copier() {
+            finish();
+        }
+
+        template <typename T>
+        void operator()(
+                const backend::command_queue &src_queue,
+                const backend::device_vector<T> &src, size_t src_pos,
+                const backend::command_queue &dst_queue,
+                const backend::device_vector<T> &dst, size_t dst_pos,
+                size_t n)
+        {
+            if (!n) return;
+
+            if (same_device(src_queue, dst_queue)) {
+                backend::select_context(dst_queue);
+
+                auto &krn = copy_range_kernel<T>(dst_queue);
+
+                krn.push_arg(n);
+                krn.push_arg(src);
+                krn.push_arg(src_pos);
+                krn.push_arg(dst);
+                krn.push_arg(dst_pos);
+
+                krn(dst_queue);
+                return;
+            }
+
+            const size_t chunk = std::min<size_t>(n, 1 << 22);
+
+            for(size_t i = 0; i < n; i += chunk) {
+                size_t m = std::min(chunk, n - i);
+
+                stage &s = buf[next];
+                next = 1 - next;
+
+                s.wait();
+                if (s.data.size() < m * sizeof(T)) s.data.resize(m * sizeof(T));
+
+                T *host = reinterpret_cast<T*>(s.data.data());
+
+                src.read (src_queue, src_pos + i, m, host, true);
+                dst.write(dst_queue, dst_pos + i, m, host, false);
+
+                s.queue = &dst_queue;
+            }
+        }
+
+        /// Waits for the pending writes to the destination devices.
+        void finish() {
+            buf[0].wait();
+            buf[1].wait();
+        }
+    private:
+        struct stage {
+            std::vector<char> data;
+            const backend::command_queue *queue;
+
+            stage() : queue(0) {}
+
+            void wait() {
+                if (queue) queue->finish();
+                queue = 0;
+            }
+        };
+
+        stage buf[2];
+        unsigned next;
+};
+
+// Copies a chunk of every component of a device buffer set to a partitioned
+// vector tuple.
+template <class Buffers, class Tuple>
+struct receive_chunk {
+    range_copier &copy;
+    Buffers &src;
+    const backend::command_queue &q;
+    size_t src_pos;
+    const Tuple &dst;
+    unsigned b;
+    size_t dst_pos, n;
+
+    receive_chunk(range_copier &copy, Buffers &src, const backend::command_queue &q,
+            size_t src_pos, const Tuple &dst, unsigned b, size_t dst_pos, size_t n)
+        : copy(copy), src(src), q(q), src_pos(src_pos), dst(dst), b(b),
+          dst_pos(dst_pos), n(n)
+    {}
+
+    template <class I>
+    void operator()(I) const {
+        const auto &v = boost::fusion::at_c<I::value>(dst);
+
+        copy(q, detail::at_c<I::value>(src), src_pos,
+                v.queue_list()[b], v(b), dst_pos, n);
+    }
+};
+
+} // namespace detail
+} // namespace vex
+
+#endif
@@ -193,6 +193,9 @@ struct temp_storage<K, I,
     typename std::enable_if<I == boost::mpl::size<K>::value>::type >
 {
     temp_storage(const backend::command_queue&, size_t) {}
+
+    template <class Tuple>
+    void swap(Tuple&) {}
 };
 
 template <size_t I, size_t N, class Enable = void>
@@ -0,0 +1,853 @@
+#ifndef VEXCL_NTH_ELEMENT_HPP
+#define VEXCL_NTH_ELEMENT_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/nth_element.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Partial sorting: selection of the nth element and of the top k elements.
+ */
+
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <boost/mpl/range_c.hpp>
+
+#include <vexcl/backend.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/detail/fusion.hpp>
+#include <vexcl/scan.hpp>
+#include <vexcl/sort.hpp>
+
+namespace vex {
+namespace detail {
+
+//---------------------------------------------------------------------------
+// Radix select
+//---------------------------------------------------------------------------
+// The keys are mapped onto unsigned integers with radix_sort_key(). The
+// selection walks the digits from the most significant one down; each pass
+// only counts the keys that share the already selected high digits.
+template <typename T>
+struct radix_select_key {
+    typedef typename std::conditional<sizeof(T) == 4, cl_uint, cl_ulong>::type type;
+};
+
+// Loads the mapped key. The keys that were compacted after the previous
+// passes are stored already mapped.
+template <typename T, bool Mapped>
+void radix_select_load(backend::source_generator &src, const std::string &key) {
+    typedef typename radix_select_key<T>::type U;
+
+    if (Mapped) {
+        src.new_line() << type_name<U>() << " k = " << key << ";";
+    } else {
+        src.new_line() << type_name<U>() << " k = radix_sort_key(" << key << ");";
+        src.new_line() << "if (descending) k = ~k;";
+    }
+}
+
+// Every thread counts the digits of the candidate keys in its range. CPU
+// threads process contiguous tiles, GPU threads stride through the keys.
+template <int RB, typename T, bool Mapped>
+backend::kernel& radix_select_count_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        typedef typename radix_select_key<T>::type U;
+        typedef typename std::conditional<Mapped, U, T>::type K;
+
+        backend::source_generator src(queue);
+
+        if (!Mapped) radix_sort_key<T>(src);
+
+        src.begin_kernel("radix_select_count");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("count");
+        src.template parameter< int >("nthreads");
+        src.template parameter< int >("tile");
+        src.template parameter< int >("strided");
+        src.template parameter< int >("shift");
+        src.template parameter< int >("descending");
+        src.template parameter< U >("prefix");
+        src.template parameter< U >("mask");
+        src.template parameter< global_ptr<const K> >("keys");
+        src.template parameter< global_ptr<int> >("hist");
+        src.end_kernel_parameters();
+
+        src.new_line() << "int tid = " << src.global_id(0) << ";";
+        src.new_line() << "if (tid >= nthreads) return;";
+
+        src.new_line() << "int c[" << (1 << RB) << "];";
+        src.new_line() << "for(int d = 0; d < " << (1 << RB) << "; ++d) c[d] = 0;";
+
+        src.new_line() << "int beg  = strided ? tid : tid * tile;";
+        src.new_line() << "int end  = strided ? count : min(count, beg + tile);";
+        src.new_line() << "int step = strided ? nthreads : 1;";
+        src.new_line() << "for(int i = beg; i < end; i += step)";
+        src.open("{");
+        radix_select_load<T, Mapped>(src, "keys[i]");
+        src.new_line() << "if ((k & mask) == prefix) ++c[(k >> shift) & " << (1 << RB) - 1 << "];";
+        src.close("}");
+
+        src.new_line() << "for(int d = 0; d < " << (1 << RB) << "; ++d) hist[d * nthreads + tid] = c[d];";
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "radix_select_count"));
+    }
+
+    return kernel->second;
+}
+
+// Every thread copies the mapped keys of the selected bucket from its range
+// to the candidate buffer. The output positions come from the scanned digit
+// counts of the last pass.
+template <typename T, bool Mapped>
+backend::kernel& radix_select_compact_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        typedef typename radix_select_key<T>::type U;
+        typedef typename std::conditional<Mapped, U, T>::type K;
+
+        backend::source_generator src(queue);
+
+        if (!Mapped) radix_sort_key<T>(src);
+
+        src.begin_kernel("radix_select_compact");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("count");
+        src.template parameter< int >("nthreads");
+        src.template parameter< int >("tile");
+        src.template parameter< int >("strided");
+        src.template parameter< int >("descending");
+        src.template parameter< U >("prefix");
+        src.template parameter< U >("mask");
+        src.template parameter< int >("base");
+        src.template parameter< global_ptr<const int> >("offset");
+        src.template parameter< global_ptr<const K> >("keys");
+        src.template parameter< global_ptr<U> >("cand");
+        src.end_kernel_parameters();
+
+        src.new_line() << "int tid = " << src.global_id(0) << ";";
+        src.new_line() << "if (tid >= nthreads) return;";
+
+        src.new_line() << "int pos = offset[base + tid] - offset[base];";
+
+        src.new_line() << "int beg  = strided ? tid : tid * tile;";
+        src.new_line() << "int end  = strided ? count : min(count, beg + tile);";
+        src.new_line() << "int step = strided ? nthreads : 1;";
+        src.new_line() << "for(int i = beg; i < end; i += step)";
+        src.open("{");
+        radix_select_load<T, Mapped>(src, "keys[i]");
+        src.new_line() << "if ((k & mask) == prefix) cand[pos++] = k;";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "radix_select_compact"));
+    }
+
+    return kernel->second;
+}
+
+// Every work-group sums the per-thread counts of a single bin.
+template <int NT>
+backend::kernel& radix_select_sum_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        src.begin_kernel("radix_select_sum");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("nthreads");
+        src.template parameter< global_ptr<const int> >("hist");
+        src.template parameter< global_ptr<int> >("total");
+        src.end_kernel_parameters();
+
+        src.new_line() << "int bin = " << src.group_id(0) << ";";
+        src.new_line() << "int lid = " << src.local_id(0) << ";";
+
+        src.new_line() << "int s = 0;";
+        src.new_line() << "for(int t = lid; t < nthreads; t += " << NT << ") s += hist[bin * nthreads + t];";
+
+        if (NT > 1) {
+            std::ostringstream shared;
+            shared << "part[" << NT << "]";
+            src.smem_static_var("int", shared.str());
+
+            src.new_line() << "part[lid] = s;";
+            src.new_line().barrier();
+
+            src.new_line() << "for(int o = " << NT / 2 << "; o > 0; o /= 2)";
+            src.open("{");
+            src.new_line() << "if (lid < o) part[lid] += part[lid + o];";
+            src.new_line().barrier();
+            src.close("}");
+
+            src.new_line() << "if (lid == 0) total[bin] = part[0];";
+        } else {
+            src.new_line() << "total[bin] = s;";
+        }
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "radix_select_sum"));
+    }
+
+    return kernel->second;
+}
+
+// Every thread counts the keys of its tile that go before, together with, and
+// after the selected bucket.
+template <typename T>
+backend::kernel& nth_element_count_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        typedef typename radix_select_key<T>::type U;
+
+        backend::source_generator src(queue);
+
+        radix_sort_key<T>(src);
+
+        src.begin_kernel("nth_element_count");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("count");
+        src.template parameter< int >("nthreads");
+        src.template parameter< int >("tile");
+        src.template parameter< int >("descending");
+        src.template parameter< U >("prefix");
+        src.template parameter< U >("mask");
+        src.template parameter< global_ptr<const T> >("keys");
+        src.template parameter< global_ptr<int> >("hist");
+        src.end_kernel_parameters();
+
+        src.new_line() << "int tid = " << src.global_id(0) << ";";
+        src.new_line() << "if (tid >= nthreads) return;";
+
+        src.new_line() << "int c[3] = {0, 0, 0};";
+
+        src.new_line() << "int beg = tid * tile;";
+        src.new_line() << "int end = min(count, beg + tile);";
+        src.new_line() << "for(int i = beg; i < end; ++i)";
+        src.open("{");
+        src.new_line() << type_name<U>() << " k = radix_sort_key(keys[i]);";
+        src.new_line() << "if (descending) k = ~k;";
+        src.new_line() << "k &= mask;";
+        src.new_line() << "++c[(k > prefix) + (k >= prefix)];";
+        src.close("}");
+
+        src.new_line() << "for(int d = 0; d < 3; ++d) hist[d * nthreads + tid] = c[d];";
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "nth_element_count"));
+    }
+
+    return kernel->second;
+}
+
+// Stable three-way partition of the keys (and values) around the selected
+// bucket.
+template <typename T, typename V>
+backend::kernel& nth_element_scatter_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        typedef typename radix_select_key<T>::type U;
+
+        backend::source_generator src(queue);
+
+        radix_sort_key<T>(src);
+
+        src.begin_kernel("nth_element_scatter");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("count");
+        src.template parameter< int >("nthreads");
+        src.template parameter< int >("tile");
+        src.template parameter< int >("descending");
+        src.template parameter< U >("prefix");
+        src.template parameter< U >("mask");
+        src.template parameter< global_ptr<const int> >("offset");
+        src.template parameter< global_ptr<const T> >("keys_src");
+        src.template parameter< global_ptr<T> >("keys_dst");
+
+        boost::mpl::for_each<V>( pointer_param<global_ptr, true>(src, "vals_src") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr      >(src, "vals_dst") );
+
+        src.end_kernel_parameters();
+
+        src.new_line() << "int tid = " << src.global_id(0) << ";";
+        src.new_line() << "if (tid >= nthreads) return;";
+
+        src.new_line() << "int pos[3];";
+        src.new_line() << "for(int d = 0; d < 3; ++d) pos[d] = offset[d * nthreads + tid];";
+
+        src.new_line() << "int beg = tid * tile;";
+        src.new_line() << "int end = min(count, beg + tile);";
+        src.new_line() << "for(int i = beg; i < end; ++i)";
+        src.open("{");
+        src.new_line() << type_name<T>() << " key = keys_src[i];";
+        src.new_line() << type_name<U>() << " k = radix_sort_key(key);";
+        src.new_line() << "if (descending) k = ~k;";
+        src.new_line() << "k &= mask;";
+        src.new_line() << "int j = pos[(k > prefix) + (k >= prefix)]++;";
+        src.new_line() << "keys_dst[j] = key;";
+        for(int p = 0; p < boost::mpl::size<V>::value; ++p)
+            src.new_line() << "vals_dst" << p << "[j] = vals_src" << p << "[i];";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "nth_element_scatter"));
+    }
+
+    return kernel->second;
+}
+
+// The candidates of the radix select on a single device. Initially these
+// are all keys of the partition. When the selected bucket holds at most half
+// of the candidates, it is compacted into a smaller buffer, so the following
+// passes only read the remaining candidates.
+template <int RB, typename T>
+class radix_select_candidates {
+    public:
+        typedef typename radix_select_key<T>::type U;
+
+        radix_select_candidates(const backend::command_queue &queue,
+                const backend::device_vector<T> &keys, bool descending)
+            : queue(queue), keys(keys), descending(descending),
+              cpu(is_cpu(queue)), count(static_cast<int>(keys.size())),
+              bins(1 << RB)
+        {
+            resize();
+        }
+
+        int size() const { return count; }
+
+        // Adds the digit counts of the candidates to the total.
+        void count_digits(int shift, U prefix, U mask, std::vector<size_t> &total) {
+            backend::select_context(queue);
+
+            auto kernel = cand ?
+                radix_select_count_kernel<RB, T, true >(queue) :
+                radix_select_count_kernel<RB, T, false>(queue);
+
+            kernel.push_arg(count);
+            kernel.push_arg(nthreads);
+            kernel.push_arg(tile);
+            kernel.push_arg(static_cast<int>(!cpu));
+            kernel.push_arg(shift);
+            kernel.push_arg(static_cast<int>(descending));
+            kernel.push_arg(prefix);
+            kernel.push_arg(mask);
+            if (cand) kernel.push_arg(*cand); else kernel.push_arg(keys);
+            kernel.push_arg(*hist);
+
+            kernel.config((nthreads + ws() - 1) / ws(), ws());
+            kernel(queue);
+
+            auto sum = cpu ?
+                radix_select_sum_kernel<1>(queue) :
+                radix_select_sum_kernel<VEX_SORT_NT_GPU>(queue);
+
+            backend::device_vector<int> b(queue, 1 << RB);
+
+            sum.push_arg(nthreads);
+            sum.push_arg(*hist);
+            sum.push_arg(b);
+
+            sum.config(1 << RB, ws());
+            sum(queue);
+
+            b.read(queue, 0, bins.size(), bins.data(), true);
+
+            for(size_t d = 0; d < bins.size(); ++d) total[d] += bins[d];
+        }
+
+        // Keeps the candidates that fall into the selected bucket. The
+        // prefix and the mask already include the selected digit.
+        void select(int digit, U prefix, U mask) {
+            const int m = bins[digit];
+
+            if (2 * m > count) return;
+
+            backend::select_context(queue);
+
+            backend::device_vector<int> offset(queue, hist->size());
+            scan(queue, *hist, offset, 0, true, plus<int>().device);
+
+            std::unique_ptr< backend::device_vector<U> > next;
+
+            if (m) {
+                next.reset(new backend::device_vector<U>(queue, m));
+
+                auto kernel = cand ?
+                    radix_select_compact_kernel<T, true >(queue) :
+                    radix_select_compact_kernel<T, false>(queue);
+
+                kernel.push_arg(count);
+                kernel.push_arg(nthreads);
+                kernel.push_arg(tile);
+                kernel.push_arg(static_cast<int>(!cpu));
+                kernel.push_arg(static_cast<int>(descending));
+                kernel.push_arg(prefix);
+                kernel.push_arg(mask);
+                kernel.push_arg(digit * nthreads);
+                kernel.push_arg(offset);
+                if (cand) kernel.push_arg(*cand); else kernel.push_arg(keys);
+                kernel.push_arg(*next);
+
+                kernel.config((nthreads + ws() - 1) / ws(), ws());
+                kernel(queue);
+            }
+
+            cand = std::move(next);
+            count = m;
+
+            if (count) resize();
+        }
+    private:
+        const backend::command_queue &queue;
+        const backend::device_vector<T> &keys;
+        bool descending, cpu;
+
+        int count, nthreads, tile;
+
+        std::unique_ptr< backend::device_vector<U> > cand;
+        std::unique_ptr< backend::device_vector<int> > hist;
+        std::vector<int> bins;
+
+        size_t ws() const { return cpu ? 1 : VEX_SORT_NT_GPU; }
+
+        void resize() {
+            nthreads = static_cast<int>(cpu ?
+                std::min<size_t>(count, backend::kernel::num_workgroups(queue)) :
+                std::min<size_t>((count + 31) / 32, backend::kernel::num_workgroups(queue) * VEX_SORT_NT_GPU));
+            tile = (count + nthreads - 1) / nthreads;
+
+            hist.reset(new backend::device_vector<int>(queue, static_cast<size_t>(nthreads) << RB));
+        }
+};
+
+// Finds the bucket of the mapped keys that contains the element of rank nth.
+// Returns the prefix and the mask of the bucket. The search stops early when
+// the bucket only holds the single element.
+template <int RB, typename T>
+std::pair<typename radix_select_key<T>::type, typename radix_select_key<T>::type>
+radix_select(const vector<T> &keys, size_t nth, bool descending) {
+    typedef typename radix_select_key<T>::type U;
+
+    const auto &queue = keys.queue_list();
+
+    std::vector< std::unique_ptr< radix_select_candidates<RB, T> > > part;
+    for(unsigned d = 0; d < queue.size(); ++d)
+        if (keys.part_size(d))
+            part.emplace_back(new radix_select_candidates<RB, T>(queue[d], keys(d), descending));
+
+    U prefix = 0, mask = 0;
+
+    for(int shift = 8 * sizeof(T) - RB; shift >= 0; shift -= RB) {
+        std::vector<size_t> total(1 << RB, 0);
+
+        for(auto p = part.begin(); p != part.end(); ++p)
+            if ((*p)->size()) (*p)->count_digits(shift, prefix, mask, total);
+
+        int digit = 0;
+        while(nth >= total[digit]) nth -= total[digit++];
+
+        prefix |= static_cast<U>(digit) << shift;
+        mask   |= static_cast<U>((1 << RB) - 1) << shift;
+
+        if (total[digit] == 1 || shift == 0) break;
+
+        for(auto p = part.begin(); p != part.end(); ++p)
+            if ((*p)->size()) (*p)->select(digit, prefix, mask);
+    }
+
+    return std::make_pair(prefix, mask);
+}
+
+/// Partially sorts the keys (and values) so that the nth element is in place.
+/**
+ * The bucket of the nth element is found with the radix select. Then each
+ * partition is split into the keys before, inside, and after the bucket with
+ * a stable three-way partition into temporary buffers, and the parts are
+ * copied to their places in the vector. Parts that move to another device
+ * are staged through the host.
+ */
+template <class V, typename T, class VTuple>
+T nth_element_sink(vector<T> &keys, const VTuple &vals, size_t nth, bool descending) {
+    namespace fusion = boost::fusion;
+
+    typedef typename radix_select_key<T>::type U;
+
+    precondition(nth < keys.size(), "nth is out of range");
+
+    const auto &queue = keys.queue_list();
+    const unsigned ndev = static_cast<unsigned>(queue.size());
+
+    // The digit width has to be the same on all devices.
+    bool cpu = true;
+    for(unsigned d = 0; d < ndev; ++d) cpu = cpu && is_cpu(queue[d]);
+
+    std::pair<U, U> bucket = cpu ?
+        radix_select<8>(keys, nth, descending) :
+        radix_select<4>(keys, nth, descending);
+
+    std::vector< std::unique_ptr< backend::device_vector<T> > > keys_tmp(ndev);
+    std::vector< std::unique_ptr< temp_storage<V> > > vals_tmp(ndev);
+
+    // cnt[d][c] is the number of keys of class c (before, inside, and after
+    // the bucket) in the partition d.
+    std::vector< std::vector<size_t> > cnt(ndev, std::vector<size_t>(3, 0));
+
+    for(unsigned d = 0; d < ndev; ++d) {
+        const int count = static_cast<int>(keys.part_size(d));
+        if (!count) continue;
+
+        backend::select_context(queue[d]);
+
+        const int nthreads = is_cpu(queue[d]) ?
+            static_cast<int>(std::min<size_t>(count, backend::kernel::num_workgroups(queue[d]))) :
+            (count + 31) / 32;
+        const int tile = (count + nthreads - 1) / nthreads;
+
+        backend::device_vector<int> hist  (queue[d], 3 * nthreads);
+        backend::device_vector<int> offset(queue[d], 3 * nthreads);
+
+        keys_tmp[d].reset(new backend::device_vector<T>(queue[d], count));
+        vals_tmp[d].reset(new temp_storage<V>(queue[d], count));
+
+        auto count_kernel   = nth_element_count_kernel<T>(queue[d]);
+        auto scatter_kernel = nth_element_scatter_kernel<T, V>(queue[d]);
+
+        const size_t ws = is_cpu(queue[d]) ? 1 : VEX_SORT_NT_GPU;
+        const size_t wg = (nthreads + ws - 1) / ws;
+
+        count_kernel.push_arg(count);
+        count_kernel.push_arg(nthreads);
+        count_kernel.push_arg(tile);
+        count_kernel.push_arg(static_cast<int>(descending));
+        count_kernel.push_arg(bucket.first);
+        count_kernel.push_arg(bucket.second);
+        count_kernel.push_arg(keys(d));
+        count_kernel.push_arg(hist);
+
+        count_kernel.config(wg, ws);
+        count_kernel(queue[d]);
+
+        scan(queue[d], hist, offset, 0, true, plus<int>().device);
+
+        int bnd[2];
+        offset.read(queue[d], nthreads,     1, bnd + 0, true);
+        offset.read(queue[d], 2 * nthreads, 1, bnd + 1, true);
+
+        cnt[d][0] = bnd[0];
+        cnt[d][1] = bnd[1] - bnd[0];
+        cnt[d][2] = count - bnd[1];
+
+        auto vpart = fusion::transform(vals, extract_device_vector(d));
+
+        scatter_kernel.push_arg(count);
+        scatter_kernel.push_arg(nthreads);
+        scatter_kernel.push_arg(tile);
+        scatter_kernel.push_arg(static_cast<int>(descending));
+        scatter_kernel.push_arg(bucket.first);
+        scatter_kernel.push_arg(bucket.second);
+        scatter_kernel.push_arg(offset);
+        scatter_kernel.push_arg(keys(d));
+        scatter_kernel.push_arg(*keys_tmp[d]);
+
+        push_args<boost::mpl::size<V>::value>(scatter_kernel, vpart);
+        push_args<boost::mpl::size<V>::value>(scatter_kernel, *vals_tmp[d]);
+
+        scatter_kernel.config(wg, ws);
+        scatter_kernel(queue[d]);
+    }
+
+    range_copier copy;
+
+    if (ndev == 1) {
+        const size_t count = keys.part_size(0);
+
+        copy(queue[0], *keys_tmp[0], 0, queue[0], keys(0), 0, count);
+
+        boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<V>::value> >(
+                store_partition<temp_storage<V>, VTuple>(copy, queue[0], *vals_tmp[0], vals, 0, count));
+    } else {
+        // Copies within a device are done by kernels on the destination
+        // queue, so the partitioned keys have to be ready on every queue.
+        for(unsigned d = 0; d < ndev; ++d) queue[d].finish();
+
+        // The global order is the keys of all partitions before the bucket,
+        // then the bucket, then the rest. Each class of a partition is a
+        // contiguous chunk that may span several destination partitions.
+        size_t dst = 0;
+        for(int c = 0; c < 3; ++c) {
+            for(unsigned s = 0; s < ndev; ++s) {
+                size_t n = cnt[s][c];
+                if (!n) continue;
+
+                size_t src = 0;
+                for(int p = 0; p < c; ++p) src += cnt[s][p];
+
+                for(unsigned b = 0; b < ndev; ++b) {
+                    size_t lo = std::max(dst,     keys.part_start(b));
+                    size_t hi = std::min(dst + n, keys.part_start(b + 1));
+                    if (lo >= hi) continue;
+
+                    copy(queue[s], *keys_tmp[s], src + lo - dst,
+                            queue[b], keys(b), lo - keys.part_start(b), hi - lo);
+
+                    boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<V>::value> >(
+                            receive_chunk<temp_storage<V>, VTuple>(copy, *vals_tmp[s], queue[s], src + lo - dst,
+                                vals, b, lo - keys.part_start(b), hi - lo));
+                }
+
+                dst += n;
+            }
+        }
+    }
+
+    copy.finish();
+
+    return keys[nth];
+}
+
+template <typename T, class Comp>
+void sort_all(vector<T> &keys, const boost::fusion::vector<>&, Comp comp) {
+    sort_sink(boost::fusion::vector<vector<T>&>(keys), comp);
+}
+
+template <typename T, class VTuple, class Comp>
+void sort_all(vector<T> &keys, const VTuple &vals, Comp comp) {
+    sort_by_key_sink(boost::fusion::vector<vector<T>&>(keys), vals, comp);
+}
+
+// Copies the head of the first partition of a vector to a new buffer.
+struct copy_head {
+    range_copier &copy;
+    const backend::command_queue &q;
+    size_t n;
+
+    copy_head(range_copier &copy, const backend::command_queue &q, size_t n)
+        : copy(copy), q(q), n(n) {}
+
+    template <class T> struct result;
+
+    template <class This, class T>
+    struct result< This(T) > {
+        typedef backend::device_vector<typename std::decay<T>::type::value_type> type;
+    };
+
+    template <class T>
+    backend::device_vector<typename T::value_type> operator()(const T &v) const {
+        backend::device_vector<typename T::value_type> buf(q, n);
+        copy(q, v(0), 0, q, buf, 0, n);
+        return buf;
+    }
+};
+
+// Copies every buffer of a tuple back to the head of the first partition of
+// the corresponding vector.
+template <class Head, class Tuple>
+struct store_head {
+    range_copier &copy;
+    const backend::command_queue &q;
+    Head &src;
+    const Tuple &dst;
+    size_t n;
+
+    store_head(range_copier &copy, const backend::command_queue &q,
+            Head &src, const Tuple &dst, size_t n)
+        : copy(copy), q(q), src(src), dst(dst), n(n) {}
+
+    template <class I>
+    void operator()(I) const {
+        copy(q, boost::fusion::at_c<I::value>(src), 0,
+                q, boost::fusion::at_c<I::value>(dst)(0), 0, n);
+    }
+};
+
+/// Moves the top k keys (and values) to the front of the vector in order.
+template <class V, typename T, class VTuple, class Comp>
+void top_k_sink(vector<T> &keys, const VTuple &vals, size_t k, Comp comp) {
+    namespace fusion = boost::fusion;
+
+    const bool descending = radix_sort_type<T, Comp>::descending;
+
+    precondition(k <= keys.size(), "k is out of range");
+
+    if (!k) return;
+
+    if (k < keys.size())
+        nth_element_sink<V>(keys, vals, k - 1, descending);
+
+    if (k <= keys.part_size(0)) {
+        // The head is sorted in temporary buffers and copied back, so that
+        // the buffers of the vectors are left in place.
+        const auto &q = keys.queue_list()[0];
+
+        range_copier copy;
+
+        backend::device_vector<T> khead(q, k);
+        copy(q, keys(0), 0, q, khead, 0, k);
+
+        auto vhead = fusion::as_vector(fusion::transform(vals, copy_head(copy, q, k)));
+
+        radix_sort<V>(q, khead, vhead, static_cast<int>(k), descending);
+
+        copy(q, khead, 0, q, keys(0), 0, k);
+
+        boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<V>::value> >(
+                store_head<decltype(vhead), VTuple>(copy, q, vhead, vals, k));
+    } else {
+        sort_all(keys, vals, comp);
+    }
+}
+
+} // namespace detail
+
+/// Partially sorts the vector so that its nth element is in the sorted position.
+/**
+ * As with std::nth_element(), the elements before the nth one are not
+ * greater than it, and the elements after it are not less than it (in
+ * the order given by the comparator). Only 32 and 64 bit arithmetic keys
+ * with vex::less or vex::greater are supported. The element is found
+ * with radix select: each pass over the keys refines the bucket of
+ * candidates by one digit. The relative order of the elements within the
+ * three groups is preserved.
+ *
+ * \returns the value of the nth element.
+ */
+template <typename K, class Comp>
+K nth_element(vector<K> &keys, size_t nth, Comp) {
+    static_assert(detail::radix_sort_type<K, Comp>::value,
+            "nth_element only supports arithmetic keys with vex::less or vex::greater");
+
+    return detail::nth_element_sink< boost::mpl::vector<> >(
+            keys, boost::fusion::vector<>(), nth,
+            detail::radix_sort_type<K, Comp>::descending);
+}
+
+/// Partially sorts the vector so that its nth element is in the sorted position.
+template <typename K>
+K nth_element(vector<K> &keys, size_t nth) {
+    return nth_element(keys, nth, less<K>());
+}
+
+/// Partially sorts keys and values so that the nth key is in the sorted position.
+template <typename K, class V, class Comp>
+K nth_element(vector<K> &keys, V &&vals, size_t nth, Comp) {
+    static_assert(detail::radix_sort_type<K, Comp>::value,
+            "nth_element only supports arithmetic keys with vex::less or vex::greater");
+
+    auto v = detail::forward_as_sequence(vals);
+
+    precondition(boost::fusion::at_c<0>(v).size() == keys.size(),
+            "keys and values should have same size");
+    precondition(boost::fusion::at_c<0>(v).nparts() == keys.nparts(),
+            "Keys and values span different devices");
+
+    return detail::nth_element_sink< typename detail::extract_value_types<decltype(v)>::type >(
+            keys, v, nth, detail::radix_sort_type<K, Comp>::descending);
+}
+
+/// Partially sorts keys and values so that the nth key is in the sorted position.
+template <typename K, typename V>
+K nth_element(vector<K> &keys, vector<V> &vals, size_t nth) {
+    return nth_element(keys, vals, nth, less<K>());
+}
+
+/// Moves the k largest elements to the front of the vector in descending order.
+/**
+ * With vex::less as the comparator, the k smallest elements are selected
+ * in ascending order instead. The rest of the vector is left in unspecified
+ * order. The elements are selected with vex::nth_element(), and only the
+ * selected head of the vector is sorted.
+ */
+template <typename K, class Comp>
+void top_k(vector<K> &keys, size_t k, Comp comp) {
+    static_assert(detail::radix_sort_type<K, Comp>::value,
+            "top_k only supports arithmetic keys with vex::less or vex::greater");
+
+    detail::top_k_sink< boost::mpl::vector<> >(keys, boost::fusion::vector<>(), k, comp);
+}
+
+/// Moves the k largest elements to the front of the vector in descending order.
+template <typename K>
+void top_k(vector<K> &keys, size_t k) {
+    top_k(keys, k, greater<K>());
+}
+
+/// Moves the k largest keys and their values to the front of the vectors.
+template <typename K, class V, class Comp>
+void top_k(vector<K> &keys, V &&vals, size_t k, Comp comp) {
+    static_assert(detail::radix_sort_type<K, Comp>::value,
+            "top_k only supports arithmetic keys with vex::less or vex::greater");
+
+    auto v = detail::forward_as_sequence(vals);
+
+    precondition(boost::fusion::at_c<0>(v).size() == keys.size(),
+            "keys and values should have same size");
+    precondition(boost::fusion::at_c<0>(v).nparts() == keys.nparts(),
+            "Keys and values span different devices");
+
+    detail::top_k_sink< typename detail::extract_value_types<decltype(v)>::type >(
+            keys, v, k, comp);
+}
+
+/// Moves the k largest keys and their values to the front of the vectors.
+template <typename K, typename V>
+void top_k(vector<K> &keys, vector<V> &vals, size_t k) {
+    top_k(keys, vals, k, greater<K>());
+}
+
+} // namespace vex
+
+#endif
@@ -51,10 +51,17 @@ limitations under the License.
 */
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+#include <boost/mpl/range_c.hpp>
 
 #include <vexcl/vector.hpp>
 #include <vexcl/scan.hpp>
+#include <vexcl/scan_by_key.hpp>
 #include <vexcl/detail/fusion.hpp>
+#include <vexcl/detail/copy_range.hpp>
 #include <vexcl/function.hpp>
 
 namespace vex {
@@ -420,90 +427,62 @@ struct do_vex_resize {
     }
 };
 
-struct do_push_arg {
-    backend::kernel &k;
-
-    do_push_arg(backend::kernel &k) : k(k) {}
-
-    template <class T>
-    void operator()(const T &t) const {
-        k.push_arg( t(0) );
-    }
-};
-
-template <typename IKTuple, typename OKTuple, typename V, class Comp, class Oper>
-int reduce_by_key_sink(
-        IKTuple &&ikeys, vector<V> const &ivals,
-        OKTuple &&okeys, vector<V>       &ovals,
-        Comp, Oper
-        )
+// Reduces a single partition into the temporary output buffers. Returns the
+// number of the reduced segments.
+template <class K, class Comp, class Oper, class KTuple, typename V>
+size_t reduce_partition(const backend::command_queue &queue,
+        const KTuple &ikeys, const backend::device_vector<V> &ivals, size_t count,
+        std::unique_ptr< temp_storage<K> > &okeys,
+        std::unique_ptr< backend::device_vector<V> > &ovals)
 {
-    namespace fusion = boost::fusion;
-    typedef typename extract_value_types<IKTuple>::type K;
-
-    static_assert(
-            std::is_same<K, typename extract_value_types<OKTuple>::type>::value,
-            "Incompatible input and output key types");
-
-    precondition(
-            fusion::at_c<0>(ikeys).nparts() == 1 && ivals.nparts() == 1,
-            "reduce_by_key is only supported for single device contexts"
-            );
-
-    precondition(fusion::at_c<0>(ikeys).size() == ivals.size(),
-            "keys and values should have same size"
-            );
-
-    const auto &queue = fusion::at_c<0>(ikeys).queue_list();
-    backend::select_context(queue[0]);
+    backend::select_context(queue);
 
     const int NT_cpu = 1;
     const int NT_gpu = 256;
-    const int NT = is_cpu(queue[0]) ? NT_cpu : NT_gpu;
+    const int NT = is_cpu(queue) ? NT_cpu : NT_gpu;
 
-    size_t count         = fusion::at_c<0>(ikeys).size();
     size_t num_blocks    = (count + NT - 1) / NT;
     size_t scan_buf_size = alignup(num_blocks, NT);
 
-    backend::device_vector<int> key_sum   (queue[0], scan_buf_size);
-    backend::device_vector<V>   pre_sum   (queue[0], scan_buf_size);
-    backend::device_vector<V>   post_sum  (queue[0], scan_buf_size);
-    backend::device_vector<V>   offset_val(queue[0], count);
-    backend::device_vector<int> offset    (queue[0], count);
+    backend::device_vector<int> key_sum   (queue, scan_buf_size);
+    backend::device_vector<V>   pre_sum   (queue, scan_buf_size);
+    backend::device_vector<V>   post_sum  (queue, scan_buf_size);
+    backend::device_vector<V>   offset_val(queue, count);
+    backend::device_vector<int> offset    (queue, count);
 
     /***** Kernel 0 *****/
-    auto krn0 = offset_calculation<K, Comp>(queue[0]);
+    auto krn0 = offset_calculation<K, Comp>(queue);
 
     krn0.push_arg(count);
-    boost::fusion::for_each(ikeys, do_push_arg(krn0));
+    push_args<boost::mpl::size<K>::value>(krn0, ikeys);
     krn0.push_arg(offset);
 
-    krn0(queue[0]);
+    krn0(queue);
 
     VEX_FUNCTION(int, plus, (int, x)(int, y), return x + y;);
-    scan(queue[0], offset, offset, 0, false, plus);
+    scan(queue, offset, offset, 0, false, plus);
 
     /***** Kernel 1 *****/
-    auto krn1 = is_cpu(queue[0]) ?
-        block_scan_by_key<NT_cpu, V, Oper>(queue[0]) :
-        block_scan_by_key<NT_gpu, V, Oper>(queue[0]);
+    auto krn1 = is_cpu(queue) ?
+        block_scan_by_key<NT_cpu, V, Oper>(queue) :
+        block_scan_by_key<NT_gpu, V, Oper>(queue);
 
     krn1.push_arg(count);
     krn1.push_arg(offset);
-    krn1.push_arg(ivals(0));
+    krn1.push_arg(ivals);
     krn1.push_arg(offset_val);
     krn1.push_arg(key_sum);
     krn1.push_arg(pre_sum);
 
     krn1.config(num_blocks, NT);
-    krn1(queue[0]);
+    krn1(queue);
 
     /***** Kernel 2 *****/
     uint work_per_thread = std::max<uint>(1U, static_cast<uint>(scan_buf_size / NT));
 
-    auto krn2 = is_cpu(queue[0]) ?
-        block_inclusive_scan_by_key<NT_cpu, V, Oper>(queue[0]) :
-        block_inclusive_scan_by_key<NT_gpu, V, Oper>(queue[0]);
+    auto krn2 = is_cpu(queue) ?
+        block_inclusive_scan_by_key<NT_cpu, V, Oper>(queue) :
+        block_inclusive_scan_by_key<NT_gpu, V, Oper>(queue);
 
     krn2.push_arg(num_blocks);
     krn2.push_arg(key_sum);
@@ -512,10 +491,10 @@ int reduce_by_key_sink(
     krn2.push_arg(work_per_thread);
 
     krn2.config(1, NT);
-    krn2(queue[0]);
+    krn2(queue);
 
     /***** Kernel 3 *****/
-    auto krn3 = block_sum_by_key<V, Oper>(queue[0]);
+    auto krn3 = block_sum_by_key<V, Oper>(queue);
 
     krn3.push_arg(count);
     krn3.push_arg(key_sum);
@@ -524,31 +503,147 @@ int reduce_by_key_sink(
     krn3.push_arg(offset_val);
 
     krn3.config(num_blocks, NT);
-    krn3(queue[0]);
+    krn3(queue);
 
-    /***** resize okeys and ovals *****/
+    /***** allocate okeys and ovals *****/
     int out_elements;
-    offset.read(queue[0], count - 1, 1, &out_elements, true);
+    offset.read(queue, count - 1, 1, &out_elements, true);
     ++out_elements;
 
-    boost::fusion::for_each(okeys, do_vex_resize(queue, out_elements));
-    ovals.resize(ivals.queue_list(), out_elements);
+    okeys.reset(new temp_storage<K>(queue, out_elements));
+    ovals.reset(new backend::device_vector<V>(queue, out_elements));
 
     /***** Kernel 4 *****/
-    auto krn4 = key_value_mapping<K, V>(queue[0]);
+    auto krn4 = key_value_mapping<K, V>(queue);
 
     krn4.push_arg(count);
-    boost::fusion::for_each(ikeys, do_push_arg(krn4));
-    boost::fusion::for_each(okeys, do_push_arg(krn4));
-    krn4.push_arg(ovals(0));
+    push_args<boost::mpl::size<K>::value>(krn4, ikeys);
+    push_args<boost::mpl::size<K>::value>(krn4, *okeys);
+    krn4.push_arg(*ovals);
     krn4.push_arg(offset);
     krn4.push_arg(offset_val);
 
-    krn4(queue[0]);
+    krn4(queue);
 
     return out_elements;
 }
 
+template <typename IKTuple, typename OKTuple, typename V, class Comp, class Oper>
+int reduce_by_key_sink(
+        IKTuple &&ikeys, vector<V> const &ivals,
+        OKTuple &&okeys, vector<V>       &ovals,
+        Comp, Oper
+        )
+{
+    namespace fusion = boost::fusion;
+    typedef typename extract_value_types<IKTuple>::type K;
+
+    static_assert(
+            std::is_same<K, typename extract_value_types<OKTuple>::type>::value,
+            "Incompatible input and output key types");
+
+    const auto &k0 = fusion::at_c<0>(ikeys);
+
+    precondition(k0.size() == ivals.size() && k0.nparts() == ivals.nparts(),
+            "keys and values should have same size"
+            );
+
+    const auto &queue = k0.queue_list();
+    const unsigned ndev = static_cast<unsigned>(queue.size());
+
+    for(unsigned d = 0; d < ndev; ++d)
+        precondition(k0.part_size(d) == ivals.part_size(d),
+                "keys and values should have same partitioning"
+                );
+
+    // Reduce every partition.
+    std::vector< std::unique_ptr< temp_storage<K> > >           part_keys(ndev);
+    std::vector< std::unique_ptr< backend::device_vector<V> > > part_vals(ndev);
+    std::vector<size_t> m(ndev, 0);
+
+    for(unsigned d = 0; d < ndev; ++d)
+        if (size_t n = k0.part_size(d))
+            m[d] = reduce_partition<K, Comp, Oper>(queue[d],
+                    fusion::transform(ikeys, extract_device_vector(d)), ivals(d), n,
+                    part_keys[d], part_vals[d]);
+
+    if (ndev == 1) {
+        boost::fusion::for_each(okeys, do_vex_resize(queue, m[0]));
+        ovals.resize(queue, m[0]);
+
+        if (m[0]) {
+            auto kpart = fusion::transform(okeys, extract_device_vector(0));
+            part_keys[0]->swap(kpart);
+            std::swap(ovals(0), *part_vals[0]);
+        }
+
+        return static_cast<int>(m[0]);
+    }
+
+    // The last segment of a partition may continue on the next device. In
+    // this case its value is carried over to the first segment of the next
+    // partition, and the segment itself is dropped.
+    std::vector<size_t> keep(m);
+
+    for(unsigned d = 0, prev = ndev; d < ndev; ++d) {
+        const size_t n = k0.part_size(d);
+        if (!n) continue;
+
+        if (prev < ndev) {
+            V carry;
+            part_vals[prev]->read(queue[prev], m[prev] - 1, 1, &carry, true);
+
+            if (sbk::continued_segment<K, Comp>(
+                        queue[prev], fusion::transform(ikeys, extract_device_vector(prev)), k0.part_size(prev),
+                        queue[d],    fusion::transform(ikeys, extract_device_vector(d)), 1))
+            {
+                sbk::add_carry<Oper>(queue[d], 1, carry, *part_vals[d]);
+                --keep[prev];
+            }
+        }
+
+        prev = d;
+    }
+
+    // Gather the remaining segments in the output vectors.
+    size_t total = 0;
+    for(unsigned d = 0; d < ndev; ++d) total += keep[d];
+
+    boost::fusion::for_each(okeys, do_vex_resize(queue, total));
+    ovals.resize(queue, total);
+
+    // The reduced segments of a partition may span several output
+    // partitions. Copies within a device are done by kernels on the
+    // destination queue, so the temporary outputs have to be ready on every
+    // queue.
+    for(unsigned d = 0; d < ndev; ++d) queue[d].finish();
+
+    range_copier copy;
+
+    size_t pos = 0;
+    for(unsigned d = 0; d < ndev; pos += keep[d++]) {
+        if (!keep[d]) continue;
+
+        for(unsigned b = 0; b < ndev; ++b) {
+            size_t lo = std::max(pos,           ovals.part_start(b));
+            size_t hi = std::min(pos + keep[d], ovals.part_start(b + 1));
+            if (lo >= hi) continue;
+
+            boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<K>::value> >(
+                    receive_chunk<temp_storage<K>, typename std::decay<OKTuple>::type>(
+                        copy, *part_keys[d], queue[d], lo - pos,
+                        okeys, b, lo - ovals.part_start(b), hi - lo));
+
+            copy(queue[d], *part_vals[d], lo - pos,
+                    queue[b], ovals(b), lo - ovals.part_start(b), hi - lo);
+        }
+    }
+
+    copy.finish();
+
+    return static_cast<int>(total);
+}
+
 } // namespace rbk
 } // namespace detail
 
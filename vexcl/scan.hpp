@@ -52,11 +52,18 @@ limitations under the License.
 
 #include <string>
 #include <functional>
+#include <numeric>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <type_traits>
 
 #include <vexcl/backend.hpp>
 #include <vexcl/util.hpp>
 #include <vexcl/vector.hpp>
 #include <vexcl/function.hpp>
+#include <vexcl/element_index.hpp>
+#include <vexcl/vector_view.hpp>
 
 namespace vex {
 
@@ -331,8 +338,249 @@ backend::kernel block_addition(
     return kernel->second;
 }
 
+//---------------------------------------------------------------------------
+// Single-pass scan with decoupled look-back.
+//
+// Every workgroup takes the next tile index from an atomic counter, reduces
+// its tile, and publishes the tile aggregate. It then walks back over the
+// preceding tiles until it finds one with a published inclusive prefix,
+// combining the aggregates on the way, and publishes its own inclusive
+// prefix. The look-back spins on flags set by other workgroups, so it is
+// only correct when the workgroups that took smaller tile indices are
+// guaranteed to make progress.
+//---------------------------------------------------------------------------
+#if defined(VEXCL_BACKEND_CUDA)
+inline std::string lookback_fence() { return "__threadfence();"; }
+inline std::string lookback_atomic_inc(const std::string &p) { return "atomicAdd(" + p + ", 1u)"; }
+inline std::string lookback_volatile() { return "volatile "; }
+#elif defined(VEXCL_BACKEND_JIT)
+inline std::string lookback_fence() { return "__sync_synchronize();"; }
+inline std::string lookback_atomic_inc(const std::string &p) { return "atomic_add(" + p + ", 1u)"; }
+inline std::string lookback_volatile() { return "volatile "; }
+#else
+inline std::string lookback_fence() { return "mem_fence(CLK_GLOBAL_MEM_FENCE);"; }
+inline std::string lookback_atomic_inc(const std::string &p) { return "atomic_inc(" + p + ")"; }
+inline std::string lookback_volatile() { return "volatile global "; }
+#endif
+
+/// Checks if the single-pass scan may be used on the device.
+/**
+ * OpenCL gives no forward progress guarantees for workgroups, and a
+ * workgroup that spins on a tile that has not been scheduled yet may hang
+ * the device. So with the OpenCL backends the look-back is opt-in: define
+ * VEXCL_LOOKBACK_SCAN to enable it on GPUs. CPU OpenCL implementations
+ * always use the three-kernel scan. Define VEXCL_NO_LOOKBACK_SCAN to disable
+ * the single-pass scan with every backend.
+ */
+template <typename T>
+bool lookback_scan_supported(const backend::command_queue &queue) {
+#if defined(VEXCL_NO_LOOKBACK_SCAN)
+    (void)queue;
+    return false;
+#elif defined(VEXCL_BACKEND_CUDA) || defined(VEXCL_BACKEND_JIT)
+    (void)queue;
+    return std::is_arithmetic<T>::value;
+#elif defined(VEXCL_LOOKBACK_SCAN)
+    return std::is_arithmetic<T>::value && !is_cpu(queue);
+#else
+    (void)queue;
+    return false;
+#endif
+}
+
+// Publishes the tile aggregate, looks back for the exclusive prefix of the
+// tile, and publishes the inclusive prefix of the tile. Leaves the exclusive
+// prefix in the "prefix" variable for tile > 0.
+template <typename T>
+void lookback_prefix(backend::source_generator &src) {
+    const std::string vol = lookback_volatile();
+
+    src.new_line() << "if (tile == 0)";
+    src.open("{");
+    src.new_line() << "((" << vol << type_name<T>() << "*)incl)[0] = aggregate;";
+    src.new_line() << lookback_fence();
+    src.new_line() << "((" << vol << "uint*)flag)[0] = 2;";
+    src.close("}");
+    src.new_line() << "else";
+    src.open("{");
+    src.new_line() << "((" << vol << type_name<T>() << "*)aggr)[tile] = aggregate;";
+    src.new_line() << lookback_fence();
+    src.new_line() << "((" << vol << "uint*)flag)[tile] = 1;";
+    src.new_line() << "size_t pred = tile - 1;";
+    src.new_line() << "int have = 0;";
+    src.new_line() << "for(;;)";
+    src.open("{");
+    src.new_line() << "uint f;";
+    src.new_line() << "do f = ((" << vol << "uint*)flag)[pred]; while (f == 0);";
+    src.new_line() << lookback_fence();
+    src.new_line() << type_name<T>() << " v = (f == 2) ?"
+        " ((" << vol << type_name<T>() << "*)incl)[pred] :"
+        " ((" << vol << type_name<T>() << "*)aggr)[pred];";
+    src.new_line() << "prefix = have ? oper(v, prefix) : v;";
+    src.new_line() << "have = 1;";
+    src.new_line() << "if (f == 2) break;";
+    src.new_line() << "--pred;";
+    src.close("}");
+    src.new_line() << "((" << vol << type_name<T>() << "*)incl)[tile] = oper(prefix, aggregate);";
+    src.new_line() << lookback_fence();
+    src.new_line() << "((" << vol << "uint*)flag)[tile] = 2;";
+    src.close("}");
+}
+
+template <int NT, int VT, typename T, typename Oper>
+backend::kernel lookback_scan_kernel(const backend::command_queue &queue)
+{
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Oper::define(src, "oper");
+
+        src.begin_kernel("lookback_scan");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t              >("n");
+        src.template parameter< global_ptr<const T> >("input");
+        src.template parameter< global_ptr<T>       >("output");
+        src.template parameter< T                   >("init");
+        src.template parameter< int                 >("exclusive");
+        src.template parameter< global_ptr<uint>    >("counter");
+        src.template parameter< global_ptr<uint>    >("flag");
+        src.template parameter< global_ptr<T>       >("aggr");
+        src.template parameter< global_ptr<T>       >("incl");
+        src.end_kernel_parameters();
+
+        const int TILE = NT * VT;
+
+        if (NT == 1) {
+            // A single thread per tile: scan the tile serially, reading the
+            // input twice (the tile stays in cache between the passes).
+            src.new_line() << "size_t tile = " << lookback_atomic_inc("counter") << ";";
+            src.new_line() << "size_t start = tile * " << TILE << ";";
+            src.new_line() << "size_t end = (n - start < " << TILE << ") ? n : start + " << TILE << ";";
+
+            src.new_line() << type_name<T>() << " aggregate = input[start];";
+            src.new_line() << "if (exclusive && start == 0) aggregate = oper(init, aggregate);";
+            src.new_line() << "for(size_t i = start + 1; i < end; ++i)"
+                " aggregate = oper(aggregate, input[i]);";
+
+            src.new_line() << type_name<T>() << " prefix = init;";
+            lookback_prefix<T>(src);
+
+            src.new_line() << "int have = tile > 0;";
+            src.new_line() << "for(size_t i = start; i < end; ++i)";
+            src.open("{");
+            src.new_line() << type_name<T>() << " x = input[i];";
+            src.new_line() << "if (exclusive && i == 0) x = oper(init, x);";
+            src.new_line() << "if (exclusive) output[i] = have ? prefix : init;";
+            src.new_line() << "prefix = have ? oper(prefix, x) : x;";
+            src.new_line() << "have = 1;";
+            src.new_line() << "if (!exclusive) output[i] = prefix;";
+            src.close("}");
+        } else {
+            src.new_line() << "size_t l_id = " << src.local_id(0) << ";";
+
+            src.smem_static_var("uint", "tile_idx");
+            src.smem_static_var(type_name<T>(), "tile_prefix");
+            {
+                std::ostringstream s;
+                s << "tile_buf[" << TILE << "]";
+                src.smem_static_var(type_name<T>(), s.str());
+            }
+            {
+                std::ostringstream s;
+                s << "part[" << NT << "]";
+                src.smem_static_var(type_name<T>(), s.str());
+            }
+
+            src.new_line() << "if (l_id == 0) tile_idx = " << lookback_atomic_inc("counter") << ";";
+            src.new_line().barrier();
+
+            src.new_line() << "size_t tile = tile_idx;";
+            src.new_line() << "size_t start = tile * " << TILE << ";";
+            src.new_line() << "size_t m = (n - start < " << TILE << ") ? n - start : " << TILE << ";";
+
+            // Coalesced load of the tile into shared memory.
+            src.new_line() << "for(size_t j = 0; j < " << VT << "; ++j)";
+            src.open("{");
+            src.new_line() << "size_t i = l_id + j * " << NT << ";";
+            src.new_line() << "if (i < m) tile_buf[i] = input[start + i];";
+            src.close("}");
+            src.new_line().barrier();
+
+            // Each thread reduces VT consecutive elements.
+            src.new_line() << "size_t first = l_id * " << VT << ";";
+            src.new_line() << type_name<T>() << " sum = init;";
+            src.new_line() << "if (first < m)";
+            src.open("{");
+            src.new_line() << "sum = tile_buf[first];";
+            src.new_line() << "if (exclusive && start + first == 0) sum = oper(init, sum);";
+            src.new_line() << "for(size_t j = 1; j < " << VT << " && first + j < m; ++j)"
+                " sum = oper(sum, tile_buf[first + j]);";
+            src.close("}");
+            src.new_line() << "part[l_id] = sum;";
+
+            // Inclusive scan of the thread sums. Threads past the end of
+            // the tile only ever combine with their valid predecessors.
+            src.new_line() << "for(size_t offset = 1; offset < " << NT << "; offset *= 2)";
+            src.open("{");
+            src.new_line().barrier();
+            src.new_line() << "if (l_id >= offset) sum = oper(part[l_id - offset], sum);";
+            src.new_line().barrier();
+            src.new_line() << "part[l_id] = sum;";
+            src.close("}");
+            src.new_line().barrier();
+
+            src.new_line() << "if (l_id == 0)";
+            src.open("{");
+            src.new_line() << type_name<T>() << " aggregate = part[(m - 1) / " << VT << "];";
+            src.new_line() << type_name<T>() << " prefix = init;";
+            lookback_prefix<T>(src);
+            src.new_line() << "tile_prefix = prefix;";
+            src.close("}");
+            src.new_line().barrier();
+
+            // Each thread scans its elements in place, starting with the
+            // exclusive prefix of the thread.
+            src.new_line() << "if (first < m)";
+            src.open("{");
+            src.new_line() << "int have = tile > 0 || l_id > 0;";
+            src.new_line() << type_name<T>() << " run = init;";
+            src.new_line() << "if (l_id > 0) run = tile > 0 ? oper(tile_prefix, part[l_id - 1]) : part[l_id - 1];";
+            src.new_line() << "else if (tile > 0) run = tile_prefix;";
+            src.new_line() << "for(size_t j = 0; j < " << VT << " && first + j < m; ++j)";
+            src.open("{");
+            src.new_line() << type_name<T>() << " x = tile_buf[first + j];";
+            src.new_line() << "if (exclusive && start + first + j == 0) x = oper(init, x);";
+            src.new_line() << "if (exclusive) tile_buf[first + j] = have ? run : init;";
+            src.new_line() << "run = have ? oper(run, x) : x;";
+            src.new_line() << "have = 1;";
+            src.new_line() << "if (!exclusive) tile_buf[first + j] = run;";
+            src.close("}");
+            src.close("}");
+            src.new_line().barrier();
+
+            // Coalesced store of the tile.
+            src.new_line() << "for(size_t j = 0; j < " << VT << "; ++j)";
+            src.open("{");
+            src.new_line() << "size_t i = l_id + j * " << NT << ";";
+            src.new_line() << "if (i < m) output[start + i] = tile_buf[i];";
+            src.close("}");
+        }
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "lookback_scan"));
+    }
+
+    return kernel->second;
+}
+
 template <typename T, typename Oper>
-void scan(
+void lookback_scan(
         backend::command_queue    const &queue,
         backend::device_vector<T> const &input,
         backend::device_vector<T>       &output,
@@ -340,6 +588,52 @@ void scan(
         bool exclusive,
         Oper
         )
+{
+    const int NT_cpu = 1;
+    const int VT_cpu = 4096;
+    const int NT_gpu = 256;
+    const int VT_gpu = sizeof(T) > 4 ? 4 : 8;
+
+    const int tile_size = is_cpu(queue) ? NT_cpu * VT_cpu : NT_gpu * VT_gpu;
+
+    const size_t count     = input.size();
+    const size_t num_tiles = (count + tile_size - 1) / tile_size;
+
+    // The tile counter and the tile status flags have to start from zero.
+    std::vector<uint> status(num_tiles + 1, 0);
+    backend::device_vector<uint> counter(queue, 1, status.data());
+    backend::device_vector<uint> flag(queue, num_tiles, status.data());
+    backend::device_vector<T>    aggr(queue, num_tiles);
+    backend::device_vector<T>    incl(queue, num_tiles);
+
+    auto krn = is_cpu(queue) ?
+        lookback_scan_kernel<NT_cpu, VT_cpu, T, Oper>(queue) :
+        lookback_scan_kernel<NT_gpu, VT_gpu, T, Oper>(queue);
+
+    krn.push_arg(count);
+    krn.push_arg(input);
+    krn.push_arg(output);
+    krn.push_arg(init);
+    krn.push_arg(exclusive ? 1 : 0);
+    krn.push_arg(counter);
+    krn.push_arg(flag);
+    krn.push_arg(aggr);
+    krn.push_arg(incl);
+
+    krn.config(num_tiles, is_cpu(queue) ? NT_cpu : NT_gpu);
+
+    krn(queue);
+}
+
+template <typename T, typename Oper>
+void scan(
+        backend::command_queue    const &queue,
+        backend::device_vector<T> const &input,
+        backend::device_vector<T>       &output,
+        T init,
+        bool exclusive,
+        Oper oper
+        )
 {
     precondition(
             input.size() == output.size(),
@@ -348,6 +642,13 @@ void scan(
 
     backend::select_context(queue);
 
+    if (input.size() == 0) return;
+
+    if (lookback_scan_supported<T>(queue)) {
+        lookback_scan(queue, input, output, init, exclusive, oper);
+        return;
+    }
+
     const int NT_cpu = 1;
     const int NT_gpu = 256;
     const int NT = is_cpu(queue) ? NT_cpu : NT_gpu;
@@ -442,18 +743,28 @@ void inclusive_scan(
     for(unsigned d = 0; d < queue.size(); ++d)
         detail::scan(queue[d], input(d), output(d), init, false, oper.device);
 
-    std::vector<T> tail(queue.size() - 1);
+    // Totals of the preceding partitions, combined left to right.
+    std::vector<T>    carry(queue.size());
+    std::vector<char> have(queue.size(), 0);
 
-    for(unsigned d = 1; d < queue.size(); ++d)
-        if (size_t head = output.part_start(d))
-            tail[d - 1] = output[head - 1];
+    T sum = init;
+    bool any = false;
 
-    std::partial_sum(tail.begin(), tail.end(), tail.begin(), oper);
+    for(unsigned d = 0; d < queue.size(); ++d) {
+        carry[d] = sum;
+        have[d]  = any;
+
+        if (output.part_size(d)) {
+            T tail = output[output.part_start(d + 1) - 1];
+            sum = any ? oper(sum, tail) : tail;
+            any = true;
+        }
+    }
 
     for(unsigned d = 1; d < queue.size(); ++d)
-        if (output.part_start(d)) {
+        if (have[d] && output.part_size(d)) {
             vector<T> part(queue[d], output(d));
-            part = oper.device(part, tail[d - 1]);
+            part = oper.device(carry[d], part);
         }
 }
 
@@ -484,26 +795,48 @@ void exclusive_scan(
 
     auto &queue = input.queue_list();
 
-    std::vector<T> tail(queue.size() - 1);
-
-    for(unsigned d = 1; d < queue.size(); ++d)
-        if (size_t head = input.part_start(d))
-            tail[d - 1] = input[head - 1];
+    // The first partition is scanned with the initial value. The rest of the
+    // partitions are scanned inclusively into temporary buffers and are
+    // shifted by one element when the carries are known, so that init is
+    // only applied once.
+    std::vector<T> tail(queue.size());
 
     for(unsigned d = 0; d < queue.size(); ++d)
-        detail::scan(queue[d], input(d), output(d), init, true, oper.device);
+        if (input.part_size(d))
+            tail[d] = input[input.part_start(d + 1) - 1];
 
-    for(unsigned d = 1; d < queue.size(); ++d)
-        if (size_t head = output.part_start(d))
-            tail[d - 1] = oper(tail[d - 1], output[head - 1]);
+    std::vector< std::unique_ptr< backend::device_vector<T> > > incl(queue.size());
 
-    std::partial_sum(tail.begin(), tail.end(), tail.begin(), oper);
+    for(unsigned d = 0; d < queue.size(); ++d) {
+        if (d == 0) {
+            detail::scan(queue[d], input(d), output(d), init, true, oper.device);
+        } else if (size_t n = input.part_size(d)) {
+            incl[d].reset(new backend::device_vector<T>(queue[d], n));
+            detail::scan(queue[d], input(d), *incl[d], init, false, oper.device);
+        }
+    }
 
-    for(unsigned d = 1; d < queue.size(); ++d)
-        if (output.part_start(d)) {
+    T carry = init;
+
+    for(unsigned d = 0; d < queue.size(); ++d) {
+        size_t n = output.part_size(d);
+        if (!n) continue;
+
+        if (d > 0) {
             vector<T> part(queue[d], output(d));
-            part = oper.device(part, tail[d - 1]);
+            vector<T> prev(queue[d], *incl[d]);
+            auto i = element_index();
+
+            part = if_else(i == 0, carry,
+                    oper.device(carry, permutation(i - 1)(prev)));
+
+            T total;
+            incl[d]->read(queue[d], n - 1, 1, &total, true);
+            carry = oper(carry, total);
+        } else {
+            carry = oper(output[n - 1], tail[0]);
         }
+    }
 }
 
 /// Exclusive scan.
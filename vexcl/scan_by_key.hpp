@@ -51,6 +51,12 @@ limitations under the License.
 */
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
+
+#include <boost/mpl/range_c.hpp>
 
 #include <vexcl/vector.hpp>
 #include <vexcl/detail/fusion.hpp>
@@ -618,37 +624,260 @@ backend::kernel block_add_by_key(const backend::command_queue &queue) {
     return kernel->second;
 }
 
-template <bool exclusive, class KTuple, class V, class Comp, class Oper>
-void scan_by_key(
-        KTuple &&keys, const vector<V> &ivals, vector<V> &ovals, Comp, Oper, V init
-        )
+//---------------------------------------------------------------------------
+// Multi-device support. Every partition is processed independently, and then
+// the segments that cross the partition boundaries are fixed up: the last key
+// and partial value of a partition are carried to the next device, where
+// they are combined with the leading segment of the partition.
+//---------------------------------------------------------------------------
+// Finds the length of the leading run of the keys that continue the segment
+// of the carried key. Every work-group writes the minimum over its threads.
+template <int NT, typename K, class Comp>
+backend::kernel first_break(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Comp::define(src, "comp");
+
+        src.begin_kernel("first_break");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t >("n");
+
+        boost::mpl::for_each<K>(pointer_param<global_ptr, true>(src, "carry"));
+        boost::mpl::for_each<K>(pointer_param<global_ptr, true>(src, "keys"));
+
+        src.template parameter< global_ptr<int> >("brk");
+        src.end_kernel_parameters();
+
+        const size_t nK = boost::mpl::size<K>::value;
+
+        src.new_line() << "int m = n;";
+
+        src.new_line().grid_stride_loop().open("{");
+        src.new_line() << "int same = idx ? comp(keys0[idx]";
+        for(size_t p = 1; p < nK; ++p) src << ", keys" << p << "[idx]";
+        for(size_t p = 0; p < nK; ++p) src << ", keys" << p << "[idx - 1]";
+        src << ") : comp(keys0[0]";
+        for(size_t p = 1; p < nK; ++p) src << ", keys" << p << "[0]";
+        for(size_t p = 0; p < nK; ++p) src << ", carry" << p << "[0]";
+        src << ");";
+        src.new_line() << "if (!same) { m = idx; break; }";
+        src.close("}");
+
+        if (NT > 1) {
+            std::ostringstream shared;
+            shared << "part[" << NT << "]";
+            src.smem_static_var("int", shared.str());
+
+            src.new_line() << "int lid = " << src.local_id(0) << ";";
+            src.new_line() << "part[lid] = m;";
+            src.new_line().barrier();
+
+            src.new_line() << "for(int o = " << NT / 2 << "; o > 0; o /= 2)";
+            src.open("{");
+            src.new_line() << "if (lid < o) part[lid] = min(part[lid], part[lid + o]);";
+            src.new_line().barrier();
+            src.close("}");
+
+            src.new_line() << "if (lid == 0) brk[" << src.group_id(0) << "] = part[0];";
+        } else {
+            src.new_line() << "brk[" << src.group_id(0) << "] = m;";
+        }
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "first_break"));
+    }
+
+    return kernel->second;
+}
+
+//---------------------------------------------------------------------------
+// Prepends the carried value to the leading values of a partition.
+template <typename V, class Oper>
+backend::kernel apply_carry(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Oper::define(src, "oper");
+
+        src.begin_kernel("apply_carry");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t        >("n");
+        src.template parameter< V             >("carry");
+        src.template parameter< global_ptr<V> >("vals");
+        src.end_kernel_parameters();
+
+        src.new_line().grid_stride_loop().open("{");
+        src.new_line() << "vals[idx] = oper(carry, vals[idx]);";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "apply_carry"));
+    }
+
+    return kernel->second;
+}
+
+//---------------------------------------------------------------------------
+// Turns the inclusive scan of a partition into the exclusive one.
+template <typename K, typename V, class Comp, class Oper>
+backend::kernel exclusive_shift(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Comp::define(src, "comp");
+        Oper::define(src, "oper");
+
+        src.begin_kernel("exclusive_shift");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t >("n");
+        src.template parameter< int    >("cont");
+        src.template parameter< V      >("carry");
+        src.template parameter< V      >("init");
+
+        boost::mpl::for_each<K>(pointer_param<global_ptr, true>(src, "keys"));
+
+        src.template parameter< global_ptr<const V> >("ivals");
+        src.template parameter< global_ptr<V>       >("ovals");
+        src.end_kernel_parameters();
+
+        const size_t nK = boost::mpl::size<K>::value;
+
+        src.new_line().grid_stride_loop().open("{");
+        src.new_line() << "if (idx == 0)";
+        src.new_line() << "    ovals[0] = cont ? oper(init, carry) : init;";
+        src.new_line() << "else if (comp(keys0[idx]";
+        for(size_t p = 1; p < nK; ++p) src << ", keys" << p << "[idx]";
+        for(size_t p = 0; p < nK; ++p) src << ", keys" << p << "[idx - 1]";
+        src << "))";
+        src.new_line() << "    ovals[idx] = oper(init, ivals[idx - 1]);";
+        src.new_line() << "else";
+        src.new_line() << "    ovals[idx] = init;";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "exclusive_shift"));
+    }
+
+    return kernel->second;
+}
+
+//---------------------------------------------------------------------------
+// Copies a single key tuple from a partition to the carry buffer on another
+// device.
+template <class KTuple, class K>
+struct carry_key {
+    const backend::command_queue &src_queue;
+    const KTuple &src;
+    size_t pos;
+    const backend::command_queue &dst_queue;
+    temp_storage<K> &dst;
+
+    carry_key(const backend::command_queue &src_queue, const KTuple &src, size_t pos,
+            const backend::command_queue &dst_queue, temp_storage<K> &dst)
+        : src_queue(src_queue), src(src), pos(pos), dst_queue(dst_queue), dst(dst)
+    {}
+
+    template <class I>
+    void operator()(I) const {
+        typename boost::mpl::at<K, I>::type v;
+
+        boost::fusion::at_c<I::value>(src).read(src_queue, pos, 1, &v, true);
+        detail::at_c<I::value>(dst).write(dst_queue, 0, 1, &v, true);
+    }
+};
+
+// Returns the number of leading keys of the partition that continue the
+// segment of the last key of the previous partition.
+template <typename K, class Comp, class PTuple, class KTuple>
+size_t continued_segment(
+        const backend::command_queue &prev_queue, const PTuple &prev_keys, size_t prev_count,
+        const backend::command_queue &queue, const KTuple &keys, size_t count)
 {
-    namespace fusion = boost::fusion;
-    typedef typename extract_value_types<KTuple>::type K;
+    temp_storage<K> carry(queue, 1);
 
-    precondition(
-            fusion::at_c<0>(keys).nparts() == 1 && ivals.nparts() == 1,
-            "scan_by_key is only supported for single device contexts"
-            );
+    boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<K>::value> >(
+            carry_key<PTuple, K>(prev_queue, prev_keys, prev_count - 1, queue, carry));
 
-    precondition(ivals.size() == ovals.size() && ivals.nparts() == ovals.nparts(),
-            "input and output should have same size"
-            );
+    backend::select_context(queue);
 
+    const int NT_cpu = 1;
+    const int NT_gpu = 256;
+    const int NT = is_cpu(queue) ? NT_cpu : NT_gpu;
+
+    const size_t ng = std::max<size_t>(1, std::min<size_t>(
+                backend::kernel::num_workgroups(queue), (count + NT - 1) / NT));
+
+    backend::device_vector<int> brk(queue, ng);
+
+    auto krn = is_cpu(queue) ?
+        first_break<NT_cpu, K, Comp>(queue) :
+        first_break<NT_gpu, K, Comp>(queue);
+
+    krn.push_arg(count);
+    push_args<boost::mpl::size<K>::value>(krn, carry);
+    push_args<boost::mpl::size<K>::value>(krn, keys);
+    krn.push_arg(brk);
 
-    const auto &queue = fusion::at_c<0>(keys).queue_list()[0];
+    krn.config(ng, NT);
+    krn(queue);
+
+    std::vector<int> b(ng);
+    brk.read(queue, 0, ng, b.data(), true);
+
+    return *std::min_element(b.begin(), b.end());
+}
+
+// Combines the carried value with the first n values of the partition.
+template <class Oper, typename V>
+void add_carry(const backend::command_queue &queue, size_t n, V carry,
+        backend::device_vector<V> &vals)
+{
+    backend::select_context(queue);
+
+    auto krn = apply_carry<V, Oper>(queue);
+
+    krn.push_arg(n);
+    krn.push_arg(carry);
+    krn.push_arg(vals);
+
+    krn(queue);
+}
+
+//---------------------------------------------------------------------------
+// Scans a single partition.
+template <bool exclusive, class K, class Comp, class Oper, class KTuple, class V>
+void scan_partition(const backend::command_queue &queue,
+        const KTuple &ikeys, const backend::device_vector<V> &ivals,
+        backend::device_vector<V> &ovals, size_t count, V init)
+{
     backend::select_context(queue);
 
     const int NT_cpu = 1;
     const int NT_gpu = 256;
     const int NT = is_cpu(queue) ? NT_cpu : NT_gpu;
 
-    size_t count         = fusion::at_c<0>(keys).size();
     size_t num_blocks    = (count + 2 * NT - 1) / (2 * NT);
     size_t scan_buf_size = alignup(num_blocks, NT);
 
-    auto ikeys = fusion::transform(keys, extract_device_vector(0));
-
     temp_storage<K>           key_sum (queue, scan_buf_size);
     backend::device_vector<V> pre_sum (queue, scan_buf_size);
     backend::device_vector<V> pre_sum1(queue, scan_buf_size);
@@ -659,7 +888,7 @@ void scan_by_key(
         block_scan_by_key<NT_gpu, K, V, Comp, Oper, exclusive>(queue);
 
     krn0.push_arg(count);
-    krn0.push_arg(ivals(0));
+    krn0.push_arg(ivals);
     krn0.push_arg(pre_sum);
     krn0.push_arg(pre_sum1);
 
@@ -695,8 +924,8 @@ void scan_by_key(
     krn2.push_arg(count);
     krn2.push_arg(pre_sum);
     krn2.push_arg(pre_sum1);
-    krn2.push_arg(ivals(0));
-    krn2.push_arg(ovals(0));
+    krn2.push_arg(ivals);
+    krn2.push_arg(ovals);
 
     push_args<boost::mpl::size<K>::value>(krn2, ikeys);
 
@@ -706,6 +935,104 @@ void scan_by_key(
     krn2(queue);
 }
 
+template <bool exclusive, class KTuple, class V, class Comp, class Oper>
+void scan_by_key(
+        KTuple &&keys, const vector<V> &ivals, vector<V> &ovals, Comp, Oper, V init
+        )
+{
+    namespace fusion = boost::fusion;
+    typedef typename extract_value_types<KTuple>::type K;
+
+    const auto &k0 = fusion::at_c<0>(keys);
+
+    precondition(k0.size() == ivals.size() && k0.nparts() == ivals.nparts(),
+            "keys and values should have same size"
+            );
+
+    precondition(ivals.size() == ovals.size() && ivals.nparts() == ovals.nparts(),
+            "input and output should have same size"
+            );
+
+    const auto &queue = k0.queue_list();
+    const unsigned ndev = static_cast<unsigned>(queue.size());
+
+    for(unsigned d = 0; d < ndev; ++d)
+        precondition(
+                k0.part_size(d) == ivals.part_size(d) && k0.part_size(d) == ovals.part_size(d),
+                "keys and values should have same partitioning"
+                );
+
+    if (ndev == 1) {
+        scan_partition<exclusive, K, Comp, Oper>(queue[0],
+                fusion::transform(keys, extract_device_vector(0)),
+                ivals(0), ovals(0), k0.size(), init);
+        return;
+    }
+
+    // Scan the partitions, fix up the segments that continue from the
+    // previous partitions, and shift the results in case of the exclusive
+    // scan.
+    std::vector< std::unique_ptr< backend::device_vector<V> > > incl(ndev);
+
+    for(unsigned d = 0; d < ndev; ++d) {
+        if (size_t n = k0.part_size(d)) {
+            if (exclusive) incl[d].reset(new backend::device_vector<V>(queue[d], n));
+
+            scan_partition<false, K, Comp, Oper>(queue[d],
+                    fusion::transform(keys, extract_device_vector(d)),
+                    ivals(d), exclusive ? *incl[d] : ovals(d), n, init);
+        }
+    }
+
+    std::vector<size_t> cont(ndev, 0);
+    std::vector<V>      carry(ndev, init);
+
+    for(unsigned d = 0, prev = ndev; d < ndev; ++d) {
+        const size_t n = k0.part_size(d);
+        if (!n) continue;
+
+        if (prev < ndev) {
+            auto &out = exclusive ? *incl[prev] : ovals(prev);
+            const size_t m = k0.part_size(prev);
+
+            out.read(queue[prev], m - 1, 1, &carry[d], true);
+
+            cont[d] = continued_segment<K, Comp>(
+                    queue[prev], fusion::transform(keys, extract_device_vector(prev)), m,
+                    queue[d],    fusion::transform(keys, extract_device_vector(d)),    n);
+
+            if (cont[d]) add_carry<Oper>(queue[d], cont[d], carry[d],
+                    exclusive ? *incl[d] : ovals(d));
+        }
+
+        prev = d;
+    }
+
+    if (!exclusive) return;
+
+    for(unsigned d = 0; d < ndev; ++d) {
+        const size_t n = k0.part_size(d);
+        if (!n) continue;
+
+        backend::select_context(queue[d]);
+
+        auto krn = exclusive_shift<K, V, Comp, Oper>(queue[d]);
+
+        krn.push_arg(n);
+        krn.push_arg(static_cast<int>(cont[d] > 0));
+        krn.push_arg(carry[d]);
+        krn.push_arg(init);
+
+        push_args<boost::mpl::size<K>::value>(krn,
+                fusion::transform(keys, extract_device_vector(d)));
+
+        krn.push_arg(*incl[d]);
+        krn.push_arg(ovals(d));
+
+        krn(queue[d]);
+    }
+}
+
 } // namespace sbk
 } // namespace detail
 
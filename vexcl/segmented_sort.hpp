@@ -0,0 +1,769 @@
+#ifndef VEXCL_SEGMENTED_SORT_HPP
+#define VEXCL_SEGMENTED_SORT_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/segmented_sort.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Independent sorting of the segments of a vector.
+ */
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <boost/fusion/include/vector.hpp>
+
+#include <vexcl/backend.hpp>
+#include <vexcl/util.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/detail/fusion.hpp>
+#include <vexcl/detail/copy_range.hpp>
+#include <vexcl/scan.hpp>
+#include <vexcl/sort.hpp>
+
+namespace vex {
+namespace detail {
+
+//---------------------------------------------------------------------------
+// Segmented sort
+//---------------------------------------------------------------------------
+// Segment s spans [offsets[s], offsets[s + 1]) of the keys. The segments are
+// sorted in up to three steps, depending on the size of the largest segment:
+//
+// 1. Every thread sorts the segments with at most VT elements in registers.
+//    The kernel also finds the largest segment size.
+// 2. Larger segments are sorted by a workgroup each with the block sort on
+//    GPUs, or serially by a thread each with a merge sort on CPUs.
+// 3. The segments that are too large for the second step are sorted one by
+//    one with the regular sort.
+
+// Emits code that sets the keys past the end of a short segment to the
+// largest key of the segment, so that the padding stays in the tail of the
+// sorted registers.
+template <int VT, typename K>
+void segment_pad_keys(backend::source_generator &src, const std::string &count) {
+    const int nK = boost::mpl::size<K>::value;
+
+    boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
+                src.new_line() << tname << " max_key" << pos << " = thread_keys" << pos << "[0];";
+                }) );
+
+    for(int i = 1; i < VT; ++i) {
+        src.new_line() << "if(" << i << " < " << count << " && comp(";
+        for(int p = 0; p < nK; ++p)
+            src << (p ? ", " : "") << "max_key" << p;
+        for(int p = 0; p < nK; ++p)
+            src << ", thread_keys" << p << "[" << i << "]";
+        src << ") )";
+        src.open("{");
+        for(int p = 0; p < nK; ++p)
+            src.new_line() << "max_key" << p << " = thread_keys" << p << "[" << i << "];";
+        src.close("}");
+    }
+
+    for(int i = 1; i < VT; ++i) {
+        src.new_line() << "if(" << i << " >= " << count << ")";
+        src.open("{");
+        for(int p = 0; p < nK; ++p)
+            src.new_line() << "thread_keys" << p << "[" << i << "] = max_key" << p << ";";
+        src.close("}");
+    }
+}
+
+//---------------------------------------------------------------------------
+template <int NT, int VT, typename K, typename V, typename I, typename Comp>
+backend::kernel& segmented_small_sort_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Comp::define(src, "comp");
+        odd_even_transpose_sort<VT, K, V>(src);
+
+        const int nK = boost::mpl::size<K>::value;
+        const int nV = boost::mpl::size<V>::value;
+
+        src.begin_kernel("segmented_small_sort");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t              >("n");
+        src.template parameter< global_ptr<const I> >("offsets");
+
+        boost::mpl::for_each<K>( pointer_param<global_ptr>(src, "keys") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr>(src, "vals") );
+
+        src.template parameter< global_ptr<I>       >("max_size");
+        src.end_kernel_parameters();
+
+        src.new_line() << type_name<I>() << " largest = 0;";
+
+        src.new_line().grid_stride_loop().open("{");
+
+        src.new_line() << type_name<I>() << " start = offsets[idx];";
+        src.new_line() << type_name<I>() << " count = offsets[idx + 1] - start;";
+        src.new_line() << "if (count > largest) largest = count;";
+        src.new_line() << "if (count < 2 || count > " << VT << ") continue;";
+
+        boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
+                    src.new_line() << tname << " thread_keys" << pos << "[" << VT << "];";
+                    }) );
+        boost::mpl::for_each<V>( type_iterator([&](size_t pos, std::string tname) {
+                    src.new_line() << tname << " thread_vals" << pos << "[" << VT << "];";
+                    }) );
+
+        for(int i = 0; i < VT; ++i) {
+            src.new_line() << "if (" << i << " < count)";
+            src.open("{");
+            for(int p = 0; p < nK; ++p)
+                src.new_line() << "thread_keys" << p << "[" << i << "] = keys" << p << "[start + " << i << "];";
+            for(int p = 0; p < nV; ++p)
+                src.new_line() << "thread_vals" << p << "[" << i << "] = vals" << p << "[start + " << i << "];";
+            src.close("}");
+        }
+
+        segment_pad_keys<VT, K>(src, "count");
+
+        src.new_line() << odd_even_transpose_sort<VT, K, V>() << "(";
+        for(int p = 0; p < nK; ++p)
+            src << (p ? ", " : "") << "thread_keys" << p;
+        for(int p = 0; p < nV; ++p)
+            src << ", thread_vals" << p;
+        src << ");";
+
+        for(int i = 0; i < VT; ++i) {
+            src.new_line() << "if (" << i << " < count)";
+            src.open("{");
+            for(int p = 0; p < nK; ++p)
+                src.new_line() << "keys" << p << "[start + " << i << "] = thread_keys" << p << "[" << i << "];";
+            for(int p = 0; p < nV; ++p)
+                src.new_line() << "vals" << p << "[start + " << i << "] = thread_vals" << p << "[" << i << "];";
+            src.close("}");
+        }
+
+        src.close("}");
+
+        // Largest segment size in the workgroup.
+        if (NT == 1) {
+            src.new_line() << "max_size[" << src.group_id(0) << "] = largest;";
+        } else {
+            src.smem_static_var(type_name<I>(), "part[" + std::to_string(NT) + "]");
+            src.new_line() << "size_t lid = " << src.local_id(0) << ";";
+            src.new_line() << "part[lid] = largest;";
+            for(int s = NT / 2; s > 0; s /= 2) {
+                src.new_line().barrier();
+                src.new_line() << "if (lid < " << s << " && part[lid + " << s << "] > part[lid])"
+                    " part[lid] = part[lid + " << s << "];";
+            }
+            src.new_line().barrier();
+            src.new_line() << "if (lid == 0) max_size[" << src.group_id(0) << "] = part[0];";
+        }
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "segmented_small_sort"));
+    }
+
+    return kernel->second;
+}
+
+//---------------------------------------------------------------------------
+// Every workgroup sorts the segments that fit into a single block sort tile.
+template <int NT, int VT, typename K, typename V, typename I, typename Comp>
+backend::kernel& segmented_block_sort_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Comp::define(src, "comp");
+
+        block_sort_functions<NT, VT, K, V>(src);
+
+        src.begin_kernel("segmented_block_sort");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t              >("n");
+        src.template parameter< int                 >("min_size");
+        src.template parameter< global_ptr<const I> >("offsets");
+
+        boost::mpl::for_each<K>( pointer_param<global_ptr, true>(src, "keys_src") );
+        boost::mpl::for_each<K>( pointer_param<global_ptr      >(src, "keys_dst") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr, true>(src, "vals_src") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr      >(src, "vals_dst") );
+
+        src.end_kernel_parameters();
+
+        block_sort_shared<NT, VT, K, V>(src);
+
+        src.new_line() << "int tid = " << src.local_id(0) << ";";
+
+        src.new_line() << "for(" << type_name<size_t>() << " seg = " << src.group_id(0)
+            << "; seg < n; seg += " << src.num_groups(0) << ")";
+        src.open("{");
+        src.new_line() << type_name<I>() << " gid  = offsets[seg];";
+        src.new_line() << type_name<I>() << " size = offsets[seg + 1] - gid;";
+        src.new_line() << "if (size <= min_size || size > " << NT * VT << ") continue;";
+        src.new_line() << "int count2 = size;";
+
+        block_sort_tile<NT, VT, K, V>(src);
+
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "segmented_block_sort"));
+    }
+
+    return kernel->second;
+}
+
+//---------------------------------------------------------------------------
+// Declares the source (a_*) and the destination (b_*) arrays of a merge pass.
+struct declare_flip_pointers {
+    backend::source_generator &src;
+    std::string name, flip;
+    int pos;
+
+    declare_flip_pointers(backend::source_generator &src,
+            const std::string &name, const std::string &flip)
+        : src(src), name(name), flip(flip), pos(0) {}
+
+    template <class T>
+    void operator()(T) {
+        src.new_line() << type_name< global_ptr<T> >() << " a_" << name << pos
+            << " = " << flip << " ? " << name << "_tmp" << pos << " : " << name << pos << ";";
+        src.new_line() << type_name< global_ptr<T> >() << " b_" << name << pos
+            << " = " << flip << " ? " << name << pos << " : " << name << "_tmp" << pos << ";";
+        ++pos;
+    }
+};
+
+//---------------------------------------------------------------------------
+// Every thread sorts whole segments with a bottom-up merge sort. The runs of
+// VT elements are sorted with insertion sort first, and the merge passes go
+// back and forth between the keys and the temporary buffers.
+template <int VT, typename K, typename V, typename I, typename Comp>
+backend::kernel& segmented_serial_sort_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        Comp::define(src, "comp");
+
+        const int nK = boost::mpl::size<K>::value;
+        const int nV = boost::mpl::size<V>::value;
+
+        src.begin_kernel("segmented_serial_sort");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t              >("n");
+        src.template parameter< int                 >("min_size");
+        src.template parameter< int                 >("max_size");
+        src.template parameter< global_ptr<const I> >("offsets");
+
+        boost::mpl::for_each<K>( pointer_param<global_ptr>(src, "keys") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr>(src, "vals") );
+        boost::mpl::for_each<K>( pointer_param<global_ptr>(src, "keys_tmp") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr>(src, "vals_tmp") );
+
+        src.end_kernel_parameters();
+
+        // Moves element j of the source arrays to position i of the
+        // destination arrays.
+        auto move = [&](const std::string &dst, const std::string &i,
+                const std::string &from, const std::string &j)
+        {
+            for(int p = 0; p < nK; ++p)
+                src.new_line() << dst << "_keys" << p << "[" << i << "] = "
+                    << from << "_keys" << p << "[" << j << "];";
+            for(int p = 0; p < nV; ++p)
+                src.new_line() << dst << "_vals" << p << "[" << i << "] = "
+                    << from << "_vals" << p << "[" << j << "];";
+        };
+
+        src.new_line().grid_stride_loop().open("{");
+
+        const std::string idx_t = type_name<I>();
+
+        src.new_line() << idx_t << " start = offsets[idx];";
+        src.new_line() << idx_t << " end   = offsets[idx + 1];";
+        src.new_line() << idx_t << " count = end - start;";
+        src.new_line() << "if (count <= min_size || count > max_size) continue;";
+
+        // Insertion sort of the runs.
+        src.new_line() << "for(" << idx_t << " r = start; r < end; r += " << VT << ")";
+        src.open("{");
+        src.new_line() << idx_t << " e = (r + " << VT << " < end) ? r + " << VT << " : end;";
+        src.new_line() << "for(" << idx_t << " i = r + 1; i < e; ++i)";
+        src.open("{");
+        boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
+                    src.new_line() << tname << " key" << pos << " = keys" << pos << "[i];";
+                    }) );
+        boost::mpl::for_each<V>( type_iterator([&](size_t pos, std::string tname) {
+                    src.new_line() << tname << " val" << pos << " = vals" << pos << "[i];";
+                    }) );
+        src.new_line() << idx_t << " j = i;";
+        src.new_line() << "for(; j > r && comp(";
+        for(int p = 0; p < nK; ++p)
+            src << (p ? ", " : "") << "key" << p;
+        for(int p = 0; p < nK; ++p)
+            src << ", keys" << p << "[j - 1]";
+        src << "); --j)";
+        src.open("{");
+        for(int p = 0; p < nK; ++p)
+            src.new_line() << "keys" << p << "[j] = keys" << p << "[j - 1];";
+        for(int p = 0; p < nV; ++p)
+            src.new_line() << "vals" << p << "[j] = vals" << p << "[j - 1];";
+        src.close("}");
+        for(int p = 0; p < nK; ++p)
+            src.new_line() << "keys" << p << "[j] = key" << p << ";";
+        for(int p = 0; p < nV; ++p)
+            src.new_line() << "vals" << p << "[j] = val" << p << ";";
+        src.close("}");
+        src.close("}");
+
+        // Merge passes.
+        src.new_line() << "int flip = 0;";
+        src.new_line() << "for(" << idx_t << " w = " << VT << "; w < count; w *= 2, flip = !flip)";
+        src.open("{");
+        boost::mpl::for_each<K>( declare_flip_pointers(src, "keys", "flip") );
+        boost::mpl::for_each<V>( declare_flip_pointers(src, "vals", "flip") );
+
+        src.new_line() << "for(" << idx_t << " lo = start; lo < end; lo += 2 * w)";
+        src.open("{");
+        src.new_line() << idx_t << " mid = (lo + w < end) ? lo + w : end;";
+        src.new_line() << idx_t << " hi  = (mid + w < end) ? mid + w : end;";
+        src.new_line() << idx_t << " i = lo, j = mid, o = lo;";
+        src.new_line() << "for(; i < mid && j < hi; ++o)";
+        src.open("{");
+        src.new_line() << "if (comp(";
+        for(int p = 0; p < nK; ++p)
+            src << (p ? ", " : "") << "a_keys" << p << "[j]";
+        for(int p = 0; p < nK; ++p)
+            src << ", a_keys" << p << "[i]";
+        src << "))";
+        src.open("{");
+        move("b", "o", "a", "j");
+        src.new_line() << "++j;";
+        src.close("}");
+        src.new_line() << "else";
+        src.open("{");
+        move("b", "o", "a", "i");
+        src.new_line() << "++i;";
+        src.close("}");
+        src.close("}");
+        src.new_line() << "for(; i < mid; ++o)";
+        src.open("{");
+        move("b", "o", "a", "i");
+        src.new_line() << "++i;";
+        src.close("}");
+        src.new_line() << "for(; j < hi; ++o)";
+        src.open("{");
+        move("b", "o", "a", "j");
+        src.new_line() << "++j;";
+        src.close("}");
+        src.close("}");
+        src.close("}");
+
+        // The result ended up in the temporary buffers.
+        src.new_line() << "if (flip)";
+        src.open("{");
+        src.new_line() << "for(" << idx_t << " i = start; i < end; ++i)";
+        src.open("{");
+        for(int p = 0; p < nK; ++p)
+            src.new_line() << "keys" << p << "[i] = keys_tmp" << p << "[i];";
+        for(int p = 0; p < nV; ++p)
+            src.new_line() << "vals" << p << "[i] = vals_tmp" << p << "[i];";
+        src.close("}");
+        src.close("}");
+
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "segmented_serial_sort"));
+    }
+
+    return kernel->second;
+}
+
+//---------------------------------------------------------------------------
+// Flags the segments that are larger than the limit.
+template <typename I>
+backend::kernel& large_segment_flags_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        src.begin_kernel("large_segment_flags");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t              >("n");
+        src.template parameter< size_t              >("limit");
+        src.template parameter< global_ptr<const I> >("offsets");
+        src.template parameter< global_ptr<int>     >("flags");
+        src.end_kernel_parameters();
+
+        src.new_line().grid_stride_loop().open("{");
+        src.new_line() << "flags[idx] = (offsets[idx + 1] - offsets[idx] > limit);";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "large_segment_flags"));
+    }
+
+    return kernel->second;
+}
+
+// Writes the bounds of the segments that are larger than the limit to the
+// positions given by the inclusive scan of their flags.
+template <typename I>
+backend::kernel& large_segment_list_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        backend::source_generator src(queue);
+
+        src.begin_kernel("large_segment_list");
+        src.begin_kernel_parameters();
+        src.template parameter< size_t              >("n");
+        src.template parameter< size_t              >("limit");
+        src.template parameter< global_ptr<const I> >("offsets");
+        src.template parameter< global_ptr<const int> >("pos");
+        src.template parameter< global_ptr<I>       >("bounds");
+        src.end_kernel_parameters();
+
+        src.new_line().grid_stride_loop().open("{");
+        src.new_line() << type_name<I>() << " start = offsets[idx];";
+        src.new_line() << type_name<I>() << " end   = offsets[idx + 1];";
+        src.new_line() << "if (end - start > limit)";
+        src.open("{");
+        src.new_line() << "int i = pos[idx] - 1;";
+        src.new_line() << "bounds[2 * i]     = start;";
+        src.new_line() << "bounds[2 * i + 1] = end;";
+        src.close("}");
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "large_segment_list"));
+    }
+
+    return kernel->second;
+}
+
+// The bounds of the segments that are too large for the segmented kernels.
+// The list is compacted on the device, so that only the number of the large
+// segments and their bounds are read back.
+template <typename I>
+struct large_segments {
+    std::vector<I> bounds;
+
+    large_segments(const backend::command_queue &queue,
+            const backend::device_vector<I> &offsets, size_t nseg, size_t limit)
+    {
+        backend::device_vector<int> flags(queue, nseg);
+        backend::device_vector<int> pos  (queue, nseg);
+
+        auto flag = large_segment_flags_kernel<I>(queue);
+
+        flag.push_arg(nseg);
+        flag.push_arg(limit);
+        flag.push_arg(offsets);
+        flag.push_arg(flags);
+
+        flag(queue);
+
+        scan(queue, flags, pos, 0, false, plus<int>().device);
+
+        int n = 0;
+        pos.read(queue, nseg - 1, 1, &n, true);
+
+        if (n == 0) return;
+
+        backend::device_vector<I> b(queue, 2 * n);
+
+        auto list = large_segment_list_kernel<I>(queue);
+
+        list.push_arg(nseg);
+        list.push_arg(limit);
+        list.push_arg(offsets);
+        list.push_arg(pos);
+        list.push_arg(b);
+
+        list(queue);
+
+        bounds.resize(2 * n);
+        b.read(queue, 0, 2 * n, bounds.data(), true);
+    }
+
+    size_t size() const {
+        return bounds.size() / 2;
+    }
+
+    size_t start(size_t j) const {
+        return bounds[2 * j];
+    }
+
+    size_t count(size_t j) const {
+        return bounds[2 * j + 1] - bounds[2 * j];
+    }
+
+    size_t largest() const {
+        size_t m = 0;
+        for(size_t j = 0; j < size(); ++j) m = std::max(m, count(j));
+        return m;
+    }
+};
+
+// Sorts the segments that are too large for the segmented kernels one after
+// another with the regular single partition sort (the radix sort where it
+// applies). Every segment is copied into a scratch buffer large enough for
+// the largest one, sorted there, and copied back.
+template <typename K, typename I, class Comp>
+void sort_large_segments(const backend::command_queue &queue,
+        backend::device_vector<K> &keys, boost::fusion::vector<>,
+        const backend::device_vector<I> &offsets, size_t nseg, size_t limit,
+        Comp comp)
+{
+    large_segments<I> seg(queue, offsets, nseg, limit);
+    if (!seg.size()) return;
+
+    range_copier copy;
+
+    backend::device_vector<K> k(queue, seg.largest());
+    boost::fusion::vector<backend::device_vector<K>&> kt(k);
+
+    for(size_t j = 0; j < seg.size(); ++j) {
+        copy(queue, keys, seg.start(j), queue, k, 0, seg.count(j));
+
+        sort_partition(queue, kt, comp, seg.count(j),
+                radix_sort_keys<boost::mpl::vector<K>, Comp>());
+
+        copy(queue, k, 0, queue, keys, seg.start(j), seg.count(j));
+    }
+}
+
+template <typename K, typename V, typename I, class Comp>
+void sort_large_segments(const backend::command_queue &queue,
+        backend::device_vector<K> &keys,
+        boost::fusion::vector<backend::device_vector<V>&> vals,
+        const backend::device_vector<I> &offsets, size_t nseg, size_t limit,
+        Comp comp)
+{
+    large_segments<I> seg(queue, offsets, nseg, limit);
+    if (!seg.size()) return;
+
+    range_copier copy;
+
+    backend::device_vector<K> k(queue, seg.largest());
+    backend::device_vector<V> v(queue, seg.largest());
+
+    boost::fusion::vector<backend::device_vector<K>&> kt(k);
+    boost::fusion::vector<backend::device_vector<V>&> vt(v);
+
+    auto &x = boost::fusion::at_c<0>(vals);
+
+    for(size_t j = 0; j < seg.size(); ++j) {
+        copy(queue, keys, seg.start(j), queue, k, 0, seg.count(j));
+        copy(queue, x,    seg.start(j), queue, v, 0, seg.count(j));
+
+        sort_by_key_partition(queue, kt, vt, comp, seg.count(j),
+                radix_sort_keys<boost::mpl::vector<K>, Comp>());
+
+        copy(queue, k, 0, queue, keys, seg.start(j), seg.count(j));
+        copy(queue, v, 0, queue, x,    seg.start(j), seg.count(j));
+    }
+}
+
+/// Sorts the segments of a single partition.
+template <class V, typename K, class VTup, typename I, class Comp>
+void segmented_sort(const backend::command_queue &queue,
+        backend::device_vector<K> &keys, VTup vals,
+        const backend::device_vector<I> &offsets, size_t nseg,
+        Comp comp)
+{
+    typedef boost::mpl::vector<K> KL;
+    typedef decltype(comp.device) DevComp;
+
+    backend::select_context(queue);
+
+    const bool cpu = is_cpu(queue);
+
+    const int NT_cpu = 1;
+    const int NT_gpu = VEX_SORT_NT_GPU;
+    const int NT = cpu ? NT_cpu : NT_gpu;
+
+    // Segments sorted in registers, by a block sort tile, and serially on
+    // CPUs.
+    const int VT_small = 16;
+    const int VT_block = sizeof(K) > 4 ? 7 : 11;
+    const int NV       = NT_gpu * VT_block;
+    const int cpu_max  = 1 << 16;
+
+    // Step 1: small segments, and the largest segment size.
+    const size_t ngroups = std::max<size_t>(1, std::min<size_t>(
+                (nseg + NT - 1) / NT, backend::kernel::num_workgroups(queue)));
+
+    backend::device_vector<I> max_size(queue, ngroups);
+
+    auto small = cpu ?
+        segmented_small_sort_kernel<NT_cpu, VT_small, KL, V, I, DevComp>(queue) :
+        segmented_small_sort_kernel<NT_gpu, VT_small, KL, V, I, DevComp>(queue);
+
+    small.push_arg(nseg);
+    small.push_arg(offsets);
+    small.push_arg(keys);
+    push_args<boost::mpl::size<V>::value>(small, vals);
+    small.push_arg(max_size);
+
+    small.config(ngroups, NT);
+    small(queue);
+
+    std::vector<I> ms(ngroups);
+    max_size.read(queue, 0, ngroups, ms.data(), true);
+
+    const size_t largest = *std::max_element(ms.begin(), ms.end());
+    if (largest <= static_cast<size_t>(VT_small)) return;
+
+    // Step 2: medium segments.
+    const int limit = cpu ? cpu_max : NV;
+
+    if (cpu) {
+        temp_storage<KL> keys_tmp(queue, keys.size());
+        temp_storage<V>  vals_tmp(queue, keys.size());
+
+        auto serial = segmented_serial_sort_kernel<VT_small, KL, V, I, DevComp>(queue);
+
+        serial.push_arg(nseg);
+        serial.push_arg(VT_small);
+        serial.push_arg(limit);
+        serial.push_arg(offsets);
+        serial.push_arg(keys);
+        push_args<boost::mpl::size<V>::value>(serial, vals);
+        push_args<boost::mpl::size<KL>::value>(serial, keys_tmp);
+        push_args<boost::mpl::size<V>::value>(serial, vals_tmp);
+
+        serial.config(std::min<size_t>(nseg, backend::kernel::num_workgroups(queue)), 1);
+        serial(queue);
+    } else {
+        auto block = segmented_block_sort_kernel<NT_gpu, VT_block, KL, V, I, DevComp>(queue);
+
+        block.push_arg(nseg);
+        block.push_arg(VT_small);
+        block.push_arg(offsets);
+        block.push_arg(keys);
+        block.push_arg(keys);
+        push_args<boost::mpl::size<V>::value>(block, vals);
+        push_args<boost::mpl::size<V>::value>(block, vals);
+
+        block.config(std::min<size_t>(nseg, backend::kernel::num_workgroups(queue)), NT_gpu);
+        block(queue);
+    }
+
+    if (largest <= static_cast<size_t>(limit)) return;
+
+    // Step 3: large segments.
+    sort_large_segments(queue, keys, vals, offsets, nseg, limit, comp);
+}
+
+} // namespace detail
+
+/// Sorts every segment of the vector independently.
+/**
+ * Segment i spans elements from offsets[i] to offsets[i + 1] - 1 of the
+ * vector, so that offsets has one more element than there are segments (as
+ * the row pointers of a CSR matrix). The segments are sorted with a stable
+ * sort in a single pass each: small segments in registers, medium ones in
+ * shared memory (or serially on CPUs), and only the largest segments with the
+ * regular sort. The keys and the offsets should be located on a single
+ * device.
+ */
+template <typename K, typename I, class Comp>
+void segmented_sort(vector<K> &keys, const vector<I> &offsets, Comp comp) {
+    precondition(
+            keys.nparts() == 1 && offsets.nparts() == 1,
+            "segmented_sort only supports single device vectors"
+            );
+
+    if (offsets.size() < 2) return;
+
+    detail::segmented_sort< boost::mpl::vector<> >(keys.queue_list()[0],
+            keys(0), boost::fusion::vector<>(), offsets(0), offsets.size() - 1,
+            comp);
+}
+
+/// Sorts every segment of the vector independently into ascending order.
+template <typename K, typename I>
+void segmented_sort(vector<K> &keys, const vector<I> &offsets) {
+    segmented_sort(keys, offsets, less<K>());
+}
+
+/// Sorts every segment of the keys and the values independently.
+template <typename K, typename V, typename I, class Comp>
+void segmented_sort(vector<K> &keys, vector<V> &vals, const vector<I> &offsets, Comp comp) {
+    precondition(
+            keys.nparts() == 1 && vals.nparts() == 1 && offsets.nparts() == 1,
+            "segmented_sort only supports single device vectors"
+            );
+
+    precondition(keys.size() == vals.size(),
+            "keys and values should have same size"
+            );
+
+    if (offsets.size() < 2) return;
+
+    detail::segmented_sort< boost::mpl::vector<V> >(keys.queue_list()[0],
+            keys(0), boost::fusion::vector<backend::device_vector<V>&>(vals(0)),
+            offsets(0), offsets.size() - 1, comp);
+}
+
+/// Sorts every segment of the keys and the values independently into ascending key order.
+template <typename K, typename V, typename I>
+void segmented_sort(vector<K> &keys, vector<V> &vals, const vector<I> &offsets) {
+    segmented_sort(keys, vals, offsets, less<K>());
+}
+
+} // namespace vex
+
+#endif
@@ -62,19 +62,31 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <algorithm>
 #include <functional>
 
+#include <boost/mpl/range_c.hpp>
+
 #include <vexcl/backend.hpp>
 #include <vexcl/util.hpp>
 #include <vexcl/vector.hpp>
 #include <vexcl/detail/fusion.hpp>
+#include <vexcl/detail/copy_range.hpp>
 #include <vexcl/function.hpp>
+#include <vexcl/scan.hpp>
 
 #ifndef VEX_SORT_NT_GPU
 #  define VEX_SORT_NT_GPU 256
 #endif
 
 namespace vex {
+
+template <typename T> struct less;
+template <typename T> struct greater;
+
 namespace detail {
 
 //---------------------------------------------------------------------------
@@ -816,6 +828,129 @@ struct call_shared_to_thread {
     }
 };
 
+//---------------------------------------------------------------------------
+// Device functions used by the block sort.
+template <int NT, int VT, typename K, typename V>
+void block_sort_functions(backend::source_generator &src) {
+    boost::mpl::for_each<
+        typename boost::mpl::copy<
+            typename boost::mpl::copy<
+                V,
+                boost::mpl::back_inserter<K>
+                >::type,
+            boost::mpl::inserter<
+                boost::mpl::set<int>,
+                boost::mpl::insert<boost::mpl::_1, boost::mpl::_2>
+                >
+            >::type
+        >( define_transfer_functions<NT, VT>(src) );
+
+    serial_merge<VT, K >(src);
+    mergesort<NT, VT, K, V>(src);
+}
+
+// Shared memory used by the block sort.
+template <int NT, int VT, typename K, typename V>
+void block_sort_shared(backend::source_generator &src) {
+    src.new_line() << "union Shared";
+    src.open("{");
+
+    src.new_line() << "struct";
+    src.open("{");
+    boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
+                src.new_line() << tname << " keys" << pos << "[" << NT * (VT + 1) << "];";
+                }) );
+    src.close("};");
+
+    if (boost::mpl::size<V>::value) {
+        src.new_line() << "struct";
+        src.open("{");
+        boost::mpl::for_each<V>( type_iterator([&](size_t pos, std::string tname) {
+                    src.new_line() << tname << " vals" << pos << "[" << NT * VT << "];";
+                    }) );
+        src.close("};");
+    }
+
+    src.close("};");
+
+    src.smem_static_var("union Shared", "shared");
+}
+
+// Sorts count2 elements starting at position gid of keys_src (vals_src) into
+// keys_dst (vals_dst) within a single workgroup.
+template <int NT, int VT, typename K, typename V>
+void block_sort_tile(backend::source_generator &src) {
+    // Load the values into thread order.
+    boost::mpl::for_each<V>( type_iterator([&](size_t pos, std::string tname) {
+                src.new_line() << tname << " thread_vals" << pos << "[" << VT << "];";
+                }) );
+
+    boost::mpl::for_each<V>( call_global_to_shared<NT, VT>(src, "vals_src", "shared.vals") );
+    boost::mpl::for_each<V>( call_shared_to_thread<VT>(src, "shared.vals", "thread_vals") );
+
+    // Load keys into shared memory and transpose into register in thread order.
+    boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
+                src.new_line() << tname << " thread_keys" << pos << "[" << VT << "];";
+                }) );
+
+    boost::mpl::for_each<K>( call_global_to_shared<NT, VT>(src, "keys_src", "shared.keys") );
+    boost::mpl::for_each<K>( call_shared_to_thread<VT>(src, "shared.keys", "thread_keys") );
+
+    // If we're in the last tile, set the uninitialized keys for the thread with
+    // a partial number of keys.
+    src.new_line() << "int first = " << VT << " * tid;";
+    src.new_line() << "if(first + " << VT << " > count2 && first < count2)";
+    src.open("{");
+
+    boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
+                src.new_line() << tname << " max_key" << pos << " = thread_keys" << pos << "[0];";
+                }) );
+
+    for(int i = 1; i < VT; ++i) {
+        src.new_line()
+            << "if(first + " << i << " < count2 && comp(";
+        for(int p = 0; p < boost::mpl::size<K>::value; ++p)
+            src << (p ? ", " : "") << "max_key" << p;
+        for(int p = 0; p < boost::mpl::size<K>::value; ++p)
+            src << ", thread_keys" << p << "[" << i << "]";
+        src << ") )";
+        src.open("{");
+        for(int p = 0; p < boost::mpl::size<K>::value; ++p)
+        src.new_line() << "max_key" << p << " = thread_keys" << p << "[" << i << "];";
+        src.close("}");
+    }
+
+    // Fill in the uninitialized elements with max key.
+    for(int i = 0; i < VT; ++i) {
+        src.new_line()
+            << "if(first + " << i << " >= count2)";
+        src.open("{");
+        for(int p = 0; p < boost::mpl::size<K>::value; ++p)
+            src.new_line() << "thread_keys" << p << "[" << i << "] = max_key" << p << ";";
+        src.close("}");
+    }
+
+    src.close("}");
+
+    src.new_line() << mergesort<NT, VT, K, V>()
+        << "(count2, tid";
+    for(int p = 0; p < boost::mpl::size<K>::value; ++p)
+        src << ", thread_keys" << p;
+    for(int p = 0; p < boost::mpl::size<K>::value; ++p)
+        src << ", shared.keys" << p;
+    for(int p = 0; p < boost::mpl::size<V>::value; ++p)
+        src << ", thread_vals" << p;
+    for(int p = 0; p < boost::mpl::size<V>::value; ++p)
+        src << ", shared.vals" << p;
+    src << ");";
+
+    // Store the sorted keys to global.
+    boost::mpl::for_each<K>( call_shared_to_global<NT, VT>(src, "count2", "shared.keys", "keys_dst", "gid") );
+
+    boost::mpl::for_each<V>( call_thread_to_shared<VT>(src, "thread_vals", "shared.vals") );
+    boost::mpl::for_each<V>( call_shared_to_global<NT, VT>(src, "count2", "shared.vals", "vals_dst", "gid") );
+}
+
 //---------------------------------------------------------------------------
 template <int NT, int VT, typename K, typename V, typename Comp>
 backend::kernel& block_sort_kernel(const backend::command_queue &queue) {
@@ -828,21 +963,7 @@ backend::kernel& block_sort_kernel(const backend::command_queue &queue) {
 
         Comp::define(src, "comp");
 
-        boost::mpl::for_each<
-            typename boost::mpl::copy<
-                typename boost::mpl::copy<
-                    V,
-                    boost::mpl::back_inserter<K>
-                    >::type,
-                boost::mpl::inserter<
-                    boost::mpl::set<int>,
-                    boost::mpl::insert<boost::mpl::_1, boost::mpl::_2>
-                    >
-                >::type
-            >( define_transfer_functions<NT, VT>(src) );
-
-        serial_merge<VT, K >(src);
-        mergesort<NT, VT, K, V>(src);
+        block_sort_functions<NT, VT, K, V>(src);
 
         src.begin_kernel("block_sort");
         src.begin_kernel_parameters();
@@ -857,103 +978,14 @@ backend::kernel& block_sort_kernel(const backend::command_queue &queue) {
 
         const int NV = NT * VT;
 
-        src.new_line() << "union Shared";
-        src.open("{");
-
-        src.new_line() << "struct";
-        src.open("{");
-        boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
-                    src.new_line() << tname << " keys" << pos << "[" << NT * (VT + 1) << "];";
-                    }) );
-        src.close("};");
-
-        if (boost::mpl::size<V>::value) {
-            src.new_line() << "struct";
-            src.open("{");
-            boost::mpl::for_each<V>( type_iterator([&](size_t pos, std::string tname) {
-                        src.new_line() << tname << " vals" << pos << "[" << NT * VT << "];";
-                        }) );
-            src.close("};");
-        }
-
-        src.close("};");
-
-        src.smem_static_var("union Shared", "shared");
+        block_sort_shared<NT, VT, K, V>(src);
 
         src.new_line() << "int tid    = " << src.local_id(0) << ";";
         src.new_line() << "int block  = " << src.group_id(0) << ";";
         src.new_line() << "int gid    = " << NV << " * block;";
         src.new_line() << "int count2 = min(" << NV << ", count - gid);";
 
-        // Load the values into thread order.
-        boost::mpl::for_each<V>( type_iterator([&](size_t pos, std::string tname) {
-                    src.new_line() << tname << " thread_vals" << pos << "[" << VT << "];";
-                    }) );
-
-        boost::mpl::for_each<V>( call_global_to_shared<NT, VT>(src, "vals_src", "shared.vals") );
-        boost::mpl::for_each<V>( call_shared_to_thread<VT>(src, "shared.vals", "thread_vals") );
-
-        // Load keys into shared memory and transpose into register in thread order.
-        boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
-                    src.new_line() << tname << " thread_keys" << pos << "[" << VT << "];";
-                    }) );
-
-        boost::mpl::for_each<K>( call_global_to_shared<NT, VT>(src, "keys_src", "shared.keys") );
-        boost::mpl::for_each<K>( call_shared_to_thread<VT>(src, "shared.keys", "thread_keys") );
-
-        // If we're in the last tile, set the uninitialized keys for the thread with
-        // a partial number of keys.
-        src.new_line() << "int first = " << VT << " * tid;";
-        src.new_line() << "if(first + " << VT << " > count2 && first < count2)";
-        src.open("{");
-
-        boost::mpl::for_each<K>( type_iterator([&](size_t pos, std::string tname) {
-                    src.new_line() << tname << " max_key" << pos << " = thread_keys" << pos << "[0];";
-                    }) );
-
-        for(int i = 1; i < VT; ++i) {
-            src.new_line()
-                << "if(first + " << i << " < count2 && comp(";
-            for(int p = 0; p < boost::mpl::size<K>::value; ++p)
-                src << (p ? ", " : "") << "max_key" << p;
-            for(int p = 0; p < boost::mpl::size<K>::value; ++p)
-                src << ", thread_keys" << p << "[" << i << "]";
-            src << ") )";
-            src.open("{");
-            for(int p = 0; p < boost::mpl::size<K>::value; ++p)
-            src.new_line() << "max_key" << p << " = thread_keys" << p << "[" << i << "];";
-            src.close("}");
-        }
-
-        // Fill in the uninitialized elements with max key.
-        for(int i = 0; i < VT; ++i) {
-            src.new_line()
-                << "if(first + " << i << " >= count2)";
-            src.open("{");
-            for(int p = 0; p < boost::mpl::size<K>::value; ++p)
-                src.new_line() << "thread_keys" << p << "[" << i << "] = max_key" << p << ";";
-            src.close("}");
-        }
-
-        src.close("}");
-
-        src.new_line() << mergesort<NT, VT, K, V>()
-            << "(count2, tid";
-        for(int p = 0; p < boost::mpl::size<K>::value; ++p)
-            src << ", thread_keys" << p;
-        for(int p = 0; p < boost::mpl::size<K>::value; ++p)
-            src << ", shared.keys" << p;
-        for(int p = 0; p < boost::mpl::size<V>::value; ++p)
-            src << ", thread_vals" << p;
-        for(int p = 0; p < boost::mpl::size<V>::value; ++p)
-            src << ", shared.vals" << p;
-        src << ");";
-
-        // Store the sorted keys to global.
-        boost::mpl::for_each<K>( call_shared_to_global<NT, VT>(src, "count2", "shared.keys", "keys_dst", "gid") );
-
-        boost::mpl::for_each<V>( call_thread_to_shared<VT>(src, "thread_vals", "shared.vals") );
-        boost::mpl::for_each<V>( call_shared_to_global<NT, VT>(src, "count2", "shared.vals", "vals_dst", "gid") );
+        block_sort_tile<NT, VT, K, V>(src);
 
         src.end_kernel();
 
@@ -1078,7 +1110,7 @@ backend::device_vector<int> merge_path_partitions(
         merge_partition_kernel<NT_cpu, K, Comp>(queue) :
         merge_partition_kernel<NT_gpu, K, Comp>(queue);
 
-    int a_count = static_cast<int>(boost::fusion::at_c<0>(keys).size());
+    int a_count = count;
     int b_count = 0;
 
     merge_partition.push_arg(a_count);
@@ -1713,9 +1745,9 @@ inline int find_log2(int x, bool round_up = false) {
     return a;
 }
 
-/// Sorts single partition of a vector.
+/// Sorts the first count elements of a single partition of a vector.
 template <class KT, class Comp>
-void sort(const backend::command_queue &queue, KT &keys, Comp) {
+void sort(const backend::command_queue &queue, KT &keys, Comp, size_t n) {
     typedef typename extract_value_types<KT>::type K;
     using boost::fusion::at_c;
 
@@ -1735,7 +1767,7 @@ void sort(const backend::command_queue &queue, KT &keys, Comp) {
     const int VT = (sizeof_keys::value > 4) ? 7 : 11;
     const int NV = NT * VT;
 
-    const int count = static_cast<int>(at_c<0>(keys).size());
+    const int count = static_cast<int>(n);
     const int num_blocks = (count + NV - 1) / NV;
     const int num_passes = detail::find_log2(num_blocks, true);
 
@@ -1785,15 +1817,21 @@ void sort(const backend::command_queue &queue, KT &keys, Comp) {
 }
 
 /// Sorts single partition of a vector.
+template <class KT, class Comp>
+void sort(const backend::command_queue &queue, KT &keys, Comp comp) {
+    sort(queue, keys, comp, boost::fusion::at_c<0>(keys).size());
+}
+
+/// Sorts the first count elements of a single partition of keys and values.
 template <class KTup, class VTup, class Comp>
-void sort_by_key(const backend::command_queue &queue, KTup &&keys, VTup &&vals, Comp) {
+void sort_by_key(const backend::command_queue &queue, KTup &&keys, VTup &&vals, Comp, size_t n) {
     typedef typename extract_value_types<KTup>::type K;
     typedef typename extract_value_types<VTup>::type V;
 
     using boost::fusion::at_c;
 
-    precondition(at_c<0>(keys).size() == at_c<0>(vals).size(),
-            "keys and values should have same size"
+    precondition(at_c<0>(keys).size() >= n && at_c<0>(vals).size() >= n,
+            "keys and values are too short"
             );
 
     backend::select_context(queue);
@@ -1804,7 +1842,7 @@ void sort_by_key(const backend::command_queue &queue, KTup &&keys, VTup &&vals,
     const int VT = (sizeof(K) > 4) ? 7 : 11;
     const int NV = NT * VT;
 
-    const int count = static_cast<int>(at_c<0>(keys).size());
+    const int count = static_cast<int>(n);
     const int num_blocks = (count + NV - 1) / NV;
     const int num_passes = detail::find_log2(num_blocks, true);
 
@@ -1869,6 +1907,302 @@ void sort_by_key(const backend::command_queue &queue, KTup &&keys, VTup &&vals,
     }
 }
 
+/// Sorts single partition of a vector.
+template <class KTup, class VTup, class Comp>
+void sort_by_key(const backend::command_queue &queue, KTup &&keys, VTup &&vals, Comp comp) {
+    precondition(
+            boost::fusion::at_c<0>(keys).size() == boost::fusion::at_c<0>(vals).size(),
+            "keys and values should have same size"
+            );
+
+    sort_by_key(queue, keys, vals, comp, boost::fusion::at_c<0>(keys).size());
+}
+
+//---------------------------------------------------------------------------
+// Radix sort
+//---------------------------------------------------------------------------
+// Single-component keys of 32 or 64 bit arithmetic types that are compared
+// with vex::less or vex::greater are sorted with the LSD radix sort instead
+// of the merge sort.
+template <typename T, class Comp>
+struct radix_sort_type {
+    static const bool descending = std::is_same<Comp, greater<T> >::value;
+
+    static const bool value =
+        std::is_arithmetic<T>::value &&
+        (sizeof(T) == 4 || sizeof(T) == 8) &&
+        (descending || std::is_same<Comp, less<T> >::value);
+};
+
+template <class K, class Comp, class Enable = void>
+struct radix_sort_keys : std::false_type {};
+
+template <class K, class Comp>
+struct radix_sort_keys<K, Comp,
+    typename std::enable_if<boost::mpl::size<K>::value == 1>::type>
+    : std::integral_constant<bool,
+        radix_sort_type<typename boost::mpl::at_c<K, 0>::type, Comp>::value>
+{
+    static const bool descending =
+        radix_sort_type<typename boost::mpl::at_c<K, 0>::type, Comp>::descending;
+};
+
+// Maps the key onto an unsigned integer with the same ordering. Negative
+// floating point zero is ordered before the positive one.
+template <typename T>
+void radix_sort_key(backend::source_generator &src) {
+    typedef typename std::conditional<sizeof(T) == 4, cl_uint, cl_ulong>::type U;
+
+    const std::string u  = type_name<U>();
+    const std::string sb = "((" + u + ")1 << " + std::to_string(8 * sizeof(T) - 1) + ")";
+
+    src.begin_function<U>("radix_sort_key");
+    src.begin_function_parameters();
+    src.template parameter<T>("x");
+    src.end_function_parameters();
+
+    if (std::is_floating_point<T>::value) {
+        // Flip all bits of negative numbers, and the sign bit of the rest.
+        src.new_line() << "union { " << type_name<T>() << " f; " << u << " u; } v;";
+        src.new_line() << "v.f = x;";
+        src.new_line() << "return v.u ^ ((v.u & " << sb << ") ? ~(" << u << ")0 : " << sb << ");";
+    } else if (std::is_signed<T>::value) {
+        src.new_line() << "return (" << u << ")x ^ " << sb << ";";
+    } else {
+        src.new_line() << "return x;";
+    }
+
+    src.end_function();
+}
+
+// Every thread counts the digits of the keys in its tile.
+template <int RB, typename T>
+backend::kernel& radix_sort_count_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        typedef typename std::conditional<sizeof(T) == 4, cl_uint, cl_ulong>::type U;
+
+        backend::source_generator src(queue);
+
+        radix_sort_key<T>(src);
+
+        src.begin_kernel("radix_sort_count");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("count");
+        src.template parameter< int >("nthreads");
+        src.template parameter< int >("tile");
+        src.template parameter< int >("shift");
+        src.template parameter< int >("descending");
+        src.template parameter< global_ptr<const T> >("keys");
+        src.template parameter< global_ptr<int> >("hist");
+        src.end_kernel_parameters();
+
+        src.new_line() << "int tid = " << src.global_id(0) << ";";
+        src.new_line() << "if (tid >= nthreads) return;";
+
+        src.new_line() << "int c[" << (1 << RB) << "];";
+        src.new_line() << "for(int d = 0; d < " << (1 << RB) << "; ++d) c[d] = 0;";
+
+        src.new_line() << "int beg = tid * tile;";
+        src.new_line() << "int end = min(count, beg + tile);";
+        src.new_line() << "for(int i = beg; i < end; ++i)";
+        src.open("{");
+        src.new_line() << type_name<U>() << " k = radix_sort_key(keys[i]);";
+        src.new_line() << "if (descending) k = ~k;";
+        src.new_line() << "++c[(k >> shift) & " << (1 << RB) - 1 << "];";
+        src.close("}");
+
+        src.new_line() << "for(int d = 0; d < " << (1 << RB) << "; ++d) hist[d * nthreads + tid] = c[d];";
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "radix_sort_count"));
+    }
+
+    return kernel->second;
+}
+
+// Every thread moves the keys (and values) of its tile to the positions
+// given by the scanned digit counts. Since the counts are stored digit-major,
+// the order of the equal digits is preserved.
+template <int RB, typename T, typename V>
+backend::kernel& radix_sort_scatter_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        typedef typename std::conditional<sizeof(T) == 4, cl_uint, cl_ulong>::type U;
+
+        backend::source_generator src(queue);
+
+        radix_sort_key<T>(src);
+
+        src.begin_kernel("radix_sort_scatter");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("count");
+        src.template parameter< int >("nthreads");
+        src.template parameter< int >("tile");
+        src.template parameter< int >("shift");
+        src.template parameter< int >("descending");
+        src.template parameter< global_ptr<const int> >("offset");
+        src.template parameter< global_ptr<const T> >("keys_src");
+        src.template parameter< global_ptr<T> >("keys_dst");
+
+        boost::mpl::for_each<V>( pointer_param<global_ptr, true>(src, "vals_src") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr      >(src, "vals_dst") );
+
+        src.end_kernel_parameters();
+
+        src.new_line() << "int tid = " << src.global_id(0) << ";";
+        src.new_line() << "if (tid >= nthreads) return;";
+
+        src.new_line() << "int pos[" << (1 << RB) << "];";
+        src.new_line() << "for(int d = 0; d < " << (1 << RB) << "; ++d) pos[d] = offset[d * nthreads + tid];";
+
+        src.new_line() << "int beg = tid * tile;";
+        src.new_line() << "int end = min(count, beg + tile);";
+        src.new_line() << "for(int i = beg; i < end; ++i)";
+        src.open("{");
+        src.new_line() << type_name<T>() << " key = keys_src[i];";
+        src.new_line() << type_name<U>() << " k = radix_sort_key(key);";
+        src.new_line() << "if (descending) k = ~k;";
+        src.new_line() << "int j = pos[(k >> shift) & " << (1 << RB) - 1 << "]++;";
+        src.new_line() << "keys_dst[j] = key;";
+        for(int p = 0; p < boost::mpl::size<V>::value; ++p)
+            src.new_line() << "vals_dst" << p << "[j] = vals_src" << p << "[i];";
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "radix_sort_scatter"));
+    }
+
+    return kernel->second;
+}
+
+/// Sorts single partition of a vector with LSD radix sort.
+template <class V, typename T, class VTup>
+void radix_sort(const backend::command_queue &queue,
+        backend::device_vector<T> &keys, VTup &&vals, int count, bool descending)
+{
+    backend::select_context(queue);
+
+    // Four bits per pass on GPUs keep the per-thread counters in registers.
+    const int RB_cpu = 8;
+    const int RB_gpu = 4;
+    const int RB     = is_cpu(queue) ? RB_cpu : RB_gpu;
+
+    // Every pass swaps the keys with the scratch buffer, so an even number of
+    // passes leaves the sorted keys in the buffer of the input vector.
+    static_assert(
+            (8 * sizeof(T) / RB_cpu) % 2 == 0 && (8 * sizeof(T) / RB_gpu) % 2 == 0,
+            "Radix sort needs an even number of passes"
+            );
+
+    // A CPU core sorts a contiguous chunk of the keys, a GPU thread only
+    // handles a short tile.
+    const int nthreads = is_cpu(queue) ?
+        static_cast<int>(std::min<size_t>(count, backend::kernel::num_workgroups(queue))) :
+        (count + 31) / 32;
+    const int tile = (count + nthreads - 1) / nthreads;
+
+    const size_t hist_size = static_cast<size_t>(nthreads) << RB;
+
+    backend::device_vector<int> hist  (queue, hist_size);
+    backend::device_vector<int> offset(queue, hist_size);
+
+    backend::device_vector<T> keys_tmp(queue, count);
+    temp_storage<V> vals_tmp(queue, count);
+
+    auto count_kernel = is_cpu(queue) ?
+        radix_sort_count_kernel<RB_cpu, T>(queue) :
+        radix_sort_count_kernel<RB_gpu, T>(queue);
+
+    auto scatter_kernel = is_cpu(queue) ?
+        radix_sort_scatter_kernel<RB_cpu, T, V>(queue) :
+        radix_sort_scatter_kernel<RB_gpu, T, V>(queue);
+
+    const size_t ws = is_cpu(queue) ? 1 : VEX_SORT_NT_GPU;
+    const size_t wg = (nthreads + ws - 1) / ws;
+
+    for(int shift = 0; shift < static_cast<int>(8 * sizeof(T)); shift += RB) {
+        count_kernel.push_arg(count);
+        count_kernel.push_arg(nthreads);
+        count_kernel.push_arg(tile);
+        count_kernel.push_arg(shift);
+        count_kernel.push_arg(static_cast<int>(descending));
+        count_kernel.push_arg(keys);
+        count_kernel.push_arg(hist);
+
+        count_kernel.config(wg, ws);
+        count_kernel(queue);
+
+        scan(queue, hist, offset, 0, true, plus<int>().device);
+
+        scatter_kernel.push_arg(count);
+        scatter_kernel.push_arg(nthreads);
+        scatter_kernel.push_arg(tile);
+        scatter_kernel.push_arg(shift);
+        scatter_kernel.push_arg(static_cast<int>(descending));
+        scatter_kernel.push_arg(offset);
+        scatter_kernel.push_arg(keys);
+        scatter_kernel.push_arg(keys_tmp);
+
+        push_args<boost::mpl::size<V>::value>(scatter_kernel, vals);
+        push_args<boost::mpl::size<V>::value>(scatter_kernel, vals_tmp);
+
+        scatter_kernel.config(wg, ws);
+        scatter_kernel(queue);
+
+        std::swap(keys, keys_tmp);
+        vals_tmp.swap(vals);
+    }
+}
+
+// Sort the first count elements of the partition with the merge sort or
+// with the radix sort, depending on the type of the keys and the comparison.
+template <class KT, class Comp>
+void sort_partition(const backend::command_queue &queue, KT &keys, Comp comp,
+        size_t count, std::false_type)
+{
+    sort(queue, keys, comp.device, count);
+}
+
+template <class KT, class Comp>
+void sort_partition(const backend::command_queue &queue, KT &keys, Comp,
+        size_t count, std::true_type)
+{
+    typedef typename extract_value_types<KT>::type K;
+
+    radix_sort< boost::mpl::vector<> >(queue, boost::fusion::at_c<0>(keys),
+            boost::fusion::vector<>(), static_cast<int>(count),
+            radix_sort_keys<K, Comp>::descending);
+}
+
+template <class KTup, class VTup, class Comp>
+void sort_by_key_partition(const backend::command_queue &queue,
+        KTup &keys, VTup &vals, Comp comp, size_t count, std::false_type)
+{
+    sort_by_key(queue, keys, vals, comp.device, count);
+}
+
+template <class KTup, class VTup, class Comp>
+void sort_by_key_partition(const backend::command_queue &queue,
+        KTup &keys, VTup &vals, Comp, size_t count, std::true_type)
+{
+    typedef typename extract_value_types<KTup>::type K;
+    typedef typename extract_value_types<VTup>::type V;
+
+    radix_sort<V>(queue, boost::fusion::at_c<0>(keys), vals,
+            static_cast<int>(count), radix_sort_keys<K, Comp>::descending);
+}
+
 template <class S1, class S2>
 boost::fusion::zip_view< boost::fusion::vector<S1&, S2&> >
 make_zip_view(S1 &s1, S2 &s2) {
@@ -2066,6 +2400,355 @@ merge(const KTuple &keys, const VTuple &vals, Comp comp) {
     return fusion::as_vector(fusion::join(dst_keys, dst_vals));
 }
 
+//---------------------------------------------------------------------------
+// Multi-device merge
+//---------------------------------------------------------------------------
+// Merges the sorted runs [a_beg, a_end) and [a_end, b_end) of src into dst.
+// Every thread finds the start of its tile on the merge path and merges the
+// tile serially. Equal keys are taken from the first run first.
+template <typename K, typename V, typename Comp>
+backend::kernel& merge_runs_kernel(const backend::command_queue &queue) {
+    static detail::kernel_cache cache;
+
+    auto kernel = cache.find(queue);
+
+    if (kernel == cache.end()) {
+        const int NK = boost::mpl::size<K>::value;
+        const int NV = boost::mpl::size<V>::value;
+
+        backend::source_generator src(queue);
+
+        Comp::define(src, "comp");
+
+        src.begin_kernel("merge_runs");
+        src.begin_kernel_parameters();
+        src.template parameter< int >("a_beg");
+        src.template parameter< int >("a_end");
+        src.template parameter< int >("b_end");
+        src.template parameter< int >("tile");
+
+        boost::mpl::for_each<K>( pointer_param<global_ptr, true>(src, "keys_src") );
+        boost::mpl::for_each<K>( pointer_param<global_ptr      >(src, "keys_dst") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr, true>(src, "vals_src") );
+        boost::mpl::for_each<V>( pointer_param<global_ptr      >(src, "vals_dst") );
+
+        src.end_kernel_parameters();
+
+        src.new_line() << "int na = a_end - a_beg;";
+        src.new_line() << "int nb = b_end - a_end;";
+        src.new_line() << "int tid  = " << src.global_id(0) << ";";
+        src.new_line() << "int diag = min(na + nb, tid * tile);";
+        src.new_line() << "int last = min(na + nb, diag + tile);";
+        src.new_line() << "if (diag >= last) return;";
+
+        auto a = [&](const char *prefix, const char *i) {
+            std::ostringstream s;
+            for(int p = 0; p < NK; ++p)
+                s << (p ? ", " : "") << prefix << p << "[a_beg + " << i << "]";
+            return s.str();
+        };
+
+        auto b = [&](const char *prefix, const char *j) {
+            std::ostringstream s;
+            for(int p = 0; p < NK; ++p)
+                s << (p ? ", " : "") << prefix << p << "[a_end + " << j << "]";
+            return s.str();
+        };
+
+        src.new_line() << "int lo = max(0, diag - nb);";
+        src.new_line() << "int hi = min(diag, na);";
+        src.new_line() << "while(lo < hi)";
+        src.open("{");
+        src.new_line() << "int mid = (lo + hi) / 2;";
+        src.new_line() << "if (!comp(" << b("keys_src", "(diag - 1 - mid)") << ", "
+            << a("keys_src", "mid") << ")) lo = mid + 1; else hi = mid;";
+        src.close("}");
+
+        src.new_line() << "int i = lo;";
+        src.new_line() << "int j = diag - lo;";
+        src.new_line() << "for(int k = a_beg + diag; k < a_beg + last; ++k)";
+        src.open("{");
+        src.new_line() << "if (j >= nb || (i < na && !comp("
+            << b("keys_src", "j") << ", " << a("keys_src", "i") << ")))";
+        src.open("{");
+        for(int p = 0; p < NK; ++p)
+            src.new_line() << "keys_dst" << p << "[k] = keys_src" << p << "[a_beg + i];";
+        for(int p = 0; p < NV; ++p)
+            src.new_line() << "vals_dst" << p << "[k] = vals_src" << p << "[a_beg + i];";
+        src.new_line() << "++i;";
+        src.close("}");
+        src.new_line() << "else";
+        src.open("{");
+        for(int p = 0; p < NK; ++p)
+            src.new_line() << "keys_dst" << p << "[k] = keys_src" << p << "[a_end + j];";
+        for(int p = 0; p < NV; ++p)
+            src.new_line() << "vals_dst" << p << "[k] = vals_src" << p << "[a_end + j];";
+        src.new_line() << "++j;";
+        src.close("}");
+        src.close("}");
+
+        src.end_kernel();
+
+        kernel = cache.insert(queue, backend::kernel(
+                    queue, src.str(), "merge_runs"));
+    }
+
+    return kernel->second;
+}
+
+// Number of elements of the sorted partition d that precede the key x in
+// the stable order. Ties are ordered by the partition index.
+template <class KTuple, class Key, class Comp>
+size_t count_preceding(const KTuple &keys, unsigned d, const Key &x,
+        bool ties_precede, Comp comp)
+{
+    namespace fusion = boost::fusion;
+
+    size_t lo = fusion::at_c<0>(keys).part_start(d);
+    size_t hi = fusion::at_c<0>(keys).part_start(d + 1);
+
+    const size_t beg = lo;
+
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        auto y = fusion::as_vector(fusion::transform(keys, do_index(mid)));
+
+        bool before = ties_precede ?
+            !fusion::invoke(comp, fusion::join(x, y)) :
+             fusion::invoke(comp, fusion::join(y, x));
+
+        if (before) lo = mid + 1; else hi = mid;
+    }
+
+    return lo - beg;
+}
+
+// Finds how many elements of each sorted partition belong to the first r
+// elements of the merged sequence (k-way merge path).
+template <class KTuple, class Comp>
+std::vector<size_t> co_rank(const KTuple &keys, size_t r, Comp comp) {
+    namespace fusion = boost::fusion;
+
+    const unsigned ndev = static_cast<unsigned>(fusion::at_c<0>(keys).nparts());
+
+    std::vector<size_t> split(ndev);
+
+    for(unsigned s = 0; s < ndev; ++s) {
+        const size_t beg = fusion::at_c<0>(keys).part_start(s);
+
+        size_t lo = 0;
+        size_t hi = fusion::at_c<0>(keys).part_size(s);
+
+        while(lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            auto x = fusion::as_vector(fusion::transform(keys, do_index(beg + mid)));
+
+            size_t rank = mid;
+            for(unsigned t = 0; t < ndev; ++t)
+                if (t != s) rank += count_preceding(keys, t, x, t < s, comp);
+
+            if (rank < r) lo = mid + 1; else hi = mid;
+        }
+
+        split[s] = lo;
+    }
+
+    return split;
+}
+
+// Sends a chunk of every component of a partitioned vector tuple to device
+// buffers of the destination queue.
+template <class Tuple, class Buffers>
+struct send_chunk {
+    range_copier &copy;
+    const Tuple &src;
+    Buffers &dst;
+    unsigned s;
+    size_t src_pos;
+    const backend::command_queue &q;
+    size_t dst_pos, n;
+
+    send_chunk(range_copier &copy, const Tuple &src, Buffers &dst, unsigned s,
+            size_t src_pos, const backend::command_queue &q, size_t dst_pos, size_t n)
+        : copy(copy), src(src), dst(dst), s(s), src_pos(src_pos), q(q),
+          dst_pos(dst_pos), n(n)
+    {}
+
+    template <class I>
+    void operator()(I) const {
+        const auto &v = boost::fusion::at_c<I::value>(src);
+
+        copy(v.queue_list()[s], v(s), src_pos,
+                q, detail::at_c<I::value>(dst), dst_pos, n);
+    }
+};
+
+// Copies device buffers to the partitions of a vector tuple on the same
+// device.
+template <class Buffers, class Tuple>
+struct store_partition {
+    range_copier &copy;
+    const backend::command_queue &q;
+    Buffers &src;
+    const Tuple &dst;
+    unsigned d;
+    size_t n;
+
+    store_partition(range_copier &copy, const backend::command_queue &q,
+            Buffers &src, const Tuple &dst, unsigned d, size_t n)
+        : copy(copy), q(q), src(src), dst(dst), d(d), n(n)
+    {}
+
+    template <class I>
+    void operator()(I) const {
+        copy(q, detail::at_c<I::value>(src), 0,
+                q, boost::fusion::at_c<I::value>(dst)(d), 0, n);
+    }
+};
+
+/// Merges the sorted runs of device buffers pairwise until one is left.
+/**
+ * The merged sequence ends up in keys and vals; keys_tmp and vals_tmp are
+ * used as scratch space.
+ */
+template <class K, class V, class Comp>
+void merge_runs(const backend::command_queue &queue,
+        temp_storage<K> &keys, temp_storage<V> &vals,
+        temp_storage<K> &keys_tmp, temp_storage<V> &vals_tmp,
+        std::vector<int> runs, Comp)
+{
+    backend::select_context(queue);
+
+    auto merge = merge_runs_kernel<K, V, Comp>(queue);
+
+    const size_t ws = is_cpu(queue) ? 1 : VEX_SORT_NT_GPU;
+
+    while(runs.size() > 2) {
+        std::vector<int> merged(1, 0);
+
+        for(size_t j = 0; j + 1 < runs.size(); j += 2) {
+            int a_beg = runs[j];
+            int a_end = runs[j + 1];
+            int b_end = j + 2 < runs.size() ? runs[j + 2] : a_end;
+
+            int count    = b_end - a_beg;
+            int nthreads = is_cpu(queue) ?
+                static_cast<int>(std::min<size_t>(count, backend::kernel::num_workgroups(queue))) :
+                (count + 31) / 32;
+            int tile     = (count + nthreads - 1) / nthreads;
+
+            merge.push_arg(a_beg);
+            merge.push_arg(a_end);
+            merge.push_arg(b_end);
+            merge.push_arg(tile);
+
+            push_args<boost::mpl::size<K>::value>(merge, keys);
+            push_args<boost::mpl::size<K>::value>(merge, keys_tmp);
+            push_args<boost::mpl::size<V>::value>(merge, vals);
+            push_args<boost::mpl::size<V>::value>(merge, vals_tmp);
+
+            merge.config((nthreads + ws - 1) / ws, ws);
+            merge(queue);
+
+            merged.push_back(b_end);
+        }
+
+        std::swap(keys, keys_tmp);
+        std::swap(vals, vals_tmp);
+
+        runs.swap(merged);
+    }
+}
+
+/// Merges sorted vector partitions on the compute devices.
+/**
+ * The ranks of the partition boundaries are split between the sorted
+ * partitions with the k-way merge path. Every device receives its part of
+ * each partition into temporary buffers, merges the received runs there, and
+ * copies the result back to its partition. The buffers of the vectors are
+ * kept, so that other vectors or raw buffers sharing them see the result.
+ */
+template <class V, class KTuple, class VTuple, class Comp>
+void merge_partitions(const KTuple &keys, const VTuple &vals, Comp comp) {
+    namespace fusion = boost::fusion;
+
+    typedef typename extract_value_types<KTuple>::type K;
+
+    const auto &queue = fusion::at_c<0>(keys).queue_list();
+    const unsigned ndev = static_cast<unsigned>(queue.size());
+
+    // split[b][s] is the number of elements of partition s that go to the
+    // devices before b.
+    std::vector< std::vector<size_t> > split(ndev + 1);
+    split[0].resize(ndev, 0);
+    for(unsigned b = 1; b < ndev; ++b)
+        split[b] = co_rank(keys, fusion::at_c<0>(keys).part_start(b), comp);
+    for(unsigned s = 0; s < ndev; ++s)
+        split[ndev].push_back(fusion::at_c<0>(keys).part_size(s));
+
+    // Copies within a device are done by kernels on the destination queue,
+    // so the sorted partitions have to be ready on every queue.
+    for(unsigned d = 0; d < ndev; ++d) queue[d].finish();
+
+    // Send the data to the destination devices.
+    range_copier copy;
+
+    std::vector< std::unique_ptr< temp_storage<K> > > recv_keys(ndev);
+    std::vector< std::unique_ptr< temp_storage<V> > > recv_vals(ndev);
+    std::vector< std::vector<int> > runs(ndev);
+
+    for(unsigned b = 0; b < ndev; ++b) {
+        const size_t n = fusion::at_c<0>(keys).part_size(b);
+        if (!n) continue;
+
+        recv_keys[b].reset(new temp_storage<K>(queue[b], n));
+        recv_vals[b].reset(new temp_storage<V>(queue[b], n));
+
+        size_t pos = 0;
+        runs[b].push_back(0);
+
+        for(unsigned s = 0; s < ndev; ++s) {
+            size_t m = split[b + 1][s] - split[b][s];
+            if (!m) continue;
+
+            size_t src_pos = split[b][s];
+
+            boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<K>::value> >(
+                    send_chunk<KTuple, temp_storage<K> >(copy, keys, *recv_keys[b], s, src_pos, queue[b], pos, m));
+            boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<V>::value> >(
+                    send_chunk<VTuple, temp_storage<V> >(copy, vals, *recv_vals[b], s, src_pos, queue[b], pos, m));
+
+            pos += m;
+            runs[b].push_back(static_cast<int>(pos));
+        }
+    }
+
+    // The partitions are not overwritten until every device has received
+    // its part.
+    copy.finish();
+    for(unsigned d = 0; d < ndev; ++d) queue[d].finish();
+
+    // Merge the received runs on each device, and store the result.
+    for(unsigned b = 0; b < ndev; ++b) {
+        if (!recv_keys[b]) continue;
+
+        const size_t n = fusion::at_c<0>(keys).part_size(b);
+
+        if (runs[b].size() > 2) {
+            temp_storage<K> keys_tmp(queue[b], n);
+            temp_storage<V> vals_tmp(queue[b], n);
+
+            merge_runs<K, V>(queue[b], *recv_keys[b], *recv_vals[b],
+                    keys_tmp, vals_tmp, runs[b], comp.device);
+        }
+
+        boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<K>::value> >(
+                store_partition<temp_storage<K>, KTuple>(copy, queue[b], *recv_keys[b], keys, b, n));
+        boost::mpl::for_each< boost::mpl::range_c<int, 0, boost::mpl::size<V>::value> >(
+                store_partition<temp_storage<V>, VTuple>(copy, queue[b], *recv_vals[b], vals, b, n));
+    }
+}
+
 template <class K, class Comp>
 void sort_sink(K &&keys, Comp comp) {
     namespace fusion = boost::fusion;
@@ -2075,16 +2758,16 @@ void sort_sink(K &&keys, Comp comp) {
     for(unsigned d = 0; d < queue.size(); ++d)
         if (fusion::at_c<0>(keys).part_size(d)) {
             auto part = fusion::transform(keys, extract_device_vector(d));
-            sort(queue[d], part, comp.device);
+            sort_partition(queue[d], part, comp,
+                    fusion::at_c<0>(keys).part_size(d), radix_sort_keys<
+                    typename extract_value_types<K>::type, Comp>());
         }
 
     if (queue.size() <= 1) return;
 
     // Vector partitions have been sorted on compute devices.
-    // Now we need to merge them on a CPU. This is a linear time operation,
-    // so total performance should be good enough.
-    auto host_vectors = merge(keys, comp);
-    fusion::for_each( make_zip_view(host_vectors, keys), do_copy() );
+    // Now we need to merge them.
+    merge_partitions< boost::mpl::vector<> >(keys, fusion::vector<>(), comp);
 }
 
 template <class K, class V, class Comp>
@@ -2096,23 +2779,27 @@ void sort_by_key_sink(K &&keys, V &&vals, Comp comp) {
             "Keys and values span different devices"
             );
 
+    precondition(
+            fusion::at_c<0>(keys).size() == fusion::at_c<0>(vals).size(),
+            "keys and values should have same size"
+            );
+
     const auto &queue = fusion::at_c<0>(keys).queue_list();
 
     for(unsigned d = 0; d < queue.size(); ++d)
         if (fusion::at_c<0>(keys).part_size(d)) {
             auto kpart = fusion::transform(keys, extract_device_vector(d));
             auto vpart = fusion::transform(vals, extract_device_vector(d));
-            sort_by_key(queue[d], kpart, vpart, comp.device);
+            sort_by_key_partition(queue[d], kpart, vpart, comp,
+                    fusion::at_c<0>(keys).part_size(d), radix_sort_keys<
+                    typename extract_value_types<K>::type, Comp>());
         }
 
     if (queue.size() <= 1) return;
 
     // Vector partitions have been sorted on compute devices.
-    // Now we need to merge them on a CPU. This is a linear time operation,
-    // so total performance should be good enough.
-    auto host_vectors = merge(keys, vals, comp);
-    auto dev_vectors  = fusion::join(keys, vals);
-    fusion::for_each( make_zip_view(host_vectors, dev_vectors), do_copy() );
+    // Now we need to merge them.
+    merge_partitions< typename extract_value_types<V>::type >(keys, vals, comp);
 }
 
 } // namespace detail
@@ -2120,8 +2807,8 @@ void sort_by_key_sink(K &&keys, V &&vals, Comp comp) {
 /// Function object class for less-than inequality comparison.
 /**
  * The need for host-side and device-side parts comes from the fact that
- * vectors are partially sorted on device and then final merge step is done on
- * host.
+ * vectors are partially sorted on each device, and the host splits the merged
+ * sequence between the devices.
  */
 template <typename T>
 struct less : std::less<T> {
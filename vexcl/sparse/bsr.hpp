@@ -0,0 +1,355 @@
+#ifndef VEXCL_SPARSE_BSR_HPP
+#define VEXCL_SPARSE_BSR_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/bsr.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Sparse matrix in block CSR format.
+ */
+
+#include <vector>
+#include <map>
+#include <string>
+#include <type_traits>
+
+#include <boost/range.hpp>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/sparse/product.hpp>
+#include <vexcl/sparse/spmv_ops.hpp>
+
+namespace vex {
+namespace sparse {
+
+/// Sparse matrix in block CSR (BSR) format.
+/**
+ * The matrix is stored as a CSR matrix of dense BxB blocks, with a single
+ * column index per block. The blocks are stored row-major. The block size is
+ * a compile-time constant, so the block times subvector products are fully
+ * unrolled in the generated code. The product is computed by a kernel that
+ * handles a block row per work item, so that the B-wide slice of the vector
+ * is loaded once per block.
+ *
+ * The constructor takes the matrix in the scalar CSR format; the number of
+ * rows and columns should be divisible by the block size. Blocks that are
+ * only partially filled are padded with zeros.
+ */
+template <typename Val, unsigned B, typename Col = int, typename Ptr = Col>
+class bsr {
+    public:
+        typedef Val value_type;
+
+        typedef Val val_type;
+        typedef Col col_type;
+        typedef Ptr ptr_type;
+
+        static const unsigned block_size = B;
+
+        template <class PtrRange, class ColRange, class ValRange>
+        bsr(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                bool /*fast_setup*/ = true
+           ) :
+            q(q[0]), n(nrows), m(ncols), nb(0)
+        {
+            static_assert(B > 0, "Block size should be positive");
+
+            precondition(q.size() == 1,
+                    "sparse::bsr is only supported for single-device contexts");
+
+            precondition(n % B == 0 && m % B == 0,
+                    "Matrix size should be divisible by the block size");
+
+            const size_t nbrows = n / B;
+
+            std::vector<Ptr> _ptr(nbrows + 1);
+            std::vector<Col> _col;
+            std::vector<Val> _val;
+
+            _ptr[0] = 0;
+
+            std::map<Col, size_t> blocks;
+            for(size_t ib = 0; ib < nbrows; ++ib) {
+                blocks.clear();
+
+                for(size_t i = ib * B; i < (ib + 1) * B; ++i)
+                    for(auto j = ptr[i], e = ptr[i+1]; j < e; ++j)
+                        blocks.insert(std::make_pair(static_cast<Col>(col[j] / B), 0));
+
+                size_t head = _col.size();
+                for(auto b = blocks.begin(); b != blocks.end(); ++b) {
+                    b->second = head++;
+                    _col.push_back(b->first);
+                }
+
+                _val.resize(head * B * B, Val());
+
+                for(size_t i = ib * B; i < (ib + 1) * B; ++i)
+                    for(auto j = ptr[i], e = ptr[i+1]; j < e; ++j) {
+                        size_t b = blocks[static_cast<Col>(col[j] / B)];
+                        _val[b * B * B + (i % B) * B + col[j] % B] = val[j];
+                    }
+
+                _ptr[ib + 1] = static_cast<Ptr>(head);
+            }
+
+            nb = _col.size();
+
+            this->ptr = backend::device_vector<Ptr>(q[0], nbrows + 1, _ptr.data());
+
+            if (nb) {
+                this->col = backend::device_vector<Col>(q[0], nb, _col.data());
+                this->val = backend::device_vector<Val>(q[0], nb * B * B, _val.data());
+            }
+        }
+
+        // Dummy matrix; used internally to pass empty parameters to kernels.
+        bsr(const backend::command_queue &q)
+            : q(q), n(0), m(0), nb(0)
+        {}
+
+        template <class Expr>
+        friend
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            matrix_vector_product<bsr, Expr>
+        >::type
+        operator*(const bsr &A, const Expr &x) {
+            return matrix_vector_product<bsr, Expr>(A, x);
+        }
+
+        // The product is computed by a separate kernel, where each work item
+        // handles a block row. The B-wide slice of x is loaded into
+        // registers once per block and is applied to all B rows of the
+        // block. The expression kernel reads the result.
+        template <class Vector>
+        static void terminal_preamble(const Vector&, backend::source_generator&,
+            const backend::command_queue&, const std::string&,
+            detail::kernel_generator_state_ptr)
+        {}
+
+        template <class Vector>
+        static void local_terminal_init(const Vector&, backend::source_generator&,
+            const backend::command_queue&, const std::string&,
+            detail::kernel_generator_state_ptr)
+        {}
+
+        template <class Vector>
+        static void kernel_param_declaration(const Vector&, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            typedef typename product_type<Vector>::type T;
+
+            src.parameter< global_ptr<const T> >(prm_name + "_y");
+        }
+
+        template <class Vector>
+        static void partial_vector_expr(const Vector&, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            src << prm_name << "_y[idx]";
+        }
+
+        template <class Vector>
+        void kernel_arg_setter(const Vector &x,
+            backend::kernel &kernel, unsigned part, size_t index_offset,
+            detail::kernel_generator_state_ptr state) const
+        {
+            typedef typename product_type<Vector>::type T;
+
+            if (!n) {
+                kernel.push_arg(static_cast<size_t>(0));
+                return;
+            }
+
+            product_buffers &buf = product_buf.reserve(state);
+
+            const size_t bytes = n * sizeof(T);
+            if (buf.bytes < bytes) {
+                buf.bytes = bytes;
+                buf.y = backend::device_vector<char>(q, bytes);
+            }
+
+            backend::device_vector<T> y = buf.y.template reinterpret<T>();
+
+            product(x, y, part, index_offset);
+
+            kernel.push_arg(y);
+        }
+
+        template <class Vector>
+        void expression_properties(const Vector &x,
+            std::vector<backend::command_queue> &queue_list,
+            std::vector<size_t> &partition,
+            size_t &size) const
+        {
+            queue_list = std::vector<backend::command_queue>(1, q);
+            partition  = std::vector<size_t>(2, 0);
+            partition.back() = size = n;
+        }
+
+        size_t rows()     const { return n; }
+        size_t cols()     const { return m; }
+        size_t nonzeros() const { return nb * B * B; }
+
+        /// Number of nonzero blocks.
+        size_t blocks()   const { return nb; }
+    private:
+        backend::command_queue q;
+
+        size_t n, m, nb;
+
+        backend::device_vector<Ptr> ptr;
+        backend::device_vector<Col> col;
+        backend::device_vector<Val> val;
+
+        struct product_buffers {
+            product_buffers() : bytes(0) {}
+
+            size_t bytes;
+            backend::device_vector<char> y;
+        };
+
+        mutable product_buffer_pool<product_buffers> product_buf;
+
+        template <class Vector>
+        struct product_type {
+            typedef typename detail::return_type<Vector>::type x_type;
+            typedef decltype(std::declval<Val>() * std::declval<x_type>()) type;
+        };
+
+        template <class Vector, typename T>
+        void product(const Vector &x, backend::device_vector<T> &y,
+                unsigned part, size_t index_offset) const
+        {
+            using namespace vex::detail;
+
+            typedef typename detail::return_type<Vector>::type x_type;
+            typedef spmv_ops_impl<Val, x_type> spmv_ops;
+
+            static kernel_cache cache;
+
+            backend::select_context(q);
+            auto K = cache.find(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                output_terminal_preamble tp(src, q, "prm_x", empty_state());
+                boost::proto::eval(boost::proto::as_child(x), tp);
+
+                src.begin_kernel("vexcl_bsr_product");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<const Val> >("val");
+                src.template parameter< global_ptr<T> >("y");
+
+                declare_expression_parameter decl_x(src, q, "prm_x", empty_state());
+                extract_terminals()(boost::proto::as_child(x), decl_x);
+
+                src.end_kernel_parameters();
+                src.grid_stride_loop("brow", "n").open("{");
+
+                for(unsigned r = 0; r < B; ++r)
+                    spmv_ops::decl_accum_var(src, "sum" + std::to_string(r));
+
+                src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[brow], e = ptr[brow + 1]; j < e; ++j)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " c = col[j] * " << B << ";";
+                src.new_line() << type_name<Ptr>() << " v = j * " << B * B << ";";
+
+                for(unsigned k = 0; k < B; ++k) {
+                    src.new_line() << type_name<x_type>() << " x" << k << ";";
+                    src.open("{");
+                    src.new_line() << type_name<Col>() << " idx = c + " << k << ";";
+
+                    output_local_preamble init_x(src, q, "prm_x", empty_state());
+                    boost::proto::eval(boost::proto::as_child(x), init_x);
+
+                    src.new_line() << "x" << k << " = ";
+                    vector_expr_context expr_x(src, q, "prm_x", empty_state());
+                    boost::proto::eval(boost::proto::as_child(x), expr_x);
+                    src << ";";
+
+                    src.close("}");
+                }
+
+                for(unsigned r = 0; r < B; ++r)
+                    for(unsigned k = 0; k < B; ++k)
+                        spmv_ops::append_product(src, "sum" + std::to_string(r),
+                                "val[v + " + std::to_string(r * B + k) + "]",
+                                "x" + std::to_string(k));
+
+                src.close("}");
+
+                for(unsigned r = 0; r < B; ++r)
+                    src.new_line() << "y[brow * " << B << " + " << r << "] = sum" << r << ";";
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_bsr_product"));
+            }
+
+            auto &krn = K->second;
+
+            krn.push_arg(n / B);
+            if (nb) {
+                krn.push_arg(ptr);
+                krn.push_arg(col);
+                krn.push_arg(val);
+            } else {
+                krn.push_arg(ptr);
+                krn.push_arg(static_cast<size_t>(0));
+                krn.push_arg(static_cast<size_t>(0));
+            }
+            krn.push_arg(y);
+
+            set_expression_argument x_args(krn, part, index_offset, empty_state());
+            extract_terminals()(boost::proto::as_child(x), x_args);
+
+            krn(q);
+        }
+};
+
+} // namespace sparse
+} // namespace vex
+
+#endif
@@ -0,0 +1,183 @@
+#ifndef VEXCL_SPARSE_COO_HPP
+#define VEXCL_SPARSE_COO_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/coo.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Conversion of device-resident COO triplets to CSR format.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/cast.hpp>
+#include <vexcl/sort.hpp>
+#include <vexcl/reduce_by_key.hpp>
+
+namespace vex {
+namespace detail {
+
+// Splits the sorted unique (row * ncols + col) keys into the row pointer
+// (found with a binary search for the first key of each row) and the column
+// indices.
+template <typename Col, typename Ptr>
+backend::kernel& coo_compress_kernel(const backend::command_queue &q) {
+    static kernel_cache cache;
+
+    auto K = cache.find(q);
+    if (K == cache.end()) {
+        backend::source_generator src(q);
+
+        src.begin_kernel("vexcl_coo_compress");
+        src.begin_kernel_parameters();
+        src.template parameter<size_t>("n");
+        src.template parameter<size_t>("nrows");
+        src.template parameter<cl_ulong>("m");
+        src.template parameter<size_t>("nnz");
+        src.template parameter< global_ptr<const cl_ulong> >("key");
+        src.template parameter< global_ptr<Ptr> >("ptr");
+        src.template parameter< global_ptr<Col> >("col");
+        src.end_kernel_parameters();
+        src.grid_stride_loop().open("{");
+        src.new_line() << "if (idx <= nrows)";
+        src.open("{");
+        src.new_line() << type_name<cl_ulong>() << " k = idx * m;";
+        src.new_line() << "size_t lo = 0, hi = nnz;";
+        src.new_line() << "while(lo < hi)";
+        src.open("{");
+        src.new_line() << "size_t mid = (lo + hi) / 2;";
+        src.new_line() << "if (key[mid] < k) lo = mid + 1; else hi = mid;";
+        src.close("}");
+        src.new_line() << "ptr[idx] = lo;";
+        src.close("}");
+        src.new_line() << "if (idx < nnz) col[idx] = key[idx] % m;";
+        src.close("}");
+        src.end_kernel();
+
+        K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_coo_compress"));
+    }
+
+    return K->second;
+}
+
+// Builds CSR arrays from the (row * ncols + col) keys and the values.
+// The keys and the values are sorted in place, duplicates are summed up.
+template <typename Val, typename Col, typename Ptr>
+void keys_to_csr(const backend::command_queue &q, size_t nrows, cl_ulong ncols,
+        vector<cl_ulong> &key, vector<Val> &val,
+        vector<Ptr> &ptr, vector<Col> &col, vector<Val> &uval)
+{
+    std::vector<backend::command_queue> ctx(1, q);
+
+    if (ptr.size() != nrows + 1) ptr.resize(ctx, nrows + 1);
+
+    if (!key.size()) {
+        ptr = 0;
+        col.clear();
+        uval.clear();
+        return;
+    }
+
+    sort_by_key(key, val);
+
+    vector<cl_ulong> ukey;
+    const size_t nnz = reduce_by_key(key, val, ukey, uval);
+
+    precondition(nnz <= static_cast<size_t>(std::numeric_limits<Ptr>::max()),
+            "The number of nonzeros exceeds the range of the row pointer type");
+
+    col.resize(ctx, nnz);
+
+    auto &K = coo_compress_kernel<Col, Ptr>(q);
+
+    K.push_arg(std::max(nrows + 1, nnz));
+    K.push_arg(nrows);
+    K.push_arg(ncols);
+    K.push_arg(nnz);
+    K.push_arg(ukey(0));
+    K.push_arg(ptr(0));
+    K.push_arg(col(0));
+    K(q);
+}
+
+} // namespace detail
+
+namespace sparse {
+
+/// Converts a sparse matrix in COO format to CSR format on the device.
+/**
+ * The triplets may come in any order; duplicate entries are summed up. The
+ * triplets are sorted by (row, column) with vex::sort_by_key() and the
+ * duplicates are combined with vex::reduce_by_key(), so no data is
+ * transferred to the host. The result may be used to construct a matrix in
+ * CSR or ELL format directly on the device:
+ *
+ \code
+ vex::vector<int> ptr, col;
+ vex::vector<double> val;
+ vex::sparse::coo_to_csr(n, m, I, J, V, ptr, col, val);
+
+ vex::sparse::csr<double> A(n, m, ptr, col, val);
+ \endcode
+ *
+ * The input vectors should be allocated on a single device.
+ */
+template <typename Idx, typename Val, typename Col, typename Ptr>
+void coo_to_csr(size_t nrows, size_t ncols,
+        const vector<Idx> &row, const vector<Idx> &col, const vector<Val> &val,
+        vector<Ptr> &ptr, vector<Col> &csr_col, vector<Val> &csr_val)
+{
+    precondition(row.nparts() == 1,
+            "sparse::coo_to_csr is only supported for single-device contexts");
+    precondition(col.size() == row.size() && val.size() == row.size(),
+            "Inconsistent COO arrays");
+
+    const cl_ulong m = ncols;
+
+    vector<cl_ulong> key;
+    vector<Val>      tmp;
+
+    if (row.size()) {
+        key.resize(row.queue_list(), row.size());
+        tmp.resize(row.queue_list(), row.size());
+
+        key = cast<cl_ulong>(row) * m + col;
+        tmp = val;
+    }
+
+    vex::detail::keys_to_csr(row.queue_list()[0], nrows, m, key, tmp, ptr, csr_col, csr_val);
+}
+
+} // namespace sparse
+} // namespace vex
+
+#endif
@@ -32,18 +32,36 @@ THE SOFTWARE.
  */
 
 #include <vector>
+#include <memory>
+#include <algorithm>
 #include <type_traits>
 #include <utility>
 
 #include <boost/range.hpp>
+#include <boost/mpl/identity.hpp>
 #include <vexcl/util.hpp>
 #include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/element_index.hpp>
+#include <vexcl/sort.hpp>
 #include <vexcl/sparse/product.hpp>
 #include <vexcl/sparse/spmv_ops.hpp>
+#include <vexcl/sparse/transposed.hpp>
 
 namespace vex {
 namespace sparse {
 
+/// Sparse matrix in CSR format.
+/**
+ * On CPU devices (including the JIT backend) the matrix checks at setup
+ * whether the default row-wise split of the product between the workgroups
+ * would be imbalanced with respect to the number of nonzeros (as is the case
+ * for power-law graphs or matrices with a few dense rows). If so, the row
+ * pointer is split into chunks of equal work along the merge path of rows and
+ * nonzeros, and the product is computed by a separate nnz-balanced kernel with
+ * a fixup of the rows that cross the chunk boundaries. The chunk boundaries
+ * are computed only once, in the constructor.
+ */
 template <typename Val, typename Col = int, typename Ptr = Col>
 class csr {
     public:
@@ -62,20 +80,42 @@ class csr {
                 const ValRange &val,
                 bool fast_setup = true
            )
-            : q(q[0]), n(nrows), m(ncols), nnz(boost::size(val)),
+            : q(q[0]), n(nrows), m(ncols), nnz(boost::size(val)), nchunks(0),
               ptr(q[0], boost::size(ptr), &ptr[0]),
               col(q[0], boost::size(col), &col[0]),
               val(q[0], boost::size(val), &val[0])
         {
             precondition(q.size() == 1,
                     "sparse::csr is only supported for single-device contexts");
+
+            if (is_cpu(q[0])) setup_merge_path(ptr);
         }
 
+        /// Constructs the matrix from CSR arrays that reside on the device.
+        /**
+         * The matrix does not share any buffers with the given vectors: the
+         * arrays are copied on the device, so the vectors may be modified or
+         * released afterwards, and update_values() does not change them.
+         */
+        csr(size_t nrows, size_t ncols,
+                const vector<Ptr> &ptr,
+                const vector<Col> &col,
+                const vector<Val> &val
+           )
+            : csr(nrows, ncols, ptr, col, val, true)
+        {}
+
         // Dummy matrix; used internally to pass empty parameters to kernels.
         csr(const backend::command_queue &q)
-            : q(q), n(0), m(0), nnz(0)
+            : q(q), n(0), m(0), nnz(0), nchunks(0)
         {}
 
+        template <typename V, typename C, typename P>
+        friend csr<V, C, P> multiply(const csr<V, C, P>&, const csr<V, C, P>&);
+
+        template <typename V, typename C, typename P>
+        friend class triangular_solve;
+
         template <class Expr>
         friend
         typename std::enable_if<
@@ -89,6 +129,16 @@ class csr {
             return matrix_vector_product<csr, Expr>(A, x);
         }
 
+        template <class MV>
+        friend
+        typename std::enable_if<
+            std::is_base_of<multivector_terminal_expression, MV>::value,
+            matrix_multivector_product<csr, MV>
+        >::type
+        operator*(const csr &A, const MV &x) {
+            return matrix_multivector_product<csr, MV>(A, x);
+        }
+
         template <class Vector>
         static void terminal_preamble(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
@@ -98,16 +148,26 @@ class csr {
             boost::proto::eval(boost::proto::as_child(x), tp);
         }
 
-        template <class Vector>
+        // The low-level operations are a template parameter of the hooks,
+        // so that the product may be computed over a semiring (see
+        // vex::sparse::semiring_view).
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
         static void local_terminal_init(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
         {
-            typedef typename detail::return_type<Vector>::type x_type;
-            typedef spmv_ops_impl<Val, x_type> spmv_ops;
-
             spmv_ops::decl_accum_var(src, prm_name + "_sum");
-            src.new_line() << "if (" << prm_name << "_ptr)";
+
+            if (merge_path_spmv<Vector, spmv_ops>::value) {
+                src.new_line() << "if (" << prm_name << "_Ax)";
+                src.new_line() << "  " << prm_name << "_sum = " << prm_name << "_Ax[idx];";
+                src.new_line() << "else ";
+            } else {
+                src.new_line();
+            }
+            src << "if (" << prm_name << "_ptr)";
             src.open("{");
             src.new_line() << type_name<Ptr>() << " row_beg = " << prm_name << "_ptr[idx];";
             src.new_line() << type_name<Ptr>() << " row_end = " << prm_name << "_ptr[idx+1];";
@@ -131,7 +191,9 @@ class csr {
             src.close("}");
         }
 
-        template <class Vector>
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
         static void kernel_param_declaration(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
@@ -140,6 +202,9 @@ class csr {
             src.parameter< global_ptr<Col> >(prm_name + "_col");
             src.parameter< global_ptr<Val> >(prm_name + "_val");
 
+            if (merge_path_spmv<Vector, spmv_ops>::value)
+                src.parameter< global_ptr<const typename merge_path_spmv<Vector>::type> >(prm_name + "_Ax");
+
             detail::declare_expression_parameter decl_x(src, q, prm_name + "_x", state);
             detail::extract_terminals()(boost::proto::as_child(x), decl_x);
         }
@@ -152,7 +217,9 @@ class csr {
             src << prm_name << "_sum";
         }
 
-        template <class Vector>
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
         void kernel_arg_setter(const Vector &x,
             backend::kernel &kernel, unsigned part, size_t index_offset,
             detail::kernel_generator_state_ptr state) const
@@ -167,6 +234,9 @@ class csr {
                 kernel.push_arg(static_cast<size_t>(0));
             }
 
+            push_merge_path_product(x, kernel, state,
+                    std::integral_constant<bool, merge_path_spmv<Vector, spmv_ops>::value>());
+
             detail::set_expression_argument x_args(kernel, part, index_offset, state);
             detail::extract_terminals()( boost::proto::as_child(x), x_args);
         }
@@ -182,17 +252,475 @@ class csr {
             partition.back() = size = n;
         }
 
+        /// Sparse matrix - multivector product.
+        /**
+         * Computes y = scale * A * x, or y += scale * A * x when append is
+         * set. Used by the multivector expressions (e.g. Y = A * X).
+         */
+        template <class MV>
+        void apply(const MV &x, MV &y,
+                typename cl_scalar_of<typename MV::sub_value_type>::type scale,
+                bool append = false) const
+        {
+            using namespace vex::detail;
+            typedef spmm_source<Val, MV> spmm;
+
+            spmm::check(x, y, rows(), cols());
+
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            backend::select_context(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_csr_spmm");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<const Val> >("val");
+                spmm::parameters(src);
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                spmm::begin_row(src);
+                src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[idx], e = ptr[idx+1]; j < e; ++j)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " c = col[j];";
+                spmm::nonzero(src, "val[j]", "c");
+                src.close("}");
+                spmm::end_row(src);
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_csr_spmm"));
+            }
+
+            K->second.push_arg(n);
+            K->second.push_arg(ptr);
+            if (nnz) {
+                K->second.push_arg(col);
+                K->second.push_arg(val);
+            } else {
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+            }
+            spmm::set_arguments(K->second, x, y, scale, append);
+
+            K->second(q);
+        }
+
         size_t rows()     const { return n; }
         size_t cols()     const { return m; }
         size_t nonzeros() const { return nnz; }
+
+        /// Whether the product is computed with the nnz-balanced kernel.
+        bool balanced() const { return nchunks > 0; }
+
+        /// Replaces the values of the nonzeros, keeping the sparsity pattern.
+        /**
+         * The values should be given in the order of the column indices the
+         * matrix was constructed with.
+         */
+        template <class ValRange>
+        void update_values(const ValRange &v) {
+            precondition(static_cast<size_t>(boost::size(v)) == nnz,
+                    "Wrong number of values");
+
+            if (nnz) val.write(q, 0, nnz, &v[0], true);
+        }
+
+        /// Replaces the values of the nonzeros with the values on the device.
+        void update_values(const vector<Val> &v) {
+            precondition(v.size() == nnz, "Wrong number of values");
+
+            if (!nnz) return;
+
+            vector<Val> dst(q, val);
+            dst = v;
+        }
+
+        /// Transposed matrix.
+        /**
+         * Returns a view that may be used in products (y = A.transposed() * x).
+         * The column-wise structure of the matrix is built on the device on
+         * first use and is cached afterwards; the values are shared with the
+         * matrix.
+         */
+        const csr_transposed<Val, Col, Ptr>& transposed() const {
+            if (!At) build_transposed();
+            return *At;
+        }
     private:
         backend::command_queue q;
 
-        size_t n, m, nnz;
+        size_t n, m, nnz, nchunks;
+
+        // The arrays are copied unless they were created for the matrix
+        // (see sparse::multiply()).
+        csr(size_t nrows, size_t ncols,
+                const vector<Ptr> &ptr,
+                const vector<Col> &col,
+                const vector<Val> &val,
+                bool copy_input
+           )
+            : q(ptr.queue_list()[0]), n(nrows), m(ncols), nnz(val.size()), nchunks(0)
+        {
+            precondition(ptr.nparts() == 1,
+                    "sparse::csr is only supported for single-device contexts");
+            precondition(ptr.size() == n + 1 && col.size() == nnz,
+                    "Inconsistent CSR arrays");
+
+            this->ptr = copy_input ? device_copy(ptr) : ptr(0);
+
+            if (nnz) {
+                this->col = copy_input ? device_copy(col) : col(0);
+                this->val = copy_input ? device_copy(val) : val(0);
+            }
+
+            if (is_cpu(q)) {
+                std::vector<Ptr> host_ptr(n + 1);
+                vex::copy(ptr, host_ptr);
+                setup_merge_path(host_ptr);
+            }
+        }
+
+        template <typename T>
+        static backend::device_vector<T> device_copy(const vector<T> &src) {
+            const backend::command_queue &q = src.queue_list()[0];
+
+            backend::device_vector<T> dst(q, src.size());
+
+            vector<T> d(q, dst);
+            d = src;
+
+            return dst;
+        }
 
         backend::device_vector<Ptr> ptr;
         backend::device_vector<Col> col;
         backend::device_vector<Val> val;
+
+        // Merge path coordinates (row, nonzero) of the chunk boundaries.
+        backend::device_vector<Ptr> path_row;
+        backend::device_vector<Ptr> path_nz;
+
+        // Product results and partial sums of the rows crossing chunk
+        // boundaries.
+        struct merge_path_buffers {
+            merge_path_buffers() : bytes(0) {}
+
+            size_t bytes;
+            backend::device_vector<char> Ax;
+            backend::device_vector<char> carry;
+        };
+
+        mutable product_buffer_pool<merge_path_buffers> merge_buf;
+
+        mutable std::shared_ptr< csr_transposed<Val, Col, Ptr> > At;
+
+        // The nnz-balanced product is only supported for arithmetic types
+        // and the default operations, since the fixup has to add up the
+        // partial row sums.
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
+        struct merge_path_spmv {
+            typedef typename detail::return_type<Vector>::type x_type;
+
+            static const bool value =
+                std::is_arithmetic<Val>::value && std::is_arithmetic<x_type>::value &&
+                std::is_same<spmv_ops, spmv_ops_impl<Val, x_type> >::value;
+
+            typedef typename std::conditional<value,
+                    std::common_type<Val, x_type>,
+                    boost::mpl::identity<Val>
+                >::type::type type;
+        };
+
+        template <class PtrRange>
+        void setup_merge_path(const PtrRange &host_ptr) {
+            const size_t nwg = backend::kernel::num_workgroups(q);
+
+            if (n < nwg || nnz < nwg) return;
+
+            // Find the heaviest chunk of the default row-wise split.
+            const size_t chunk_size = (n + nwg - 1) / nwg;
+            size_t max_nnz = 0;
+            for(size_t beg = 0; beg < n; beg += chunk_size) {
+                size_t end = std::min(n, beg + chunk_size);
+                max_nnz = std::max(max_nnz, static_cast<size_t>(host_ptr[end] - host_ptr[beg]));
+            }
+
+            // Rows are balanced well enough, no need for the merge path.
+            if (max_nnz * nwg < 2 * nnz) return;
+
+            nchunks = nwg;
+
+            // Split the merge path of the row ends and the nonzero indices
+            // into chunks of equal length.
+            const size_t path_len = n + nnz;
+            const size_t diag_len = (path_len + nchunks - 1) / nchunks;
+
+            std::vector<Ptr> prow(nchunks + 1);
+            std::vector<Ptr> pnz (nchunks + 1);
+
+            for(size_t c = 0; c <= nchunks; ++c) {
+                size_t diag = std::min(path_len, c * diag_len);
+
+                size_t lo = diag > nnz ? diag - nnz : 0;
+                size_t hi = std::min(diag, n);
+
+                while(lo < hi) {
+                    size_t mid = (lo + hi) / 2;
+                    if (static_cast<size_t>(host_ptr[mid + 1]) <= diag - 1 - mid)
+                        lo = mid + 1;
+                    else
+                        hi = mid;
+                }
+
+                prow[c] = static_cast<Ptr>(lo);
+                pnz [c] = static_cast<Ptr>(diag - lo);
+            }
+
+            path_row = backend::device_vector<Ptr>(q, nchunks + 1, prow.data());
+            path_nz  = backend::device_vector<Ptr>(q, nchunks + 1, pnz.data());
+        }
+
+        template <class Vector>
+        void push_merge_path_product(const Vector&, backend::kernel &kernel,
+                detail::kernel_generator_state_ptr, std::false_type) const
+        { }
+
+        template <class Vector>
+        void push_merge_path_product(const Vector &x, backend::kernel &kernel,
+                detail::kernel_generator_state_ptr state, std::true_type) const
+        {
+            typedef typename merge_path_spmv<Vector>::type T;
+
+            if (!nchunks) {
+                kernel.push_arg(static_cast<size_t>(0));
+                return;
+            }
+
+            merge_path_buffers &buf = merge_buf.reserve(state);
+
+            if (buf.bytes < sizeof(T)) {
+                buf.bytes = sizeof(T);
+                buf.Ax    = backend::device_vector<char>(q, n * sizeof(T));
+                buf.carry = backend::device_vector<char>(q, nchunks * sizeof(T));
+            }
+
+            backend::device_vector<T> Ax    = buf.Ax.template reinterpret<T>();
+            backend::device_vector<T> carry = buf.carry.template reinterpret<T>();
+
+            merge_path_product(x, Ax, carry);
+
+            kernel.push_arg(Ax);
+        }
+
+        template <class Vector, typename T>
+        void merge_path_product(const Vector &x,
+                backend::device_vector<T> &Ax, backend::device_vector<T> &carry) const
+        {
+            using namespace vex::detail;
+            typedef spmv_ops_impl<Val, typename detail::return_type<Vector>::type> spmv_ops;
+
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            backend::select_context(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                output_terminal_preamble otp(src, q, "prm_x", empty_state());
+                boost::proto::eval(boost::proto::as_child(x), otp);
+
+                src.begin_kernel("vexcl_csr_merge_path_spmv");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter< global_ptr<const Ptr> >("path_row");
+                src.template parameter< global_ptr<const Ptr> >("path_nz");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<const Val> >("val");
+                src.template parameter< global_ptr<T> >("Ax");
+                src.template parameter< global_ptr<T> >("carry");
+
+                extract_terminals()(boost::proto::as_child(x),
+                        declare_expression_parameter(src, q, "prm_x", empty_state()));
+
+                src.end_kernel_parameters();
+                src.grid_stride_loop("chunk", "n").open("{");
+
+                src.new_line() << type_name<Ptr>() << " row = path_row[chunk];";
+                src.new_line() << type_name<Ptr>() << " row_end = path_row[chunk + 1];";
+                src.new_line() << type_name<Ptr>() << " j = path_nz[chunk];";
+                src.new_line() << type_name<Ptr>() << " j_end = path_nz[chunk + 1];";
+
+                // Rows that end within the chunk.
+                src.new_line() << "for(; row < row_end; ++row)";
+                src.open("{");
+                spmv_ops::decl_accum_var(src, "sum");
+                src.new_line() << "for(" << type_name<Ptr>() << " e = ptr[row + 1]; j < e; ++j)";
+                src.open("{");
+                merge_path_append(x, src, spmv_ops());
+                src.close("}");
+                src.new_line() << "Ax[row] = sum;";
+                src.close("}");
+
+                // Partial sum of the row that continues into the next chunk.
+                src.open("{");
+                spmv_ops::decl_accum_var(src, "sum");
+                src.new_line() << "for(; j < j_end; ++j)";
+                src.open("{");
+                merge_path_append(x, src, spmv_ops());
+                src.close("}");
+                src.new_line() << "carry[chunk] = sum;";
+                src.close("}");
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_csr_merge_path_spmv"));
+            }
+
+            K->second.push_arg(nchunks);
+            K->second.push_arg(path_row);
+            K->second.push_arg(path_nz);
+            K->second.push_arg(ptr);
+            K->second.push_arg(col);
+            K->second.push_arg(val);
+            K->second.push_arg(Ax);
+            K->second.push_arg(carry);
+
+            extract_terminals()(boost::proto::as_child(x),
+                    set_expression_argument(K->second, 0, 0, empty_state()));
+
+            K->second.config(nchunks, 1);
+            K->second(q);
+
+            merge_path_fixup(Ax, carry);
+        }
+
+        template <class Vector, class spmv_ops>
+        void merge_path_append(const Vector &x, backend::source_generator &src, spmv_ops) const {
+            using namespace vex::detail;
+
+            src.new_line() << type_name<Col>() << " idx = col[j];";
+
+            output_local_preamble init_x(src, q, "prm_x", empty_state());
+            boost::proto::eval(boost::proto::as_child(x), init_x);
+
+            backend::source_generator vec_value;
+            vector_expr_context expr_x(vec_value, q, "prm_x", empty_state());
+            boost::proto::eval(boost::proto::as_child(x), expr_x);
+
+            spmv_ops::append_product(src, "sum", "val[j]", vec_value.str());
+        }
+
+        // Adds partial sums of the rows crossing the chunk boundaries.
+        // The kernel is launched with a single thread to avoid races on
+        // rows spanning several chunks.
+        template <typename T>
+        void merge_path_fixup(backend::device_vector<T> &Ax, backend::device_vector<T> &carry) const {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_csr_merge_path_fixup");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<size_t>("nrows");
+                src.template parameter< global_ptr<const Ptr> >("path_row");
+                src.template parameter< global_ptr<T> >("Ax");
+                src.template parameter< global_ptr<const T> >("carry");
+                src.end_kernel_parameters();
+                src.grid_stride_loop("chunk", "n").open("{");
+                src.new_line() << type_name<Ptr>() << " row = path_row[chunk + 1];";
+                src.new_line() << "if (row < nrows) Ax[row] += carry[chunk];";
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_csr_merge_path_fixup"));
+            }
+
+            K->second.push_arg(nchunks);
+            K->second.push_arg(n);
+            K->second.push_arg(path_row);
+            K->second.push_arg(Ax);
+            K->second.push_arg(carry);
+
+            K->second.config(1, 1);
+            K->second(q);
+        }
+
+        // Sorts the nonzeros by column (along with their row indices and
+        // positions in the value array) to get the column-wise structure.
+        void build_transposed() const {
+            std::vector<backend::command_queue> ctx(1, q);
+
+            vector<Col> c, r;
+            vector<Ptr> p;
+
+            if (nnz) {
+                // Sort a copy, the column indices of the matrix are kept
+                // intact.
+                const vector<Col> Acol(q, col, nnz);
+
+                c.resize(ctx, nnz);
+                r.resize(ctx, nnz);
+                p.resize(ctx, nnz);
+
+                c = Acol;
+                p = element_index();
+
+                auto &K = transpose_kernel();
+
+                K.push_arg(n);
+                K.push_arg(ptr);
+                K.push_arg(r(0));
+                K(q);
+            }
+
+            At = std::make_shared< csr_transposed<Val, Col, Ptr> >(
+                    q, m, n, c, r, p, val);
+        }
+
+        // Row index of each nonzero.
+        backend::kernel& transpose_kernel() const {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_csr_row_index");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<Col> >("row");
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+                src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[idx], e = ptr[idx+1]; j < e; ++j)";
+                src.new_line() << "  row[j] = idx;";
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_csr_row_index"));
+            }
+
+            return K->second;
+        }
 };
 
 } // namespace sparse
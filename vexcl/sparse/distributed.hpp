@@ -8,23 +8,27 @@
 #include <vexcl/util.hpp>
 #include <vexcl/backend.hpp>
 #include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
 #include <vexcl/sparse/product.hpp>
 #include <vexcl/sparse/spmv_ops.hpp>
 
 namespace vex {
 namespace sparse {
 
-/// Value-type of a vector corresponding to the matrix with value-type T.
-template <class T, class Enable = void>
-struct rhs_of {
-    typedef T type;
-};
-
 template <class Matrix, typename rhs_type = typename rhs_of<typename Matrix::val_type>::type>
 class distributed {
     public:
         typedef typename Matrix::value_type value_type;
 
+        // Buffers of a single product: the ghost values of the vector on
+        // each device and, when the exchange is overlapped with the local
+        // part of the product, the result of the local part.
+        struct product_buffers {
+            std::vector< backend::device_vector<rhs_type> > rem_x;
+            std::vector< backend::device_vector<rhs_type> > loc_y;
+            std::vector< std::vector<rhs_type> > vals_to_recv;
+        };
+
         template <class PtrRange, class ColRange, class ValRange>
         distributed(
                 const std::vector<backend::command_queue> &q,
@@ -36,15 +40,24 @@ class distributed {
            )
             : q(q), n(nrows), m(ncols), nnz(boost::size(val)),
               row_part(partition(n, q)), col_part(partition(m, q)),
-              A_loc(q.size()), A_rem(q.size())
+              A_loc(q.size()), A_rem(q.size()), shared(false)
         {
             if (q.size() == 1) {
                 A_loc[0] = std::make_shared<Matrix>(q, nrows, ncols, ptr, col, val, fast_setup);
                 return;
             }
 
+            // Devices that may access each other's buffers exchange the
+            // ghost values directly, without staging them on the host.
+            shared = backend::shared_memory_access(q);
+
             std::vector<std::vector<col_type>> rcols(q.size());
 
+            nz_part.resize(q.size() + 1);
+            loc_mask.resize(q.size());
+            for(size_t d = 0; d <= q.size(); ++d)
+                nz_part[d] = ptr[row_part[d]];
+
 #ifdef _OPENMP
 #  pragma omp parallel for schedule(static,1)
 #endif
@@ -85,12 +98,15 @@ class distributed {
                 std::vector<col_type> rem_col; rem_col.reserve(rem_nnz);
                 std::vector<val_type> rem_val; rem_val.reserve(rem_nnz);
 
+                loc_mask[d].resize(loc_nnz + rem_nnz);
+
                 for(size_t i = row_part[d], ii = 0; i < row_part[d+1]; ++i, ++ii) {
                     for(ptr_type j = ptr[i]; j < ptr[i+1]; ++j) {
                         col_type c = col[j];
                         val_type v = val[j];
 
                         if (col_beg <= c && c < col_end) {
+                            loc_mask[d][j - nz_part[d]] = true;
                             loc_col.push_back(c - col_beg);
                             loc_val.push_back(v);
                         } else {
@@ -176,8 +192,9 @@ class distributed {
                 size_t nrecv = rcols[d].size();
                 if (!nrecv) continue;
 
-                ex[d].vals_to_recv.resize(nrecv);
-                ex[d].rem_x = backend::device_vector<rhs_type>(q[d], nrecv);
+                // Local part of the product is computed separately while the
+                // ghost values are in transit.
+                ex[d].overlap = A_loc[d] && !shared;
 
                 // See where in rem_vals each element of rcols[d] is placed.
                 ex[d].cols_to_recv.reserve(nrecv);
@@ -187,6 +204,10 @@ class distributed {
                     assert(*rc == *c);
                     ex[d].cols_to_recv.push_back(static_cast<col_type>(std::distance(rem_cols.begin(), rc)));
                 }
+
+                if (shared)
+                    ex[d].recv_cols = backend::device_vector<col_type>(q[d], nrecv,
+                            ex[d].cols_to_recv.data());
             }
 
             // See what elements of rem_vals each GPU needs to send:
@@ -206,13 +227,24 @@ class distributed {
                 size_t nsend = rval_ptr[d+1] - rval_ptr[d];
 
                 if (nsend) {
-                    ex[d].vals_to_send = backend::device_vector<rhs_type>(q[d], nsend);
+                    if (!shared)
+                        ex[d].vals_to_send = backend::device_vector<rhs_type>(q[d], nsend);
                     ex[d].cols_to_send = backend::device_vector<col_type>(q[d], nsend,
                             &rem_cols[rval_ptr[d]]);
                 }
             }
 
+            if (shared) {
+                if (!rem_cols.empty())
+                    rem_buf = backend::device_vector<rhs_type>(q[0], rem_cols.size());
+                return;
+            }
+
             rem_vals.resize(rem_cols.size());
+
+            // Secondary queues for the ghost transfers.
+            for(size_t d = 0; d < q.size(); ++d)
+                squeue.push_back(backend::duplicate_queue(q[d]));
         }
 
         template <class Expr>
@@ -225,8 +257,14 @@ class distributed {
             matrix_vector_product<distributed, Expr>
         >::type
         operator*(const distributed &A, const Expr &x) {
-            A.exchange(x);
-            return matrix_vector_product<distributed, Expr>(A, x);
+            std::shared_ptr<product_buffers> buf;
+
+            if (A.q.size() > 1) {
+                buf = A.reserve_buffers();
+                A.exchange(x, *buf);
+            }
+
+            return matrix_vector_product<distributed, Expr>(A, x, buf);
         }
 
         template <class Vector>
@@ -253,7 +291,8 @@ class distributed {
             Matrix::local_terminal_init(x,     src, q, prm_name + "_loc", state);
             Matrix::local_terminal_init(dummy, src, q, prm_name + "_rem", state);
 
-            src.new_line() << type_name<rhs_type>() << " " << prm_name << "_sum = ";
+            src.new_line() << type_name<rhs_type>() << " " << prm_name << "_sum = "
+                << prm_name << "_loc_y ? " << prm_name << "_loc_y[idx] : ";
             Matrix::partial_vector_expr(x, src, q, prm_name + "_loc", state);
             src << ";";
 
@@ -269,6 +308,8 @@ class distributed {
         {
             vex::vector<rhs_type> dummy;
 
+            src.parameter< global_ptr<const rhs_type> >(prm_name + "_loc_y");
+
             Matrix::kernel_param_declaration(x,     src, q, prm_name + "_loc", state);
             Matrix::kernel_param_declaration(dummy, src, q, prm_name + "_rem", state);
         }
@@ -282,24 +323,35 @@ class distributed {
         }
 
         template <class Vector>
-        void kernel_arg_setter(const Vector &x,
+        void kernel_arg_setter(const Vector &x, const product_buffers *buf,
             backend::kernel &kernel, unsigned part, size_t index_offset,
             detail::kernel_generator_state_ptr state) const
         {
-            if (A_loc[part]) {
+            // The local part is already computed by exchange() when the
+            // part needs ghost values.
+            bool loc_done = q.size() > 1 && ex[part].overlap;
+
+            if (loc_done)
+                kernel.push_arg(buf->loc_y[part]);
+            else
+                kernel.push_arg(static_cast<size_t>(0));
+
+            if (A_loc[part] && !loc_done) {
                 A_loc[part]->kernel_arg_setter(x, kernel, part, index_offset, state);
             } else {
                 Matrix dummy_A(q[part]);
-                backend::device_vector<rhs_type> dummy_x;
-                dummy_A.kernel_arg_setter(dummy_x, kernel, part, index_offset, state);
+                dummy_A.kernel_arg_setter(x, kernel, part, index_offset, state);
             }
 
+            // Ghost values are wrapped into a single-device vector to match
+            // the parameter declaration.
             if (A_rem[part]) {
-                A_rem[part]->kernel_arg_setter(ex[part].rem_x, kernel, part, index_offset, state);
+                vex::vector<rhs_type> rem_x(q[part], buf->rem_x[part]);
+                A_rem[part]->kernel_arg_setter(rem_x, kernel, 0, 0, state);
             } else {
                 Matrix dummy_A(q[part]);
-                backend::device_vector<rhs_type> dummy_x;
-                dummy_A.kernel_arg_setter(dummy_x, kernel, part, index_offset, state);
+                vex::vector<rhs_type> dummy_x(q[part], backend::device_vector<rhs_type>(), 1);
+                dummy_A.kernel_arg_setter(dummy_x, kernel, 0, 0, state);
             }
         }
 
@@ -317,34 +369,130 @@ class distributed {
         size_t rows()     const { return n;   }
         size_t cols()     const { return m;   }
         size_t nonzeros() const { return nnz; }
+
+        /// Replaces the values of the nonzeros, keeping the sparsity pattern.
+        /**
+         * The values should be given in the order of the column indices the
+         * matrix was constructed with. The split into the local and remote
+         * parts and the ghost exchange setup are reused; the local and
+         * remote matrices on each device only rewrite their values.
+         */
+        template <class ValRange>
+        void update_values(const ValRange &v) {
+            precondition(static_cast<size_t>(boost::size(v)) == nnz,
+                    "Wrong number of values");
+
+            if (q.size() == 1) {
+                A_loc[0]->update_values(v);
+                return;
+            }
+
+#ifdef _OPENMP
+#  pragma omp parallel for schedule(static,1)
+#endif
+            for(int d = 0; d < static_cast<int>(q.size()); ++d) {
+                std::vector<typename Matrix::val_type> loc_val, rem_val;
+
+                for(size_t j = nz_part[d], k = 0; j < nz_part[d+1]; ++j, ++k) {
+                    if (loc_mask[d][k])
+                        loc_val.push_back(v[j]);
+                    else
+                        rem_val.push_back(v[j]);
+                }
+
+                if (A_loc[d]) A_loc[d]->update_values(loc_val);
+                if (A_rem[d]) A_rem[d]->update_values(rem_val);
+            }
+        }
+
+        /// Replaces the values of the nonzeros with the values on the device.
+        /**
+         * With multiple devices the values are split into the local and
+         * remote parts on the host.
+         */
+        void update_values(const vector<typename Matrix::val_type> &v) {
+            precondition(v.size() == nnz, "Wrong number of values");
+
+            if (q.size() == 1) {
+                A_loc[0]->update_values(v);
+                return;
+            }
+
+            std::vector<typename Matrix::val_type> host_val(nnz);
+            vex::copy(v, host_val);
+            update_values(host_val);
+        }
     private:
         typedef typename Matrix::ptr_type       ptr_type;
         typedef typename Matrix::col_type       col_type;
         typedef typename Matrix::val_type       val_type;
 
+        // Range of the nonzeros of each device strip, and whether each of the
+        // nonzeros belongs to the local part of the strip.
+        std::vector<size_t> nz_part;
+        std::vector<std::vector<char>> loc_mask;
+
         mutable std::vector<backend::command_queue> q;
+        mutable std::vector<backend::command_queue> squeue;
 
         size_t n, m, nnz;
         std::vector<size_t> row_part, col_part;
         std::vector<std::shared_ptr<Matrix>> A_loc, A_rem;
 
         mutable std::vector<rhs_type> rem_vals;
+
+        // Combined ghost vector for devices with shared memory access.
+        bool shared;
+        mutable backend::device_vector<rhs_type> rem_buf;
         std::vector<size_t>   rval_ptr;
 
         struct exdata {
+            exdata() : overlap(false) {}
+
+            bool overlap;
+
             std::vector<col_type> cols_to_recv;
-            mutable std::vector<rhs_type> vals_to_recv;
 
             backend::device_vector<col_type> cols_to_send;
             mutable backend::device_vector<rhs_type> vals_to_send;
 
-            mutable backend::device_vector<rhs_type> rem_x;
+            backend::device_vector<col_type> recv_cols;
         };
 
         std::vector<exdata> ex;
 
+        // Buffers of the products. A product keeps its buffers reserved
+        // until the expression holding it is destroyed. The exchange orders
+        // the transfers into reused buffers after the kernels that read them.
+        mutable product_buffer_pool<product_buffers> product_buf;
+
+        std::shared_ptr<product_buffers> reserve_buffers() const {
+            std::shared_ptr<product_buffers> buf = product_buf.reserve();
+            if (!buf->rem_x.empty()) return buf;
+
+            buf->rem_x.resize(q.size());
+            buf->loc_y.resize(q.size());
+            buf->vals_to_recv.resize(q.size());
+
+            for(unsigned d = 0; d < q.size(); ++d) {
+                size_t nrecv = ex[d].cols_to_recv.size();
+                if (!nrecv) continue;
+
+                buf->rem_x[d] = backend::device_vector<rhs_type>(q[d], nrecv);
+
+                if (!shared)
+                    buf->vals_to_recv[d].resize(nrecv);
+
+                if (ex[d].overlap)
+                    buf->loc_y[d] = backend::device_vector<rhs_type>(q[d],
+                            row_part[d+1] - row_part[d]);
+            }
+
+            return buf;
+        }
+
         template <class Expr>
-        void exchange(const Expr &expr) const {
+        void exchange(const Expr &expr, product_buffers &buf) const {
             using namespace vex::detail;
             static kernel_cache cache;
 
@@ -367,6 +515,7 @@ class distributed {
                     src.begin_kernel("vexcl_sparse_gather");
                     src.begin_kernel_parameters();
                     src.template parameter<size_t>("n");
+                    src.template parameter<size_t>("ofs");
                     src.template parameter< global_ptr<const col_type> >("cols_to_send");
                     src.template parameter< global_ptr<rhs_type> >("vals_to_send");
 
@@ -391,7 +540,7 @@ class distributed {
                     src << ";";
 
                     src.close("}");
-                    src.new_line() << "vals_to_send[idx] = cur_val;";
+                    src.new_line() << "vals_to_send[ofs + idx] = cur_val;";
 
                     src.close("}");
                     src.end_kernel();
@@ -403,30 +552,193 @@ class distributed {
                 auto &krn = K->second;
 
                 krn.push_arg(nsend);
-                krn.push_arg(ex[d].cols_to_send);
-                krn.push_arg(ex[d].vals_to_send);
+                if (shared) {
+                    krn.push_arg(rval_ptr[d]);
+                    krn.push_arg(ex[d].cols_to_send);
+                    krn.push_arg(rem_buf);
+                } else {
+                    krn.push_arg(static_cast<size_t>(0));
+                    krn.push_arg(ex[d].cols_to_send);
+                    krn.push_arg(ex[d].vals_to_send);
+                }
 
                 extract_terminals()(boost::proto::as_child(expr),
                         set_expression_argument(krn, d, col_part[d], empty_state()));
 
                 krn(q[d]);
 
-                ex[d].vals_to_send.read(q[d], 0, nsend, &rem_vals[rval_ptr[d]]);
+                if (shared) continue;
+
+                // Get the gathered values to host on the secondary queue.
+                backend::wait_list gathered;
+                backend::wait_list_append(gathered, backend::enqueue_marker(q[d]));
+                backend::enqueue_barrier(squeue[d], gathered);
+
+                ex[d].vals_to_send.read(squeue[d], 0, nsend, &rem_vals[rval_ptr[d]], false);
+            }
+
+            if (shared) {
+                receive_ghosts(buf);
+                return;
+            }
+
+            // Meanwhile, compute the local part of the product.
+            for(unsigned d = 0; d < q.size(); ++d)
+                if (ex[d].overlap) local_product(expr, d, buf);
+
+            // This also completes the writes of the previous product that
+            // used the buffers, so that vals_to_recv may be refilled.
+            for(unsigned d = 0; d < q.size(); ++d) squeue[d].finish();
+
+            // Send the ghost values to the devices. The transfers wait for
+            // the kernels of the previous product that read rem_x, and the
+            // main queues wait for the transfers before computing the remote
+            // part of the product.
+            for(unsigned d = 0; d < q.size(); ++d) {
+                size_t nrecv = ex[d].cols_to_recv.size();
+                if (!nrecv) continue;
+
+                for(size_t i = 0; i < nrecv; ++i)
+                    buf.vals_to_recv[d][i] = rem_vals[ex[d].cols_to_recv[i]];
+
+                backend::select_context(q[d]);
+
+                backend::wait_list done;
+                backend::wait_list_append(done, backend::enqueue_marker(q[d]));
+                backend::enqueue_barrier(squeue[d], done);
+
+                buf.rem_x[d].write(squeue[d], 0, nrecv, buf.vals_to_recv[d].data(), false);
+
+                backend::wait_list received;
+                backend::wait_list_append(received, backend::enqueue_marker(squeue[d]));
+                backend::enqueue_barrier(q[d], received);
             }
+        }
+
+        // Each device picks its ghost values from the combined vector
+        // filled by the gather kernels.
+        void receive_ghosts(product_buffers &buf) const {
+            using namespace vex::detail;
+            static kernel_cache cache;
 
+            backend::wait_list gathered;
             for(unsigned d = 0; d < q.size(); ++d)
-                if (rval_ptr[d+1] > rval_ptr[d]) q[d].finish();
+                if (rval_ptr[d+1] > rval_ptr[d])
+                    backend::wait_list_append(gathered, backend::enqueue_marker(q[d]));
 
+            backend::wait_list received;
             for(unsigned d = 0; d < q.size(); ++d) {
-                for(size_t i = 0; i < ex[d].cols_to_recv.size(); ++i)
-                    ex[d].vals_to_recv[i] = rem_vals[ex[d].cols_to_recv[i]];
+                size_t nrecv = ex[d].cols_to_recv.size();
+                if (!nrecv) continue;
+
+                backend::select_context(q[d]);
+                backend::enqueue_barrier(q[d], gathered);
+
+                auto K = cache.find(q[d]);
+
+                if (K == cache.end()) {
+                    backend::source_generator src(q[d]);
+
+                    src.begin_kernel("vexcl_sparse_receive");
+                    src.begin_kernel_parameters();
+                    src.template parameter<size_t>("n");
+                    src.template parameter< global_ptr<const col_type> >("cols");
+                    src.template parameter< global_ptr<const rhs_type> >("vals");
+                    src.template parameter< global_ptr<rhs_type> >("rem_x");
+                    src.end_kernel_parameters();
+                    src.grid_stride_loop().open("{");
+                    src.new_line() << "rem_x[idx] = vals[cols[idx]];";
+                    src.close("}");
+                    src.end_kernel();
+
+                    K = cache.insert(q[d], backend::kernel(
+                                q[d], src.str(), "vexcl_sparse_receive"));
+                }
+
+                auto &krn = K->second;
+
+                krn.push_arg(nrecv);
+                krn.push_arg(ex[d].recv_cols);
+                krn.push_arg(rem_buf);
+                krn.push_arg(buf.rem_x[d]);
 
-                ex[d].rem_x.write(q[d], 0, ex[d].cols_to_recv.size(), ex[d].vals_to_recv.data());
+                krn(q[d]);
+
+                backend::wait_list_append(received, backend::enqueue_marker(q[d]));
             }
+
+            // The next gather should not overwrite the ghost values before
+            // every device has received them.
+            for(unsigned d = 0; d < q.size(); ++d)
+                if (rval_ptr[d+1] > rval_ptr[d])
+                    backend::enqueue_barrier(q[d], received);
+        }
+
+        template <class Expr>
+        void local_product(const Expr &expr, unsigned d, product_buffers &buf) const {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            backend::select_context(q[d]);
+            auto K = cache.find(q[d]);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q[d]);
+
+                Matrix::terminal_preamble(expr, src, q[d], "prm", empty_state());
+
+                src.begin_kernel("vexcl_sparse_local_spmv");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter< global_ptr<rhs_type> >("loc_y");
+
+                Matrix::kernel_param_declaration(expr, src, q[d], "prm", empty_state());
+
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                Matrix::local_terminal_init(expr, src, q[d], "prm", empty_state());
+
+                src.new_line() << "loc_y[idx] = ";
+                Matrix::partial_vector_expr(expr, src, q[d], "prm", empty_state());
+                src << ";";
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q[d], backend::kernel(
+                            q[d], src.str(), "vexcl_sparse_local_spmv"));
+            }
+
+            auto &krn = K->second;
+
+            krn.push_arg(row_part[d+1] - row_part[d]);
+            krn.push_arg(buf.loc_y[d]);
+
+            A_loc[d]->kernel_arg_setter(expr, krn, d, col_part[d], empty_state());
+
+            krn(q[d]);
         }
 };
 
 } // namespace sparse
+
+namespace traits {
+
+template <class Matrix, typename rhs_type, class Vector>
+struct kernel_arg_setter< sparse::matrix_vector_product<sparse::distributed<Matrix, rhs_type>, Vector> > {
+    static void set(const sparse::matrix_vector_product<sparse::distributed<Matrix, rhs_type>, Vector> &term,
+            backend::kernel &kernel, unsigned part, size_t index_offset,
+            detail::kernel_generator_state_ptr state)
+    {
+        typedef typename sparse::distributed<Matrix, rhs_type>::product_buffers Buffers;
+
+        term.A.kernel_arg_setter(term.x, static_cast<const Buffers*>(term.data.get()),
+                kernel, part, index_offset, state);
+    }
+};
+
+} // namespace traits
 } // namespace vex
 
 #endif
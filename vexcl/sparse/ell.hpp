@@ -32,6 +32,7 @@ THE SOFTWARE.
  */
 
 #include <vector>
+#include <memory>
 #include <type_traits>
 #include <utility>
 
@@ -54,6 +55,7 @@ THE SOFTWARE.
 #include <vexcl/vector_pointer.hpp>
 #include <vexcl/scan.hpp>
 #include <vexcl/sparse/spmv_ops.hpp>
+#include <vexcl/sparse/transposed.hpp>
 
 namespace vex {
 namespace sparse {
@@ -168,6 +170,7 @@ class ell {
 
             ell_col = backend::device_vector<Col>(q[0], ell_pitch * ell_width, _ell_col.data());
             ell_val = backend::device_vector<Val>(q[0], ell_pitch * ell_width, _ell_val.data());
+            src_ptr = backend::device_vector<Ptr>(q[0], n + 1, &ptr[0]);
 
             if (csr_nnz) {
                 csr_ptr = backend::device_vector<Col>(q[0], n + 1,   _csr_ptr.data());
@@ -176,6 +179,38 @@ class ell {
             }
         }
 
+        /// Constructs the matrix from CSR arrays that reside on the device.
+        /**
+         * The conversion to ELL format is done on the device (see also
+         * vex::sparse::coo_to_csr()). The matrix does not share any buffers
+         * with the given vectors: the arrays it keeps (including the row
+         * pointer, used by update_values()) are copied, so the vectors may be
+         * modified or released afterwards.
+         */
+        ell(size_t nrows, size_t ncols,
+                const vector<Ptr> &ptr,
+                const vector<Col> &col,
+                const vector<Val> &val
+           ) :
+            q(ptr.queue_list()[0]), n(nrows), m(ncols), nnz(val.size()),
+            ell_pitch(alignup(nrows, 16U)), csr_nnz(0)
+        {
+            precondition(ptr.nparts() == 1,
+                    "sparse::ell is only supported for single-device contexts");
+            precondition(ptr.size() == n + 1 && col.size() == nnz,
+                    "Inconsistent CSR arrays");
+
+            backend::device_vector<Col> Acol;
+            backend::device_vector<Val> Aval;
+
+            if (nnz) {
+                Acol = col(0);
+                Aval = val(0);
+            }
+
+            convert_on_device(ptr(0), Acol, Aval, true);
+        }
+
         // Dummy matrix; used internally to pass empty parameters to kernels.
         ell(const backend::command_queue &q)
             : q(q), n(0), m(0), nnz(0), ell_pitch(0), csr_nnz(0), ell_width(0)
@@ -194,6 +229,16 @@ class ell {
             return matrix_vector_product<ell, Expr>(A, x);
         }
 
+        template <class MV>
+        friend
+        typename std::enable_if<
+            std::is_base_of<multivector_terminal_expression, MV>::value,
+            matrix_multivector_product<ell, MV>
+        >::type
+        operator*(const ell &A, const MV &x) {
+            return matrix_multivector_product<ell, MV>(A, x);
+        }
+
         template <class Vector>
         static void terminal_preamble(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
@@ -203,14 +248,16 @@ class ell {
             boost::proto::eval(boost::proto::as_child(x), tp);
         }
 
-        template <class Vector>
+        // The low-level operations are a template parameter of the hooks,
+        // so that the product may be computed over a semiring (see
+        // vex::sparse::semiring_view).
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
         static void local_terminal_init(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
         {
-            typedef typename detail::return_type<Vector>::type x_type;
-            typedef spmv_ops_impl<Val, x_type> spmv_ops;
-
             spmv_ops::decl_accum_var(src, prm_name + "_sum");
             src.open("{");
 
@@ -264,7 +311,9 @@ class ell {
             src.close("}");
         }
 
-        template <class Vector>
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
         static void kernel_param_declaration(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
@@ -290,7 +339,9 @@ class ell {
             src << prm_name << "_sum";
         }
 
-        template <class Vector>
+        template <class Vector,
+                  class spmv_ops = spmv_ops_impl<Val, typename detail::return_type<Vector>::type>
+                  >
         void kernel_arg_setter(const Vector &x,
             backend::kernel &kernel, unsigned part, size_t index_offset,
             detail::kernel_generator_state_ptr state) const
@@ -329,15 +380,150 @@ class ell {
             partition.back() = size = n;
         }
 
+        /// Sparse matrix - multivector product.
+        /**
+         * Computes y = scale * A * x, or y += scale * A * x when append is
+         * set. Used by the multivector expressions (e.g. Y = A * X).
+         */
+        template <class MV>
+        void apply(const MV &x, MV &y,
+                typename cl_scalar_of<typename MV::sub_value_type>::type scale,
+                bool append = false) const
+        {
+            using namespace vex::detail;
+            typedef spmm_source<Val, MV> spmm;
+
+            spmm::check(x, y, rows(), cols());
+
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            backend::select_context(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_ell_spmm");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<int>("ell_width");
+                src.template parameter<size_t>("ell_pitch");
+                src.template parameter< global_ptr<const Col> >("ell_col");
+                src.template parameter< global_ptr<const Val> >("ell_val");
+                src.template parameter< global_ptr<const Ptr> >("csr_ptr");
+                src.template parameter< global_ptr<const Col> >("csr_col");
+                src.template parameter< global_ptr<const Val> >("csr_val");
+                spmm::parameters(src);
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                spmm::begin_row(src);
+                src.new_line() << "for(size_t j = 0; j < ell_width; ++j)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " c = ell_col[idx + j * ell_pitch];";
+                src.new_line() << "if (c == (" << type_name<Col>() << ")(-1)) break;";
+                spmm::nonzero(src, "ell_val[idx + j * ell_pitch]", "c");
+                src.close("}");
+                src.new_line() << "if (csr_ptr)";
+                src.open("{");
+                src.new_line() << "for(" << type_name<Ptr>() << " j = csr_ptr[idx], e = csr_ptr[idx+1]; j < e; ++j)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " c = csr_col[j];";
+                spmm::nonzero(src, "csr_val[j]", "c");
+                src.close("}");
+                src.close("}");
+                spmm::end_row(src);
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_ell_spmm"));
+            }
+
+            K->second.push_arg(n);
+            K->second.push_arg(ell_width);
+            K->second.push_arg(ell_pitch);
+            if (ell_width) {
+                K->second.push_arg(ell_col);
+                K->second.push_arg(ell_val);
+            } else {
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+            }
+            if (csr_nnz) {
+                K->second.push_arg(csr_ptr);
+                K->second.push_arg(csr_col);
+                K->second.push_arg(csr_val);
+            } else {
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+            }
+            spmm::set_arguments(K->second, x, y, scale, append);
+
+            K->second(q);
+        }
+
         size_t rows()     const { return n; }
         size_t cols()     const { return m; }
         size_t nonzeros() const { return nnz; }
+
+        /// Replaces the values of the nonzeros, keeping the sparsity pattern.
+        /**
+         * The values should be given in the order of the column indices the
+         * matrix was constructed with. The split of the matrix into the ELL
+         * and CSR parts is reused, so only the value arrays are rewritten.
+         */
+        template <class ValRange>
+        void update_values(const ValRange &v) {
+            precondition(static_cast<size_t>(boost::size(v)) == nnz,
+                    "Wrong number of values");
+
+            if (!nnz) return;
+
+            if (!ell_width) {
+                csr_val.write(q, 0, nnz, &v[0], true);
+            } else {
+                backend::device_vector<Val> tmp(q, nnz, &v[0]);
+                scatter_values(tmp);
+            }
+        }
+
+        /// Replaces the values of the nonzeros with the values on the device.
+        void update_values(const vector<Val> &v) {
+            precondition(v.size() == nnz, "Wrong number of values");
+
+            if (!nnz) return;
+
+            if (!ell_width) {
+                vector<Val> dst(q, csr_val);
+                dst = v;
+            } else {
+                scatter_values(v(0));
+            }
+        }
+
+        /// Transposed matrix.
+        /**
+         * The column-wise structure is built on the device on first use and
+         * is cached afterwards. It refers to the nonzeros in the ELL and CSR
+         * value arrays of the matrix, so the values are not copied.
+         * \sa vex::sparse::csr::transposed()
+         */
+        const csr_transposed<Val, Col, Ptr>& transposed() const {
+            if (!At) build_transposed();
+            return *At;
+        }
     private:
         backend::command_queue q;
 
         size_t n, m, nnz, ell_pitch, csr_nnz;
         int ell_width;
 
+        // Row pointer of the original matrix; used to scatter the updated
+        // values into the ELL and CSR parts.
+        backend::device_vector<Ptr> src_ptr;
+
         backend::device_vector<Col> ell_col;
         backend::device_vector<Val> ell_val;
 
@@ -345,6 +531,98 @@ class ell {
         backend::device_vector<Col> csr_col;
         backend::device_vector<Val> csr_val;
 
+        mutable std::shared_ptr< csr_transposed<Val, Col, Ptr> > At;
+
+        // Column, row, and value position of every nonzero, in the order
+        // the matrix was constructed with. The positions of the nonzeros in
+        // the CSR part are offset by the size of the ELL part.
+        void build_transposed() const {
+            std::vector<backend::command_queue> ctx(1, q);
+
+            vector<Col> c, r;
+            vector<Ptr> p;
+
+            const size_t ell_size = ell_pitch * ell_width;
+
+            if (nnz) {
+                c.resize(ctx, nnz);
+                r.resize(ctx, nnz);
+                p.resize(ctx, nnz);
+
+                using namespace vex::detail;
+                static kernel_cache cache;
+
+                auto K = cache.find(q);
+                if (K == cache.end()) {
+                    backend::source_generator src(q);
+
+                    src.begin_kernel("vexcl_ell_transpose");
+                    src.begin_kernel_parameters();
+                    src.template parameter<size_t>("n");
+                    src.template parameter<int>("ell_width");
+                    src.template parameter<size_t>("ell_pitch");
+                    src.template parameter<size_t>("ell_size");
+                    src.template parameter< global_ptr<const col_type> >("ell_col");
+                    src.template parameter< global_ptr<const ptr_type> >("csr_ptr");
+                    src.template parameter< global_ptr<const col_type> >("csr_col");
+                    src.template parameter< global_ptr<const ptr_type> >("ptr");
+                    src.template parameter< global_ptr<col_type> >("col");
+                    src.template parameter< global_ptr<col_type> >("row");
+                    src.template parameter< global_ptr<ptr_type> >("pos");
+                    src.end_kernel_parameters();
+                    src.grid_stride_loop().open("{");
+
+                    src.new_line() << type_name<int>() << " w = 0;";
+                    src.new_line() << type_name<ptr_type>() << " csr_head = 0;";
+                    src.new_line() << "if (csr_ptr) csr_head = csr_ptr[idx];";
+                    src.new_line() << "for(" << type_name<ptr_type>() << " j = ptr[idx], e = ptr[idx+1]; j < e; ++j, ++w)";
+                    src.open("{");
+                    src.new_line() << "row[j] = idx;";
+                    src.new_line() << "if (w < ell_width) {";
+                    src.new_line() << "  col[j] = ell_col[idx + w * ell_pitch];";
+                    src.new_line() << "  pos[j] = idx + w * ell_pitch;";
+                    src.new_line() << "} else {";
+                    src.new_line() << "  col[j] = csr_col[csr_head];";
+                    src.new_line() << "  pos[j] = ell_size + csr_head;";
+                    src.new_line() << "  ++csr_head;";
+                    src.new_line() << "}";
+                    src.close("}");
+                    src.close("}");
+                    src.end_kernel();
+
+                    K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_ell_transpose"));
+                }
+
+                K->second.push_arg(n);
+                K->second.push_arg(ell_width);
+                K->second.push_arg(ell_pitch);
+                K->second.push_arg(ell_size);
+                if (ell_width)
+                    K->second.push_arg(ell_col);
+                else
+                    K->second.push_arg(static_cast<size_t>(0));
+                if (csr_nnz) {
+                    K->second.push_arg(csr_ptr);
+                    K->second.push_arg(csr_col);
+                } else {
+                    K->second.push_arg(static_cast<size_t>(0));
+                    K->second.push_arg(static_cast<size_t>(0));
+                }
+                K->second.push_arg(ell_width ? src_ptr : csr_ptr);
+                K->second.push_arg(c(0));
+                K->second.push_arg(r(0));
+                K->second.push_arg(p(0));
+                K->second(q);
+            }
+
+            if (ell_width)
+                At = std::make_shared< csr_transposed<Val, Col, Ptr> >(
+                        q, m, n, c, r, p, ell_val, csr_val, ell_size);
+            else
+                At = std::make_shared< csr_transposed<Val, Col, Ptr> >(
+                        q, m, n, c, r, p, csr_val);
+        }
+
         backend::kernel& csr2ell_kernel() const {
             using namespace vex::detail;
             static kernel_cache cache;
@@ -396,6 +674,73 @@ class ell {
             return kernel->second;
         }
 
+        template <typename T>
+        backend::device_vector<T> device_copy(
+                const backend::device_vector<T> &src, size_t size) const
+        {
+            if (!size) return backend::device_vector<T>();
+
+            backend::device_vector<T> dst(q, size);
+
+            vector<T> s(q, src, size), d(q, dst);
+            d = s;
+
+            return dst;
+        }
+
+        void scatter_values(const backend::device_vector<Val> &v) {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_ell_update_values");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<int>("ell_width");
+                src.template parameter<size_t>("ell_pitch");
+                src.template parameter< global_ptr<const ptr_type> >("ptr");
+                src.template parameter< global_ptr<const val_type> >("val");
+                src.template parameter< global_ptr<val_type> >("ell_val");
+                src.template parameter< global_ptr<const ptr_type> >("csr_ptr");
+                src.template parameter< global_ptr<val_type> >("csr_val");
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                src.new_line() << type_name<int>() << " w = 0;";
+                src.new_line() << type_name<ptr_type>() << " csr_head = 0;";
+                src.new_line() << "if (csr_ptr) csr_head = csr_ptr[idx];";
+                src.new_line() << "for(" << type_name<ptr_type>() << " j = ptr[idx], e = ptr[idx+1]; j < e; ++j, ++w)";
+                src.open("{");
+                src.new_line() << "if (w < ell_width)";
+                src.new_line() << "  ell_val[idx + w * ell_pitch] = val[j];";
+                src.new_line() << "else";
+                src.new_line() << "  csr_val[csr_head++] = val[j];";
+                src.close("}");
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_ell_update_values"));
+            }
+
+            K->second.push_arg(n);
+            K->second.push_arg(ell_width);
+            K->second.push_arg(ell_pitch);
+            K->second.push_arg(src_ptr);
+            K->second.push_arg(v);
+            K->second.push_arg(ell_val);
+            if (csr_nnz) {
+                K->second.push_arg(csr_ptr);
+                K->second.push_arg(csr_val);
+            } else {
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+            }
+            K->second(q);
+        }
+
         template <class PtrRange, class ColRange, class ValRange>
         void convert(
                 const PtrRange &host_ptr,
@@ -409,6 +754,18 @@ class ell {
             backend::device_vector<Col> Acol(q, nnz, &host_col[0]);
             backend::device_vector<Val> Aval(q, nnz, &host_val[0]);
 
+            convert_on_device(Aptr, Acol, Aval, false);
+        }
+
+        // The input arrays are copied when they are kept by the matrix and
+        // belong to the caller.
+        void convert_on_device(
+                const backend::device_vector<Ptr> &Aptr,
+                const backend::device_vector<Col> &Acol,
+                const backend::device_vector<Val> &Aval,
+                bool copy_input
+                )
+        {
             /* 1. Get optimal ELL widths for local and remote parts. */
             // Speed of ELL relative to CSR:
             const double ell_vs_csr = 3.0;
@@ -451,9 +808,9 @@ class ell {
             if (ell_width == 0) {
                 assert(csr_nnz == nnz);
 
-                csr_ptr = Aptr;
-                csr_col = Acol;
-                csr_val = Aval;
+                csr_ptr = copy_input ? device_copy(Aptr, n + 1) : Aptr;
+                csr_col = copy_input ? device_copy(Acol, nnz)   : Acol;
+                csr_val = copy_input ? device_copy(Aval, nnz)   : Aval;
 
                 return;
             }
@@ -480,6 +837,7 @@ class ell {
             /* 3. Split the input matrix into ELL and CSR submatrices. */
             ell_col = backend::device_vector<Col>(q, ell_pitch * ell_width);
             ell_val = backend::device_vector<Val>(q, ell_pitch * ell_width);
+            src_ptr = copy_input ? device_copy(Aptr, n + 1) : Aptr;
 
             vex::vector<Col>(q, ell_col) = -1;
 
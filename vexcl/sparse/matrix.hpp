@@ -1,12 +1,123 @@
 #ifndef VEXCL_SPARSE_MATRIX_HPP
 #define VEXCL_SPARSE_MATRIX_HPP
 
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+#include <memory>
+#include <type_traits>
+
+#include <boost/optional.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/lock_guard.hpp>
+#include <boost/mpl/identity.hpp>
+
+#include <vexcl/backend.hpp>
+#include <vexcl/profiler.hpp>
 #include <vexcl/sparse/ell.hpp>
 #include <vexcl/sparse/csr.hpp>
+#include <vexcl/sparse/sell.hpp>
 
 namespace vex {
 namespace sparse {
 
+/// Storage format of sparse::matrix.
+enum class format {
+    automatic, ///< CSR for CPUs, ELL for other devices.
+    csr,       ///< sparse::csr
+    ell,       ///< sparse::ell (hybrid ELL + CSR)
+    sell,      ///< sparse::sell (SELL-C-sigma)
+    tuned      ///< The fastest of the above, measured at construction.
+};
+
+} // namespace sparse
+
+namespace detail {
+
+// Folder holding the tuned formats. The VEXCL_SPARSE_FORMATS_PATH
+// environment variable overrides the default location.
+inline std::string sparse_format_dir() {
+    if (const char *dir = getenv("VEXCL_SPARSE_FORMATS_PATH")) return dir;
+    return appdata_path() + path_delim() + "formats";
+}
+
+// Path to the file holding the tuned format for the given matrix signature.
+inline std::string sparse_format_path(const std::string &signature, bool create = false) {
+    std::string dir = sparse_format_dir();
+    if (create) boost::filesystem::create_directories(dir);
+    return dir + path_delim() + static_cast<std::string>(sha1_hasher(signature));
+}
+
+// Reads the format selected for a matrix with the same signature before.
+inline boost::optional<sparse::format> load_sparse_format(const std::string &signature) {
+    if (getenv("VEXCL_RETUNE_SPARSE_FORMATS"))
+        return boost::optional<sparse::format>();
+
+    std::ifstream f(sparse_format_path(signature).c_str());
+
+    int fmt;
+    std::string cached_signature;
+
+    if (!(f >> fmt))
+        return boost::optional<sparse::format>();
+
+    std::getline(f >> std::ws, cached_signature);
+
+    if (cached_signature != signature ||
+            fmt < static_cast<int>(sparse::format::csr) ||
+            fmt > static_cast<int>(sparse::format::sell))
+        return boost::optional<sparse::format>();
+
+    return boost::optional<sparse::format>(static_cast<sparse::format>(fmt));
+}
+
+// Size class of a matrix dimension: the number of bits in its binary
+// representation, so that sizes within a factor of two share the class.
+inline unsigned sparse_size_class(size_t n) {
+    unsigned c = 0;
+    for(; n; n >>= 1) ++c;
+    return c;
+}
+
+// Saves the tuned format for future runs.
+inline void save_sparse_format(const std::string &signature, sparse::format fmt) {
+    // Prevent writing to the same file by several threads at the same time.
+    static boost::mutex mx;
+    boost::lock_guard<boost::mutex> lock(mx);
+
+    try {
+        std::ofstream f(sparse_format_path(signature, true).c_str());
+        f << static_cast<int>(fmt) << "\n" << signature << std::endl;
+    } catch(const boost::filesystem::filesystem_error&) {
+        // Not being able to cache the format is not an error.
+    }
+}
+
+} // namespace detail
+
+namespace sparse {
+
+/// Sparse matrix in a format suitable for the device.
+/**
+ * The expression kernels contain the product code of the default format for
+ * the device (CSR on CPUs, ELL otherwise). When the matrix is stored in
+ * another format, the product is computed by a separate kernel generated for
+ * that format, and the expression kernel reads the result.
+ *
+ * With format::tuned, the matrix is built in each of the supported formats
+ * in turn, and a few products are timed for each of them. The fastest format
+ * is kept. The decision is cached on disk (in the vexcl folder of the user
+ * home directory, or in the folder given by the VEXCL_SPARSE_FORMATS_PATH
+ * environment variable) under a key made of the device signature, the value
+ * types, and coarse statistics of the matrix structure: the size classes
+ * (powers of two) of the dimensions, the rounded average row width, and the
+ * rounded coefficient of variation of the row widths. Similar matrices on the
+ * same device skip the measurement. Set the VEXCL_RETUNE_SPARSE_FORMATS
+ * environment variable to ignore the cached decisions.
+ */
 template <typename Val, typename Col = int, typename Ptr = Col>
 class matrix {
     public:
@@ -26,15 +137,25 @@ class matrix {
                 bool fast_setup = true
            ) : q(q[0])
         {
-            if (is_cpu(q[0])) {
-                Acpu = std::make_shared<Csr>(q, nrows, ncols, ptr, col, val);
-            } else {
-                Agpu = std::make_shared<Ell>(q, nrows, ncols, ptr, col, val, fast_setup);
-            }
+            init(q, nrows, ncols, ptr, col, val, format::automatic, fast_setup);
+        }
+
+        template <class PtrRange, class ColRange, class ValRange>
+        matrix(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                format fmt,
+                bool fast_setup = true
+           ) : q(q[0])
+        {
+            init(q, nrows, ncols, ptr, col, val, fmt, fast_setup);
         }
 
         // Dummy matrix; used internally to pass empty parameters to kernels.
-        matrix(const backend::command_queue &q) : q(q) {}
+        matrix(const backend::command_queue &q) : q(q), fmt(format::automatic) {}
 
         template <class Expr>
         friend
@@ -49,16 +170,30 @@ class matrix {
             return matrix_vector_product<matrix, Expr>(A, x);
         }
 
+        template <class MV>
+        friend
+        typename std::enable_if<
+            std::is_base_of<multivector_terminal_expression, MV>::value,
+            matrix_multivector_product<matrix, MV>
+        >::type
+        operator*(const matrix &A, const MV &x) {
+            return matrix_multivector_product<matrix, MV>(A, x);
+        }
+
+        // The expression kernels only contain the code of the default
+        // format for the device (CSR on CPUs, ELL otherwise). A matrix
+        // stored in another format computes the product with a kernel of
+        // its own format (see product()), and the expression kernel reads
+        // the result.
         template <class Vector>
         static void terminal_preamble(const Vector &x, backend::source_generator &src,
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
         {
-            if (is_cpu(q)) {
+            if (is_cpu(q))
                 Csr::terminal_preamble(x, src, q, prm_name, state);
-            } else {
+            else
                 Ell::terminal_preamble(x, src, q, prm_name, state);
-            }
         }
 
         template <class Vector>
@@ -66,11 +201,10 @@ class matrix {
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
         {
-            if (is_cpu(q)) {
+            if (is_cpu(q))
                 Csr::local_terminal_init(x, src, q, prm_name, state);
-            } else {
+            else
                 Ell::local_terminal_init(x, src, q, prm_name, state);
-            }
         }
 
         template <class Vector>
@@ -78,11 +212,14 @@ class matrix {
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
         {
-            if (is_cpu(q)) {
+            typedef typename product_type<Vector>::type T;
+
+            src.parameter< global_ptr<const T> >(prm_name + "_Ay");
+
+            if (is_cpu(q))
                 Csr::kernel_param_declaration(x, src, q, prm_name, state);
-            } else {
+            else
                 Ell::kernel_param_declaration(x, src, q, prm_name, state);
-            }
         }
 
         template <class Vector>
@@ -90,11 +227,12 @@ class matrix {
             const backend::command_queue &q, const std::string &prm_name,
             detail::kernel_generator_state_ptr state)
         {
-            if (is_cpu(q)) {
+            src << "(" << prm_name << "_Ay ? " << prm_name << "_Ay[idx] : ";
+            if (is_cpu(q))
                 Csr::partial_vector_expr(x, src, q, prm_name, state);
-            } else {
+            else
                 Ell::partial_vector_expr(x, src, q, prm_name, state);
-            }
+            src << ")";
         }
 
         template <class Vector>
@@ -102,16 +240,43 @@ class matrix {
             backend::kernel &kernel, unsigned part, size_t index_offset,
             detail::kernel_generator_state_ptr state) const
         {
-            if (is_cpu(q)) {
-                if (Acpu) {
-                    Acpu->kernel_arg_setter(x, kernel, part, index_offset, state);
+            typedef typename product_type<Vector>::type T;
+
+            const bool cpu = is_cpu(q);
+
+            if (fmt == format::automatic || fmt == default_format(q)) {
+                kernel.push_arg(static_cast<size_t>(0));
+            } else {
+                product_buffers &buf = product_buf.reserve(state);
+
+                const size_t bytes = rows() * sizeof(T);
+                if (buf.bytes < bytes) {
+                    buf.bytes = bytes;
+                    buf.Ay = backend::device_vector<char>(q, bytes);
+                }
+
+                backend::device_vector<T> Ay = buf.Ay.template reinterpret<T>();
+
+                if (Acsr)
+                    product(*Acsr, x, Ay, part, index_offset);
+                else if (Aell)
+                    product(*Aell, x, Ay, part, index_offset);
+                else
+                    product(*Asell, x, Ay, part, index_offset);
+
+                kernel.push_arg(Ay);
+            }
+
+            if (cpu) {
+                if (Acsr) {
+                    Acsr->kernel_arg_setter(x, kernel, part, index_offset, state);
                 } else {
                     Csr dummy_A(q);
                     dummy_A.kernel_arg_setter(x, kernel, part, index_offset, state);
                 }
             } else {
-                if (Agpu) {
-                    Agpu->kernel_arg_setter(x, kernel, part, index_offset, state);
+                if (Aell) {
+                    Aell->kernel_arg_setter(x, kernel, part, index_offset, state);
                 } else {
                     Ell dummy_A(q);
                     dummy_A.kernel_arg_setter(x, kernel, part, index_offset, state);
@@ -125,25 +290,279 @@ class matrix {
             std::vector<size_t> &partition,
             size_t &size) const
         {
-            if (Acpu) {
-                Acpu->expression_properties(x, queue_list, partition, size);
-            } else if (Agpu) {
-                Agpu->expression_properties(x, queue_list, partition, size);
+            if (Acsr) {
+                Acsr->expression_properties(x, queue_list, partition, size);
+            } else if (Aell) {
+                Aell->expression_properties(x, queue_list, partition, size);
+            } else if (Asell) {
+                Asell->expression_properties(x, queue_list, partition, size);
+            }
+        }
+
+        /// Sparse matrix - multivector product.
+        /**
+         * Computes y = scale * A * x, or y += scale * A * x when append is
+         * set. Used by the multivector expressions (e.g. Y = A * X).
+         */
+        template <class MV>
+        void apply(const MV &x, MV &y,
+                typename cl_scalar_of<typename MV::sub_value_type>::type scale,
+                bool append = false) const
+        {
+            if (Acsr) {
+                Acsr->apply(x, y, scale, append);
+            } else if (Aell) {
+                Aell->apply(x, y, scale, append);
+            } else if (Asell) {
+                Asell->apply(x, y, scale, append);
             }
         }
 
-        size_t rows()     const { return Acpu ? Acpu->rows()     : Agpu->rows();     }
-        size_t cols()     const { return Acpu ? Acpu->cols()     : Agpu->cols();     }
-        size_t nonzeros() const { return Acpu ? Acpu->nonzeros() : Agpu->nonzeros(); }
+        size_t rows()     const { return Acsr ? Acsr->rows()     : Aell ? Aell->rows()     : Asell->rows();     }
+        size_t cols()     const { return Acsr ? Acsr->cols()     : Aell ? Aell->cols()     : Asell->cols();     }
+        size_t nonzeros() const { return Acsr ? Acsr->nonzeros() : Aell ? Aell->nonzeros() : Asell->nonzeros(); }
+
+        /// Transposed matrix.
+        /**
+         * \sa vex::sparse::csr::transposed()
+         */
+        const csr_transposed<Val, Col, Ptr>& transposed() const {
+            return Acsr ? Acsr->transposed() : Aell ? Aell->transposed() : Asell->transposed();
+        }
+
+        /// Storage format used for the matrix.
+        format storage_format() const { return fmt; }
+
+        /// Replaces the values of the nonzeros, keeping the sparsity pattern.
+        /**
+         * The values may come from a host range or from a vex::vector. They
+         * should be given in the order of the column indices the matrix was
+         * constructed with.
+         */
+        template <class ValRange>
+        void update_values(const ValRange &v) {
+            if (Acsr) {
+                Acsr->update_values(v);
+            } else if (Aell) {
+                Aell->update_values(v);
+            } else if (Asell) {
+                Asell->update_values(v);
+            }
+        }
     private:
-        typedef ell<Val, Col, Ptr> Ell;
-        typedef csr<Val, Col, Ptr> Csr;
+        typedef ell<Val, Col, Ptr>  Ell;
+        typedef csr<Val, Col, Ptr>  Csr;
+        typedef sell<Val, Col, Ptr> Sell;
 
         backend::command_queue q;
+        format fmt;
+
+        std::shared_ptr<Csr>  Acsr;
+        std::shared_ptr<Ell>  Aell;
+        std::shared_ptr<Sell> Asell;
+
+        struct product_buffers {
+            product_buffers() : bytes(0) {}
+
+            size_t bytes;
+            backend::device_vector<char> Ay;
+        };
 
-        std::shared_ptr<Ell> Agpu;
-        std::shared_ptr<Csr> Acpu;
+        mutable product_buffer_pool<product_buffers> product_buf;
 
+        static format default_format(const backend::command_queue &q) {
+            return is_cpu(q) ? format::csr : format::ell;
+        }
+
+        // Type of the product computed with the kernel of the storage
+        // format.
+        template <class Vector>
+        struct product_type {
+            typedef typename detail::return_type<Vector>::type x_type;
+
+            typedef typename std::conditional<
+                    !std::is_arithmetic<Val>::value,
+                    rhs_of<Val>,
+                    typename std::conditional<
+                        std::is_arithmetic<x_type>::value,
+                        std::common_type<Val, x_type>,
+                        boost::mpl::identity<x_type>
+                    >::type
+                >::type::type type;
+        };
+
+        // Computes the product with a kernel generated for the storage format
+        // of the matrix. The kernels are cached separately for each format.
+        template <class Format, class Vector, typename T>
+        void product(const Format &A, const Vector &x, backend::device_vector<T> &y,
+                unsigned part, size_t index_offset) const
+        {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            backend::select_context(q);
+            auto K = cache.find(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                Format::terminal_preamble(x, src, q, "prm", empty_state());
+
+                src.begin_kernel("vexcl_sparse_matrix_product");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter< global_ptr<T> >("y");
+
+                Format::kernel_param_declaration(x, src, q, "prm", empty_state());
+
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                Format::local_terminal_init(x, src, q, "prm", empty_state());
+
+                src.new_line() << "y[idx] = ";
+                Format::partial_vector_expr(x, src, q, "prm", empty_state());
+                src << ";";
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(
+                            q, src.str(), "vexcl_sparse_matrix_product"));
+            }
+
+            auto &krn = K->second;
+
+            krn.push_arg(rows());
+            krn.push_arg(y);
+
+            A.kernel_arg_setter(x, krn, part, index_offset, empty_state());
+
+            krn(q);
+        }
+
+        template <class PtrRange, class ColRange, class ValRange>
+        void init(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                format f, bool fast_setup
+                )
+        {
+            if (f == format::tuned && nrows) {
+                tune(q, nrows, ncols, ptr, col, val, fast_setup);
+                return;
+            }
+
+            if (f == format::automatic || f == format::tuned)
+                f = is_cpu(q[0]) ? format::csr : format::ell;
+
+            build(q, nrows, ncols, ptr, col, val, f, fast_setup);
+        }
+
+        template <class PtrRange, class ColRange, class ValRange>
+        void build(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                format f, bool fast_setup
+                )
+        {
+            fmt = f;
+
+            Acsr.reset();
+            Aell.reset();
+            Asell.reset();
+
+            switch(f) {
+                case format::csr:
+                    Acsr = std::make_shared<Csr>(q, nrows, ncols, ptr, col, val);
+                    break;
+                case format::sell:
+                    Asell = std::make_shared<Sell>(q, nrows, ncols, ptr, col, val);
+                    break;
+                default:
+                    Aell = std::make_shared<Ell>(q, nrows, ncols, ptr, col, val, fast_setup);
+                    break;
+            }
+        }
+
+        template <class PtrRange, class ColRange, class ValRange>
+        void tune(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                bool fast_setup
+                )
+        {
+            typedef typename rhs_of<Val>::type rhs_type;
+
+            // Coarse statistics of the matrix structure, so that matrices
+            // with a similar structure share the decision.
+            double nnz = static_cast<double>(ptr[nrows] - ptr[0]);
+            double avg_width = nnz / nrows;
+
+            double var = 0;
+            for(size_t i = 0; i < nrows; ++i) {
+                double d = static_cast<double>(ptr[i+1] - ptr[i]) - avg_width;
+                var += d * d;
+            }
+            var /= nrows;
+
+            double variability = avg_width > 0 ? std::sqrt(var) / avg_width : 0.0;
+
+            std::ostringstream sig;
+            sig << backend::get_device_signature(q[0]) << "; "
+                << type_name<Val>() << " " << type_name<Col>() << " " << type_name<Ptr>() << "; "
+                << detail::sparse_size_class(nrows) << " "
+                << detail::sparse_size_class(ncols) << " "
+                << static_cast<long>(avg_width + 0.5) << " "
+                << static_cast<long>(10 * variability + 0.5);
+
+            if (boost::optional<format> f = detail::load_sparse_format(sig.str())) {
+                build(q, nrows, ncols, ptr, col, val, *f, fast_setup);
+                return;
+            }
+
+            const int nruns = 5;
+            const format candidates[] = {format::csr, format::ell, format::sell};
+
+            std::vector<backend::command_queue> ctx(1, q[0]);
+            vex::vector<rhs_type> x(ctx, std::vector<rhs_type>(ncols, rhs_type()));
+            vex::vector<rhs_type> y(ctx, nrows);
+
+            format best_fmt  = candidates[0];
+            double best_time = std::numeric_limits<double>::max();
+
+            for(const format *f = candidates; f != candidates + 3; ++f) {
+                build(q, nrows, ncols, ptr, col, val, *f, fast_setup);
+
+                // The first product compiles the kernel.
+                y = (*this) * x;
+                q[0].finish();
+
+                stopwatch<> watch;
+                for(int k = 0; k < nruns; ++k) y = (*this) * x;
+                q[0].finish();
+
+                double t = watch.toc();
+                if (t < best_time) {
+                    best_time = t;
+                    best_fmt  = *f;
+                }
+            }
+
+            detail::save_sparse_format(sig.str(), best_fmt);
+
+            if (best_fmt != fmt)
+                build(q, nrows, ncols, ptr, col, val, best_fmt, fast_setup);
+        }
 };
 
 } // namespace sparse
@@ -1,29 +1,197 @@
 #ifndef VEXCL_SPARSE_PRODUCT_HPP
 #define VEXCL_SPARSE_PRODUCT_HPP
 
+#include <string>
+#include <memory>
+#include <vector>
+#include <vexcl/multivector.hpp>
+#include <vexcl/sparse/spmv_ops.hpp>
+
 namespace vex {
 namespace sparse {
 
+/// Value-type of a vector corresponding to the matrix with value-type T.
+template <class T, class Enable = void>
+struct rhs_of {
+    typedef T type;
+};
+
 struct matrix_vector_product_terminal {};
 
 typedef vector_expression<
         typename boost::proto::terminal< matrix_vector_product_terminal >::type
         > matrix_vector_product_expression;
 
+/// Buffers for the parts of the products computed before the kernel launch.
+/**
+ * Some formats compute a part of the product with separate kernels and pass
+ * the result to the expression kernel. A buffer is reserved for the launch
+ * whose arguments are being set: it is kept in the kernel generator state,
+ * so that several products with the same matrix in one expression get
+ * separate buffers. Buffers that are no longer reserved are reused by the
+ * following launches, which are ordered by the queue of the matrix.
+ */
+template <class Buffers>
+class product_buffer_pool {
+    public:
+        /// Reserves buffers for as long as the returned pointer is held.
+        /**
+         * Used by the matrices that fill the buffers when the product is
+         * formed, before the kernel arguments are set.
+         */
+        std::shared_ptr<Buffers> reserve() {
+            for(auto b = pool.begin(); b != pool.end(); ++b)
+                if (b->use_count() == 1) return *b;
+
+            std::shared_ptr<Buffers> buf = std::make_shared<Buffers>();
+            pool.push_back(buf);
+            return buf;
+        }
+
+        /// Reserves buffers for the launch whose arguments are being set.
+        Buffers& reserve(detail::kernel_generator_state_ptr state) {
+            std::shared_ptr<Buffers> buf = reserve();
+
+            typedef std::vector< std::shared_ptr<void> > reserved_list;
+
+            auto s = state->find("sparse_product_buffers");
+
+            if (s == state->end()) {
+                s = state->insert(std::make_pair(
+                            std::string("sparse_product_buffers"),
+                            boost::any(reserved_list())
+                            )).first;
+            }
+
+            boost::any_cast<reserved_list&>(s->second).push_back(buf);
+
+            return *buf;
+        }
+    private:
+        std::vector< std::shared_ptr<Buffers> > pool;
+};
+
 template <class Matrix, class Vector>
 struct matrix_vector_product : matrix_vector_product_expression
 {
     const Matrix &A;
     typename boost::proto::result_of::as_child<const Vector, vector_domain>::type x;
 
-    matrix_vector_product(const Matrix &A, const Vector &x)
-        : A(A), x(boost::proto::as_child(x)) {}
+    // Buffers the matrix reserved for the product when it was formed (see
+    // product_buffer_pool::reserve()); they are released with the product.
+    std::shared_ptr<void> data;
+
+    matrix_vector_product(const Matrix &A, const Vector &x,
+            std::shared_ptr<void> data = std::shared_ptr<void>())
+        : A(A), x(boost::proto::as_child(x)), data(data) {}
+};
+
+/// Product of a sparse matrix and a multivector.
+/**
+ * All components of the result are computed by a single kernel, which reads
+ * each nonzero of the matrix once and updates the accumulators of every
+ * component.
+ */
+template <class Matrix, class MV>
+struct matrix_multivector_product
+    : multivector_expression<
+        boost::proto::terminal< additive_multivector_transform >::type
+        >
+{
+    typedef typename MV::sub_value_type value_type;
+
+    const Matrix &A;
+    const MV &x;
+
+    typename cl_scalar_of<value_type>::type scale;
+
+    matrix_multivector_product(const Matrix &A, const MV &x)
+        : A(A), x(x), scale(1) {}
+
+    template <bool negate, bool append>
+    void apply(MV &y) const {
+        A.apply(x, y, negate ? -scale : scale, append);
+    }
+};
+
+// Source generation helpers for the sparse matrix - multivector product
+// kernels. The format specific kernel declares the matrix parameters, loops
+// over the nonzeros of the row idx, and calls nonzero() for each of them.
+template <class Val, class MV>
+struct spmm_source {
+    typedef typename MV::sub_value_type     T;
+    typedef typename cl_scalar_of<T>::type  S;
+    typedef spmv_ops_impl<Val, T>           spmv_ops;
+
+    static const size_t N = MV::NDIM;
+
+    static std::string name(const char *prefix, size_t k) {
+        return prefix + std::to_string(k);
+    }
+
+    static void parameters(backend::source_generator &src) {
+        src.template parameter<S>("scale");
+        src.template parameter<int>("append");
+
+        for(size_t k = 0; k < N; ++k)
+            src.template parameter< global_ptr<const T> >(name("x", k));
+
+        for(size_t k = 0; k < N; ++k)
+            src.template parameter< global_ptr<T> >(name("y", k));
+    }
+
+    static void begin_row(backend::source_generator &src) {
+        for(size_t k = 0; k < N; ++k)
+            spmv_ops::decl_accum_var(src, name("sum", k));
+    }
+
+    static void nonzero(backend::source_generator &src,
+            const std::string &val, const std::string &col)
+    {
+        src.open("{");
+        src.new_line() << type_name<Val>() << " v = " << val << ";";
+        for(size_t k = 0; k < N; ++k)
+            spmv_ops::append_product(src, name("sum", k), "v",
+                    name("x", k) + "[" + col + "]");
+        src.close("}");
+    }
+
+    static void end_row(backend::source_generator &src) {
+        for(size_t k = 0; k < N; ++k)
+            src.new_line() << "if (append) " << name("y", k) << "[idx] += scale * " << name("sum", k)
+                << "; else " << name("y", k) << "[idx] = scale * " << name("sum", k) << ";";
+    }
+
+    static void check(const MV &x, const MV &y, size_t rows, size_t cols) {
+        for(size_t k = 0; k < N; ++k) {
+            precondition(x(k).nparts() == 1 && y(k).nparts() == 1,
+                    "Sparse matrix - multivector product is only supported for single device contexts"
+                    );
+            precondition(x(k).size() == cols && y(k).size() == rows,
+                    "Wrong vector size"
+                    );
+        }
+    }
+
+    static void set_arguments(backend::kernel &K,
+            const MV &x, MV &y, S scale, bool append)
+    {
+        K.push_arg(scale);
+        K.push_arg(static_cast<int>(append));
+
+        for(size_t k = 0; k < N; ++k) K.push_arg(x(k)());
+        for(size_t k = 0; k < N; ++k) K.push_arg(y(k)());
+    }
 };
 
 } // namespace sparse
 
 namespace traits {
 
+template <class Matrix, class MV>
+struct is_scalable< sparse::matrix_multivector_product<Matrix, MV> >
+    : std::true_type {};
+
 template <> struct is_vector_expr_terminal< sparse::matrix_vector_product_terminal >
     : std::true_type {};
 
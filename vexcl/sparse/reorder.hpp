@@ -0,0 +1,333 @@
+#ifndef VEXCL_SPARSE_REORDER_HPP
+#define VEXCL_SPARSE_REORDER_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/reorder.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Bandwidth-reducing reordering of sparse matrices.
+ */
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <numeric>
+#include <utility>
+
+#include <boost/range.hpp>
+
+#include <vexcl/util.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/vector_view.hpp>
+
+namespace vex {
+namespace detail {
+
+// Adjacency graph of A + A^T without the diagonal. The matrix should be
+// square, with n rows and n columns.
+template <class PtrRange, class ColRange>
+void symmetric_graph(size_t n, const PtrRange &ptr, const ColRange &col,
+        std::vector<size_t> &gptr, std::vector<size_t> &gcol)
+{
+    precondition(static_cast<size_t>(boost::size(ptr)) == n + 1,
+            "Row pointer should have n + 1 entries");
+
+    gptr.assign(n + 1, 0);
+
+    for(size_t i = 0; i < n; ++i)
+        for(auto j = ptr[i], e = ptr[i+1]; j < e; ++j) {
+            size_t c = col[j];
+            precondition(c < n,
+                    "Column index out of range; the matrix should be square");
+            if (c == i) continue;
+            ++gptr[i + 1];
+            ++gptr[c + 1];
+        }
+
+    std::partial_sum(gptr.begin(), gptr.end(), gptr.begin());
+
+    gcol.resize(gptr[n]);
+    std::vector<size_t> head(gptr.begin(), gptr.end() - 1);
+
+    for(size_t i = 0; i < n; ++i)
+        for(auto j = ptr[i], e = ptr[i+1]; j < e; ++j) {
+            size_t c = col[j];
+            if (c == i) continue;
+            gcol[head[i]++] = c;
+            gcol[head[c]++] = i;
+        }
+
+    // Remove duplicates (entries present in both triangles).
+    size_t head_ptr = 0;
+    for(size_t i = 0, beg = 0; i < n; ++i) {
+        size_t end = gptr[i + 1];
+
+        std::sort(gcol.begin() + beg, gcol.begin() + end);
+        size_t last = std::unique(gcol.begin() + beg, gcol.begin() + end) - gcol.begin();
+
+        gptr[i] = head_ptr;
+        for(size_t j = beg; j < last; ++j) gcol[head_ptr++] = gcol[j];
+
+        beg = end;
+    }
+    gptr[n] = head_ptr;
+    gcol.resize(head_ptr);
+}
+
+// Breadth-first search from the given root over the unmarked vertices.
+// Returns the number of levels and the vertices of the last level.
+inline size_t bfs_levels(size_t root,
+        const std::vector<size_t> &gptr, const std::vector<size_t> &gcol,
+        std::vector<size_t> &level, std::vector<size_t> &last)
+{
+    std::vector<size_t> front(1, root), next;
+    std::vector<size_t> visited(1, root);
+
+    level[root] = 0;
+    size_t nlev = 0;
+
+    while(!front.empty()) {
+        ++nlev;
+        last.swap(front);
+        next.clear();
+
+        for(auto v = last.begin(); v != last.end(); ++v)
+            for(size_t j = gptr[*v]; j < gptr[*v + 1]; ++j) {
+                size_t c = gcol[j];
+                if (level[c] != static_cast<size_t>(-1)) continue;
+                level[c] = nlev;
+                next.push_back(c);
+                visited.push_back(c);
+            }
+
+        front.swap(next);
+    }
+
+    for(auto v = visited.begin(); v != visited.end(); ++v)
+        level[*v] = static_cast<size_t>(-1);
+
+    return nlev;
+}
+
+} // namespace detail
+
+namespace sparse {
+
+/// Reverse Cuthill-McKee ordering of a sparse matrix.
+/**
+ * Returns the new order of the rows: the i-th row of the reordered matrix is
+ * the order[i]-th row of the original one. The ordering is computed for the
+ * structure of A + A^T, so the matrix does not have to be structurally
+ * symmetric, but it should be square: ptr should have n + 1 entries, and the
+ * column indices should be less than n. Each connected component starts at a pseudo-peripheral vertex
+ * found with the George-Liu algorithm.
+ */
+template <class PtrRange, class ColRange>
+std::vector<size_t> rcm(size_t n, const PtrRange &ptr, const ColRange &col) {
+    std::vector<size_t> gptr, gcol;
+    vex::detail::symmetric_graph(n, ptr, col, gptr, gcol);
+
+    auto degree = [&](size_t i) { return gptr[i + 1] - gptr[i]; };
+
+    const size_t unmarked = static_cast<size_t>(-1);
+
+    std::vector<size_t> order;
+    order.reserve(n);
+
+    std::vector<size_t> level(n, unmarked), last;
+    std::vector<char>   done(n, false);
+
+    // Vertices sorted by degree, to find the start of each component.
+    std::vector<size_t> by_degree(n);
+    std::iota(by_degree.begin(), by_degree.end(), 0);
+    std::stable_sort(by_degree.begin(), by_degree.end(),
+            [&](size_t a, size_t b) { return degree(a) < degree(b); });
+
+    for(auto s = by_degree.begin(); s != by_degree.end(); ++s) {
+        if (done[*s]) continue;
+
+        // Pseudo-peripheral vertex.
+        size_t root = *s;
+        size_t nlev = vex::detail::bfs_levels(root, gptr, gcol, level, last);
+
+        for(;;) {
+            size_t cand = *std::min_element(last.begin(), last.end(),
+                    [&](size_t a, size_t b) { return degree(a) < degree(b); });
+
+            std::vector<size_t> cand_last;
+            size_t cand_nlev = vex::detail::bfs_levels(cand, gptr, gcol, level, cand_last);
+
+            if (cand_nlev <= nlev) break;
+
+            root = cand;
+            nlev = cand_nlev;
+            last.swap(cand_last);
+        }
+
+        // Cuthill-McKee traversal with neighbours sorted by degree.
+        size_t head = order.size();
+        order.push_back(root);
+        done[root] = true;
+
+        for(; head < order.size(); ++head) {
+            size_t v = order[head];
+            size_t beg = order.size();
+
+            for(size_t j = gptr[v]; j < gptr[v + 1]; ++j) {
+                size_t c = gcol[j];
+                if (done[c]) continue;
+                done[c] = true;
+                order.push_back(c);
+            }
+
+            std::stable_sort(order.begin() + beg, order.end(),
+                    [&](size_t a, size_t b) { return degree(a) < degree(b); });
+        }
+    }
+
+    std::reverse(order.begin(), order.end());
+    return order;
+}
+
+/// Symmetric reordering of a sparse matrix and of the associated vectors.
+/**
+ * Computes the reverse Cuthill-McKee ordering of the matrix (see
+ * vex::sparse::rcm()), which reduces its bandwidth and makes the accesses
+ * to the vector in the matrix-vector product more local. Reordering of the
+ * matrix also reduces the number of ghost points of vex::sparse::distributed.
+ *
+ * The matrix is reordered on the host (since the sparse matrix constructors
+ * take host arrays), and the vectors are reordered on the device with
+ * vex::permutation(), so the vectors should be allocated on a single device:
+ *
+ \code
+ vex::sparse::reordering R(ctx, n, ptr, col);
+
+ std::vector<int> rptr, rcol;
+ std::vector<double> rval;
+ R.matrix(ptr, col, val, rptr, rcol, rval);
+
+ vex::sparse::matrix<double> A(ctx, n, n, rptr, rcol, rval);
+
+ R.forward(f, rhs); // rhs = P f
+ solve(A, rhs, u);
+ R.inverse(u, x);   // x = P^T u
+ \endcode
+ */
+class reordering {
+    public:
+        /// Computes the reverse Cuthill-McKee ordering of the matrix.
+        template <class PtrRange, class ColRange>
+        reordering(
+                const std::vector<backend::command_queue> &q,
+                size_t n, const PtrRange &ptr, const ColRange &col
+                ) : order(rcm(n, ptr, col)), inv(n)
+        {
+            for(size_t i = 0; i < n; ++i) inv[order[i]] = i;
+
+            if (n) {
+                std::vector<backend::command_queue> q1(1, q[0]);
+                fwd = vex::vector<size_t>(q1, order);
+                bwd = vex::vector<size_t>(q1, inv);
+            }
+        }
+
+        /// Number of rows.
+        size_t size() const { return order.size(); }
+
+        /// New order of the rows.
+        /** The i-th row of the reordered matrix is the permutation()[i]-th row of the original one. */
+        const std::vector<size_t>& permutation() const { return order; }
+
+        /// Position of the original rows in the reordered matrix.
+        const std::vector<size_t>& inverse_permutation() const { return inv; }
+
+        /// Reorders the matrix in CSR format (computes \f$P A P^T\f$).
+        /**
+         * The column indices within each row of the result are sorted.
+         */
+        template <class PtrRange, class ColRange, class ValRange, typename Ptr, typename Col, typename Val>
+        void matrix(const PtrRange &ptr, const ColRange &col, const ValRange &val,
+                std::vector<Ptr> &rptr, std::vector<Col> &rcol, std::vector<Val> &rval) const
+        {
+            const size_t n = order.size();
+
+            rptr.resize(n + 1);
+            rptr[0] = 0;
+            for(size_t i = 0; i < n; ++i)
+                rptr[i+1] = rptr[i] + static_cast<Ptr>(ptr[order[i] + 1] - ptr[order[i]]);
+
+            rcol.resize(rptr[n]);
+            rval.resize(rptr[n]);
+
+            std::vector< std::pair<Col, Val> > row;
+            for(size_t i = 0; i < n; ++i) {
+                row.clear();
+                for(auto j = ptr[order[i]], e = ptr[order[i] + 1]; j < e; ++j)
+                    row.push_back(std::make_pair(static_cast<Col>(inv[col[j]]), static_cast<Val>(val[j])));
+
+                std::sort(row.begin(), row.end(),
+                        [](const std::pair<Col, Val> &a, const std::pair<Col, Val> &b) {
+                            return a.first < b.first;
+                        });
+
+                Ptr head = rptr[i];
+                for(auto r = row.begin(); r != row.end(); ++r, ++head) {
+                    rcol[head] = r->first;
+                    rval[head] = r->second;
+                }
+            }
+        }
+
+        /// Reorders the vector: y = P x.
+        template <typename T>
+        void forward(const vector<T> &x, vector<T> &y) const {
+            precondition(x.size() == size() && y.size() == size(), "Wrong vector size");
+            precondition(x.nparts() <= 1 && y.nparts() <= 1,
+                    "Reordering of multi-device vectors is not supported");
+
+            if (size()) y = vex::permutation(fwd)(x);
+        }
+
+        /// Restores the original order of the vector: x = P^T y.
+        template <typename T>
+        void inverse(const vector<T> &y, vector<T> &x) const {
+            precondition(x.size() == size() && y.size() == size(), "Wrong vector size");
+            precondition(x.nparts() <= 1 && y.nparts() <= 1,
+                    "Reordering of multi-device vectors is not supported");
+
+            if (size()) x = vex::permutation(bwd)(y);
+        }
+    private:
+        std::vector<size_t> order, inv;
+        vex::vector<size_t> fwd, bwd;
+};
+
+} // namespace sparse
+} // namespace vex
+
+#endif
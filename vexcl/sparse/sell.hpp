@@ -0,0 +1,539 @@
+#ifndef VEXCL_SPARSE_SELL_HPP
+#define VEXCL_SPARSE_SELL_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/sell.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Sparse matrix in SELL-C-sigma format.
+ */
+
+#include <vector>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+#include <type_traits>
+#include <utility>
+
+#include <boost/range.hpp>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/sparse/product.hpp>
+#include <vexcl/sparse/spmv_ops.hpp>
+#include <vexcl/sparse/transposed.hpp>
+
+namespace vex {
+namespace sparse {
+
+/// Sparse matrix in SELL-C-sigma format.
+/**
+ * Rows of the matrix are sorted by their width within windows of sigma
+ * consecutive rows, and the sorted rows are grouped into slices of C rows.
+ * Each slice is stored column-major (as a small ELL matrix) and is padded to
+ * its own width only. With C matching the SIMD (or warp) width of the device
+ * the format combines the regular memory access of ELL with the low padding
+ * overhead of CSR.
+ */
+template <typename Val, typename Col = int, typename Ptr = Col>
+class sell {
+    public:
+        typedef Val value_type;
+
+        typedef Val val_type;
+        typedef Col col_type;
+        typedef Ptr ptr_type;
+
+        /// Constructor.
+        /**
+         * \param C     Slice height. When zero, 8 is used for CPUs and 32
+         *              for other devices.
+         * \param sigma Sorting window. When zero, 32 * C is used. Rows are
+         *              not reordered when sigma is one.
+         */
+        template <class PtrRange, class ColRange, class ValRange>
+        sell(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                bool /*fast_setup*/ = true,
+                size_t C = 0, size_t sigma = 0
+           ) :
+            q(q[0]), n(nrows), m(ncols), nnz(boost::size(val)),
+            C(C ? C : (is_cpu(q[0]) ? 8 : 32)),
+            sigma(sigma ? sigma : 32 * this->C)
+        {
+            precondition(q.size() == 1,
+                    "sparse::sell is only supported for single-device contexts");
+
+            if (!nnz) return;
+
+            // Sort rows by width (descending) within each window.
+            std::vector<size_t> order(n);
+            std::iota(order.begin(), order.end(), 0);
+
+            if (this->sigma > 1) {
+                for(size_t beg = 0; beg < n; beg += this->sigma) {
+                    size_t end = std::min(n, beg + this->sigma);
+                    std::stable_sort(order.begin() + beg, order.begin() + end,
+                            [&](size_t a, size_t b) {
+                                return ptr[a+1] - ptr[a] > ptr[b+1] - ptr[b];
+                            });
+                }
+
+                std::vector<Col> _perm(n);
+                for(size_t i = 0; i < n; ++i) _perm[order[i]] = static_cast<Col>(i);
+
+                perm = backend::device_vector<Col>(q[0], n, _perm.data());
+            }
+
+            // Slice widths.
+            size_t nslices = (n + this->C - 1) / this->C;
+            std::vector<Ptr> _slice_ptr(nslices + 1);
+            _slice_ptr[0] = 0;
+
+            for(size_t s = 0; s < nslices; ++s) {
+                size_t w = 0;
+                for(size_t i = s * this->C, e = std::min(n, i + this->C); i < e; ++i)
+                    w = std::max(w, static_cast<size_t>(ptr[order[i]+1] - ptr[order[i]]));
+
+                _slice_ptr[s+1] = _slice_ptr[s] + static_cast<Ptr>(w * this->C);
+            }
+
+            // Fill the slices.
+            std::vector<Col> _col(_slice_ptr.back(), static_cast<Col>(-1));
+            std::vector<Val> _val(_slice_ptr.back(), Val());
+
+            for(size_t i = 0; i < n; ++i) {
+                size_t s = i / this->C, lane = i % this->C;
+                size_t head = _slice_ptr[s] + lane;
+
+                for(Ptr j = ptr[order[i]], e = ptr[order[i]+1]; j < e; ++j, head += this->C) {
+                    _col[head] = col[j];
+                    _val[head] = val[j];
+                }
+            }
+
+            slice_ptr = backend::device_vector<Ptr>(q[0], nslices + 1, _slice_ptr.data());
+            sell_col  = backend::device_vector<Col>(q[0], _col.size(), _col.data());
+            sell_val  = backend::device_vector<Val>(q[0], _val.size(), _val.data());
+            src_ptr   = backend::device_vector<Ptr>(q[0], n + 1, &ptr[0]);
+        }
+
+        // Dummy matrix; used internally to pass empty parameters to kernels.
+        sell(const backend::command_queue &q)
+            : q(q), n(0), m(0), nnz(0), C(0), sigma(0)
+        {}
+
+        template <class Expr>
+        friend
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            matrix_vector_product<sell, Expr>
+        >::type
+        operator*(const sell &A, const Expr &x) {
+            return matrix_vector_product<sell, Expr>(A, x);
+        }
+
+        template <class MV>
+        friend
+        typename std::enable_if<
+            std::is_base_of<multivector_terminal_expression, MV>::value,
+            matrix_multivector_product<sell, MV>
+        >::type
+        operator*(const sell &A, const MV &x) {
+            return matrix_multivector_product<sell, MV>(A, x);
+        }
+
+        template <class Vector>
+        static void terminal_preamble(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            detail::kernel_generator_state_ptr state)
+        {
+            detail::output_terminal_preamble tp(src, q, prm_name + "_x", state);
+            boost::proto::eval(boost::proto::as_child(x), tp);
+        }
+
+        template <class Vector>
+        static void local_terminal_init(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            detail::kernel_generator_state_ptr state)
+        {
+            typedef typename detail::return_type<Vector>::type x_type;
+            typedef spmv_ops_impl<Val, x_type> spmv_ops;
+
+            spmv_ops::decl_accum_var(src, prm_name + "_sum");
+            src.new_line() << "if (" << prm_name << "_slice_ptr)";
+            src.open("{");
+            src.new_line() << type_name<Col>() << " pos = " << prm_name << "_perm ? "
+                << prm_name << "_perm[idx] : idx;";
+            src.new_line() << type_name<Col>() << " slice = pos / " << prm_name << "_C;";
+            src.new_line() << type_name<Ptr>() << " beg = " << prm_name << "_slice_ptr[slice] + pos % " << prm_name << "_C;";
+            src.new_line() << type_name<Ptr>() << " end = " << prm_name << "_slice_ptr[slice + 1];";
+            src.new_line() << "for(" << type_name<Ptr>() << " j = beg; j < end; j += " << prm_name << "_C)";
+            src.open("{");
+            src.new_line() << type_name<Col>() << " c = " << prm_name << "_col[j];";
+            src.new_line() << "if (c != (" << type_name<Col>() << ")(-1))";
+            src.open("{");
+
+            src.new_line() << type_name<Col>() << " idx = c;";
+
+            detail::output_local_preamble init_x(src, q, prm_name + "_x", state);
+            boost::proto::eval(boost::proto::as_child(x), init_x);
+
+            backend::source_generator vec_value;
+            detail::vector_expr_context expr_x(vec_value, q, prm_name + "_x", state);
+            boost::proto::eval(boost::proto::as_child(x), expr_x);
+
+            spmv_ops::append_product(src, prm_name + "_sum", prm_name + "_val[j]", vec_value.str());
+
+            src.close("} else break;");
+            src.close("}");
+            src.close("}");
+        }
+
+        template <class Vector>
+        static void kernel_param_declaration(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            detail::kernel_generator_state_ptr state)
+        {
+            src.parameter< int >(prm_name + "_C");
+            src.parameter< global_ptr<Col> >(prm_name + "_perm");
+            src.parameter< global_ptr<Ptr> >(prm_name + "_slice_ptr");
+            src.parameter< global_ptr<Col> >(prm_name + "_col");
+            src.parameter< global_ptr<Val> >(prm_name + "_val");
+
+            detail::declare_expression_parameter decl_x(src, q, prm_name + "_x", state);
+            detail::extract_terminals()(boost::proto::as_child(x), decl_x);
+        }
+
+        template <class Vector>
+        static void partial_vector_expr(const Vector &x, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            src << prm_name << "_sum";
+        }
+
+        template <class Vector>
+        void kernel_arg_setter(const Vector &x,
+            backend::kernel &kernel, unsigned part, size_t index_offset,
+            detail::kernel_generator_state_ptr state) const
+        {
+            kernel.push_arg(static_cast<int>(C));
+
+            if (nnz && sigma > 1)
+                kernel.push_arg(perm);
+            else
+                kernel.push_arg(static_cast<size_t>(0));
+
+            if (nnz) {
+                kernel.push_arg(slice_ptr);
+                kernel.push_arg(sell_col);
+                kernel.push_arg(sell_val);
+            } else {
+                kernel.push_arg(static_cast<size_t>(0));
+                kernel.push_arg(static_cast<size_t>(0));
+                kernel.push_arg(static_cast<size_t>(0));
+            }
+
+            detail::set_expression_argument x_args(kernel, part, index_offset, state);
+            detail::extract_terminals()( boost::proto::as_child(x), x_args);
+        }
+
+        template <class Vector>
+        void expression_properties(const Vector &x,
+            std::vector<backend::command_queue> &queue_list,
+            std::vector<size_t> &partition,
+            size_t &size) const
+        {
+            queue_list = std::vector<backend::command_queue>(1, q);
+            partition  = std::vector<size_t>(2, 0);
+            partition.back() = size = n;
+        }
+
+        /// Sparse matrix - multivector product.
+        /**
+         * Computes y = scale * A * x, or y += scale * A * x when append is
+         * set. Used by the multivector expressions (e.g. Y = A * X).
+         */
+        template <class MV>
+        void apply(const MV &x, MV &y,
+                typename cl_scalar_of<typename MV::sub_value_type>::type scale,
+                bool append = false) const
+        {
+            using namespace vex::detail;
+            typedef spmm_source<Val, MV> spmm;
+
+            spmm::check(x, y, rows(), cols());
+
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            backend::select_context(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_sell_spmm");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<int>("C");
+                src.template parameter< global_ptr<const Col> >("perm");
+                src.template parameter< global_ptr<const Ptr> >("slice_ptr");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<const Val> >("val");
+                spmm::parameters(src);
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                spmm::begin_row(src);
+                src.new_line() << "if (slice_ptr)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " pos = perm ? perm[idx] : idx;";
+                src.new_line() << type_name<Col>() << " slice = pos / C;";
+                src.new_line() << "for(" << type_name<Ptr>() << " j = slice_ptr[slice] + pos % C, e = slice_ptr[slice + 1]; j < e; j += C)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " c = col[j];";
+                src.new_line() << "if (c == (" << type_name<Col>() << ")(-1)) break;";
+                spmm::nonzero(src, "val[j]", "c");
+                src.close("}");
+                src.close("}");
+                spmm::end_row(src);
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_sell_spmm"));
+            }
+
+            K->second.push_arg(n);
+            K->second.push_arg(static_cast<int>(C));
+            if (nnz && sigma > 1)
+                K->second.push_arg(perm);
+            else
+                K->second.push_arg(static_cast<size_t>(0));
+            if (nnz) {
+                K->second.push_arg(slice_ptr);
+                K->second.push_arg(sell_col);
+                K->second.push_arg(sell_val);
+            } else {
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(static_cast<size_t>(0));
+            }
+            spmm::set_arguments(K->second, x, y, scale, append);
+
+            K->second(q);
+        }
+
+        size_t rows()     const { return n; }
+        size_t cols()     const { return m; }
+        size_t nonzeros() const { return nnz; }
+
+        /// Slice height.
+        size_t slice_height() const { return C; }
+
+        /// Sorting window.
+        size_t sorting_window() const { return sigma; }
+
+        /// Replaces the values of the nonzeros, keeping the sparsity pattern.
+        /**
+         * The values should be given in the order of the column indices the
+         * matrix was constructed with. The row order and the slices are
+         * reused, so only the value array is rewritten.
+         */
+        template <class ValRange>
+        void update_values(const ValRange &v) {
+            precondition(static_cast<size_t>(boost::size(v)) == nnz,
+                    "Wrong number of values");
+
+            if (!nnz) return;
+
+            backend::device_vector<Val> tmp(q, nnz, &v[0]);
+            scatter_values(tmp);
+        }
+
+        /// Replaces the values of the nonzeros with the values on the device.
+        void update_values(const vector<Val> &v) {
+            precondition(v.size() == nnz, "Wrong number of values");
+
+            if (nnz) scatter_values(v(0));
+        }
+
+        /// Transposed matrix.
+        /**
+         * The column-wise structure is built on the device on first use and
+         * is cached afterwards. It refers to the nonzeros in the slices of
+         * the matrix, so the values are not copied.
+         * \sa vex::sparse::csr::transposed()
+         */
+        const csr_transposed<Val, Col, Ptr>& transposed() const {
+            if (!At) build_transposed();
+            return *At;
+        }
+    private:
+        backend::command_queue q;
+
+        size_t n, m, nnz, C, sigma;
+
+        // Position of each row in the sorted order.
+        backend::device_vector<Col> perm;
+
+        backend::device_vector<Ptr> slice_ptr;
+        backend::device_vector<Col> sell_col;
+        backend::device_vector<Val> sell_val;
+
+        // Row pointer of the original matrix; used to scatter the updated
+        // values into the slices.
+        backend::device_vector<Ptr> src_ptr;
+
+        mutable std::shared_ptr< csr_transposed<Val, Col, Ptr> > At;
+
+        // Column, row, and position in the slices of every nonzero, in the
+        // order the matrix was constructed with.
+        void build_transposed() const {
+            std::vector<backend::command_queue> ctx(1, q);
+
+            vector<Col> c, r;
+            vector<Ptr> p;
+
+            if (nnz) {
+                c.resize(ctx, nnz);
+                r.resize(ctx, nnz);
+                p.resize(ctx, nnz);
+
+                using namespace vex::detail;
+                static kernel_cache cache;
+
+                auto K = cache.find(q);
+                if (K == cache.end()) {
+                    backend::source_generator src(q);
+
+                    src.begin_kernel("vexcl_sell_transpose");
+                    src.begin_kernel_parameters();
+                    src.template parameter<size_t>("n");
+                    src.template parameter<size_t>("C");
+                    src.template parameter< global_ptr<const Col> >("perm");
+                    src.template parameter< global_ptr<const Ptr> >("slice_ptr");
+                    src.template parameter< global_ptr<const Col> >("sell_col");
+                    src.template parameter< global_ptr<const Ptr> >("ptr");
+                    src.template parameter< global_ptr<Col> >("col");
+                    src.template parameter< global_ptr<Col> >("row");
+                    src.template parameter< global_ptr<Ptr> >("pos");
+                    src.end_kernel_parameters();
+                    src.grid_stride_loop().open("{");
+
+                    src.new_line() << type_name<Col>() << " p = perm ? perm[idx] : idx;";
+                    src.new_line() << type_name<Ptr>() << " head = slice_ptr[p / C] + p % C;";
+                    src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[idx], e = ptr[idx+1]; j < e; ++j, head += C)";
+                    src.open("{");
+                    src.new_line() << "col[j] = sell_col[head];";
+                    src.new_line() << "row[j] = idx;";
+                    src.new_line() << "pos[j] = head;";
+                    src.close("}");
+
+                    src.close("}");
+                    src.end_kernel();
+
+                    K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_sell_transpose"));
+                }
+
+                K->second.push_arg(n);
+                K->second.push_arg(C);
+                if (sigma > 1)
+                    K->second.push_arg(perm);
+                else
+                    K->second.push_arg(static_cast<size_t>(0));
+                K->second.push_arg(slice_ptr);
+                K->second.push_arg(sell_col);
+                K->second.push_arg(src_ptr);
+                K->second.push_arg(c(0));
+                K->second.push_arg(r(0));
+                K->second.push_arg(p(0));
+                K->second(q);
+            }
+
+            At = std::make_shared< csr_transposed<Val, Col, Ptr> >(
+                    q, m, n, c, r, p, sell_val);
+        }
+
+        void scatter_values(const backend::device_vector<Val> &v) {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_sell_update_values");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<size_t>("C");
+                src.template parameter< global_ptr<const Col> >("perm");
+                src.template parameter< global_ptr<const Ptr> >("slice_ptr");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<const Val> >("val");
+                src.template parameter< global_ptr<Val> >("sell_val");
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                src.new_line() << type_name<Col>() << " pos = perm ? perm[idx] : idx;";
+                src.new_line() << type_name<Ptr>() << " head = slice_ptr[pos / C] + pos % C;";
+                src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[idx], e = ptr[idx+1]; j < e; ++j, head += C)";
+                src.new_line() << "  sell_val[head] = val[j];";
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_sell_update_values"));
+            }
+
+            K->second.push_arg(n);
+            K->second.push_arg(C);
+            if (sigma > 1)
+                K->second.push_arg(perm);
+            else
+                K->second.push_arg(static_cast<size_t>(0));
+            K->second.push_arg(slice_ptr);
+            K->second.push_arg(src_ptr);
+            K->second.push_arg(v);
+            K->second.push_arg(sell_val);
+            K->second(q);
+        }
+};
+
+} // namespace sparse
+} // namespace vex
+
+#endif
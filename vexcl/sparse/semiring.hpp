@@ -0,0 +1,297 @@
+#ifndef VEXCL_SPARSE_SEMIRING_HPP
+#define VEXCL_SPARSE_SEMIRING_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/semiring.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Sparse matrix-vector product over a semiring.
+ */
+
+#include <string>
+#include <sstream>
+#include <limits>
+#include <type_traits>
+
+#include <vexcl/operations.hpp>
+#include <vexcl/sparse/product.hpp>
+
+namespace vex {
+namespace detail {
+
+// Source representation of a constant that survives the round trip through
+// the compute kernel source.
+template <typename T>
+std::string semiring_constant(T v) {
+    std::ostringstream s;
+    s.precision(std::numeric_limits<T>::max_digits10);
+    s << "((" << type_name<T>() << ")" << +v << (std::is_unsigned<T>::value ? "u" : "") << ")";
+    return s.str();
+}
+
+} // namespace detail
+
+namespace sparse {
+
+/// The usual (+,*) semiring.
+struct plus_times {
+    // In order to define a semiring for vex::sparse::over, one should define
+    // a struct like the following:
+    template <class T>
+    struct impl {
+        // Additive identity (the value of an empty row).
+        static T zero() {
+            return T();
+        }
+
+        // Device-side addition.
+        struct add : UserFunction<add, T(T, T)> {
+            static std::string body() { return "return prm1 + prm2;"; }
+        };
+
+        // Device-side multiplication.
+        struct mul : UserFunction<mul, T(T, T)> {
+            static std::string body() { return "return prm1 * prm2;"; }
+        };
+    };
+};
+
+/// Tropical (min,+) semiring.
+/**
+ * Used for the single source shortest paths. The largest value of the type
+ * stands for the infinity and is preserved by the multiplication.
+ */
+struct min_plus {
+    template <class T>
+    struct impl {
+        static T zero() {
+            return std::numeric_limits<T>::max();
+        }
+
+        struct add : UserFunction<add, T(T, T)> {
+            static std::string body() { return "return prm1 < prm2 ? prm1 : prm2;"; }
+        };
+
+        struct mul : UserFunction<mul, T(T, T)> {
+            static std::string body() {
+                std::string inf = vex::detail::semiring_constant(zero());
+                return "return (prm1 == " + inf + " || prm2 == " + inf + ") ? "
+                    + inf + " : prm1 + prm2;";
+            }
+        };
+    };
+};
+
+/// (max,*) semiring.
+/**
+ * Used e.g. for the most reliable paths. The values are assumed to be
+ * nonnegative, so that zero is the additive identity.
+ */
+struct max_times {
+    template <class T>
+    struct impl {
+        static T zero() {
+            return T();
+        }
+
+        struct add : UserFunction<add, T(T, T)> {
+            static std::string body() { return "return prm1 > prm2 ? prm1 : prm2;"; }
+        };
+
+        struct mul : UserFunction<mul, T(T, T)> {
+            static std::string body() { return "return prm1 * prm2;"; }
+        };
+    };
+};
+
+/// Boolean (or,and) semiring.
+/**
+ * Used for the breadth-first search. Any nonzero value is true, the result
+ * is either 0 or 1.
+ */
+struct or_and {
+    template <class T>
+    struct impl {
+        static T zero() {
+            return T();
+        }
+
+        struct add : UserFunction<add, T(T, T)> {
+            static std::string body() { return "return (prm1 || prm2) ? 1 : 0;"; }
+        };
+
+        struct mul : UserFunction<mul, T(T, T)> {
+            static std::string body() { return "return (prm1 && prm2) ? 1 : 0;"; }
+        };
+    };
+};
+
+/// Low-level operations for sparse matrix-vector product over a semiring.
+/**
+ * Drop-in replacement for vex::sparse::spmv_ops_impl. The semiring
+ * operations are defined for each accumulator as <sum>_add and <sum>_mul.
+ */
+template <class Semiring, class mat_type, class vec_type>
+struct semiring_spmv_ops {
+    typedef decltype(std::declval<mat_type>() * std::declval<vec_type>()) res_type;
+    typedef typename Semiring::template impl<res_type> S;
+
+    static_assert(std::is_arithmetic<res_type>::value,
+            "Semiring products are only supported for scalar types");
+
+    static void define(backend::source_generator &src, const std::string &sum)
+    {
+        S::add::define(src, sum + "_add");
+        S::mul::define(src, sum + "_mul");
+    }
+
+    static void decl_accum_var(backend::source_generator &src, const std::string &name)
+    {
+        src.new_line() << type_name<res_type>() << " " << name << " = "
+            << vex::detail::semiring_constant(S::zero()) << ";";
+    }
+
+    static void append(backend::source_generator &src,
+            const std::string &sum, const std::string &val)
+    {
+        src.new_line() << sum << " = " << sum << "_add(" << sum << ", " << val << ");";
+    }
+
+    static void append_product(backend::source_generator &src,
+            const std::string &sum, const std::string &mat_val, const std::string &vec_val)
+    {
+        src.new_line() << sum << " = " << sum << "_add(" << sum << ", "
+            << sum << "_mul(" << mat_val << ", " << vec_val << "));";
+    }
+};
+
+/// Sparse matrix in CSR or ELL format viewed over a semiring.
+/**
+ * The product of the view and a vector expression is computed by the
+ * kernels of the underlying matrix, with the multiply-add replaced by the
+ * semiring operations. Instances are created with vex::sparse::over():
+ *
+ \code
+ vex::sparse::csr<double> A(ctx, n, n, ptr, col, weight);
+
+ // Relax the distances of the single source shortest paths:
+ next = min(dist, vex::sparse::over<vex::sparse::min_plus>(A) * dist);
+ \endcode
+ *
+ * The view holds a reference to the matrix, and should be consumed in the
+ * expression it is created in.
+ */
+template <class Semiring, class Matrix>
+class semiring_view {
+    public:
+        typedef typename Matrix::value_type value_type;
+
+        semiring_view(const Matrix &A) : A(A) {}
+
+        template <class Expr>
+        friend
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            matrix_vector_product<semiring_view, Expr>
+        >::type
+        operator*(const semiring_view &A, const Expr &x) {
+            return matrix_vector_product<semiring_view, Expr>(A, x);
+        }
+
+        template <class Vector>
+        static void terminal_preamble(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            vex::detail::kernel_generator_state_ptr state)
+        {
+            Matrix::terminal_preamble(x, src, q, prm_name, state);
+            ops<Vector>::define(src, prm_name + "_sum");
+        }
+
+        template <class Vector>
+        static void local_terminal_init(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            vex::detail::kernel_generator_state_ptr state)
+        {
+            Matrix::template local_terminal_init<Vector, ops<Vector> >(x, src, q, prm_name, state);
+        }
+
+        template <class Vector>
+        static void kernel_param_declaration(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            vex::detail::kernel_generator_state_ptr state)
+        {
+            Matrix::template kernel_param_declaration<Vector, ops<Vector> >(x, src, q, prm_name, state);
+        }
+
+        template <class Vector>
+        static void partial_vector_expr(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            vex::detail::kernel_generator_state_ptr state)
+        {
+            Matrix::partial_vector_expr(x, src, q, prm_name, state);
+        }
+
+        template <class Vector>
+        void kernel_arg_setter(const Vector &x,
+            backend::kernel &kernel, unsigned part, size_t index_offset,
+            vex::detail::kernel_generator_state_ptr state) const
+        {
+            A.template kernel_arg_setter<Vector, ops<Vector> >(x, kernel, part, index_offset, state);
+        }
+
+        template <class Vector>
+        void expression_properties(const Vector &x,
+            std::vector<backend::command_queue> &queue_list,
+            std::vector<size_t> &partition,
+            size_t &size) const
+        {
+            A.expression_properties(x, queue_list, partition, size);
+        }
+    private:
+        const Matrix &A;
+
+        template <class Vector>
+        struct ops : semiring_spmv_ops<Semiring, value_type,
+                        typename vex::detail::return_type<Vector>::type> {};
+};
+
+/// Views the sparse matrix over the given semiring.
+/**
+ * Supported for vex::sparse::csr and vex::sparse::ell.
+ */
+template <class Semiring, class Matrix>
+semiring_view<Semiring, Matrix> over(const Matrix &A) {
+    return semiring_view<Semiring, Matrix>(A);
+}
+
+} // namespace sparse
+} // namespace vex
+
+#endif
@@ -0,0 +1,237 @@
+#ifndef VEXCL_SPARSE_SPGEMM_HPP
+#define VEXCL_SPARSE_SPGEMM_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/spgemm.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Sparse matrix-matrix product.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <limits>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/scan.hpp>
+#include <vexcl/sort.hpp>
+#include <vexcl/reduce_by_key.hpp>
+#include <vexcl/sparse/csr.hpp>
+#include <vexcl/sparse/coo.hpp>
+
+namespace vex {
+namespace sparse {
+
+namespace detail {
+
+// Number of products contributing to each row of A * B. The counts are
+// 64-bit, since the total number of products may exceed the range of Ptr
+// even when the number of nonzeros in A * B does not.
+template <typename Val, typename Col, typename Ptr>
+backend::kernel& spgemm_row_size_kernel(const backend::command_queue &q) {
+    using namespace vex::detail;
+    static kernel_cache cache;
+
+    auto K = cache.find(q);
+    if (K == cache.end()) {
+        backend::source_generator src(q);
+
+        src.begin_kernel("vexcl_spgemm_row_size");
+        src.begin_kernel_parameters();
+        src.template parameter<size_t>("n");
+        src.template parameter< global_ptr<const Ptr> >("A_ptr");
+        src.template parameter< global_ptr<const Col> >("A_col");
+        src.template parameter< global_ptr<const Ptr> >("B_ptr");
+        src.template parameter< global_ptr<cl_ulong> >("cnt");
+        src.end_kernel_parameters();
+        src.grid_stride_loop().open("{");
+        src.new_line() << type_name<cl_ulong>() << " s = 0;";
+        src.new_line() << "for(" << type_name<Ptr>() << " j = A_ptr[idx], e = A_ptr[idx+1]; j < e; ++j)";
+        src.open("{");
+        src.new_line() << type_name<Col>() << " c = A_col[j];";
+        src.new_line() << "s += B_ptr[c+1] - B_ptr[c];";
+        src.close("}");
+        src.new_line() << "cnt[idx] = s;";
+        src.close("}");
+        src.end_kernel();
+
+        K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_spgemm_row_size"));
+    }
+
+    return K->second;
+}
+
+// Writes all products a_ij * b_jk of A * B along with their packed
+// (i * m + k) keys.
+template <typename Val, typename Col, typename Ptr>
+backend::kernel& spgemm_expand_kernel(const backend::command_queue &q) {
+    using namespace vex::detail;
+    static kernel_cache cache;
+
+    auto K = cache.find(q);
+    if (K == cache.end()) {
+        backend::source_generator src(q);
+
+        src.begin_kernel("vexcl_spgemm_expand");
+        src.begin_kernel_parameters();
+        src.template parameter<size_t>("n");
+        src.template parameter<cl_ulong>("m");
+        src.template parameter< global_ptr<const Ptr> >("A_ptr");
+        src.template parameter< global_ptr<const Col> >("A_col");
+        src.template parameter< global_ptr<const Val> >("A_val");
+        src.template parameter< global_ptr<const Ptr> >("B_ptr");
+        src.template parameter< global_ptr<const Col> >("B_col");
+        src.template parameter< global_ptr<const Val> >("B_val");
+        src.template parameter< global_ptr<const cl_ulong> >("ptr");
+        src.template parameter< global_ptr<cl_ulong> >("key");
+        src.template parameter< global_ptr<Val> >("val");
+        src.end_kernel_parameters();
+        src.grid_stride_loop().open("{");
+        src.new_line() << type_name<cl_ulong>() << " row = idx * m;";
+        src.new_line() << type_name<cl_ulong>() << " pos = ptr[idx];";
+        src.new_line() << "for(" << type_name<Ptr>() << " j = A_ptr[idx], e = A_ptr[idx+1]; j < e; ++j)";
+        src.open("{");
+        src.new_line() << type_name<Col>() << " c = A_col[j];";
+        src.new_line() << type_name<Val>() << " a = A_val[j];";
+        src.new_line() << "for(" << type_name<Ptr>() << " k = B_ptr[c], f = B_ptr[c+1]; k < f; ++k, ++pos)";
+        src.open("{");
+        src.new_line() << "key[pos] = row + B_col[k];";
+        src.new_line() << "val[pos] = a * B_val[k];";
+        src.close("}");
+        src.close("}");
+        src.close("}");
+        src.end_kernel();
+
+        K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_spgemm_expand"));
+    }
+
+    return K->second;
+}
+
+} // namespace detail
+
+/// Sparse matrix-matrix product.
+/**
+ * Computes C = A * B on the device with the ESC (expand, sort, compress)
+ * algorithm. The symbolic pass counts the products contributing to each row
+ * of C, and the row offsets are found with vex::exclusive_scan(). The
+ * products are then expanded into a temporary buffer along with their (row,
+ * column) keys, sorted with vex::sort_by_key(), and the duplicates are summed
+ * up with vex::reduce_by_key().
+ *
+ * The temporary storage is proportional to the number of products (rather
+ * than to the number of nonzeros in C). The products are counted with 64-bit
+ * integers, so their number may exceed the range of Ptr; the number of
+ * nonzeros in C is checked against it.
+ */
+template <typename Val, typename Col, typename Ptr>
+csr<Val, Col, Ptr> multiply(const csr<Val, Col, Ptr> &A, const csr<Val, Col, Ptr> &B)
+{
+    precondition(A.cols() == B.rows(), "Incompatible matrix sizes");
+
+    const backend::command_queue &q = A.q;
+    std::vector<backend::command_queue> ctx(1, q);
+
+    const size_t   n = A.rows();
+    const cl_ulong m = B.cols();
+
+    vector<Ptr> ptr(ctx, n + 1);
+
+    if (!A.nnz || !B.nnz) {
+        ptr = 0;
+        return csr<Val, Col, Ptr>(n, m, ptr, vector<Col>(), vector<Val>(), false);
+    }
+
+    backend::select_context(q);
+
+    // 1. Symbolic pass and row offsets of the expanded products.
+    vector<cl_ulong> off(ctx, n + 1);
+    {
+        vector<cl_ulong> cnt(ctx, n + 1);
+        cnt[n] = 0;
+
+        auto &K = detail::spgemm_row_size_kernel<Val, Col, Ptr>(q);
+
+        K.push_arg(n);
+        K.push_arg(A.ptr);
+        K.push_arg(A.col);
+        K.push_arg(B.ptr);
+        K.push_arg(cnt(0));
+        K(q);
+
+        exclusive_scan(cnt, off);
+    }
+
+    const cl_ulong total = off[n];
+
+    precondition(total <= std::numeric_limits<size_t>::max(),
+            "sparse::multiply: the number of products exceeds the range of size_t");
+
+    const size_t nprod = static_cast<size_t>(total);
+
+    if (!nprod) {
+        ptr = 0;
+        return csr<Val, Col, Ptr>(n, m, ptr, vector<Col>(), vector<Val>(), false);
+    }
+
+    // 2. Expand the products.
+    vector<cl_ulong> key(ctx, nprod);
+    vector<Val>      val(ctx, nprod);
+
+    {
+        auto &K = detail::spgemm_expand_kernel<Val, Col, Ptr>(q);
+
+        K.push_arg(n);
+        K.push_arg(m);
+        K.push_arg(A.ptr);
+        K.push_arg(A.col);
+        K.push_arg(A.val);
+        K.push_arg(B.ptr);
+        K.push_arg(B.col);
+        K.push_arg(B.val);
+        K.push_arg(off(0));
+        K.push_arg(key(0));
+        K.push_arg(val(0));
+        K(q);
+    }
+
+    // 3. Sort the products by (row, column), sum up the duplicates, and
+    // compress the keys into the CSR structure.
+    vector<Col> col;
+    vector<Val> uval;
+
+    vex::detail::keys_to_csr(q, n, m, key, val, ptr, col, uval);
+
+    return csr<Val, Col, Ptr>(n, m, ptr, col, uval, false);
+}
+
+} // namespace sparse
+} // namespace vex
+
+#endif
@@ -57,6 +57,55 @@ struct spmv_ops_impl {
     }
 };
 
+// Product of a scalar matrix and an interleaved block vector (each element
+// of the vector holds several right-hand sides). Every nonzero is read once
+// and is applied to all components of the block.
+template <class mat_type, class vec_type>
+struct spmv_ops_impl<mat_type, vec_type,
+    typename std::enable_if<
+        std::is_arithmetic<mat_type>::value &&
+        (cl_vector_length<vec_type>::value > 1)
+    >::type
+    >
+{
+    static const unsigned N = cl_vector_length<vec_type>::value;
+
+    static std::string component(unsigned k) {
+        static const char *xyzw[] = {"x", "y", "z", "w"};
+        static const char *hex = "0123456789abcdef";
+
+        return N <= 4 ? std::string(xyzw[k]) : std::string("s") + hex[k];
+    }
+
+    static void decl_accum_var(backend::source_generator &src, const std::string &name)
+    {
+        src.new_line() << type_name<vec_type>() << " " << name << " = {";
+        for(unsigned k = 0; k < N; ++k) src << (k ? ",0" : "0");
+        src << "};";
+    }
+
+    static void append(backend::source_generator &src,
+            const std::string &sum, const std::string &val)
+    {
+        src.open("{");
+        src.new_line() << type_name<vec_type>() << " b = " << val << ";";
+        for(unsigned k = 0; k < N; ++k)
+            src.new_line() << sum << "." << component(k) << " += b." << component(k) << ";";
+        src.close("}");
+    }
+
+    static void append_product(backend::source_generator &src,
+            const std::string &sum, const std::string &mat_val, const std::string &vec_val)
+    {
+        src.open("{");
+        src.new_line() << type_name<mat_type>() << " a = " << mat_val << ";";
+        src.new_line() << type_name<vec_type>() << " b = " << vec_val << ";";
+        for(unsigned k = 0; k < N; ++k)
+            src.new_line() << sum << "." << component(k) << " += a * b." << component(k) << ";";
+        src.close("}");
+    }
+};
+
 } // namespace sparse
 } // namespace vex
 
@@ -0,0 +1,500 @@
+#ifndef VEXCL_SPARSE_SYMMETRIC_HPP
+#define VEXCL_SPARSE_SYMMETRIC_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/symmetric.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Symmetric sparse matrix with the upper triangle stored in CSR format.
+ */
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <numeric>
+#include <type_traits>
+
+#include <boost/range.hpp>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/sparse/product.hpp>
+
+namespace vex {
+namespace sparse {
+
+/// Split of the symmetric matrix product between the threads.
+enum class symmetric_split {
+    automatic,  ///< Chunks on CPUs, colored chunks on other devices.
+    chunks,     ///< A chunk of rows per workgroup, processed in a single pass.
+    colored     ///< Many chunks of rows, processed in two passes.
+};
+
+/// Symmetric sparse matrix.
+/**
+ * Only the upper triangle of the matrix (including the diagonal) is stored,
+ * in CSR format, which halves the amount of matrix data read by the product.
+ * The constructor accepts either the full symmetric matrix or just its upper
+ * triangle; nonzeros below the diagonal are ignored.
+ *
+ * The product is computed by a separate kernel before the expression is
+ * evaluated. A nonzero \f$a_{ij}\f$ of the upper triangle contributes
+ * \f$a_{ij} x_j\f$ to \f$y_i\f$ and \f$a_{ij} x_i\f$ to \f$y_j\f$. The second
+ * contribution is written to a slot, and the slots are gathered by the
+ * receiving rows when the expression is evaluated, so no atomic operations
+ * are needed.
+ *
+ * The rows are split into chunks with an equal number of nonzeros, and each
+ * chunk is processed sequentially by a single thread. On CPUs there is a
+ * chunk per workgroup, and contributions to rows of the same chunk are added
+ * in place, so only those crossing the chunk boundaries need a slot. On other
+ * devices there are many more chunks, and they are processed in two passes:
+ * the even chunks first, then the odd ones. A chunk also adds in place to the
+ * rows of the next chunk, which is not processed in the same pass, so only
+ * the contributions reaching past the next chunk need a slot. In both cases
+ * the number of slots depends on the bandwidth of the matrix with respect to
+ * the chunk size.
+ *
+ * Only arithmetic value types are supported.
+ */
+template <typename Val, typename Col = int, typename Ptr = Col>
+class symmetric {
+    static_assert(std::is_arithmetic<Val>::value,
+            "sparse::symmetric only supports arithmetic value types");
+    public:
+        typedef Val value_type;
+
+        typedef Val val_type;
+        typedef Col col_type;
+        typedef Ptr ptr_type;
+
+        template <class PtrRange, class ColRange, class ValRange>
+        symmetric(
+                const std::vector<backend::command_queue> &q,
+                size_t nrows, size_t ncols,
+                const PtrRange &ptr,
+                const ColRange &col,
+                const ValRange &val,
+                bool /*fast_setup*/ = true,
+                symmetric_split split = symmetric_split::automatic
+           ) :
+            q(q[0]), n(nrows), nnz(0), nchunks(0), reach(0), nslots(0), nrecv(0)
+        {
+            precondition(q.size() == 1,
+                    "sparse::symmetric is only supported for single-device contexts");
+            precondition(nrows == ncols, "Symmetric matrix should be square");
+
+            // Upper triangle.
+            std::vector<Ptr> _ptr(n + 1);
+            std::vector<Col> _col;
+            std::vector<Val> _val;
+
+            _ptr[0] = 0;
+            for(size_t i = 0; i < n; ++i) {
+                for(auto j = ptr[i], e = ptr[i+1]; j < e; ++j) {
+                    if (static_cast<size_t>(col[j]) < i) continue;
+                    _col.push_back(static_cast<Col>(col[j]));
+                    _val.push_back(static_cast<Val>(val[j]));
+                }
+                _ptr[i+1] = static_cast<Ptr>(_col.size());
+            }
+
+            nnz = _col.size();
+
+            if (!n) return;
+
+            if (split == symmetric_split::automatic)
+                split = is_cpu(q[0]) ? symmetric_split::chunks : symmetric_split::colored;
+
+            // A chunk adds in place to its own rows and to the rows of the
+            // next reach chunks.
+            const size_t nthreads = backend::kernel::num_workgroups(q[0]);
+
+            if (split == symmetric_split::colored) {
+                nchunks = std::min(64 * nthreads, n);
+                reach   = 1;
+            } else {
+                nchunks = std::min(nthreads, n);
+                reach   = 0;
+            }
+
+            // Chunks with equal number of nonzeros.
+            std::vector<Col> _chunk(nchunks + 1);
+            for(size_t c = 0; c < nchunks; ++c)
+                _chunk[c] = static_cast<Col>(std::lower_bound(_ptr.begin(), _ptr.end(),
+                            static_cast<Ptr>(c * nnz / nchunks)) - _ptr.begin());
+            _chunk[nchunks] = static_cast<Col>(n);
+
+            // Transposed contributions that reach past the rows updated in
+            // place get a slot each; the slot holds the row receiving it.
+            // Slots of a chunk are numbered in the order of the nonzeros, so
+            // the kernel only needs the first slot of a chunk.
+            std::vector<Col> _target;
+            std::vector<Ptr> _slot_ptr(nchunks + 1);
+
+            for(size_t c = 0; c < nchunks; ++c) {
+                Col lim = _chunk[std::min(c + 1 + reach, nchunks)];
+
+                _slot_ptr[c] = static_cast<Ptr>(_target.size());
+                for(Col i = _chunk[c]; i < _chunk[c+1]; ++i)
+                    for(Ptr j = _ptr[i]; j < _ptr[i+1]; ++j)
+                        if (_col[j] >= lim) _target.push_back(_col[j]);
+            }
+            _slot_ptr[nchunks] = static_cast<Ptr>(_target.size());
+
+            this->chunk    = backend::device_vector<Col>(q[0], nchunks + 1, _chunk.data());
+            this->slot_ptr = backend::device_vector<Ptr>(q[0], nchunks + 1, _slot_ptr.data());
+
+            nrecv = nslots = _target.size();
+
+            this->ptr = backend::device_vector<Ptr>(q[0], n + 1, _ptr.data());
+
+            if (nnz) {
+                this->col = backend::device_vector<Col>(q[0], nnz, _col.data());
+                this->val = backend::device_vector<Val>(q[0], nnz, _val.data());
+            }
+
+            if (nrecv) {
+                // Slots received by each row.
+                std::vector<Ptr> _recv_ptr(n + 1, 0);
+                std::vector<Ptr> _recv(nrecv);
+
+                for(size_t s = 0; s < nslots; ++s)
+                    ++_recv_ptr[_target[s] + 1];
+                std::partial_sum(_recv_ptr.begin(), _recv_ptr.end(), _recv_ptr.begin());
+
+                std::vector<Ptr> head(_recv_ptr.begin(), _recv_ptr.end() - 1);
+                for(size_t s = 0; s < nslots; ++s)
+                    _recv[head[_target[s]]++] = static_cast<Ptr>(s);
+
+                this->recv_ptr = backend::device_vector<Ptr>(q[0], n + 1, _recv_ptr.data());
+                this->recv     = backend::device_vector<Ptr>(q[0], nrecv, _recv.data());
+            }
+        }
+
+        // Dummy matrix; used internally to pass empty parameters to kernels.
+        symmetric(const backend::command_queue &q)
+            : q(q), n(0), nnz(0), nchunks(0), reach(0), nslots(0), nrecv(0)
+        {}
+
+        template <class Expr>
+        friend
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            matrix_vector_product<symmetric, Expr>
+        >::type
+        operator*(const symmetric &A, const Expr &x) {
+            return matrix_vector_product<symmetric, Expr>(A, x);
+        }
+
+        // The product is computed by a separate kernel, so the expression
+        // kernel does not need the vector.
+        template <class Vector>
+        static void terminal_preamble(const Vector&, backend::source_generator&,
+            const backend::command_queue&, const std::string&,
+            detail::kernel_generator_state_ptr)
+        { }
+
+        template <class Vector>
+        static void local_terminal_init(const Vector&, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            typedef typename product_type<Vector>::type T;
+
+            src.new_line() << type_name<T>() << " " << prm_name << "_sum = " << T() << ";";
+            src.new_line() << "if (" << prm_name << "_Ax)";
+            src.open("{");
+            src.new_line() << prm_name << "_sum = " << prm_name << "_Ax[idx];";
+            src.new_line() << "if (" << prm_name << "_recv_ptr)";
+            src.new_line() << "  for(" << type_name<Ptr>() << " s = " << prm_name << "_recv_ptr[idx], "
+                "e = " << prm_name << "_recv_ptr[idx + 1]; s < e; ++s)";
+            src.new_line() << "    " << prm_name << "_sum += "
+                << prm_name << "_slot[" << prm_name << "_recv[s]];";
+            src.close("}");
+        }
+
+        template <class Vector>
+        static void kernel_param_declaration(const Vector&, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            typedef typename product_type<Vector>::type T;
+
+            src.parameter< global_ptr<const T>   >(prm_name + "_Ax");
+            src.parameter< global_ptr<const Ptr> >(prm_name + "_recv_ptr");
+            src.parameter< global_ptr<const Ptr> >(prm_name + "_recv");
+            src.parameter< global_ptr<const T>   >(prm_name + "_slot");
+        }
+
+        template <class Vector>
+        static void partial_vector_expr(const Vector&, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            src << prm_name << "_sum";
+        }
+
+        template <class Vector>
+        void kernel_arg_setter(const Vector &x,
+            backend::kernel &kernel, unsigned/*part*/, size_t/*index_offset*/,
+            detail::kernel_generator_state_ptr state) const
+        {
+            typedef typename product_type<Vector>::type T;
+
+            if (!n) {
+                for(int k = 0; k < 4; ++k)
+                    kernel.push_arg(static_cast<size_t>(0));
+                return;
+            }
+
+            product_buffers &buf = product_buf.reserve(state);
+
+            // The sizes of the buffers are proportional to the size of T.
+            if (buf.bytes < n * sizeof(T)) {
+                buf.bytes = n * sizeof(T);
+                buf.Ax    = backend::device_vector<char>(q, n * sizeof(T));
+                if (nslots)
+                    buf.slot = backend::device_vector<char>(q, nslots * sizeof(T));
+            }
+
+            backend::device_vector<T> Ax = buf.Ax.template reinterpret<T>();
+            backend::device_vector<T> slot;
+            if (nslots) slot = buf.slot.template reinterpret<T>();
+
+            product(x, Ax, slot);
+
+            kernel.push_arg(Ax);
+            if (nrecv) {
+                kernel.push_arg(recv_ptr);
+                kernel.push_arg(recv);
+                kernel.push_arg(slot);
+            } else {
+                kernel.push_arg(static_cast<size_t>(0));
+                kernel.push_arg(static_cast<size_t>(0));
+                kernel.push_arg(static_cast<size_t>(0));
+            }
+        }
+
+        template <class Vector>
+        void expression_properties(const Vector&,
+            std::vector<backend::command_queue> &queue_list,
+            std::vector<size_t> &partition,
+            size_t &size) const
+        {
+            queue_list = std::vector<backend::command_queue>(1, q);
+            partition  = std::vector<size_t>(2, 0);
+            partition.back() = size = n;
+        }
+
+        size_t rows()     const { return n; }
+        size_t cols()     const { return n; }
+
+        /// Number of stored nonzeros (the upper triangle and the diagonal).
+        size_t nonzeros() const { return nnz; }
+    private:
+        backend::command_queue q;
+
+        size_t n, nnz, nchunks, reach, nslots, nrecv;
+
+        backend::device_vector<Ptr> ptr;
+        backend::device_vector<Col> col;
+        backend::device_vector<Val> val;
+
+        // First row of each chunk and first slot of each chunk.
+        backend::device_vector<Col> chunk;
+        backend::device_vector<Ptr> slot_ptr;
+
+        // Slots received by each row.
+        backend::device_vector<Ptr> recv_ptr;
+        backend::device_vector<Ptr> recv;
+
+        // Product results and transposed contributions.
+        struct product_buffers {
+            product_buffers() : bytes(0) {}
+
+            size_t bytes;
+            backend::device_vector<char> Ax;
+            backend::device_vector<char> slot;
+        };
+
+        mutable product_buffer_pool<product_buffers> product_buf;
+
+        template <class Vector>
+        struct product_type {
+            typedef typename detail::return_type<Vector>::type x_type;
+
+            static_assert(std::is_arithmetic<x_type>::value,
+                    "sparse::symmetric only supports arithmetic vector types");
+
+            typedef typename std::common_type<Val, x_type>::type type;
+        };
+
+        // Each thread processes a chunk of rows sequentially. With reach
+        // set, the even chunks are processed by the first launch, and the odd
+        // ones by the second; the first launch also clears the rows of the
+        // odd chunks.
+        template <class Vector, typename T>
+        void product(const Vector &x,
+                backend::device_vector<T> &Ax, backend::device_vector<T> &slot) const
+        {
+            using namespace vex::detail;
+
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            backend::select_context(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                output_terminal_preamble otp(src, q, "prm_x", empty_state());
+                boost::proto::eval(boost::proto::as_child(x), otp);
+
+                src.begin_kernel("vexcl_symmetric_spmv");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<size_t>("first");
+                src.template parameter<size_t>("stride");
+                src.template parameter<size_t>("reach");
+                src.template parameter<size_t>("nchunks");
+                src.template parameter<int>("clear");
+                src.template parameter< global_ptr<const Col> >("chunk");
+                src.template parameter< global_ptr<const Ptr> >("slot_ptr");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<const Val> >("val");
+                src.template parameter< global_ptr<T> >("Ax");
+                src.template parameter< global_ptr<T> >("slot");
+
+                extract_terminals()(boost::proto::as_child(x),
+                        declare_expression_parameter(src, q, "prm_x", empty_state()));
+
+                src.end_kernel_parameters();
+                src.grid_stride_loop("t", "n").open("{");
+
+                src.new_line() << "size_t c = first + t * stride;";
+                src.new_line() << "size_t l = c + 1 + reach;";
+                src.new_line() << "if (l > nchunks) l = nchunks;";
+                src.new_line() << type_name<Col>() << " beg = chunk[c];";
+                src.new_line() << type_name<Col>() << " end = chunk[c + 1];";
+                src.new_line() << type_name<Col>() << " lim = chunk[l];";
+                src.new_line() << type_name<Ptr>() << " s = slot_ptr[c];";
+                src.new_line() << "if (clear) for(" << type_name<Col>() << " i = beg; i < lim; ++i) Ax[i] = " << T() << ";";
+                src.new_line() << "for(" << type_name<Col>() << " i = beg; i < end; ++i)";
+                src.open("{");
+
+                src.new_line() << type_name<T>() << " xi;";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " idx = i;";
+                std::string xi = vector_value(x, src);
+                src.new_line() << "xi = " << xi << ";";
+                src.close("}");
+
+                src.new_line() << type_name<T>() << " sum = Ax[i];";
+                src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[i], e = ptr[i + 1]; j < e; ++j)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " k = col[j];";
+                src.new_line() << type_name<Val>() << " a = val[j];";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " idx = k;";
+                std::string xk = vector_value(x, src);
+                src.new_line() << "sum += a * " << xk << ";";
+                src.close("}");
+                src.new_line() << "if (k >= lim) slot[s++] = a * xi;";
+                src.new_line() << "else if (k != i) Ax[k] += a * xi;";
+                src.close("}");
+                src.new_line() << "Ax[i] = sum;";
+
+                src.close("}");
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_symmetric_spmv"));
+            }
+
+            auto &krn = K->second;
+
+            const size_t npass = reach ? 2 : 1;
+
+            for(size_t pass = 0; pass < npass; ++pass) {
+                krn.push_arg((nchunks - pass + npass - 1) / npass);
+                krn.push_arg(pass);
+                krn.push_arg(npass);
+                krn.push_arg(reach);
+                krn.push_arg(nchunks);
+                krn.push_arg(static_cast<int>(pass == 0));
+                krn.push_arg(chunk);
+                krn.push_arg(slot_ptr);
+                krn.push_arg(ptr);
+
+                if (nnz) {
+                    krn.push_arg(col);
+                    krn.push_arg(val);
+                } else {
+                    krn.push_arg(static_cast<size_t>(0));
+                    krn.push_arg(static_cast<size_t>(0));
+                }
+
+                krn.push_arg(Ax);
+
+                if (nslots)
+                    krn.push_arg(slot);
+                else
+                    krn.push_arg(static_cast<size_t>(0));
+
+                extract_terminals()(boost::proto::as_child(x),
+                        set_expression_argument(krn, 0, 0, empty_state()));
+
+                krn(q);
+            }
+        }
+
+        // Outputs the local preamble of the vector expression for the
+        // current value of idx and returns the expression value.
+        template <class Vector>
+        std::string vector_value(const Vector &x, backend::source_generator &src) const {
+            using namespace vex::detail;
+
+            output_local_preamble init_x(src, q, "prm_x", empty_state());
+            boost::proto::eval(boost::proto::as_child(x), init_x);
+
+            backend::source_generator vec_value;
+            vector_expr_context expr_x(vec_value, q, "prm_x", empty_state());
+            boost::proto::eval(boost::proto::as_child(x), expr_x);
+
+            return vec_value.str();
+        }
+};
+
+} // namespace sparse
+} // namespace vex
+
+#endif
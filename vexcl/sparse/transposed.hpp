@@ -0,0 +1,274 @@
+#ifndef VEXCL_SPARSE_TRANSPOSED_HPP
+#define VEXCL_SPARSE_TRANSPOSED_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/sparse/transposed.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Transposed view of a sparse matrix.
+ */
+
+#include <string>
+#include <vector>
+#include <tuple>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/sort.hpp>
+#include <vexcl/sparse/product.hpp>
+#include <vexcl/sparse/spmv_ops.hpp>
+
+namespace vex {
+namespace sparse {
+
+/// Transposed view of a sparse matrix.
+/**
+ * Holds the column-wise structure of the matrix: column pointers, row
+ * indices, and positions of the nonzeros in the value arrays of the original
+ * matrix. The values themselves are shared with the original matrix.
+ * Instances are created with the transposed() method of vex::sparse::csr,
+ * vex::sparse::ell, vex::sparse::sell, or vex::sparse::matrix.
+ */
+template <typename Val, typename Col = int, typename Ptr = Col>
+class csr_transposed {
+    public:
+        typedef Val value_type;
+
+        typedef Val val_type;
+        typedef Col col_type;
+        typedef Ptr ptr_type;
+
+        /// Builds the view from the nonzeros of the original matrix.
+        /**
+         * For every nonzero, col holds its column (the row of the transposed
+         * matrix), row holds its row, and pos holds its position in the
+         * values. Positions below split refer to val, the rest to tail (the
+         * ELL format keeps the nonzeros that do not fit into the ELL part in
+         * a separate CSR array). The index arrays are reordered in place.
+         */
+        csr_transposed(const backend::command_queue &q,
+                size_t nrows, size_t ncols,
+                vector<Col> &col, vector<Col> &row, vector<Ptr> &pos,
+                const backend::device_vector<Val> &val,
+                const backend::device_vector<Val> &tail = backend::device_vector<Val>(),
+                size_t split = 0
+                )
+            : q(q), n(nrows), m(ncols), nnz(col.size()),
+              split(tail.size() ? split : val.size()), val(val), tail(tail)
+        {
+            ptr = backend::device_vector<Ptr>(q, n + 1);
+
+            if (!nnz) {
+                vector<Ptr>(q, ptr, n + 1) = 0;
+                return;
+            }
+
+            sort_by_key(col, std::tie(row, pos), less<Col>());
+
+            auto &K = column_ptr_kernel();
+
+            K.push_arg(n + 1);
+            K.push_arg(nnz);
+            K.push_arg(col(0));
+            K.push_arg(ptr);
+            K(q);
+
+            this->row = row(0);
+            this->pos = pos(0);
+        }
+
+        template <class Expr>
+        friend
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr<Expr>::type,
+                vector_expr_grammar
+            >::value,
+            matrix_vector_product<csr_transposed, Expr>
+        >::type
+        operator*(const csr_transposed &A, const Expr &x) {
+            return matrix_vector_product<csr_transposed, Expr>(A, x);
+        }
+
+        template <class Vector>
+        static void terminal_preamble(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            detail::kernel_generator_state_ptr state)
+        {
+            detail::output_terminal_preamble tp(src, q, prm_name + "_x", state);
+            boost::proto::eval(boost::proto::as_child(x), tp);
+        }
+
+        template <class Vector>
+        static void local_terminal_init(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            detail::kernel_generator_state_ptr state)
+        {
+            typedef typename detail::return_type<Vector>::type x_type;
+            typedef spmv_ops_impl<Val, x_type> spmv_ops;
+
+            spmv_ops::decl_accum_var(src, prm_name + "_sum");
+            src.new_line() << "if (" << prm_name << "_row)";
+            src.open("{");
+            src.new_line() << type_name<Ptr>() << " col_beg = " << prm_name << "_ptr[idx];";
+            src.new_line() << type_name<Ptr>() << " col_end = " << prm_name << "_ptr[idx+1];";
+            src.new_line() << "for(" << type_name<Ptr>() << " j = col_beg; j < col_end; ++j)";
+            src.open("{");
+
+            src.new_line() << type_name<Col>() << " idx = " << prm_name << "_row[j];";
+
+            detail::output_local_preamble init_x(src, q, prm_name + "_x", state);
+            boost::proto::eval(boost::proto::as_child(x), init_x);
+
+            backend::source_generator vec_value;
+            detail::vector_expr_context expr_x(vec_value, q, prm_name + "_x", state);
+            boost::proto::eval(boost::proto::as_child(x), expr_x);
+
+            src.new_line() << type_name<Ptr>() << " p = " << prm_name << "_pos[j];";
+            spmv_ops::append_product(src, prm_name + "_sum",
+                    "(p < " + prm_name + "_split ? " +
+                    prm_name + "_val[p] : " + prm_name + "_tail[p - " + prm_name + "_split])",
+                    vec_value.str());
+
+            src.close("}");
+            src.close("}");
+        }
+
+        template <class Vector>
+        static void kernel_param_declaration(const Vector &x, backend::source_generator &src,
+            const backend::command_queue &q, const std::string &prm_name,
+            detail::kernel_generator_state_ptr state)
+        {
+            src.parameter< global_ptr<Ptr> >(prm_name + "_ptr");
+            src.parameter< global_ptr<Col> >(prm_name + "_row");
+            src.parameter< global_ptr<Ptr> >(prm_name + "_pos");
+            src.parameter< size_t          >(prm_name + "_split");
+            src.parameter< global_ptr<Val> >(prm_name + "_val");
+            src.parameter< global_ptr<Val> >(prm_name + "_tail");
+
+            detail::declare_expression_parameter decl_x(src, q, prm_name + "_x", state);
+            detail::extract_terminals()(boost::proto::as_child(x), decl_x);
+        }
+
+        template <class Vector>
+        static void partial_vector_expr(const Vector &x, backend::source_generator &src,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+        {
+            src << prm_name << "_sum";
+        }
+
+        template <class Vector>
+        void kernel_arg_setter(const Vector &x,
+            backend::kernel &kernel, unsigned part, size_t index_offset,
+            detail::kernel_generator_state_ptr state) const
+        {
+            kernel.push_arg(ptr);
+            if (nnz) {
+                kernel.push_arg(row);
+                kernel.push_arg(pos);
+                kernel.push_arg(split);
+                kernel.push_arg(val);
+            } else {
+                kernel.push_arg(static_cast<size_t>(0));
+                kernel.push_arg(static_cast<size_t>(0));
+                kernel.push_arg(split);
+                kernel.push_arg(static_cast<size_t>(0));
+            }
+
+            if (tail.size())
+                kernel.push_arg(tail);
+            else
+                kernel.push_arg(static_cast<size_t>(0));
+
+            detail::set_expression_argument x_args(kernel, part, index_offset, state);
+            detail::extract_terminals()( boost::proto::as_child(x), x_args);
+        }
+
+        template <class Vector>
+        void expression_properties(const Vector &x,
+            std::vector<backend::command_queue> &queue_list,
+            std::vector<size_t> &partition,
+            size_t &size) const
+        {
+            queue_list = std::vector<backend::command_queue>(1, q);
+            partition  = std::vector<size_t>(2, 0);
+            partition.back() = size = n;
+        }
+
+        size_t rows()     const { return n; }
+        size_t cols()     const { return m; }
+        size_t nonzeros() const { return nnz; }
+    private:
+        backend::command_queue q;
+
+        size_t n, m, nnz, split;
+
+        backend::device_vector<Ptr> ptr;
+        backend::device_vector<Col> row;
+        backend::device_vector<Ptr> pos;
+        backend::device_vector<Val> val;
+        backend::device_vector<Val> tail;
+
+        // Start of each column in the sorted column indices.
+        backend::kernel& column_ptr_kernel() const {
+            using namespace vex::detail;
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_csr_column_ptr");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<size_t>("nnz");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<Ptr> >("ptr");
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+                src.new_line() << "size_t lo = 0, hi = nnz;";
+                src.new_line() << "while(lo < hi)";
+                src.open("{");
+                src.new_line() << "size_t mid = (lo + hi) / 2;";
+                src.new_line() << "if (col[mid] < idx) lo = mid + 1; else hi = mid;";
+                src.close("}");
+                src.new_line() << "ptr[idx] = lo;";
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_csr_column_ptr"));
+            }
+
+            return K->second;
+        }
+};
+
+} // namespace sparse
+} // namespace vex
+
+#endif
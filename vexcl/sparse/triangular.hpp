@@ -0,0 +1,240 @@
+#ifndef VEXCL_SPARSE_TRIANGULAR_HPP
+#define VEXCL_SPARSE_TRIANGULAR_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+
+/**
+ * \file   vexcl/sparse/triangular.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Level-scheduled sparse triangular solve.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include <vexcl/util.hpp>
+#include <vexcl/operations.hpp>
+#include <vexcl/vector.hpp>
+#include <vexcl/sparse/csr.hpp>
+
+namespace vex {
+namespace sparse {
+
+/// Sparse triangular solve with level scheduling.
+/**
+ * Solves \f$L x = b\f$ or \f$U x = b\f$, where L (U) is the lower (upper)
+ * triangle of a matrix in CSR format. The nonzeros of the other triangle are
+ * ignored, so the factors of an incomplete LU decomposition may be stored in
+ * a single matrix (with the unit diagonal of L implied):
+ *
+ \code
+ vex::sparse::csr<double> LU(ctx, n, n, ptr, col, val);
+
+ vex::sparse::triangular_solve<double> L(LU, true, true);  // lower, unit diagonal
+ vex::sparse::triangular_solve<double> U(LU, false);       // upper
+
+ L.apply(b, y);
+ U.apply(y, x);
+ \endcode
+ *
+ * The dependency graph of the rows is analysed once, in the constructor.
+ * The rows are grouped into level sets, where each row only depends on the
+ * rows of the previous levels. The solve is done with a kernel launch per
+ * level, and the rows of a level are processed in parallel. The matrix
+ * storage is shared with the CSR matrix, so the values of the matrix may be
+ * updated without repeating the analysis (see vex::sparse::csr::update_values()).
+ *
+ * The performance depends on the number of levels: matrices with wide level
+ * sets (e.g. after a multicolor reordering) are solved efficiently, while a
+ * tridiagonal matrix has as many levels as rows.
+ *
+ * The rows of a level only read the solution at the rows of the previous
+ * levels, which were written by the previous launches on the same in-order
+ * queue. The kernel does not depend on the order or the concurrency of the
+ * workgroups within a launch. A sync-free solve, where a row spins on the
+ * completion flags of the rows it depends on, would need such guarantees.
+ * OpenCL and CUDA do not promise that a waiting workgroup lets the others
+ * make progress. The JIT backend splits the workgroups among OpenMP threads,
+ * so a thread spinning in one workgroup may never reach the workgroup it
+ * waits for.
+ */
+template <typename Val, typename Col = int, typename Ptr = Col>
+class triangular_solve {
+    static_assert(std::is_arithmetic<Val>::value,
+            "sparse::triangular_solve only supports arithmetic value types");
+    public:
+        /// Analyses the dependencies of the rows.
+        /**
+         * \param A     The matrix.
+         * \param lower Whether to use the lower or the upper triangle.
+         * \param unit_diagonal Whether the diagonal is implied to be unit.
+         *              The stored diagonal is ignored then.
+         */
+        triangular_solve(const csr<Val, Col, Ptr> &A, bool lower = true,
+                bool unit_diagonal = false)
+            : q(A.q), n(A.rows()), nnz(A.nonzeros()), lower(lower), unit_diagonal(unit_diagonal),
+              ptr(A.ptr), col(A.col), val(A.val)
+        {
+            precondition(A.rows() == A.cols(), "Triangular matrix should be square");
+
+            level_ptr.push_back(0);
+
+            if (!n) return;
+
+            std::vector<Ptr> host_ptr(n + 1);
+            std::vector<Col> host_col(nnz);
+
+            ptr.read(q, 0, n + 1, host_ptr.data(), true);
+            if (nnz) col.read(q, 0, nnz, host_col.data(), true);
+
+            // Level of a row is one more than the maximum level of the rows
+            // it depends on.
+            std::vector<size_t> level(n, 0);
+            size_t nlev = 0;
+
+            for(size_t k = 0; k < n; ++k) {
+                size_t i = lower ? k : n - 1 - k;
+                size_t l = 0;
+
+                for(Ptr j = host_ptr[i]; j < host_ptr[i + 1]; ++j) {
+                    size_t c = host_col[j];
+                    if (lower ? c < i : c > i) l = std::max(l, level[c] + 1);
+                }
+
+                level[i] = l;
+                nlev = std::max(nlev, l + 1);
+            }
+
+            // Sort the rows by level.
+            level_ptr.resize(nlev + 1, 0);
+            for(size_t i = 0; i < n; ++i) ++level_ptr[level[i] + 1];
+            for(size_t l = 0; l < nlev; ++l) level_ptr[l + 1] += level_ptr[l];
+
+            std::vector<Col> _order(n);
+            std::vector<size_t> head(level_ptr.begin(), level_ptr.end() - 1);
+            for(size_t i = 0; i < n; ++i)
+                _order[head[level[i]]++] = static_cast<Col>(i);
+
+            order = backend::device_vector<Col>(q, n, _order.data());
+        }
+
+        /// Solves the system: x = A \ rhs.
+        /**
+         * The right-hand side and the solution may be the same vector.
+         */
+        void apply(const vector<Val> &rhs, vector<Val> &x) const {
+            using namespace vex::detail;
+
+            precondition(rhs.nparts() == 1 && x.nparts() == 1,
+                    "sparse::triangular_solve is only supported for single-device contexts");
+            precondition(rhs.size() == n && x.size() == n, "Wrong vector size");
+
+            if (!n) return;
+
+            static kernel_cache cache;
+
+            auto K = cache.find(q);
+            backend::select_context(q);
+
+            if (K == cache.end()) {
+                backend::source_generator src(q);
+
+                src.begin_kernel("vexcl_triangular_solve");
+                src.begin_kernel_parameters();
+                src.template parameter<size_t>("n");
+                src.template parameter<size_t>("offset");
+                src.template parameter<int>("lower");
+                src.template parameter<int>("unit_diagonal");
+                src.template parameter< global_ptr<const Col> >("order");
+                src.template parameter< global_ptr<const Ptr> >("ptr");
+                src.template parameter< global_ptr<const Col> >("col");
+                src.template parameter< global_ptr<const Val> >("val");
+                src.template parameter< global_ptr<const Val> >("rhs");
+                src.template parameter< global_ptr<Val> >("x");
+                src.end_kernel_parameters();
+                src.grid_stride_loop().open("{");
+
+                src.new_line() << type_name<Col>() << " i = order[offset + idx];";
+                src.new_line() << type_name<Val>() << " sum = rhs[i];";
+                src.new_line() << type_name<Val>() << " diag = 1;";
+                src.new_line() << "for(" << type_name<Ptr>() << " j = ptr[i], e = ptr[i + 1]; j < e; ++j)";
+                src.open("{");
+                src.new_line() << type_name<Col>() << " c = col[j];";
+                src.new_line() << "if (c == i)";
+                src.new_line() << "  { if (!unit_diagonal) diag = val[j]; }";
+                src.new_line() << "else if (lower ? c < i : c > i)";
+                src.new_line() << "  sum -= val[j] * x[c];";
+                src.close("}");
+                src.new_line() << "x[i] = sum / diag;";
+
+                src.close("}");
+                src.end_kernel();
+
+                K = cache.insert(q, backend::kernel(q, src.str(), "vexcl_triangular_solve"));
+            }
+
+            for(size_t l = 0; l + 1 < level_ptr.size(); ++l) {
+                K->second.push_arg(level_ptr[l + 1] - level_ptr[l]);
+                K->second.push_arg(level_ptr[l]);
+                K->second.push_arg(static_cast<int>(lower));
+                K->second.push_arg(static_cast<int>(unit_diagonal));
+                K->second.push_arg(order);
+                K->second.push_arg(ptr);
+                if (nnz) {
+                    K->second.push_arg(col);
+                    K->second.push_arg(val);
+                } else {
+                    K->second.push_arg(static_cast<size_t>(0));
+                    K->second.push_arg(static_cast<size_t>(0));
+                }
+                K->second.push_arg(rhs(0));
+                K->second.push_arg(x(0));
+                K->second(q);
+            }
+        }
+
+        /// Number of level sets.
+        size_t levels() const { return level_ptr.size() - 1; }
+    private:
+        backend::command_queue q;
+
+        size_t n, nnz;
+        bool lower, unit_diagonal;
+
+        backend::device_vector<Ptr> ptr;
+        backend::device_vector<Col> col;
+        backend::device_vector<Val> val;
+
+        // Rows sorted by level, and the start of each level.
+        backend::device_vector<Col> order;
+        std::vector<size_t> level_ptr;
+};
+
+} // namespace sparse
+} // namespace vex
+
+#endif
@@ -50,6 +50,9 @@ class stencil_base {
 
         void exchange_halos(const vex::vector<T> &x) const;
 
+        // Copies halos directly from the buffers of the neighbours.
+        bool copy_halos(const vex::vector<T> &x) const;
+
         mutable std::vector<backend::command_queue> queue;
 
         mutable std::vector<T>  hbuf;
@@ -58,6 +61,9 @@ class stencil_base {
 
         int lhalo;
         int rhalo;
+
+        // Devices may access each other's buffers.
+        bool shared;
 };
 
 template <typename T> template <class Iterator>
@@ -67,7 +73,8 @@ stencil_base<T>::stencil_base(
         )
     : queue(q), hbuf(q.size() * (width - 1)),
       dbuf(q.size()), s(q.size()),
-      lhalo(center), rhalo(width - center - 1)
+      lhalo(center), rhalo(width - center - 1),
+      shared(q.size() > 1 && backend::shared_memory_access(q))
 {
     assert(queue.size());
     assert(lhalo >= 0);
@@ -92,6 +99,8 @@ void stencil_base<T>::exchange_halos(const vex::vector<T> &x) const {
 
     if ((queue.size() <= 1) || (width <= 0)) return;
 
+    if (shared && copy_halos(x)) return;
+
     // Get halos from neighbours.
     for(unsigned d = 0; d < queue.size(); d++) {
         if (!x.part_size(d)) continue;
@@ -149,6 +158,100 @@ void stencil_base<T>::exchange_halos(const vex::vector<T> &x) const {
     for(unsigned d = 0; d < queue.size(); d++) queue[d].finish();
 }
 
+template <typename T>
+bool stencil_base<T>::copy_halos(const vex::vector<T> &x) const {
+    using namespace detail;
+    static kernel_cache cache;
+
+    // Each halo should come from the immediate neighbour.
+    for(unsigned d = 0; d < queue.size(); d++) {
+        if (!x.part_size(d)) continue;
+
+        if (d > 0 && lhalo > 0 && x.part_size(d - 1) < static_cast<size_t>(lhalo))
+            return false;
+
+        if (d + 1 < queue.size() && rhalo > 0 && x.part_size(d + 1) < static_cast<size_t>(rhalo))
+            return false;
+    }
+
+    backend::wait_list ready;
+    for(unsigned d = 0; d < queue.size(); d++)
+        backend::wait_list_append(ready, backend::enqueue_marker(queue[d]));
+
+    for(unsigned d = 0; d < queue.size(); d++) {
+        if (!x.part_size(d)) continue;
+
+        bool left  = d > 0 && lhalo > 0;
+        bool right = d + 1 < queue.size() && rhalo > 0;
+
+        if (!left && !right) continue;
+
+        backend::select_context(queue[d]);
+        backend::enqueue_barrier(queue[d], ready);
+
+        auto K = cache.find(queue[d]);
+
+        if (K == cache.end()) {
+            backend::source_generator src(queue[d]);
+
+            src.begin_kernel("vexcl_halo_copy");
+            src.begin_kernel_parameters();
+            src.template parameter<size_t>("n");
+            src.template parameter<int>("lhalo");
+            src.template parameter<size_t>("lofs");
+            src.template parameter< global_ptr<const T> >("lsrc");
+            src.template parameter< global_ptr<const T> >("rsrc");
+            src.template parameter< global_ptr<T> >("dst");
+            src.end_kernel_parameters();
+            src.grid_stride_loop().open("{");
+            src.new_line() << "if (idx < lhalo)";
+            src.open("{");
+            src.new_line() << "if (lsrc) dst[idx] = lsrc[lofs + idx];";
+            src.close("}");
+            src.new_line() << "else";
+            src.open("{");
+            src.new_line() << "if (rsrc) dst[idx] = rsrc[idx - lhalo];";
+            src.close("}");
+            src.close("}");
+            src.end_kernel();
+
+            K = cache.insert(queue[d], backend::kernel(queue[d], src.str(), "vexcl_halo_copy"));
+        }
+
+        auto &krn = K->second;
+
+        krn.push_arg(static_cast<size_t>(lhalo + rhalo));
+        krn.push_arg(lhalo);
+
+        if (left) {
+            krn.push_arg(x.part_size(d - 1) - lhalo);
+            krn.push_arg(x(d - 1));
+        } else {
+            krn.push_arg(static_cast<size_t>(0));
+            krn.push_arg(static_cast<size_t>(0));
+        }
+
+        if (right)
+            krn.push_arg(x(d + 1));
+        else
+            krn.push_arg(static_cast<size_t>(0));
+
+        krn.push_arg(dbuf[d]);
+
+        krn(queue[d]);
+    }
+
+    // Neighbours should not overwrite their parts before the halos are copied.
+    backend::wait_list copied;
+    for(unsigned d = 0; d < queue.size(); d++)
+        backend::wait_list_append(copied, backend::enqueue_marker(queue[d]));
+
+    for(unsigned d = 0; d < queue.size(); d++)
+        backend::enqueue_barrier(queue[d], copied);
+
+    return true;
+}
+
 /// Stencil.
 /**
  * Should be used for stencil convolutions with vex::vectors as in
@@ -0,0 +1,492 @@
+#ifndef VEXCL_STREAMED_VECTOR_HPP
+#define VEXCL_STREAMED_VECTOR_HPP
+
+/*
+The MIT License
+
+Copyright (c) 2012-2017 Denis Demidov <dennis.demidov@gmail.com>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/**
+ * \file   vexcl/streamed_vector.hpp
+ * \author Denis Demidov <dennis.demidov@gmail.com>
+ * \brief  Out-of-core evaluation of vector expressions.
+ */
+
+#include <vector>
+#include <array>
+#include <string>
+#include <set>
+#include <fstream>
+#include <memory>
+
+#include <vexcl/operations.hpp>
+
+namespace vex {
+
+struct streamed_vector_terminal {};
+
+typedef vector_expression<
+    typename boost::proto::terminal< streamed_vector_terminal >::type
+    > streamed_vector_terminal_expression;
+
+namespace traits {
+
+// Hold streamed vector terminals by reference:
+template <class T>
+struct hold_terminal_by_reference< T,
+        typename std::enable_if<
+            boost::proto::matches<
+                typename boost::proto::result_of::as_expr< T >::type,
+                boost::proto::terminal< streamed_vector_terminal >
+            >::value
+        >::type
+    >
+    : std::true_type
+{ };
+
+} // namespace traits
+
+namespace detail {
+
+// Type-erased interface used by the chunked evaluator.
+struct streamed_vector_base {
+    virtual ~streamed_vector_base() {}
+
+    virtual size_t size() const = 0;
+
+    // Allocates double-buffered staging areas for the given queues.
+    virtual void prepare(const std::vector<backend::command_queue> &q, size_t chunk) const = 0;
+
+    // Makes the given staging buffer the one seen by the next kernel launch.
+    virtual void activate(unsigned d, unsigned slot) const = 0;
+
+    // Enqueues host->device transfer of [offset, offset + n) into the slot.
+    virtual void upload(backend::command_queue &q,
+            unsigned d, unsigned slot, size_t offset, size_t n) const = 0;
+
+    // Enqueues device->host transfer of [offset, offset + n) from the slot.
+    virtual void download(backend::command_queue &q,
+            unsigned d, unsigned slot, size_t offset, size_t n) const = 0;
+
+    // Completes the download once the transfer queue is done with the slot.
+    virtual void flush(unsigned d, unsigned slot, size_t offset, size_t n) const = 0;
+};
+
+} // namespace detail
+
+template <class OP, class LHS, class RHS>
+void assign_streamed_expression(const LHS &lhs, const RHS &rhs);
+
+/// Host- or file-resident vector that is processed in device-sized chunks.
+/**
+ * The vector data stays in host memory (or in a binary file) and is streamed
+ * through a pair of staging buffers on each compute device. Expressions
+ * assigned to a streamed vector are split into chunks; transfers of the next
+ * chunk overlap with the computation on the current one.
+ *
+ \code
+ std::vector<double> X(n), Y(n);
+
+ vex::streamed_vector<double> x(ctx, X.data(), n, 1 << 24);
+ vex::streamed_vector<double> y(ctx, "y.bin",  n, 1 << 24);
+
+ y = sin(x) * vex::element_index();
+ \endcode
+ *
+ * Only streamed vectors and stateless terminals (scalars, constants,
+ * element_index(), user functions) may be used in streamed expressions.
+ */
+template <typename T>
+class streamed_vector
+    : public streamed_vector_terminal_expression,
+      public detail::streamed_vector_base
+{
+    public:
+        typedef T      value_type;
+        typedef size_t size_type;
+
+        /// Wraps host memory.
+        streamed_vector(const std::vector<backend::command_queue> &queue,
+                T *host, size_t size, size_t chunk_size = default_chunk_size)
+            : queue(queue), n(size), chunk(std::min(size, chunk_size)),
+              host(host), active(0)
+        {
+            precondition(chunk_size > 0, "Chunk size should be positive");
+        }
+
+        /// Wraps binary file.
+        /**
+         * The file is created if it does not exist.
+         */
+        streamed_vector(const std::vector<backend::command_queue> &queue,
+                const std::string &fname, size_t size,
+                size_t chunk_size = default_chunk_size)
+            : queue(queue), n(size), chunk(std::min(size, chunk_size)),
+              host(0), file(std::make_shared<std::fstream>()), active(0)
+        {
+            precondition(chunk_size > 0, "Chunk size should be positive");
+
+            const std::ios::openmode mode =
+                std::ios::in | std::ios::out | std::ios::binary;
+
+            file->open(fname.c_str(), mode);
+            if (!file->is_open()) {
+                std::ofstream(fname.c_str(), std::ios::binary);
+                file->open(fname.c_str(), mode);
+            }
+
+            precondition(file->is_open(), "Failed to open " + fname);
+        }
+
+        /// Returns vector size.
+        size_t size() const {
+            return n;
+        }
+
+        /// Returns the number of elements processed by a single kernel launch.
+        size_t chunk_size() const {
+            return chunk;
+        }
+
+        /// Returns the command queues used to process the vector.
+        const std::vector<backend::command_queue>& queue_list() const {
+            return queue;
+        }
+
+        const backend::device_vector<T>& active_buffer() const {
+            return *active;
+        }
+
+#define VEXCL_ASSIGNMENT(op, op_type)                                          \
+  /** Expression assignment operator. */                                       \
+  template <class Expr>                                                        \
+  auto operator op(const Expr & expr) ->                                       \
+      typename std::enable_if<                                                 \
+          boost::proto::matches<                                               \
+              typename boost::proto::result_of::as_expr<Expr>::type,           \
+              vector_expr_grammar>::value,                                     \
+          const streamed_vector &>::type                                       \
+  {                                                                            \
+    assign_streamed_expression<op_type>(*this, expr);                          \
+    return *this;                                                              \
+  }
+
+        VEXCL_ASSIGNMENTS(VEXCL_ASSIGNMENT)
+
+#undef VEXCL_ASSIGNMENT
+
+        static const size_t default_chunk_size = 1 << 24;
+    private:
+        std::vector<backend::command_queue> queue;
+        size_t n, chunk;
+
+        T *host;
+        std::shared_ptr<std::fstream> file;
+
+        mutable std::vector< std::array<backend::device_vector<T>, 2> > buf;
+        mutable std::vector< std::array<std::vector<T>, 2> > stage;
+        mutable const backend::device_vector<T> *active;
+        mutable std::vector<backend::command_queue> buf_queue;
+
+        // The staging buffers are reused only when they were allocated for
+        // the same devices and contexts and are large enough.
+        bool prepared_for(const std::vector<backend::command_queue> &q, size_t c) const {
+            if (buf.empty() || buf_queue.size() != q.size() || buf[0][0].size() < c)
+                return false;
+
+            for(unsigned d = 0; d < q.size(); ++d) {
+                if (backend::get_context_id(q[d]) != backend::get_context_id(buf_queue[d]))
+                    return false;
+                if (backend::get_device_id(q[d]) != backend::get_device_id(buf_queue[d]))
+                    return false;
+            }
+
+            return true;
+        }
+
+        void prepare(const std::vector<backend::command_queue> &q, size_t c) const {
+            if (prepared_for(q, c)) return;
+
+            buf.clear();
+            stage.clear();
+            buf_queue = q;
+
+            for(unsigned d = 0; d < q.size(); ++d) {
+                std::array<backend::device_vector<T>, 2> b = {{
+                    backend::device_vector<T>(q[d], c),
+                    backend::device_vector<T>(q[d], c)
+                }};
+                buf.push_back(b);
+
+                stage.push_back(std::array<std::vector<T>, 2>());
+                if (!host) {
+                    stage.back()[0].resize(c);
+                    stage.back()[1].resize(c);
+                }
+            }
+        }
+
+        void activate(unsigned d, unsigned slot) const {
+            active = &buf[d][slot];
+        }
+
+        void upload(backend::command_queue &q,
+                unsigned d, unsigned slot, size_t offset, size_t m) const
+        {
+            const T *src = host + offset;
+
+            if (!host) {
+                T *dst = stage[d][slot].data();
+
+                file->clear();
+                file->seekg(offset * sizeof(T));
+                file->read(reinterpret_cast<char*>(dst), m * sizeof(T));
+
+                precondition(file->gcount() == static_cast<std::streamsize>(m * sizeof(T)),
+                        "Failed to read streamed vector data");
+
+                src = dst;
+            }
+
+            buf[d][slot].write(q, 0, m, src);
+        }
+
+        void download(backend::command_queue &q,
+                unsigned d, unsigned slot, size_t offset, size_t m) const
+        {
+            buf[d][slot].read(q, 0, m, host ? host + offset : stage[d][slot].data());
+        }
+
+        void flush(unsigned d, unsigned slot, size_t offset, size_t m) const {
+            if (host) return;
+
+            file->clear();
+            file->seekp(offset * sizeof(T));
+            file->write(reinterpret_cast<const char*>(stage[d][slot].data()), m * sizeof(T));
+
+            precondition(!file->fail(), "Failed to write streamed vector data");
+        }
+};
+
+template <typename T>
+const size_t streamed_vector<T>::default_chunk_size;
+
+namespace traits {
+
+template <>
+struct is_vector_expr_terminal< streamed_vector_terminal > : std::true_type {};
+
+template <>
+struct proto_terminal_is_value< streamed_vector_terminal > : std::true_type {};
+
+template <typename T>
+struct kernel_param_declaration< streamed_vector<T> > {
+    static void get(backend::source_generator &src,
+            const streamed_vector<T>&,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+    {
+        src.parameter< global_ptr<T> >(prm_name);
+    }
+};
+
+template <typename T>
+struct partial_vector_expr< streamed_vector<T> > {
+    static void get(backend::source_generator &src,
+            const streamed_vector<T>&,
+            const backend::command_queue&, const std::string &prm_name,
+            detail::kernel_generator_state_ptr)
+    {
+        src << prm_name << "[idx]";
+    }
+};
+
+template <typename T>
+struct kernel_arg_setter< streamed_vector<T> > {
+    static void set(const streamed_vector<T> &term,
+            backend::kernel &kernel, unsigned/*device*/, size_t/*index_offset*/,
+            detail::kernel_generator_state_ptr)
+    {
+        kernel.push_arg(term.active_buffer());
+    }
+};
+
+} // namespace traits
+
+namespace detail {
+
+struct collect_streamed_terminals {
+    std::set<const streamed_vector_base*> &terms;
+
+    collect_streamed_terminals(std::set<const streamed_vector_base*> &terms)
+        : terms(terms) {}
+
+    template <class Term>
+    typename std::enable_if<
+        std::is_base_of<streamed_vector_base, Term>::value
+        >::type
+    operator()(const Term &term) const {
+        terms.insert(&term);
+    }
+
+    template <class Term>
+    typename std::enable_if<
+        !std::is_base_of<streamed_vector_base, Term>::value
+        >::type
+    operator()(const Term&) const {}
+};
+
+} // namespace detail
+
+/// Evaluates the expression chunk by chunk.
+/**
+ * Chunks are distributed round-robin across the devices of the lhs queue
+ * list. Each device owns two staging slots per streamed vector: while the
+ * kernel processes one slot on the compute queue, the other slot is being
+ * downloaded and refilled on a separate transfer queue. Every chunk reuses the
+ * kernel cached by detail::assign_expression(); the chunk position is passed
+ * to the kernel through the index_offset argument of the terminals.
+ */
+template <class OP, class LHS, class RHS>
+void assign_streamed_expression(const LHS &lhs, const RHS &rhs) {
+    {
+        detail::get_expression_properties prop;
+        detail::extract_terminals()(boost::proto::as_child(rhs), prop);
+
+        precondition(prop.queue.empty(),
+                "Device-resident terminals are not supported in streamed expressions");
+        precondition(prop.size == 0 || prop.size == lhs.size(),
+                "Incompatible expression sizes");
+    }
+
+    std::set<const detail::streamed_vector_base*> inputs, outputs;
+
+    detail::extract_terminals()(boost::proto::as_child(rhs),
+            detail::collect_streamed_terminals(inputs));
+
+    outputs.insert(&lhs);
+    if (!std::is_same<OP, assign::SET>::value) inputs.insert(&lhs);
+
+    std::vector<const detail::streamed_vector_base*> all(inputs.begin(), inputs.end());
+    if (!inputs.count(&lhs)) all.push_back(&lhs);
+
+    std::vector<backend::command_queue> queue = lhs.queue_list();
+    std::vector<backend::command_queue> xfer;
+
+    const size_t n      = lhs.size();
+    const size_t chunk  = lhs.chunk_size();
+    const unsigned ndev = static_cast<unsigned>(queue.size());
+
+    if (!n) return;
+
+    for(unsigned d = 0; d < ndev; ++d)
+        xfer.push_back(backend::duplicate_queue(queue[d]));
+
+    for(auto t = all.begin(); t != all.end(); ++t) {
+        precondition((*t)->size() == n, "Incompatible expression sizes");
+        (*t)->prepare(queue, chunk);
+    }
+
+    // Downloads that still have to be flushed to the host storage:
+    struct pending_download {
+        bool   active;
+        size_t offset, size;
+        backend::wait_list done;
+
+        pending_download() : active(false), offset(0), size(0) {}
+    };
+
+    std::vector< std::array<pending_download, 2> > pending(ndev);
+
+    auto flush = [&](unsigned d, unsigned s) {
+        pending_download &p = pending[d][s];
+        if (!p.active) return;
+
+        backend::wait_for_events(p.done);
+
+        for(auto t = outputs.begin(); t != outputs.end(); ++t)
+            (*t)->flush(d, s, p.offset, p.size);
+
+        p.active = false;
+    };
+
+    const size_t nchunks = (n + chunk - 1) / chunk;
+
+    for(size_t k = 0; k < nchunks; ++k) {
+        const unsigned d = static_cast<unsigned>(k % ndev);
+        const unsigned s = static_cast<unsigned>((k / ndev) % 2);
+
+        const size_t offset = k * chunk;
+        const size_t size   = std::min(chunk, n - offset);
+
+        // The slot is about to be reused; its previous contents should
+        // reach the host first.
+        flush(d, s);
+
+        backend::select_context(queue[d]);
+
+        for(auto t = inputs.begin(); t != inputs.end(); ++t)
+            (*t)->upload(xfer[d], d, s, offset, size);
+
+        {
+            backend::wait_list uploaded;
+            backend::wait_list_append(uploaded, backend::enqueue_marker(xfer[d]));
+            backend::enqueue_barrier(queue[d], uploaded);
+        }
+
+        for(auto t = all.begin(); t != all.end(); ++t)
+            (*t)->activate(d, s);
+
+        std::vector<backend::command_queue> q(1, queue[d]);
+        std::vector<size_t> part(2);
+        part[0] = offset;
+        part[1] = offset + size;
+
+        detail::assign_expression<OP>(lhs, rhs, q, part);
+
+        {
+            backend::wait_list computed;
+            backend::wait_list_append(computed, backend::enqueue_marker(queue[d]));
+            backend::enqueue_barrier(xfer[d], computed);
+        }
+
+        for(auto t = outputs.begin(); t != outputs.end(); ++t)
+            (*t)->download(xfer[d], d, s, offset, size);
+
+        pending[d][s].active = true;
+        pending[d][s].offset = offset;
+        pending[d][s].size   = size;
+        pending[d][s].done   = backend::wait_list();
+
+        backend::wait_list_append(pending[d][s].done, backend::enqueue_marker(xfer[d]));
+    }
+
+    for(unsigned d = 0; d < ndev; ++d) {
+        flush(d, 0);
+        flush(d, 1);
+        xfer[d].finish();
+    }
+}
+
+} // namespace vex
+
+#endif
@@ -39,8 +39,13 @@ THE SOFTWARE.
 #include <string>
 #include <type_traits>
 #include <functional>
+#include <fstream>
+#include <ctime>
+#include <cstdlib>
 
 #include <boost/proto/proto.hpp>
+#include <boost/optional.hpp>
+#include <boost/filesystem.hpp>
 #include <boost/io/ios_state.hpp>
 #include <boost/iterator/iterator_facade.hpp>
 #include <boost/thread.hpp>
@@ -79,6 +84,75 @@ inline double equal_weights(const backend::command_queue&) {
     return 1;
 }
 
+namespace detail {
+
+// Maximum age (in seconds) of the device weights cached on disk.
+// Zero disables the cache.
+inline long device_weight_expiry() {
+    static const long expiry = std::atol(getenv("VEXCL_DEVICE_WEIGHTS_EXPIRY", "604800"));
+    return expiry;
+}
+
+// Folder holding the cached device weights. The VEXCL_DEVICE_WEIGHTS_PATH
+// environment variable overrides the default location.
+inline std::string device_weight_dir() {
+    if (const char *dir = getenv("VEXCL_DEVICE_WEIGHTS_PATH")) return dir;
+    return appdata_path() + path_delim() + "weights";
+}
+
+// Path to the file holding the cached weight of the device.
+inline std::string device_weight_path(const std::string &signature, bool create = false) {
+    std::string dir = device_weight_dir();
+    if (create) boost::filesystem::create_directories(dir);
+    return dir + path_delim() + static_cast<std::string>(sha1_hasher(signature));
+}
+
+// Reads the device weight measured in a previous run.
+inline boost::optional<double> load_device_weight(const backend::command_queue &q) {
+    if (device_weight_expiry() <= 0 || getenv("VEXCL_REFRESH_DEVICE_WEIGHTS"))
+        return boost::optional<double>();
+
+    std::string signature = backend::get_device_signature(q);
+    std::ifstream f(device_weight_path(signature).c_str());
+
+    long long stamp;
+    double weight;
+    std::string cached_signature;
+
+    if (!(f >> stamp >> weight) || weight <= 0)
+        return boost::optional<double>();
+
+    std::getline(f >> std::ws, cached_signature);
+
+    if (cached_signature != signature ||
+            std::difftime(std::time(0), static_cast<std::time_t>(stamp)) > device_weight_expiry())
+        return boost::optional<double>();
+
+    return boost::optional<double>(weight);
+}
+
+// Saves the measured device weight for future runs.
+inline void save_device_weight(const backend::command_queue &q, double weight) {
+    if (device_weight_expiry() <= 0) return;
+
+    // Prevent writing to the same file by several threads at the same time.
+    static boost::mutex mx;
+    boost::lock_guard<boost::mutex> lock(mx);
+
+    std::string signature = backend::get_device_signature(q);
+
+    try {
+        std::ofstream f(device_weight_path(signature, true).c_str());
+        f << static_cast<long long>(std::time(0)) << " "
+          << std::setprecision(17) << weight << "\n"
+          << signature << std::endl;
+    } catch(const boost::filesystem::filesystem_error&) {
+        // Not being able to cache the weight is not an error.
+    }
+}
+
+} // namespace detail
+
 template <bool dummy = true>
 struct partitioning_scheme {
     static_assert(dummy, "dummy parameter should be true");
@@ -101,8 +175,48 @@ struct partitioning_scheme {
 
     static std::vector<size_t> get(size_t n, const std::vector<backend::command_queue> &queue);
 
+    /// Overrides the cached weights of the devices behind the given queues.
+    /**
+     * Objects created afterwards are partitioned according to the new
+     * weights. Existing objects keep their partitioning.
+     *
+     * Only the ratios of the given weights matter. They are scaled so that
+     * their sum matches the sum of the current weights of the same devices.
+     * This keeps them in the units of the weighting function, so that they
+     * may be combined with the weights of the devices that are not updated.
+     */
+    static void update(const std::vector<backend::command_queue> &queue,
+            const std::vector<double> &w)
+    {
+        precondition(queue.size() == w.size(), "Wrong number of device weights");
+
+        static const bool once = init_weight_function();
+        (void)once; // do not warn about unused variable
+
+        boost::lock_guard<boost::mutex> lock(mx);
+
+        double old_sum = 0, new_sum = 0;
+
+        for(size_t d = 0; d < queue.size(); ++d) {
+            auto dev_id = backend::get_device_id(queue[d]);
+            auto dw = device_weight.find(dev_id);
+
+            old_sum += (dw == device_weight.end()) ?
+                (device_weight[dev_id] = get_weight(queue[d])) :
+                dw->second;
+
+            new_sum += w[d];
+        }
+
+        precondition(new_sum > 0, "Device weights should be positive");
+
+        for(size_t d = 0; d < queue.size(); ++d)
+            device_weight[backend::get_device_id(queue[d])] = w[d] * old_sum / new_sum;
+    }
+
     private:
         static bool is_set;
+        static bool persistent;
         static weight_function weight;
         static std::map<backend::device_id, double> device_weight;
         static boost::mutex mx;
@@ -112,14 +226,31 @@ struct partitioning_scheme {
             if (!is_set) {
                 weight = device_vector_perf;
                 is_set = true;
+                persistent = true;
             }
             return true;
         }
+
+        // The default weights are cached on disk since they are costly to
+        // measure and do not change between runs.
+        static double get_weight(const backend::command_queue &q) {
+            if (!persistent) return weight(q);
+
+            if (boost::optional<double> w = detail::load_device_weight(q))
+                return *w;
+
+            double w = weight(q);
+            detail::save_device_weight(q, w);
+            return w;
+        }
 };
 
 template <bool dummy>
 bool partitioning_scheme<dummy>::is_set = false;
 
+template <bool dummy>
+bool partitioning_scheme<dummy>::persistent = false;
+
 template <bool dummy>
 std::map<backend::device_id, double> partitioning_scheme<dummy>::device_weight;
 
@@ -147,7 +278,7 @@ std::vector<size_t> partitioning_scheme<dummy>::get(size_t n,
             auto dw = device_weight.find(dev_id);
 
             double w = (dw == device_weight.end()) ?
-                (device_weight[dev_id] = weight(*q)) :
+                (device_weight[dev_id] = get_weight(*q)) :
                 dw->second;
 
             cumsum.push_back(cumsum.back() + w);
@@ -492,6 +623,7 @@ class vector : public vector_terminal_expression {
             std::swap(queue,   v.queue);
             std::swap(part,    v.part);
             std::swap(buf,     v.buf);
+            std::swap(buf_flags, v.buf_flags);
         }
 
         /// Resizes the vector.
@@ -547,6 +679,30 @@ class vector : public vector_terminal_expression {
             vector(size, host, flags).swap(*this);
         }
 
+        /// Migrates vector data to the given partitioning.
+        /**
+         * The queue list stays the same; only the sizes of the device parts
+         * change. The data is staged through host memory, so this is meant
+         * for occasional load rebalancing (see vex::adaptive_partitioning).
+         * The new buffers are allocated with the memory flags of the original
+         * ones.
+         */
+        void repartition(const std::vector<size_t> &p) {
+            precondition(
+                    p.size() == queue.size() + 1 && p.front() == 0 && p.back() == size(),
+                    "Wrong partitioning"
+                    );
+
+            if (p == part) return;
+
+            std::vector<T> host(size());
+            read_data(0, size(), host.data(), true);
+
+            part = p;
+            allocate_buffers(buf_flags, 0);
+            write_data(0, size(), host.data(), true);
+        }
+
         /// Fills vector with zeros.
         /** This does not change the vector size! */
         void clear() {
@@ -895,12 +1051,93 @@ class vector : public vector_terminal_expression {
                 }
         }
 
+        /// Asynchronously copy data from host buffer to device(s).
+        /**
+         * Returns a list of events, one per device part involved in the
+         * transfer. The host buffer should stay valid until the events
+         * complete.
+         */
+        backend::wait_list write_data_async(size_t offset, size_t size, const T *hostptr)
+        {
+            return write_data_async(offset, size, hostptr, queue);
+        }
+
+        /// Asynchronously copy data from host buffer to device(s).
+        backend::wait_list write_data_async(size_t offset, size_t size,
+                const T *hostptr, std::vector<backend::command_queue> &q)
+        {
+            precondition(q.size() == queue.size(), "The queue list has wrong size");
+
+            backend::wait_list events;
+
+            if (!size) return events;
+
+            for(unsigned d = 0; d < q.size(); d++) {
+                precondition(
+                        backend::get_context_id(q[d]) == backend::get_context_id(queue[d]),
+                        "Wrong context!"
+                        );
+
+                size_t start = std::max(offset,        part[d]);
+                size_t stop  = std::min(offset + size, part[d + 1]);
+
+                if (stop <= start) continue;
+
+                buf[d].write(q[d], start - part[d], stop - start, hostptr + start - offset);
+                backend::wait_list_append(events, backend::enqueue_marker(q[d]));
+            }
+
+            return events;
+        }
+
+        /// Asynchronously copy data from device(s) to host buffer.
+        /**
+         * Returns a list of events, one per device part involved in the
+         * transfer. The host buffer contents are valid after the events
+         * complete.
+         */
+        backend::wait_list read_data_async(size_t offset, size_t size, T *hostptr) const
+        {
+            return read_data_async(offset, size, hostptr, queue);
+        }
+
+        /// Asynchronously copy data from device(s) to host buffer.
+        backend::wait_list read_data_async(size_t offset, size_t size,
+                T *hostptr, std::vector<backend::command_queue> &q) const
+        {
+            precondition(q.size() == queue.size(), "The queue list has wrong size");
+
+            backend::wait_list events;
+
+            if (!size) return events;
+
+            for(unsigned d = 0; d < q.size(); d++) {
+                precondition(
+                        backend::get_context_id(q[d]) == backend::get_context_id(queue[d]),
+                        "Wrong context!"
+                        );
+
+                size_t start = std::max(offset,        part[d]);
+                size_t stop  = std::min(offset + size, part[d + 1]);
+
+                if (stop <= start) continue;
+
+                buf[d].read(q[d], start - part[d], stop - start, hostptr + start - offset);
+                backend::wait_list_append(events, backend::enqueue_marker(q[d]));
+            }
+
+            return events;
+        }
+
     private:
         mutable std::vector<backend::command_queue> queue;
         std::vector<size_t>                      part;
         std::vector< backend::device_vector<T> > buf;
+        backend::mem_flags                       buf_flags = backend::MEM_READ_WRITE;
 
         void allocate_buffers(backend::mem_flags flags, const T *hostptr) {
+            buf_flags = flags;
+
             buf.clear();
             buf.reserve(queue.size());
 
@@ -1139,6 +1376,107 @@ copy(std::vector<backend::command_queue> &q,
     return result + (last - first);
 }
 
+/// Asynchronously copy device vector to host vector.
+/**
+ * Returns events marking the completion of the transfer for each of the
+ * device parts. These may be waited upon with backend::wait_for_events() or
+ * used as dependencies with backend::enqueue_barrier().
+ */
+template <class T>
+backend::wait_list copy_async(const vex::vector<T> &dv, std::vector<T> &hv) {
+    return dv.read_data_async(0, dv.size(), hv.data());
+}
+
+/// Asynchronously copy device vector to host pointer.
+template <class T>
+backend::wait_list copy_async(const vex::vector<T> &dv, T *hv) {
+    return dv.read_data_async(0, dv.size(), hv);
+}
+
+/// Asynchronously copy host vector to device vector.
+template <class T>
+backend::wait_list copy_async(const std::vector<T> &hv, vex::vector<T> &dv) {
+    return dv.write_data_async(0, dv.size(), hv.data());
+}
+
+/// Asynchronously copy host pointer to device vector.
+template <class T>
+backend::wait_list copy_async(const T *hv, vex::vector<T> &dv) {
+    return dv.write_data_async(0, dv.size(), hv);
+}
+
+/// Asynchronously copy device vector to host vector.
+template <class T>
+backend::wait_list copy_async(std::vector<backend::command_queue> &q,
+        const vex::vector<T> &dv, std::vector<T> &hv)
+{
+    return dv.read_data_async(0, dv.size(), hv.data(), q);
+}
+
+/// Asynchronously copy device vector to host pointer.
+template <class T>
+backend::wait_list copy_async(std::vector<backend::command_queue> &q,
+        const vex::vector<T> &dv, T *hv)
+{
+    return dv.read_data_async(0, dv.size(), hv, q);
+}
+
+/// Asynchronously copy host vector to device vector.
+template <class T>
+backend::wait_list copy_async(std::vector<backend::command_queue> &q,
+        const std::vector<T> &hv, vex::vector<T> &dv)
+{
+    return dv.write_data_async(0, dv.size(), hv.data(), q);
+}
+
+/// Asynchronously copy host pointer to device vector.
+template <class T>
+backend::wait_list copy_async(std::vector<backend::command_queue> &q,
+        const T *hv, vex::vector<T> &dv)
+{
+    return dv.write_data_async(0, dv.size(), hv, q);
+}
+
+/// Asynchronously copy range from device vector to host vector.
+template<class InputIterator, class OutputIterator>
+#ifdef DOXYGEN
+backend::wait_list
+#else
+typename std::enable_if<
+    std::is_same<
+        typename std::iterator_traits<InputIterator>::value_type,
+        typename std::iterator_traits<OutputIterator>::value_type
+        >::value &&
+    stored_on_device<InputIterator>::value &&
+    !stored_on_device<OutputIterator>::value,
+    backend::wait_list
+    >::type
+#endif
+copy_async(InputIterator first, InputIterator last, OutputIterator result)
+{
+    return first.vec->read_data_async(first.pos, last - first, &result[0]);
+}
+
+/// Asynchronously copy range from host vector to device vector.
+template <class InputIterator, class OutputIterator>
+#ifdef DOXYGEN
+backend::wait_list
+#else
+typename std::enable_if<
+    std::is_same<
+        typename std::iterator_traits<InputIterator>::value_type,
+        typename std::iterator_traits<OutputIterator>::value_type
+        >::value &&
+    !stored_on_device<InputIterator>::value &&
+    stored_on_device<OutputIterator>::value,
+    backend::wait_list
+    >::type
+#endif
+copy_async(InputIterator first, InputIterator last, OutputIterator result)
+{
+    return result.vec->write_data_async(result.pos, last - first, &first[0]);
+}
+
 /// Swap two vectors.
 template <typename T>
 void swap(vector<T> &x, vector<T> &y) {
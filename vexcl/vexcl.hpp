@@ -37,7 +37,9 @@ THE SOFTWARE.
 #include <vexcl/constants.hpp>
 #include <vexcl/element_index.hpp>
 #include <vexcl/vector.hpp>
+#include <vexcl/adaptive_partitioning.hpp>
 #include <vexcl/vector_view.hpp>
+#include <vexcl/streamed_vector.hpp>
 #include <vexcl/tensordot.hpp>
 #include <vexcl/vector_pointer.hpp>
 #include <vexcl/tagged_terminal.hpp>
@@ -48,6 +50,13 @@ THE SOFTWARE.
 #include <vexcl/spmat.hpp>
 #include <vexcl/sparse/distributed.hpp>
 #include <vexcl/sparse/matrix.hpp>
+#include <vexcl/sparse/bsr.hpp>
+#include <vexcl/sparse/symmetric.hpp>
+#include <vexcl/sparse/reorder.hpp>
+#include <vexcl/sparse/coo.hpp>
+#include <vexcl/sparse/triangular.hpp>
+#include <vexcl/sparse/semiring.hpp>
+#include <vexcl/sparse/spgemm.hpp>
 #include <vexcl/stencil.hpp>
 #include <vexcl/gather.hpp>
 #include <vexcl/random.hpp>
@@ -56,6 +65,8 @@ THE SOFTWARE.
 #include <vexcl/generator.hpp>
 #include <vexcl/mba.hpp>
 #include <vexcl/sort.hpp>
+#include <vexcl/nth_element.hpp>
+#include <vexcl/segmented_sort.hpp>
 #include <vexcl/scan.hpp>
 #include <vexcl/scan_by_key.hpp>
 #include <vexcl/reduce_by_key.hpp>